@@ -890,27 +890,122 @@ recalculate:
 	return pdu_size;
 }
 
-static void sdp_attr_pdu(void *value, void *udata)
+/*
+ * Exact size of a data element in its PDU form, header included. Like
+ * sdp_gen_pdu() a SEQ8 whose content doesn't fit is written as a SEQ16.
+ */
+static uint32_t sdp_data_pdu_size(sdp_data_t *d)
 {
-	sdp_append_to_pdu((sdp_buf_t *)udata, (sdp_data_t *)value);
+	uint32_t size = 0;
+	sdp_data_t *child;
+
+	switch (d->dtd) {
+	case SDP_SEQ8:
+	case SDP_SEQ16:
+	case SDP_SEQ32:
+	case SDP_ALT8:
+	case SDP_ALT16:
+	case SDP_ALT32:
+		for (child = d->val.dataseq; child; child = child->next)
+			size += sdp_data_pdu_size(child);
+
+		if (d->dtd == SDP_SEQ8 && size > UCHAR_MAX)
+			return sdp_get_data_type_size(SDP_SEQ16) + size;
+		break;
+	default:
+		size = sdp_get_data_size(NULL, d);
+		break;
+	}
+
+	return sdp_get_data_type_size(d->dtd) + size;
 }
 
-static void sdp_attr_size(void *value, void *udata)
+/* Write a data element sized by sdp_data_pdu_size() into dst */
+static uint32_t sdp_data_write_pdu(sdp_data_t *d, uint8_t *dst)
 {
-	sdp_gen_buffer((sdp_buf_t *)udata, (sdp_data_t *)value);
+	uint32_t size = 0, hdr;
+	sdp_data_t *child;
+	sdp_buf_t buf;
+
+	switch (d->dtd) {
+	case SDP_SEQ8:
+	case SDP_SEQ16:
+	case SDP_SEQ32:
+	case SDP_ALT8:
+	case SDP_ALT16:
+	case SDP_ALT32:
+		break;
+	default:
+		buf.data = dst;
+		buf.data_size = 0;
+		buf.buf_size = sdp_data_pdu_size(d);
+		return sdp_gen_pdu(&buf, d);
+	}
+
+	for (child = d->val.dataseq; child; child = child->next)
+		size += sdp_data_pdu_size(child);
+
+	if (d->dtd == SDP_SEQ8 && size > UCHAR_MAX)
+		d->dtd = SDP_SEQ16;
+
+	*dst = d->dtd;
+	sdp_set_seq_len(dst, size);
+
+	hdr = sdp_get_data_type_size(d->dtd);
+
+	for (child = d->val.dataseq; child; child = child->next)
+		hdr += sdp_data_write_pdu(child, dst + hdr);
+
+	return hdr;
 }
 
+/*
+ * Serialize a record in two passes, sizing it first so the attributes are
+ * written right away into a single buffer of the exact size.
+ */
 int sdp_gen_record_pdu(const sdp_record_t *rec, sdp_buf_t *buf)
 {
+	uint32_t size = 0, hdr;
+	sdp_list_t *l;
+	uint8_t *p;
+
 	memset(buf, 0, sizeof(sdp_buf_t));
-	sdp_list_foreach(rec->attrlist, sdp_attr_size, buf);
 
-	buf->data = bt_malloc0(buf->buf_size);
+	for (l = rec->attrlist; l; l = l->next)
+		size += sizeof(uint8_t) + sizeof(uint16_t) +
+						sdp_data_pdu_size(l->data);
+
+	/* Sequence header sized the same way as sdp_append_to_buf() does */
+	if (size + sizeof(uint8_t) + sizeof(uint8_t) <= UCHAR_MAX)
+		hdr = sdp_get_data_type_size(SDP_SEQ8);
+	else if (size <= UINT16_MAX)
+		hdr = sdp_get_data_type_size(SDP_SEQ16);
+	else
+		hdr = sdp_get_data_type_size(SDP_SEQ32);
+
+	buf->data = bt_malloc0(size + hdr);
 	if (!buf->data)
 		return -ENOMEM;
-	buf->data_size = 0;
 
-	sdp_list_foreach(rec->attrlist, sdp_attr_pdu, buf);
+	if (!rec->attrlist)
+		return 0;
+
+	buf->buf_size = size + hdr;
+	buf->data_size = size + hdr;
+
+	p = buf->data;
+	*p = hdr == 2 ? SDP_SEQ8 : hdr == 3 ? SDP_SEQ16 : SDP_SEQ32;
+	sdp_set_seq_len(p, size);
+	p += hdr;
+
+	for (l = rec->attrlist; l; l = l->next) {
+		sdp_data_t *d = l->data;
+
+		*p++ = SDP_UINT16;
+		bt_put_be16(d->attrId, p);
+		p += sizeof(uint16_t);
+		p += sdp_data_write_pdu(d, p);
+	}
 
 	return 0;
 }
@@ -1385,6 +1480,7 @@ sdp_record_t *sdp_extract_pdu(const uint8_t *buf, int bufsize, int *scanned)
 	uint8_t dtd;
 	uint16_t attr;
 	sdp_record_t *rec = sdp_record_alloc();
+	sdp_list_t *last = NULL;
 	const uint8_t *p = buf;
 
 	*scanned = sdp_extract_seqtype(buf, bufsize, &dtd, &seqlen);
@@ -1429,7 +1525,35 @@ sdp_record_t *sdp_extract_pdu(const uint8_t *buf, int bufsize, int *scanned)
 		extracted += n;
 		p += n;
 		bufsize -= n;
-		sdp_attr_replace(rec, attr, data);
+
+		/* Attributes are sent in ascending order, so they can simply
+		 * be appended instead of searching the list for each one.
+		 */
+		if (!rec->attrlist || (last &&
+				((sdp_data_t *) last->data)->attrId < attr)) {
+			sdp_list_t *node = malloc(sizeof(sdp_list_t));
+
+			if (!node) {
+				sdp_data_free(data);
+				break;
+			}
+
+			data->attrId = attr;
+			node->data = data;
+			node->next = NULL;
+
+			if (last)
+				last->next = node;
+			else
+				rec->attrlist = node;
+
+			last = node;
+		} else {
+			sdp_attr_replace(rec, attr, data);
+
+			for (last = rec->attrlist; last->next;)
+				last = last->next;
+		}
 
 		SDPDBG("Extract PDU, seqLength: %d localExtractedLength: %d",
 							seqlen, extracted);
@@ -2858,13 +2982,15 @@ void sdp_append_to_pdu(sdp_buf_t *pdu, sdp_data_t *d)
 	sdp_buf_t append;
 
 	memset(&append, 0, sizeof(sdp_buf_t));
-	sdp_gen_buffer(&append, d);
+	append.buf_size = sizeof(uint8_t) + sizeof(uint16_t) +
+						sdp_data_pdu_size(d);
 	append.data = malloc(append.buf_size);
 	if (!append.data)
 		return;
 
 	sdp_set_attrid(&append, d->attrId);
-	sdp_gen_pdu(&append, d);
+	append.data_size += sdp_data_write_pdu(d, append.data +
+							append.data_size);
 	sdp_append_to_buf(pdu, append.data, append.data_size);
 	free(append.data);
 }
@@ -3204,15 +3330,52 @@ void sdp_record_free(sdp_record_t *rec)
 
 void sdp_pattern_add_uuid(sdp_record_t *rec, uuid_t *uuid)
 {
-	uuid_t *uuid128 = sdp_uuid_to_uuid128(uuid);
+	sdp_list_t **p, *n;
+	uuid_t uuid128;
+
+	switch (uuid->type) {
+	case SDP_UUID128:
+		uuid128 = *uuid;
+		break;
+	case SDP_UUID32:
+		sdp_uuid32_to_uuid128(&uuid128, uuid);
+		break;
+	case SDP_UUID16:
+		sdp_uuid16_to_uuid128(&uuid128, uuid);
+		break;
+	default:
+		memset(&uuid128, 0, sizeof(uuid128));
+		break;
+	}
 
 	SDPDBG("Elements in target pattern : %d", sdp_list_len(rec->pattern));
-	SDPDBG("Trying to add : 0x%lx", (unsigned long) uuid128);
 
-	if (sdp_list_find(rec->pattern, uuid128, sdp_uuid128_cmp) == NULL)
-		rec->pattern = sdp_list_insert_sorted(rec->pattern, uuid128, sdp_uuid128_cmp);
-	else
-		bt_free(uuid128);
+	/* Find the insert position and check for duplicates at once, only
+	 * allocating when the UUID isn't part of the pattern yet.
+	 */
+	for (p = &rec->pattern; *p; p = &(*p)->next) {
+		int cmp = sdp_uuid128_cmp((*p)->data, &uuid128);
+
+		if (cmp == 0)
+			return;
+
+		if (cmp > 0)
+			break;
+	}
+
+	n = malloc(sizeof(sdp_list_t));
+	if (!n)
+		return;
+
+	n->data = bt_malloc0(sizeof(uuid_t));
+	if (!n->data) {
+		free(n);
+		return;
+	}
+
+	memcpy(n->data, &uuid128, sizeof(uuid_t));
+	n->next = *p;
+	*p = n;
 
 	SDPDBG("Elements in target pattern : %d", sdp_list_len(rec->pattern));
 }
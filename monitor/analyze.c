@@ -15,7 +15,10 @@
 
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <inttypes.h>
 #include <sys/time.h>
 
 #include "lib/bluetooth.h"
@@ -23,11 +26,57 @@
 #include "src/shared/util.h"
 #include "src/shared/queue.h"
 #include "src/shared/btsnoop.h"
+#include "src/shared/mainloop.h"
 #include "monitor/bt.h"
 #include "monitor/display.h"
 #include "monitor/packet.h"
 #include "monitor/analyze.h"
 
+/* Latency histogram with logarithmic buckets split into linear sub-buckets,
+ * in the style of HDR histograms. Values below LAT_HIST_LINEAR microseconds
+ * are counted exactly, larger values with a relative error of at most
+ * 1 / LAT_HIST_SUB_COUNT.
+ */
+#define LAT_HIST_SUB_BITS	4
+#define LAT_HIST_SUB_COUNT	(1 << LAT_HIST_SUB_BITS)
+#define LAT_HIST_LINEAR		(LAT_HIST_SUB_COUNT * 2)
+#define LAT_HIST_SIZE		(LAT_HIST_LINEAR + \
+				(31 - LAT_HIST_SUB_BITS) * LAT_HIST_SUB_COUNT)
+
+struct lat_hist {
+	unsigned long count;
+	uint64_t sum;
+	uint32_t min;
+	uint32_t max;
+	unsigned long buckets[LAT_HIST_SIZE];
+};
+
+struct traffic {
+	unsigned long rx_num;
+	unsigned long tx_num;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+};
+
+struct hci_buf {
+	uint16_t mtu;
+	uint16_t max_pkt;
+	unsigned int outstanding;
+	unsigned int outstanding_max;
+	unsigned int interval_max;
+	uint64_t area;
+	struct timeval first;
+	struct timeval last;
+};
+
+struct hci_cmd {
+	uint16_t index;
+	uint16_t opcode;
+	bool pending;
+	struct timeval sent;
+	struct lat_hist lat;
+};
+
 struct hci_dev {
 	uint16_t index;
 	uint8_t type;
@@ -46,6 +95,10 @@ struct hci_dev {
 	unsigned long ctrl_msg;
 	unsigned long unknown;
 	uint16_t manufacturer;
+	struct hci_buf acl_buf;
+	struct hci_buf le_buf;
+	struct traffic interval;
+	struct queue *cmd_list;
 	struct queue *conn_list;
 };
 
@@ -55,7 +108,10 @@ struct hci_dev {
 #define CONN_LE_ACL	0x04
 #define CONN_LE_ISO	0x05
 
+struct l2cap_chan;
+
 struct hci_conn {
+	struct hci_dev *dev;
 	uint16_t handle;
 	uint8_t type;
 	uint8_t bdaddr[6];
@@ -65,25 +121,409 @@ struct hci_conn {
 	unsigned long tx_num;
 	unsigned long tx_num_comp;
 	size_t tx_bytes;
+	size_t rx_bytes;
 	struct queue *tx_queue;
-	struct timeval tx_lat_min;
-	struct timeval tx_lat_max;
-	struct timeval tx_lat_med;
+	struct lat_hist tx_lat;
 	uint16_t tx_pkt_min;
 	uint16_t tx_pkt_max;
 	uint16_t tx_pkt_med;
+	unsigned int tx_outstanding;
+	unsigned int interval_outstanding;
+	struct traffic interval;
+	uint64_t rx_bytes_peak;
+	uint64_t tx_bytes_peak;
+	struct l2cap_chan *rx_chan;
+	struct l2cap_chan *tx_chan;
 	struct queue *chan_list;
 };
 
 struct l2cap_chan {
+	struct hci_conn *conn;
 	uint16_t cid;
 	uint16_t psm;
 	bool out;
 	unsigned long num;
+	uint64_t bytes;
+	unsigned long interval_num;
+	uint64_t interval_bytes;
+	uint64_t bytes_peak;
+};
+
+enum export_format {
+	EXPORT_CSV,
+	EXPORT_JSON,
 };
 
 static struct queue *dev_list;
 
+static uint64_t interval_usec = 1000000;
+static uint64_t interval_start;
+static bool live_mode;
+static int live_timeout = -1;
+
+static FILE *export_file;
+static enum export_format export_format;
+
+static uint64_t tv_to_usec(const struct timeval *tv)
+{
+	return (uint64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static uint32_t tv_diff_usec(const struct timeval *end,
+						const struct timeval *start)
+{
+	uint64_t a = tv_to_usec(end);
+	uint64_t b = tv_to_usec(start);
+
+	/* Timestamps of different sources might not be monotonic */
+	if (a < b)
+		return 0;
+
+	if (a - b > UINT32_MAX)
+		return UINT32_MAX;
+
+	return a - b;
+}
+
+static unsigned int lat_hist_bucket(uint32_t val)
+{
+	unsigned int msb;
+
+	if (val < LAT_HIST_LINEAR)
+		return val;
+
+	msb = 31 - __builtin_clz(val);
+
+	return LAT_HIST_LINEAR +
+		(msb - LAT_HIST_SUB_BITS - 1) * LAT_HIST_SUB_COUNT +
+		((val >> (msb - LAT_HIST_SUB_BITS)) & (LAT_HIST_SUB_COUNT - 1));
+}
+
+static uint32_t lat_hist_bucket_value(unsigned int bucket)
+{
+	unsigned int msb, sub;
+
+	if (bucket < LAT_HIST_LINEAR)
+		return bucket;
+
+	bucket -= LAT_HIST_LINEAR;
+	msb = bucket / LAT_HIST_SUB_COUNT + LAT_HIST_SUB_BITS + 1;
+	sub = bucket % LAT_HIST_SUB_COUNT;
+
+	return (LAT_HIST_SUB_COUNT + sub) << (msb - LAT_HIST_SUB_BITS);
+}
+
+static void lat_hist_add(struct lat_hist *hist, uint32_t val)
+{
+	if (!hist->count || val < hist->min)
+		hist->min = val;
+	if (!hist->count || val > hist->max)
+		hist->max = val;
+
+	hist->count++;
+	hist->sum += val;
+	hist->buckets[lat_hist_bucket(val)]++;
+}
+
+/* Percentile in 1/10 percent units */
+static uint32_t lat_hist_percentile(const struct lat_hist *hist,
+							unsigned int permille)
+{
+	unsigned long target, total = 0;
+	unsigned int i;
+
+	if (!hist->count)
+		return 0;
+
+	target = (hist->count * permille + 999) / 1000;
+	if (!target)
+		target = 1;
+
+	for (i = 0; i < LAT_HIST_SIZE; i++) {
+		uint32_t val;
+
+		total += hist->buckets[i];
+		if (total < target)
+			continue;
+
+		val = lat_hist_bucket_value(i);
+		if (val < hist->min)
+			return hist->min;
+		if (val > hist->max)
+			return hist->max;
+
+		return val;
+	}
+
+	return hist->max;
+}
+
+static void lat_hist_print(const char *label, const struct lat_hist *hist)
+{
+	if (!hist->count)
+		return;
+
+	print_field("%s: %lu samples", label, hist->count);
+	print_field("  %u usec min, %" PRIu64 " usec mean, %u usec max",
+					hist->min, hist->sum / hist->count,
+					hist->max);
+	print_field("  %u usec p50, %u usec p90, %u usec p99, %u usec p99.9",
+					lat_hist_percentile(hist, 500),
+					lat_hist_percentile(hist, 900),
+					lat_hist_percentile(hist, 990),
+					lat_hist_percentile(hist, 999));
+}
+
+static void lat_hist_export(const char *label, const struct lat_hist *hist)
+{
+	const char *sep = "";
+	unsigned int i;
+
+	fprintf(export_file, ",\"%s\":{\"count\":%lu", label, hist->count);
+
+	if (hist->count)
+		fprintf(export_file, ",\"min\":%u,\"mean\":%" PRIu64
+				",\"max\":%u,\"p50\":%u,\"p90\":%u"
+				",\"p99\":%u,\"p999\":%u",
+				hist->min, hist->sum / hist->count, hist->max,
+				lat_hist_percentile(hist, 500),
+				lat_hist_percentile(hist, 900),
+				lat_hist_percentile(hist, 990),
+				lat_hist_percentile(hist, 999));
+
+	fprintf(export_file, ",\"buckets\":[");
+
+	for (i = 0; i < LAT_HIST_SIZE; i++) {
+		if (!hist->buckets[i])
+			continue;
+
+		fprintf(export_file, "%s[%u,%lu]", sep,
+				lat_hist_bucket_value(i), hist->buckets[i]);
+		sep = ",";
+	}
+
+	fprintf(export_file, "]}");
+}
+
+static void buf_update(struct hci_buf *buf, struct timeval *tv, int delta)
+{
+	if (!timerisset(&buf->first))
+		buf->first = *tv;
+	else
+		buf->area += (uint64_t) buf->outstanding *
+						tv_diff_usec(tv, &buf->last);
+
+	buf->last = *tv;
+
+	if (delta < 0 && (unsigned int) -delta > buf->outstanding)
+		buf->outstanding = 0;
+	else
+		buf->outstanding += delta;
+
+	if (buf->outstanding > buf->outstanding_max)
+		buf->outstanding_max = buf->outstanding;
+
+	if (buf->outstanding > buf->interval_max)
+		buf->interval_max = buf->outstanding;
+}
+
+static void buf_print(const char *label, const struct hci_buf *buf)
+{
+	uint32_t elapsed = tv_diff_usec(&buf->last, &buf->first);
+
+	if (!buf->max_pkt && !timerisset(&buf->first))
+		return;
+
+	printf("  %s buffers: %u x %u octets\n", label, buf->max_pkt,
+								buf->mtu);
+	printf("    %u max outstanding packets\n", buf->outstanding_max);
+
+	if (elapsed)
+		printf("    %.2f average outstanding packets\n",
+					(double) buf->area / elapsed);
+}
+
+static void buf_export(const char *label, const struct hci_buf *buf)
+{
+	uint32_t elapsed = tv_diff_usec(&buf->last, &buf->first);
+
+	fprintf(export_file, ",\"%s\":{\"mtu\":%u,\"max_pkt\":%u"
+				",\"outstanding_max\":%u"
+				",\"outstanding_avg\":%.2f}",
+				label, buf->mtu, buf->max_pkt,
+				buf->outstanding_max,
+				elapsed ? (double) buf->area / elapsed : 0.0);
+}
+
+static const char *conn_type_str(uint8_t type)
+{
+	switch (type) {
+	case CONN_BR_ACL:
+		return "BR-ACL";
+	case CONN_BR_SCO:
+		return "BR-SCO";
+	case CONN_BR_ESCO:
+		return "BR-ESCO";
+	case CONN_LE_ACL:
+		return "LE-ACL";
+	case CONN_LE_ISO:
+		return "LE-ISO";
+	}
+
+	return "unknown";
+}
+
+static void export_interval(uint16_t index, int handle, int cid,
+					const struct traffic *traffic,
+					int outstanding)
+{
+	uint64_t usec = interval_start;
+
+	if (export_format == EXPORT_CSV) {
+		fprintf(export_file, "%" PRIu64 ".%06" PRIu64 ",%u,",
+					usec / 1000000, usec % 1000000, index);
+		if (handle >= 0)
+			fprintf(export_file, "%d", handle);
+		fprintf(export_file, ",");
+		if (cid >= 0)
+			fprintf(export_file, "%d", cid);
+		fprintf(export_file, ",%lu,%" PRIu64 ",%lu,%" PRIu64 ",",
+					traffic->rx_num, traffic->rx_bytes,
+					traffic->tx_num, traffic->tx_bytes);
+		if (outstanding >= 0)
+			fprintf(export_file, "%d", outstanding);
+		fprintf(export_file, "\n");
+		return;
+	}
+
+	fprintf(export_file, "{\"type\":\"interval\",\"time\":%" PRIu64
+				".%06" PRIu64 ",\"index\":%u",
+				usec / 1000000, usec % 1000000, index);
+	if (handle >= 0)
+		fprintf(export_file, ",\"handle\":%d", handle);
+	if (cid >= 0)
+		fprintf(export_file, ",\"cid\":%d", cid);
+	fprintf(export_file, ",\"rx_packets\":%lu,\"rx_bytes\":%" PRIu64
+				",\"tx_packets\":%lu,\"tx_bytes\":%" PRIu64,
+				traffic->rx_num, traffic->rx_bytes,
+				traffic->tx_num, traffic->tx_bytes);
+	if (outstanding >= 0)
+		fprintf(export_file, ",\"outstanding\":%d", outstanding);
+	fprintf(export_file, "}\n");
+}
+
+static void chan_flush_interval(void *data, void *user_data)
+{
+	struct l2cap_chan *chan = data;
+	struct traffic traffic;
+
+	if (!chan->interval_num)
+		return;
+
+	if (chan->interval_bytes > chan->bytes_peak)
+		chan->bytes_peak = chan->interval_bytes;
+
+	if (export_file) {
+		memset(&traffic, 0, sizeof(traffic));
+
+		if (chan->out) {
+			traffic.tx_num = chan->interval_num;
+			traffic.tx_bytes = chan->interval_bytes;
+		} else {
+			traffic.rx_num = chan->interval_num;
+			traffic.rx_bytes = chan->interval_bytes;
+		}
+
+		export_interval(chan->conn->dev->index, chan->conn->handle,
+						chan->cid, &traffic, -1);
+	}
+
+	chan->interval_num = 0;
+	chan->interval_bytes = 0;
+}
+
+static void conn_flush_interval(void *data, void *user_data)
+{
+	struct hci_conn *conn = data;
+
+	if (!conn->interval.rx_num && !conn->interval.tx_num &&
+						!conn->interval_outstanding)
+		return;
+
+	if (conn->interval.rx_bytes > conn->rx_bytes_peak)
+		conn->rx_bytes_peak = conn->interval.rx_bytes;
+
+	if (conn->interval.tx_bytes > conn->tx_bytes_peak)
+		conn->tx_bytes_peak = conn->interval.tx_bytes;
+
+	if (export_file)
+		export_interval(conn->dev->index, conn->handle, -1,
+					&conn->interval,
+					conn->interval_outstanding);
+
+	if (live_mode)
+		printf("  Handle %u: RX %.1f kbit/s, TX %.1f kbit/s, "
+				"%u outstanding\n", conn->handle,
+				conn->interval.rx_bytes * 8000.0 /
+								interval_usec,
+				conn->interval.tx_bytes * 8000.0 /
+								interval_usec,
+				conn->interval_outstanding);
+
+	queue_foreach(conn->chan_list, chan_flush_interval, NULL);
+
+	memset(&conn->interval, 0, sizeof(conn->interval));
+	conn->interval_outstanding = conn->tx_outstanding;
+}
+
+static void dev_flush_interval(void *data, void *user_data)
+{
+	struct hci_dev *dev = data;
+	unsigned int outstanding;
+
+	outstanding = dev->acl_buf.interval_max + dev->le_buf.interval_max;
+
+	if (!dev->interval.rx_num && !dev->interval.tx_num && !outstanding)
+		return;
+
+	if (export_file)
+		export_interval(dev->index, -1, -1, &dev->interval,
+								outstanding);
+
+	if (live_mode)
+		printf("hci%u: RX %lu packets, TX %lu packets, "
+				"%u outstanding\n", dev->index,
+				dev->interval.rx_num, dev->interval.tx_num,
+				outstanding);
+
+	queue_foreach(dev->conn_list, conn_flush_interval, NULL);
+
+	memset(&dev->interval, 0, sizeof(dev->interval));
+	dev->acl_buf.interval_max = dev->acl_buf.outstanding;
+	dev->le_buf.interval_max = dev->le_buf.outstanding;
+}
+
+static void flush_interval(struct timeval *tv)
+{
+	uint64_t now = tv_to_usec(tv);
+
+	if (!interval_start) {
+		interval_start = now - now % interval_usec;
+		return;
+	}
+
+	if (now < interval_start + interval_usec)
+		return;
+
+	queue_foreach(dev_list, dev_flush_interval, NULL);
+
+	if (export_file)
+		fflush(export_file);
+
+	interval_start += (now - interval_start) / interval_usec *
+								interval_usec;
+}
+
 static void chan_destroy(void *data)
 {
 	struct l2cap_chan *chan = data;
@@ -93,6 +533,19 @@ static void chan_destroy(void *data)
 	if (chan->psm)
 		printf("      PSM %u\n", chan->psm);
 	printf("      %lu packets\n", chan->num);
+	printf("      %" PRIu64 " octets\n", chan->bytes);
+	if (chan->bytes_peak)
+		printf("      %.1f kbit/s peak throughput\n",
+				chan->bytes_peak * 8000.0 / interval_usec);
+
+	if (export_file && export_format == EXPORT_JSON)
+		fprintf(export_file, "{\"type\":\"channel\",\"index\":%u"
+				",\"handle\":%u,\"cid\":%u,\"psm\":%u"
+				",\"direction\":\"%s\",\"packets\":%lu"
+				",\"bytes\":%" PRIu64 "}\n",
+				chan->conn->dev->index, chan->conn->handle,
+				chan->cid, chan->psm, chan->out ? "tx" : "rx",
+				chan->num, chan->bytes);
 
 	free(chan);
 }
@@ -104,6 +557,7 @@ static struct l2cap_chan *chan_alloc(struct hci_conn *conn, uint16_t cid,
 
 	chan = new0(struct l2cap_chan, 1);
 
+	chan->conn = conn;
 	chan->cid = cid;
 	chan->out = out;
 
@@ -138,30 +592,11 @@ static struct l2cap_chan *chan_lookup(struct hci_conn *conn, uint16_t cid,
 static void conn_destroy(void *data)
 {
 	struct hci_conn *conn = data;
-	const char *str;
-
-	switch (conn->type) {
-	case CONN_BR_ACL:
-		str = "BR-ACL";
-		break;
-	case CONN_BR_SCO:
-		str = "BR-SCO";
-		break;
-	case CONN_BR_ESCO:
-		str = "BR-ESCO";
-		break;
-	case CONN_LE_ACL:
-		str = "LE-ACL";
-		break;
-	case CONN_LE_ISO:
-		str = "LE-ISO";
-		break;
-	default:
-		str = "unknown";
-		break;
-	}
+	const char *str = conn_type_str(conn->type);
+	char addr[18];
 
-	conn->tx_pkt_med = conn->tx_bytes / conn->tx_num;
+	if (conn->tx_num)
+		conn->tx_pkt_med = conn->tx_bytes / conn->tx_num;
 
 	printf("  Found %s connection with handle %u\n", str, conn->handle);
 	/* TODO: Store address type */
@@ -171,18 +606,35 @@ static void conn_destroy(void *data)
 	print_field("%lu RX packets", conn->rx_num);
 	print_field("%lu TX packets", conn->tx_num);
 	print_field("%lu TX completed packets", conn->tx_num_comp);
-	print_field("%ld msec min latency",
-			conn->tx_lat_min.tv_sec * 1000 +
-			conn->tx_lat_min.tv_usec / 1000);
-	print_field("%ld msec max latency",
-			conn->tx_lat_max.tv_sec * 1000 +
-			conn->tx_lat_max.tv_usec / 1000);
-	print_field("%ld msec median latency",
-			conn->tx_lat_med.tv_sec * 1000 +
-			conn->tx_lat_med.tv_usec / 1000);
+	print_field("%u msec min latency", conn->tx_lat.min / 1000);
+	print_field("%u msec max latency", conn->tx_lat.max / 1000);
+	print_field("%u msec median latency",
+				lat_hist_percentile(&conn->tx_lat, 500) / 1000);
+	lat_hist_print("TX latency", &conn->tx_lat);
 	print_field("%u octets TX min packet size", conn->tx_pkt_min);
 	print_field("%u octets TX max packet size", conn->tx_pkt_max);
 	print_field("%u octets TX median packet size", conn->tx_pkt_med);
+	if (conn->rx_bytes_peak || conn->tx_bytes_peak) {
+		print_field("%.1f kbit/s RX peak throughput",
+				conn->rx_bytes_peak * 8000.0 / interval_usec);
+		print_field("%.1f kbit/s TX peak throughput",
+				conn->tx_bytes_peak * 8000.0 / interval_usec);
+	}
+
+	if (export_file && export_format == EXPORT_JSON) {
+		ba2str((bdaddr_t *) conn->bdaddr, addr);
+		fprintf(export_file, "{\"type\":\"connection\",\"index\":%u"
+				",\"handle\":%u,\"link\":\"%s\""
+				",\"address\":\"%s\",\"rx_packets\":%lu"
+				",\"rx_bytes\":%zu,\"tx_packets\":%lu"
+				",\"tx_bytes\":%zu,\"tx_completed\":%lu",
+				conn->dev->index, conn->handle, str, addr,
+				conn->rx_num, conn->rx_bytes, conn->tx_num,
+				conn->tx_bytes, conn->tx_num_comp);
+		lat_hist_export("tx_latency", &conn->tx_lat);
+		fprintf(export_file, "}\n");
+	}
+
 	queue_destroy(conn->chan_list, chan_destroy);
 
 	queue_destroy(conn->tx_queue, free);
@@ -196,6 +648,7 @@ static struct hci_conn *conn_alloc(struct hci_dev *dev, uint16_t handle,
 
 	conn = new0(struct hci_conn, 1);
 
+	conn->dev = dev;
 	conn->handle = handle;
 	conn->type = type;
 	conn->tx_queue = queue_new();
@@ -234,6 +687,68 @@ static struct hci_conn *conn_lookup_type(struct hci_dev *dev, uint16_t handle,
 	return conn;
 }
 
+static void cmd_destroy(void *data)
+{
+	struct hci_cmd *cmd = data;
+	char label[64];
+
+	snprintf(label, sizeof(label), "%s (0x%2.2x|0x%4.4x)",
+				packet_opcode_str(cmd->opcode),
+				cmd->opcode >> 10, cmd->opcode & 0x03ff);
+
+	if (cmd->lat.count) {
+		printf("  Command %s\n", label);
+		lat_hist_print("Response latency", &cmd->lat);
+	}
+
+	if (export_file && export_format == EXPORT_JSON) {
+		fprintf(export_file, "{\"type\":\"command\",\"index\":%u"
+				",\"opcode\":\"0x%4.4x\",\"name\":\"%s\"",
+				cmd->index, cmd->opcode,
+				packet_opcode_str(cmd->opcode));
+		lat_hist_export("latency", &cmd->lat);
+		fprintf(export_file, "}\n");
+	}
+
+	free(cmd);
+}
+
+static bool cmd_match_opcode(const void *a, const void *b)
+{
+	const struct hci_cmd *cmd = a;
+	uint16_t opcode = PTR_TO_UINT(b);
+
+	return cmd->opcode == opcode;
+}
+
+static struct hci_cmd *cmd_lookup(struct hci_dev *dev, uint16_t opcode)
+{
+	struct hci_cmd *cmd;
+
+	cmd = queue_find(dev->cmd_list, cmd_match_opcode, UINT_TO_PTR(opcode));
+	if (!cmd) {
+		cmd = new0(struct hci_cmd, 1);
+		cmd->index = dev->index;
+		cmd->opcode = opcode;
+		queue_push_tail(dev->cmd_list, cmd);
+	}
+
+	return cmd;
+}
+
+static void cmd_response(struct hci_dev *dev, struct timeval *tv,
+							uint16_t opcode)
+{
+	struct hci_cmd *cmd;
+
+	cmd = queue_find(dev->cmd_list, cmd_match_opcode, UINT_TO_PTR(opcode));
+	if (!cmd || !cmd->pending)
+		return;
+
+	lat_hist_add(&cmd->lat, tv_diff_usec(tv, &cmd->sent));
+	cmd->pending = false;
+}
+
 static void dev_destroy(void *data)
 {
 	struct hci_dev *dev = data;
@@ -270,6 +785,25 @@ static void dev_destroy(void *data)
 	printf("  %lu user logs\n", dev->user_log);
 	printf("  %lu control messages \n", dev->ctrl_msg);
 	printf("  %lu unknown opcodes\n", dev->unknown);
+	buf_print("ACL", &dev->acl_buf);
+	buf_print("LE", &dev->le_buf);
+
+	if (export_file && export_format == EXPORT_JSON) {
+		char addr[18];
+
+		ba2str((bdaddr_t *) dev->bdaddr, addr);
+		fprintf(export_file, "{\"type\":\"controller\",\"index\":%u"
+				",\"address\":\"%s\",\"commands\":%lu"
+				",\"events\":%lu,\"acl\":%lu,\"sco\":%lu"
+				",\"iso\":%lu", dev->index, addr,
+				dev->num_cmd, dev->num_evt, dev->num_acl,
+				dev->num_sco, dev->num_iso);
+		buf_export("acl_buffers", &dev->acl_buf);
+		buf_export("le_buffers", &dev->le_buf);
+		fprintf(export_file, "}\n");
+	}
+
+	queue_destroy(dev->cmd_list, cmd_destroy);
 	queue_destroy(dev->conn_list, conn_destroy);
 	printf("\n");
 
@@ -285,6 +819,7 @@ static struct hci_dev *dev_alloc(uint16_t index)
 	dev->index = index;
 	dev->manufacturer = 0xffff;
 
+	dev->cmd_list = queue_new();
 	dev->conn_list = queue_new();
 
 	return dev;
@@ -365,6 +900,7 @@ static void del_index(struct timeval *tv, uint16_t index,
 		return;
 	}
 
+	dev_flush_interval(dev, NULL);
 	dev_destroy(dev);
 }
 
@@ -373,6 +909,7 @@ static void command_pkt(struct timeval *tv, uint16_t index,
 {
 	const struct bt_hci_cmd_hdr *hdr = data;
 	struct hci_dev *dev;
+	struct hci_cmd *cmd;
 
 	data += sizeof(*hdr);
 	size -= sizeof(*hdr);
@@ -383,6 +920,10 @@ static void command_pkt(struct timeval *tv, uint16_t index,
 
 	dev->num_hci++;
 	dev->num_cmd++;
+
+	cmd = cmd_lookup(dev, le16_to_cpu(hdr->opcode));
+	cmd->pending = true;
+	cmd->sent = *tv;
 }
 
 static void evt_conn_complete(struct hci_dev *dev, struct timeval *tv,
@@ -435,6 +976,43 @@ static void rsp_read_bd_addr(struct hci_dev *dev, struct timeval *tv,
 	memcpy(dev->bdaddr, rsp->bdaddr, 6);
 }
 
+static void rsp_read_buffer_size(struct hci_dev *dev, struct timeval *tv,
+					const void *data, uint16_t size)
+{
+	const struct bt_hci_rsp_read_buffer_size *rsp = data;
+
+	if (size < sizeof(*rsp) || rsp->status)
+		return;
+
+	dev->acl_buf.mtu = le16_to_cpu(rsp->acl_mtu);
+	dev->acl_buf.max_pkt = le16_to_cpu(rsp->acl_max_pkt);
+}
+
+static void rsp_le_read_buffer_size(struct hci_dev *dev, struct timeval *tv,
+					const void *data, uint16_t size)
+{
+	const struct bt_hci_rsp_le_read_buffer_size *rsp = data;
+
+	if (size < sizeof(*rsp) || rsp->status)
+		return;
+
+	dev->le_buf.mtu = le16_to_cpu(rsp->le_mtu);
+	dev->le_buf.max_pkt = rsp->le_max_pkt;
+}
+
+static void rsp_le_read_buffer_size_v2(struct hci_dev *dev,
+					struct timeval *tv,
+					const void *data, uint16_t size)
+{
+	const struct bt_hci_rsp_le_read_buffer_size_v2 *rsp = data;
+
+	if (size < sizeof(*rsp) || rsp->status)
+		return;
+
+	dev->le_buf.mtu = le16_to_cpu(rsp->acl_mtu);
+	dev->le_buf.max_pkt = rsp->acl_max_pkt;
+}
+
 static void evt_cmd_complete(struct hci_dev *dev, struct timeval *tv,
 					const void *data, uint16_t size)
 {
@@ -446,13 +1024,43 @@ static void evt_cmd_complete(struct hci_dev *dev, struct timeval *tv,
 
 	opcode = le16_to_cpu(evt->opcode);
 
+	cmd_response(dev, tv, opcode);
+
 	switch (opcode) {
 	case BT_HCI_CMD_READ_BD_ADDR:
 		rsp_read_bd_addr(dev, tv, data, size);
 		break;
+	case BT_HCI_CMD_READ_BUFFER_SIZE:
+		rsp_read_buffer_size(dev, tv, data, size);
+		break;
+	case BT_HCI_CMD_LE_READ_BUFFER_SIZE:
+		rsp_le_read_buffer_size(dev, tv, data, size);
+		break;
+	case BT_HCI_CMD_LE_READ_BUFFER_SIZE_V2:
+		rsp_le_read_buffer_size_v2(dev, tv, data, size);
+		break;
 	}
 }
 
+static void evt_cmd_status(struct hci_dev *dev, struct timeval *tv,
+					const void *data, uint16_t size)
+{
+	const struct bt_hci_evt_cmd_status *evt = data;
+
+	cmd_response(dev, tv, le16_to_cpu(evt->opcode));
+}
+
+static struct hci_buf *conn_buf(struct hci_conn *conn)
+{
+	/* LE links share the ACL buffers if the controller has none
+	 * dedicated to LE.
+	 */
+	if (conn->type == CONN_LE_ACL && conn->dev->le_buf.max_pkt)
+		return &conn->dev->le_buf;
+
+	return &conn->dev->acl_buf;
+}
+
 static void evt_num_completed_packets(struct hci_dev *dev, struct timeval *tv,
 					const void *data, uint16_t size)
 {
@@ -466,8 +1074,6 @@ static void evt_num_completed_packets(struct hci_dev *dev, struct timeval *tv,
 		uint16_t handle = get_le16(data);
 		uint16_t count = get_le16(data + 2);
 		struct hci_conn *conn;
-		struct timeval res;
-		struct timeval *last_tx;
 
 		data += 4;
 		size -= 4;
@@ -478,43 +1084,61 @@ static void evt_num_completed_packets(struct hci_dev *dev, struct timeval *tv,
 
 		conn->tx_num_comp += count;
 
-		last_tx = queue_pop_head(conn->tx_queue);
-		if (last_tx) {
-			timersub(tv, last_tx, &res);
-
-			if ((!timerisset(&conn->tx_lat_min) ||
-					timercmp(&res, &conn->tx_lat_min, <)) &&
-					res.tv_sec >= 0 && res.tv_usec >= 0)
-				conn->tx_lat_min = res;
-
-			if (!timerisset(&conn->tx_lat_max) ||
-					timercmp(&res, &conn->tx_lat_max, >))
-				conn->tx_lat_max = res;
+		if (count > conn->tx_outstanding)
+			conn->tx_outstanding = 0;
+		else
+			conn->tx_outstanding -= count;
 
-			if (timerisset(&conn->tx_lat_med)) {
-				struct timeval tmp;
+		buf_update(conn_buf(conn), tv, -count);
 
-				timeradd(&conn->tx_lat_med, &res, &tmp);
+		while (count--) {
+			struct timeval *last_tx;
 
-				tmp.tv_sec /= 2;
-				tmp.tv_usec /= 2;
-				if (tmp.tv_sec % 2) {
-					tmp.tv_usec += 500000;
-					if (tmp.tv_usec >= 1000000) {
-						tmp.tv_sec++;
-						tmp.tv_usec -= 1000000;
-					}
-				}
-
-				conn->tx_lat_med = tmp;
-			} else
-				conn->tx_lat_med = res;
+			last_tx = queue_pop_head(conn->tx_queue);
+			if (!last_tx)
+				break;
 
+			lat_hist_add(&conn->tx_lat, tv_diff_usec(tv, last_tx));
 			free(last_tx);
 		}
 	}
 }
 
+static void le_conn_setup(struct hci_dev *dev, uint16_t handle,
+							const uint8_t *bdaddr)
+{
+	struct hci_conn *conn;
+
+	conn = conn_lookup_type(dev, handle, CONN_LE_ACL);
+	if (!conn)
+		return;
+
+	memcpy(conn->bdaddr, bdaddr, 6);
+	conn->setup_seen = true;
+}
+
+static void evt_le_conn_complete(struct hci_dev *dev, struct timeval *tv,
+					const void *data, uint16_t size)
+{
+	const struct bt_hci_evt_le_conn_complete *evt = data;
+
+	if (size < sizeof(*evt) || evt->status)
+		return;
+
+	le_conn_setup(dev, le16_to_cpu(evt->handle), evt->peer_addr);
+}
+
+static void evt_le_enh_conn_complete(struct hci_dev *dev, struct timeval *tv,
+					const void *data, uint16_t size)
+{
+	const struct bt_hci_evt_le_enhanced_conn_complete *evt = data;
+
+	if (size < sizeof(*evt) || evt->status)
+		return;
+
+	le_conn_setup(dev, le16_to_cpu(evt->handle), evt->peer_addr);
+}
+
 static void evt_le_meta_event(struct hci_dev *dev, struct timeval *tv,
 					const void *data, uint16_t size)
 {
@@ -524,6 +1148,12 @@ static void evt_le_meta_event(struct hci_dev *dev, struct timeval *tv,
 	size -= sizeof(subtype);
 
 	switch (subtype) {
+	case BT_HCI_EVT_LE_CONN_COMPLETE:
+		evt_le_conn_complete(dev, tv, data, size);
+		break;
+	case BT_HCI_EVT_LE_ENHANCED_CONN_COMPLETE:
+		evt_le_enh_conn_complete(dev, tv, data, size);
+		break;
 	}
 }
 
@@ -553,6 +1183,9 @@ static void event_pkt(struct timeval *tv, uint16_t index,
 	case BT_HCI_EVT_CMD_COMPLETE:
 		evt_cmd_complete(dev, tv, data, size);
 		break;
+	case BT_HCI_EVT_CMD_STATUS:
+		evt_cmd_status(dev, tv, data, size);
+		break;
 	case BT_HCI_EVT_NUM_COMPLETED_PACKETS:
 		evt_num_completed_packets(dev, tv, data, size);
 		break;
@@ -569,7 +1202,7 @@ static void acl_pkt(struct timeval *tv, uint16_t index, bool out,
 	struct hci_dev *dev;
 	struct hci_conn *conn;
 	struct l2cap_chan *chan;
-	uint16_t cid;
+	uint16_t handle, cid;
 
 	data += sizeof(*hdr);
 	size -= sizeof(*hdr);
@@ -581,8 +1214,11 @@ static void acl_pkt(struct timeval *tv, uint16_t index, bool out,
 	dev->num_hci++;
 	dev->num_acl++;
 
-	conn = conn_lookup_type(dev, le16_to_cpu(hdr->handle) & 0x0fff,
-								CONN_BR_ACL);
+	handle = le16_to_cpu(hdr->handle) & 0x0fff;
+
+	conn = conn_lookup(dev, handle);
+	if (!conn)
+		conn = conn_lookup_type(dev, handle, CONN_BR_ACL);
 	if (!conn)
 		return;
 
@@ -591,13 +1227,27 @@ static void acl_pkt(struct timeval *tv, uint16_t index, bool out,
 	case 0x02:
 		cid = get_le16(data + 2);
 		chan = chan_lookup(conn, cid, out);
-		if (chan)
-			chan->num++;
 		if (cid == 1)
 			l2cap_sig(conn, out, data + 4, size - 4);
+		if (out)
+			conn->tx_chan = chan;
+		else
+			conn->rx_chan = chan;
+		if (chan)
+			chan->num++;
+		break;
+	default:
+		/* Continuation fragments belong to the last channel */
+		chan = out ? conn->tx_chan : conn->rx_chan;
 		break;
 	}
 
+	if (chan) {
+		chan->bytes += size;
+		chan->interval_num++;
+		chan->interval_bytes += size;
+	}
+
 	if (out) {
 		struct timeval *last_tx;
 
@@ -611,8 +1261,25 @@ static void acl_pkt(struct timeval *tv, uint16_t index, bool out,
 			conn->tx_pkt_min = size;
 		if (!conn->tx_pkt_max || size > conn->tx_pkt_max)
 			conn->tx_pkt_max = size;
+
+		conn->tx_outstanding++;
+		if (conn->tx_outstanding > conn->interval_outstanding)
+			conn->interval_outstanding = conn->tx_outstanding;
+
+		buf_update(conn_buf(conn), tv, 1);
+
+		conn->interval.tx_num++;
+		conn->interval.tx_bytes += size;
+		dev->interval.tx_num++;
+		dev->interval.tx_bytes += size;
 	} else {
 		conn->rx_num++;
+		conn->rx_bytes += size;
+
+		conn->interval.rx_num++;
+		conn->interval.rx_bytes += size;
+		dev->interval.rx_num++;
+		dev->interval.rx_bytes += size;
 	}
 }
 
@@ -726,6 +1393,116 @@ static void unknown_opcode(struct timeval *tv, uint16_t index,
 	dev->unknown++;
 }
 
+void analyze_packet(struct timeval *tv, uint16_t index, uint16_t opcode,
+					const void *data, uint16_t size)
+{
+	struct timeval ctv;
+
+	if (!tv) {
+		gettimeofday(&ctv, NULL);
+		tv = &ctv;
+	}
+
+	flush_interval(tv);
+
+	switch (opcode) {
+	case BTSNOOP_OPCODE_NEW_INDEX:
+		new_index(tv, index, data, size);
+		break;
+	case BTSNOOP_OPCODE_DEL_INDEX:
+		del_index(tv, index, data, size);
+		break;
+	case BTSNOOP_OPCODE_COMMAND_PKT:
+		command_pkt(tv, index, data, size);
+		break;
+	case BTSNOOP_OPCODE_EVENT_PKT:
+		event_pkt(tv, index, data, size);
+		break;
+	case BTSNOOP_OPCODE_ACL_TX_PKT:
+		acl_pkt(tv, index, true, data, size);
+		break;
+	case BTSNOOP_OPCODE_ACL_RX_PKT:
+		acl_pkt(tv, index, false, data, size);
+		break;
+	case BTSNOOP_OPCODE_SCO_TX_PKT:
+	case BTSNOOP_OPCODE_SCO_RX_PKT:
+		sco_pkt(tv, index, data, size);
+		break;
+	case BTSNOOP_OPCODE_OPEN_INDEX:
+	case BTSNOOP_OPCODE_CLOSE_INDEX:
+		break;
+	case BTSNOOP_OPCODE_INDEX_INFO:
+		info_index(tv, index, data, size);
+		break;
+	case BTSNOOP_OPCODE_VENDOR_DIAG:
+		vendor_diag(tv, index, data, size);
+		break;
+	case BTSNOOP_OPCODE_SYSTEM_NOTE:
+		system_note(tv, index, data, size);
+		break;
+	case BTSNOOP_OPCODE_USER_LOGGING:
+		user_log(tv, index, data, size);
+		break;
+	case BTSNOOP_OPCODE_CTRL_OPEN:
+	case BTSNOOP_OPCODE_CTRL_CLOSE:
+	case BTSNOOP_OPCODE_CTRL_COMMAND:
+	case BTSNOOP_OPCODE_CTRL_EVENT:
+		ctrl_msg(tv, index, data, size);
+		break;
+	case BTSNOOP_OPCODE_ISO_TX_PKT:
+	case BTSNOOP_OPCODE_ISO_RX_PKT:
+		iso_pkt(tv, index, data, size);
+		break;
+	default:
+		unknown_opcode(tv, index, data, size);
+		break;
+	}
+}
+
+void analyze_set_interval(unsigned int msec)
+{
+	if (msec)
+		interval_usec = (uint64_t) msec * 1000;
+}
+
+bool analyze_set_export(const char *path)
+{
+	const char *ext;
+
+	export_file = fopen(path, "w");
+	if (!export_file) {
+		perror("Failed to open export file");
+		return false;
+	}
+
+	ext = strrchr(path, '.');
+	if (ext && !strcasecmp(ext, ".json"))
+		export_format = EXPORT_JSON;
+	else
+		export_format = EXPORT_CSV;
+
+	if (export_format == EXPORT_CSV)
+		fprintf(export_file, "time,index,handle,cid,rx_packets,"
+				"rx_bytes,tx_packets,tx_bytes,outstanding\n");
+
+	return true;
+}
+
+static void analyze_finish(void)
+{
+	/* Account the last partial interval */
+	if (interval_start)
+		queue_foreach(dev_list, dev_flush_interval, NULL);
+
+	queue_destroy(dev_list, dev_destroy);
+	dev_list = NULL;
+
+	if (export_file) {
+		fclose(export_file);
+		export_file = NULL;
+	}
+}
+
 void analyze_trace(const char *path)
 {
 	struct btsnoop *btsnoop_file;
@@ -759,66 +1536,56 @@ void analyze_trace(const char *path)
 								buf, &pktlen))
 			break;
 
-		switch (opcode) {
-		case BTSNOOP_OPCODE_NEW_INDEX:
-			new_index(&tv, index, buf, pktlen);
-			break;
-		case BTSNOOP_OPCODE_DEL_INDEX:
-			del_index(&tv, index, buf, pktlen);
-			break;
-		case BTSNOOP_OPCODE_COMMAND_PKT:
-			command_pkt(&tv, index, buf, pktlen);
-			break;
-		case BTSNOOP_OPCODE_EVENT_PKT:
-			event_pkt(&tv, index, buf, pktlen);
-			break;
-		case BTSNOOP_OPCODE_ACL_TX_PKT:
-			acl_pkt(&tv, index, true, buf, pktlen);
-			break;
-		case BTSNOOP_OPCODE_ACL_RX_PKT:
-			acl_pkt(&tv, index, false, buf, pktlen);
-			break;
-		case BTSNOOP_OPCODE_SCO_TX_PKT:
-		case BTSNOOP_OPCODE_SCO_RX_PKT:
-			sco_pkt(&tv, index, buf, pktlen);
-			break;
-		case BTSNOOP_OPCODE_OPEN_INDEX:
-		case BTSNOOP_OPCODE_CLOSE_INDEX:
-			break;
-		case BTSNOOP_OPCODE_INDEX_INFO:
-			info_index(&tv, index, buf, pktlen);
-			break;
-		case BTSNOOP_OPCODE_VENDOR_DIAG:
-			vendor_diag(&tv, index, buf, pktlen);
-			break;
-		case BTSNOOP_OPCODE_SYSTEM_NOTE:
-			system_note(&tv, index, buf, pktlen);
-			break;
-		case BTSNOOP_OPCODE_USER_LOGGING:
-			user_log(&tv, index, buf, pktlen);
-			break;
-		case BTSNOOP_OPCODE_CTRL_OPEN:
-		case BTSNOOP_OPCODE_CTRL_CLOSE:
-		case BTSNOOP_OPCODE_CTRL_COMMAND:
-		case BTSNOOP_OPCODE_CTRL_EVENT:
-			ctrl_msg(&tv, index, buf, pktlen);
-			break;
-		case BTSNOOP_OPCODE_ISO_TX_PKT:
-		case BTSNOOP_OPCODE_ISO_RX_PKT:
-			iso_pkt(&tv, index, buf, pktlen);
-			break;
-		default:
-			unknown_opcode(&tv, index, buf, pktlen);
-			break;
-		}
+		analyze_packet(&tv, index, opcode, buf, pktlen);
 
 		num_packets++;
 	}
 
 	printf("Trace contains %lu packets\n\n", num_packets);
 
-	queue_destroy(dev_list, dev_destroy);
+	analyze_finish();
 
 done:
 	btsnoop_unref(btsnoop_file);
 }
+
+static void live_timeout_callback(int id, void *user_data)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	flush_interval(&tv);
+
+	if (mainloop_modify_timeout(id, interval_usec / 1000) < 0)
+		mainloop_exit_failure();
+}
+
+int analyze_live_start(void)
+{
+	dev_list = queue_new();
+	live_mode = true;
+
+	live_timeout = mainloop_add_timeout(interval_usec / 1000,
+					live_timeout_callback, NULL, NULL);
+	if (live_timeout < 0) {
+		queue_destroy(dev_list, NULL);
+		dev_list = NULL;
+		return live_timeout;
+	}
+
+	return 0;
+}
+
+void analyze_live_stop(void)
+{
+	if (live_timeout >= 0) {
+		mainloop_remove_timeout(live_timeout);
+		live_timeout = -1;
+	}
+
+	live_mode = false;
+
+	printf("\n");
+
+	analyze_finish();
+}
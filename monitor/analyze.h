@@ -9,4 +9,14 @@
  *
  */
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/time.h>
+
+void analyze_set_interval(unsigned int msec);
+bool analyze_set_export(const char *path);
 void analyze_trace(const char *path);
+int analyze_live_start(void);
+void analyze_live_stop(void);
+void analyze_packet(struct timeval *tv, uint16_t index, uint16_t opcode,
+					const void *data, uint16_t size);
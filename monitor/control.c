@@ -21,6 +21,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -28,6 +29,7 @@
 #include <sys/stat.h>
 #include <termios.h>
 #include <fcntl.h>
+#include <byteswap.h>
 #include <linux/filter.h>
 
 #include "lib/bluetooth.h"
@@ -35,6 +37,7 @@
 #include "lib/mgmt.h"
 
 #include "src/shared/util.h"
+#include "src/shared/queue.h"
 #include "src/shared/btsnoop.h"
 #include "src/shared/mainloop.h"
 
@@ -45,17 +48,69 @@
 #include "tty.h"
 #include "control.h"
 #include "jlink.h"
+#include "analyze.h"
 
 static struct btsnoop *btsnoop_file = NULL;
 static bool hcidump_fallback = false;
 static bool decode_control = true;
+static bool analyze_data = false;
 static uint16_t filter_index = HCI_DEV_NONE;
 
+#define FILTER_MAX_VALUES	16
+
+struct filter_list {
+	uint16_t val[FILTER_MAX_VALUES];
+	unsigned int num;
+};
+
+static struct {
+	bool enabled;
+	struct filter_list index;
+	struct filter_list type;
+	struct filter_list opcode;
+	struct filter_list handle;
+	struct filter_list cid;
+	struct queue *acl_chans;
+	struct btsnoop_filter file;
+	bool file_enabled;
+} prefilter = {
+	.file.index = 0xffff,
+};
+
+struct acl_chan {
+	uint16_t index;
+	uint16_t handle;
+	uint16_t cid[2];
+};
+
+#define BATCH_SIZE	32
+
+struct batch_slot {
+	struct mgmt_hdr hdr;
+	unsigned char buf[BTSNOOP_MAX_PACKET_SIZE];
+	unsigned char control[64];
+	struct iovec iov[2];
+};
+
+struct batch_stats {
+	const char *name;
+	unsigned long reads;
+	unsigned long frames;
+	unsigned int max;
+	unsigned long hist[6];
+};
+
+static struct batch_stats monitor_stats = { .name = "Monitor" };
+static struct batch_stats control_stats = { .name = "Control" };
+
 struct control_data {
 	uint16_t channel;
 	int fd;
 	unsigned char buf[BTSNOOP_MAX_PACKET_SIZE];
 	uint16_t offset;
+	struct mmsghdr *msgs;
+	struct batch_slot *slots;
+	struct batch_stats *stats;
 };
 
 static void free_data(void *user_data)
@@ -64,6 +119,8 @@ static void free_data(void *user_data)
 
 	close(data->fd);
 
+	free(data->msgs);
+	free(data->slots);
 	free(data);
 }
 
@@ -900,83 +957,325 @@ void control_message(uint16_t opcode, const void *data, uint16_t size)
 	}
 }
 
+static bool filter_list_has(const struct filter_list *list, uint16_t val)
+{
+	unsigned int i;
+
+	for (i = 0; i < list->num; i++) {
+		if (list->val[i] == val)
+			return true;
+	}
+
+	return false;
+}
+
+static bool filter_list_add(struct filter_list *list, uint16_t val)
+{
+	if (filter_list_has(list, val))
+		return true;
+
+	if (list->num >= FILTER_MAX_VALUES)
+		return false;
+
+	list->val[list->num++] = val;
+
+	return true;
+}
+
+static bool acl_chan_match(const void *a, const void *b)
+{
+	const struct acl_chan *chan = a;
+	const struct acl_chan *match = b;
+
+	return chan->index == match->index && chan->handle == match->handle;
+}
+
+static bool prefilter_acl(uint16_t index, bool out, const uint8_t *data,
+								uint16_t size)
+{
+	struct acl_chan match, *chan;
+	uint16_t handle;
+
+	if (size < 4)
+		return false;
+
+	handle = get_le16(data);
+
+	if (prefilter.handle.num &&
+			!filter_list_has(&prefilter.handle, handle & 0x0fff))
+		return false;
+
+	if (!prefilter.cid.num)
+		return true;
+
+	match.index = index;
+	match.handle = handle & 0x0fff;
+
+	chan = queue_find(prefilter.acl_chans, acl_chan_match, &match);
+
+	/* Continuation fragments belong to the channel of the last start
+	 * fragment on the same handle and direction.
+	 */
+	if ((handle >> 12 & 0x03) == 0x01)
+		return chan && filter_list_has(&prefilter.cid, chan->cid[out]);
+
+	if (size < 8)
+		return false;
+
+	if (!chan) {
+		chan = new0(struct acl_chan, 1);
+		chan->index = index;
+		chan->handle = handle & 0x0fff;
+		queue_push_tail(prefilter.acl_chans, chan);
+	}
+
+	chan->cid[out] = get_le16(data + 6);
+
+	return filter_list_has(&prefilter.cid, chan->cid[out]);
+}
+
+static bool prefilter_match(uint16_t index, uint16_t opcode,
+					const void *data, uint16_t size)
+{
+	const uint8_t *buf = data;
+
+	if (!prefilter.enabled)
+		return true;
+
+	if (index != HCI_DEV_NONE && prefilter.index.num &&
+				!filter_list_has(&prefilter.index, index))
+		return false;
+
+	switch (opcode) {
+	case BTSNOOP_OPCODE_NEW_INDEX:
+	case BTSNOOP_OPCODE_DEL_INDEX:
+	case BTSNOOP_OPCODE_OPEN_INDEX:
+	case BTSNOOP_OPCODE_CLOSE_INDEX:
+	case BTSNOOP_OPCODE_INDEX_INFO:
+		return true;
+	}
+
+	if (prefilter.type.num && !filter_list_has(&prefilter.type, opcode))
+		return false;
+
+	switch (opcode) {
+	case BTSNOOP_OPCODE_COMMAND_PKT:
+		if (!prefilter.opcode.num)
+			return true;
+		if (size < 2)
+			return false;
+		return filter_list_has(&prefilter.opcode, get_le16(buf));
+	case BTSNOOP_OPCODE_EVENT_PKT:
+		if (!prefilter.opcode.num || size < 1)
+			return true;
+		if (buf[0] == EVT_CMD_COMPLETE && size >= 5)
+			return filter_list_has(&prefilter.opcode,
+							get_le16(buf + 3));
+		if (buf[0] == EVT_CMD_STATUS && size >= 6)
+			return filter_list_has(&prefilter.opcode,
+							get_le16(buf + 4));
+		return true;
+	case BTSNOOP_OPCODE_ACL_TX_PKT:
+		return prefilter_acl(index, true, buf, size);
+	case BTSNOOP_OPCODE_ACL_RX_PKT:
+		return prefilter_acl(index, false, buf, size);
+	case BTSNOOP_OPCODE_SCO_TX_PKT:
+	case BTSNOOP_OPCODE_SCO_RX_PKT:
+	case BTSNOOP_OPCODE_ISO_TX_PKT:
+	case BTSNOOP_OPCODE_ISO_RX_PKT:
+		if (!prefilter.handle.num)
+			return true;
+		if (size < 2)
+			return false;
+		return filter_list_has(&prefilter.handle,
+						get_le16(buf) & 0x0fff);
+	}
+
+	return true;
+}
+
+static void batch_stats_add(struct batch_stats *stats, unsigned int count)
+{
+	unsigned int bucket = 0;
+
+	stats->reads++;
+	stats->frames += count;
+
+	if (count > stats->max)
+		stats->max = count;
+
+	while (count > 1 && bucket < NELEM(stats->hist) - 1) {
+		count >>= 1;
+		bucket++;
+	}
+
+	stats->hist[bucket]++;
+}
+
+static void print_batch_stats(struct batch_stats *stats)
+{
+	static const char *labels[] = { "1", "2-3", "4-7", "8-15",
+						"16-31", "32" };
+	unsigned int i;
+
+	if (!stats->reads)
+		return;
+
+	printf("%s channel: %lu frames in %lu reads (%.1f per read, "
+				"max %u)\n", stats->name, stats->frames,
+				stats->reads,
+				(double) stats->frames / stats->reads,
+				stats->max);
+
+	for (i = 0; i < NELEM(stats->hist); i++) {
+		if (!stats->hist[i])
+			continue;
+
+		printf("  %-5s frames: %lu reads\n", labels[i],
+							stats->hist[i]);
+	}
+}
+
+void control_print_stats(void)
+{
+	print_batch_stats(&monitor_stats);
+	print_batch_stats(&control_stats);
+}
+
+static void process_frame(struct control_data *data, struct msghdr *msg,
+				struct mgmt_hdr *hdr, unsigned char *buf,
+				ssize_t len)
+{
+	struct cmsghdr *cmsg;
+	struct timeval *tv = NULL;
+	struct timeval ctv;
+	struct ucred *cred = NULL;
+	struct ucred ccred;
+	uint16_t opcode, index, pktlen;
+
+	if (len < MGMT_HDR_SIZE)
+		return;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+				cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+
+		if (cmsg->cmsg_type == SCM_TIMESTAMP) {
+			memcpy(&ctv, CMSG_DATA(cmsg), sizeof(ctv));
+			tv = &ctv;
+		}
+
+		if (cmsg->cmsg_type == SCM_CREDENTIALS) {
+			memcpy(&ccred, CMSG_DATA(cmsg), sizeof(ccred));
+			cred = &ccred;
+		}
+	}
+
+	opcode = le16_to_cpu(hdr->opcode);
+	index  = le16_to_cpu(hdr->index);
+	pktlen = le16_to_cpu(hdr->len);
+
+	/* Frames truncated by the socket filter are only used to
+	 * track the L2CAP channel of ACL fragments.
+	 */
+	if (data->channel == HCI_CHANNEL_MONITOR &&
+				len - MGMT_HDR_SIZE < pktlen) {
+		prefilter_match(index, opcode, buf, len - MGMT_HDR_SIZE);
+		return;
+	}
+
+	switch (data->channel) {
+	case HCI_CHANNEL_CONTROL:
+		packet_control(tv, cred, index, opcode, buf, pktlen);
+		break;
+	case HCI_CHANNEL_MONITOR:
+		if (!prefilter_match(index, opcode, buf, pktlen))
+			break;
+
+		btsnoop_write_hci(btsnoop_file, tv, index, opcode, 0,
+								buf, pktlen);
+		ellisys_inject_hci(tv, index, opcode, buf, pktlen);
+		if (analyze_data)
+			analyze_packet(tv, index, opcode, buf, pktlen);
+		else
+			packet_monitor(tv, cred, index, opcode, buf, pktlen);
+		break;
+	}
+}
+
 static void data_callback(int fd, uint32_t events, void *user_data)
 {
 	struct control_data *data = user_data;
-	unsigned char control[64];
-	struct mgmt_hdr hdr;
-	struct msghdr msg;
-	struct iovec iov[2];
 
 	if (events & (EPOLLERR | EPOLLHUP)) {
 		mainloop_remove_fd(data->fd);
 		return;
 	}
 
-	iov[0].iov_base = &hdr;
-	iov[0].iov_len = MGMT_HDR_SIZE;
-	iov[1].iov_base = data->buf;
-	iov[1].iov_len = sizeof(data->buf);
-
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_iov = iov;
-	msg.msg_iovlen = 2;
-	msg.msg_control = control;
-	msg.msg_controllen = sizeof(control);
-
 	while (1) {
-		struct cmsghdr *cmsg;
-		struct timeval *tv = NULL;
-		struct timeval ctv;
-		struct ucred *cred = NULL;
-		struct ucred ccred;
-		uint16_t opcode, index, pktlen;
-		ssize_t len;
+		int i, count;
 
-		len = recvmsg(data->fd, &msg, MSG_DONTWAIT);
-		if (len < 0)
+		count = recvmmsg(data->fd, data->msgs, BATCH_SIZE,
+							MSG_DONTWAIT, NULL);
+		if (count <= 0)
 			break;
 
-		if (len < MGMT_HDR_SIZE)
-			break;
+		batch_stats_add(data->stats, count);
 
-		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
-					cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-			if (cmsg->cmsg_level != SOL_SOCKET)
-				continue;
+		for (i = 0; i < count; i++) {
+			struct batch_slot *slot = &data->slots[i];
+			struct msghdr *msg = &data->msgs[i].msg_hdr;
 
-			if (cmsg->cmsg_type == SCM_TIMESTAMP) {
-				memcpy(&ctv, CMSG_DATA(cmsg), sizeof(ctv));
-				tv = &ctv;
-			}
+			process_frame(data, msg, &slot->hdr, slot->buf,
+							data->msgs[i].msg_len);
 
-			if (cmsg->cmsg_type == SCM_CREDENTIALS) {
-				memcpy(&ccred, CMSG_DATA(cmsg), sizeof(ccred));
-				cred = &ccred;
-			}
+			/* Reset the control area for the next batch */
+			msg->msg_controllen = sizeof(slot->control);
 		}
 
-		opcode = le16_to_cpu(hdr.opcode);
-		index  = le16_to_cpu(hdr.index);
-		pktlen = le16_to_cpu(hdr.len);
-
-		switch (data->channel) {
-		case HCI_CHANNEL_CONTROL:
-			packet_control(tv, cred, index, opcode,
-							data->buf, pktlen);
+		/* A short batch means the socket queue has been drained */
+		if (count < BATCH_SIZE)
 			break;
-		case HCI_CHANNEL_MONITOR:
-			btsnoop_write_hci(btsnoop_file, tv, index, opcode, 0,
-							data->buf, pktlen);
-			ellisys_inject_hci(tv, index, opcode,
-							data->buf, pktlen);
-			packet_monitor(tv, cred, index, opcode,
-							data->buf, pktlen);
-			break;
-		}
 	}
 }
 
+static bool alloc_batch(struct control_data *data)
+{
+	int i;
+
+	data->msgs = calloc(BATCH_SIZE, sizeof(*data->msgs));
+	data->slots = calloc(BATCH_SIZE, sizeof(*data->slots));
+
+	if (!data->msgs || !data->slots) {
+		free(data->msgs);
+		free(data->slots);
+		return false;
+	}
+
+	for (i = 0; i < BATCH_SIZE; i++) {
+		struct batch_slot *slot = &data->slots[i];
+		struct msghdr *msg = &data->msgs[i].msg_hdr;
+
+		slot->iov[0].iov_base = &slot->hdr;
+		slot->iov[0].iov_len = MGMT_HDR_SIZE;
+		slot->iov[1].iov_base = slot->buf;
+		slot->iov[1].iov_len = sizeof(slot->buf);
+
+		msg->msg_iov = slot->iov;
+		msg->msg_iovlen = 2;
+		msg->msg_control = slot->control;
+		msg->msg_controllen = sizeof(slot->control);
+	}
+
+	if (data->channel == HCI_CHANNEL_MONITOR)
+		data->stats = &monitor_stats;
+	else
+		data->stats = &control_stats;
+
+	return true;
+}
+
 static int open_socket(uint16_t channel)
 {
 	struct sockaddr_hci addr;
@@ -1020,35 +1319,281 @@ static int open_socket(uint16_t channel)
 	return fd;
 }
 
-static void attach_index_filter(int fd, uint16_t index)
-{
-	struct sock_filter filters[] = {
-		/* Load MGMT index:
-		 * A <- MGMT index
-		 */
-		BPF_STMT(BPF_LD + BPF_B + BPF_ABS,
-					offsetof(struct mgmt_hdr, index)),
-		/* Accept if index is HCI_DEV_NONE:
-		 * A == HCI_DEV_NONE
-		 */
-		BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, HCI_DEV_NONE, 0, 1),
-		/* return */
-		BPF_STMT(BPF_RET|BPF_K, 0x0fffffff), /* pass */
-		/* Accept if index match:
-		 * A == index
-		 */
-		BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, index, 0, 1),
-		/* returns */
-		BPF_STMT(BPF_RET|BPF_K, 0x0fffffff), /* pass */
-		BPF_STMT(BPF_RET|BPF_K, 0), /* reject */
-	};
-	struct sock_fprog fprog = {
-		.len = sizeof(filters) / sizeof(filters[0]),
-		/* casting const away: */
-		.filter = filters,
+/* Socket filter program builder. Jumps reference labels that are
+ * resolved once the whole program has been emitted.
+ */
+#define BPF_MAX_INSNS		256
+
+enum {
+	LABEL_NONE,
+	LABEL_ACCEPT,
+	LABEL_REJECT,
+	LABEL_TRUNCATE,
+	LABEL_INDEX_OK,
+	LABEL_TYPE_OK,
+	LABEL_CMD,
+	LABEL_EVT,
+	LABEL_EVT_CC,
+	LABEL_EVT_CS,
+	LABEL_ACL,
+	LABEL_ACL_CID,
+	LABEL_DATA,
+	LABEL_MAX,
+};
+
+struct bpf_prog {
+	struct sock_filter insns[BPF_MAX_INSNS];
+	uint8_t jt[BPF_MAX_INSNS];
+	uint8_t jf[BPF_MAX_INSNS];
+	int labels[LABEL_MAX];
+	unsigned int len;
+	bool overflow;
+};
+
+/* Loads through BPF_H are in network byte order */
+#define MON_LE16(val)		bswap_16(val)
+
+#define MON_OFF_OPCODE		offsetof(struct mgmt_hdr, opcode)
+#define MON_OFF_INDEX		offsetof(struct mgmt_hdr, index)
+#define MON_OFF_DATA		MGMT_HDR_SIZE
+
+static void bpf_emit(struct bpf_prog *prog, uint16_t code, uint32_t k,
+						uint8_t jt, uint8_t jf)
+{
+	if (prog->len >= BPF_MAX_INSNS) {
+		prog->overflow = true;
+		return;
+	}
+
+	prog->insns[prog->len].code = code;
+	prog->insns[prog->len].k = k;
+	prog->jt[prog->len] = jt;
+	prog->jf[prog->len] = jf;
+	prog->len++;
+}
+
+static void bpf_stmt(struct bpf_prog *prog, uint16_t code, uint32_t k)
+{
+	bpf_emit(prog, code, k, LABEL_NONE, LABEL_NONE);
+}
+
+static void bpf_jeq(struct bpf_prog *prog, uint32_t k, uint8_t label)
+{
+	bpf_emit(prog, BPF_JMP + BPF_JEQ + BPF_K, k, label, LABEL_NONE);
+}
+
+static void bpf_goto(struct bpf_prog *prog, uint8_t label)
+{
+	bpf_emit(prog, BPF_JMP + BPF_JA, 0, label, LABEL_NONE);
+}
+
+static void bpf_label(struct bpf_prog *prog, uint8_t label)
+{
+	prog->labels[label] = prog->len;
+}
+
+static void bpf_jeq_list(struct bpf_prog *prog,
+				const struct filter_list *list, uint16_t mask,
+				uint8_t label)
+{
+	unsigned int i;
+
+	for (i = 0; i < list->num; i++)
+		bpf_jeq(prog, MON_LE16(list->val[i]) & mask, label);
+}
+
+static bool bpf_resolve(struct bpf_prog *prog)
+{
+	unsigned int i;
+
+	if (prog->overflow)
+		return false;
+
+	for (i = 0; i < prog->len; i++) {
+		struct sock_filter *insn = &prog->insns[i];
+		int offset;
+
+		if (prog->jt[i] == LABEL_NONE)
+			continue;
+
+		offset = prog->labels[prog->jt[i]] - (int) i - 1;
+		if (offset < 0)
+			return false;
+
+		if (BPF_OP(insn->code) == BPF_JA) {
+			insn->k = offset;
+			continue;
+		}
+
+		if (offset > 255)
+			return false;
+
+		insn->jt = offset;
+	}
+
+	return true;
+}
+
+/*
+ * The prefilter only understands monitor frames, on other channels such as
+ * the control one the opcode field holds something else, so only the index
+ * is matched there.
+ */
+static bool compile_filter(struct bpf_prog *prog, bool monitor)
+{
+	struct filter_list index = prefilter.index;
+	static const uint16_t keep[] = {
+		BTSNOOP_OPCODE_NEW_INDEX, BTSNOOP_OPCODE_DEL_INDEX,
+		BTSNOOP_OPCODE_OPEN_INDEX, BTSNOOP_OPCODE_CLOSE_INDEX,
+		BTSNOOP_OPCODE_INDEX_INFO,
 	};
+	unsigned int i;
+
+	memset(prog, 0, sizeof(*prog));
 
-	setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+	if (filter_index != HCI_DEV_NONE)
+		filter_list_add(&index, filter_index);
+
+	if (index.num) {
+		bpf_stmt(prog, BPF_LD + BPF_H + BPF_ABS, MON_OFF_INDEX);
+		bpf_jeq(prog, MON_LE16(HCI_DEV_NONE), LABEL_INDEX_OK);
+		bpf_jeq_list(prog, &index, 0xffff, LABEL_INDEX_OK);
+		bpf_goto(prog, LABEL_REJECT);
+	}
+
+	bpf_label(prog, LABEL_INDEX_OK);
+
+	if (!monitor || !prefilter.enabled) {
+		bpf_goto(prog, LABEL_ACCEPT);
+		goto done;
+	}
+
+	bpf_stmt(prog, BPF_LD + BPF_H + BPF_ABS, MON_OFF_OPCODE);
+
+	for (i = 0; i < NELEM(keep); i++)
+		bpf_jeq(prog, MON_LE16(keep[i]), LABEL_ACCEPT);
+
+	if (prefilter.type.num) {
+		bpf_jeq_list(prog, &prefilter.type, 0xffff, LABEL_TYPE_OK);
+		bpf_goto(prog, LABEL_REJECT);
+	}
+
+	bpf_label(prog, LABEL_TYPE_OK);
+
+	bpf_jeq(prog, MON_LE16(BTSNOOP_OPCODE_COMMAND_PKT), LABEL_CMD);
+	bpf_jeq(prog, MON_LE16(BTSNOOP_OPCODE_EVENT_PKT), LABEL_EVT);
+	bpf_jeq(prog, MON_LE16(BTSNOOP_OPCODE_ACL_TX_PKT), LABEL_ACL);
+	bpf_jeq(prog, MON_LE16(BTSNOOP_OPCODE_ACL_RX_PKT), LABEL_ACL);
+	bpf_jeq(prog, MON_LE16(BTSNOOP_OPCODE_SCO_TX_PKT), LABEL_DATA);
+	bpf_jeq(prog, MON_LE16(BTSNOOP_OPCODE_SCO_RX_PKT), LABEL_DATA);
+	bpf_jeq(prog, MON_LE16(BTSNOOP_OPCODE_ISO_TX_PKT), LABEL_DATA);
+	bpf_jeq(prog, MON_LE16(BTSNOOP_OPCODE_ISO_RX_PKT), LABEL_DATA);
+	bpf_goto(prog, LABEL_ACCEPT);
+
+	/* Commands:
+	 * A <- HCI opcode
+	 */
+	bpf_label(prog, LABEL_CMD);
+	if (prefilter.opcode.num) {
+		bpf_stmt(prog, BPF_LD + BPF_H + BPF_ABS, MON_OFF_DATA);
+		bpf_jeq_list(prog, &prefilter.opcode, 0xffff, LABEL_ACCEPT);
+		bpf_goto(prog, LABEL_REJECT);
+	} else
+		bpf_goto(prog, LABEL_ACCEPT);
+
+	/* Events, only Command Complete and Command Status are matched
+	 * against the HCI opcodes:
+	 * A <- event code
+	 */
+	bpf_label(prog, LABEL_EVT);
+	if (prefilter.opcode.num) {
+		bpf_stmt(prog, BPF_LD + BPF_B + BPF_ABS, MON_OFF_DATA);
+		bpf_jeq(prog, EVT_CMD_COMPLETE, LABEL_EVT_CC);
+		bpf_jeq(prog, EVT_CMD_STATUS, LABEL_EVT_CS);
+		bpf_goto(prog, LABEL_ACCEPT);
+
+		bpf_label(prog, LABEL_EVT_CC);
+		bpf_stmt(prog, BPF_LD + BPF_H + BPF_ABS, MON_OFF_DATA + 3);
+		bpf_jeq_list(prog, &prefilter.opcode, 0xffff, LABEL_ACCEPT);
+		bpf_goto(prog, LABEL_REJECT);
+
+		bpf_label(prog, LABEL_EVT_CS);
+		bpf_stmt(prog, BPF_LD + BPF_H + BPF_ABS, MON_OFF_DATA + 4);
+		bpf_jeq_list(prog, &prefilter.opcode, 0xffff, LABEL_ACCEPT);
+		bpf_goto(prog, LABEL_REJECT);
+	} else
+		bpf_goto(prog, LABEL_ACCEPT);
+
+	/* ACL data:
+	 * A <- handle (without packet boundary and broadcast flags)
+	 */
+	bpf_label(prog, LABEL_ACL);
+	if (prefilter.handle.num) {
+		bpf_stmt(prog, BPF_LD + BPF_H + BPF_ABS, MON_OFF_DATA);
+		bpf_stmt(prog, BPF_ALU + BPF_AND + BPF_K, MON_LE16(0x0fff));
+		bpf_jeq_list(prog, &prefilter.handle, MON_LE16(0x0fff),
+							LABEL_ACL_CID);
+		bpf_goto(prog, LABEL_REJECT);
+	}
+
+	/* Continuation fragments are passed and matched in user space
+	 * while start fragments of other channels are truncated to their
+	 * L2CAP header so the channel of the following fragments is known.
+	 * A <- packet boundary flags
+	 * A <- L2CAP CID
+	 */
+	bpf_label(prog, LABEL_ACL_CID);
+	if (prefilter.cid.num) {
+		bpf_stmt(prog, BPF_LD + BPF_B + BPF_ABS, MON_OFF_DATA + 1);
+		bpf_stmt(prog, BPF_ALU + BPF_AND + BPF_K, 0x30);
+		bpf_jeq(prog, 0x10, LABEL_ACCEPT);
+		bpf_stmt(prog, BPF_LD + BPF_H + BPF_ABS, MON_OFF_DATA + 6);
+		bpf_jeq_list(prog, &prefilter.cid, 0xffff, LABEL_ACCEPT);
+		bpf_goto(prog, LABEL_TRUNCATE);
+	} else
+		bpf_goto(prog, LABEL_ACCEPT);
+
+	/* SCO and ISO data:
+	 * A <- handle
+	 */
+	bpf_label(prog, LABEL_DATA);
+	if (prefilter.handle.num) {
+		bpf_stmt(prog, BPF_LD + BPF_H + BPF_ABS, MON_OFF_DATA);
+		bpf_stmt(prog, BPF_ALU + BPF_AND + BPF_K, MON_LE16(0x0fff));
+		bpf_jeq_list(prog, &prefilter.handle, MON_LE16(0x0fff),
+							LABEL_ACCEPT);
+		bpf_goto(prog, LABEL_REJECT);
+	} else
+		bpf_goto(prog, LABEL_ACCEPT);
+
+	bpf_label(prog, LABEL_TRUNCATE);
+	bpf_stmt(prog, BPF_RET + BPF_K, MON_OFF_DATA + 8);
+
+done:
+	bpf_label(prog, LABEL_ACCEPT);
+	bpf_stmt(prog, BPF_RET + BPF_K, 0x0fffffff);
+	bpf_label(prog, LABEL_REJECT);
+	bpf_stmt(prog, BPF_RET + BPF_K, 0);
+
+	return bpf_resolve(prog);
+}
+
+static void attach_filter(int fd, uint16_t channel)
+{
+	struct bpf_prog prog;
+	struct sock_fprog fprog;
+
+	if (!compile_filter(&prog, channel == HCI_CHANNEL_MONITOR)) {
+		fprintf(stderr, "Filter too complex for socket filter\n");
+		return;
+	}
+
+	fprog.len = prog.len;
+	fprog.filter = prog.insns;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+							sizeof(fprog)) < 0)
+		perror("Failed to attach socket filter");
 }
 
 static int open_channel(uint16_t channel)
@@ -1062,18 +1607,27 @@ static int open_channel(uint16_t channel)
 	memset(data, 0, sizeof(*data));
 	data->channel = channel;
 
+	if (!alloc_batch(data)) {
+		free(data);
+		return -1;
+	}
+
 	data->fd = open_socket(channel);
 	if (data->fd < 0) {
+		free(data->msgs);
+		free(data->slots);
 		free(data);
 		return -1;
 	}
 
-	if (filter_index != HCI_DEV_NONE)
-		attach_index_filter(data->fd, filter_index);
+	if (filter_index != HCI_DEV_NONE || prefilter.enabled)
+		attach_filter(data->fd, channel);
 
 	if (mainloop_add_fd(data->fd, EPOLLIN, data_callback,
 						data, free_data) < 0) {
 		close(data->fd);
+		free(data->msgs);
+		free(data->slots);
 		free(data);
 		return -1;
 	};
@@ -1109,7 +1663,9 @@ static void client_callback(int fd, uint32_t events, void *user_data)
 		opcode = le16_to_cpu(hdr->opcode);
 		index = le16_to_cpu(hdr->index);
 
-		packet_monitor(NULL, NULL, index, opcode,
+		if (prefilter_match(index, opcode, data->buf + MGMT_HDR_SIZE,
+								pktlen))
+			packet_monitor(NULL, NULL, index, opcode,
 					data->buf + MGMT_HDR_SIZE, pktlen);
 
 		data->offset -= pktlen + MGMT_HDR_SIZE;
@@ -1323,13 +1879,22 @@ static void process_data(struct control_data *data)
 		opcode = le16_to_cpu(hdr->opcode);
 		pktlen = data_len - 4 - hdr->hdr_len;
 
+		if (!prefilter_match(0, opcode, hdr->ext_hdr + hdr->hdr_len,
+								pktlen))
+			goto next;
+
 		btsnoop_write_hci(btsnoop_file, tv, 0, opcode, drops,
 					hdr->ext_hdr + hdr->hdr_len, pktlen);
 		ellisys_inject_hci(tv, 0, opcode, hdr->ext_hdr + hdr->hdr_len,
 					pktlen);
-		packet_monitor(tv, NULL, 0, opcode,
+		if (analyze_data)
+			analyze_packet(tv, 0, opcode,
+					hdr->ext_hdr + hdr->hdr_len, pktlen);
+		else
+			packet_monitor(tv, NULL, 0, opcode,
 					hdr->ext_hdr + hdr->hdr_len, pktlen);
 
+next:
 		data->offset -= 2 + data_len;
 
 		if (data->offset > 0)
@@ -1485,6 +2050,14 @@ void control_reader(const char *path, bool pager)
 
 	format = btsnoop_get_format(btsnoop_file);
 
+	/* Time range and device terms allow archives to skip blocks */
+	if (prefilter.file_enabled) {
+		if (prefilter.index.num == 1)
+			prefilter.file.index = prefilter.index.val[0];
+
+		btsnoop_set_filter(btsnoop_file, &prefilter.file);
+	}
+
 	switch (format) {
 	case BTSNOOP_FORMAT_HCI:
 	case BTSNOOP_FORMAT_UART:
@@ -1514,6 +2087,9 @@ void control_reader(const char *path, bool pager)
 			if (opcode == 0xffff)
 				continue;
 
+			if (!prefilter_match(index, opcode, buf, pktlen))
+				continue;
+
 			packet_monitor(&tv, NULL, index, opcode, buf, pktlen);
 			ellisys_inject_hci(&tv, index, opcode, buf, pktlen);
 		}
@@ -1564,7 +2140,177 @@ void control_disable_decoding(void)
 	decode_control = false;
 }
 
+void control_analyze(void)
+{
+	analyze_data = true;
+}
+
 void control_filter_index(uint16_t index)
 {
 	filter_index = index;
 }
+
+static bool parse_filter_type(const char *str, struct filter_list *list)
+{
+	static const struct {
+		const char *str;
+		uint16_t opcode[2];
+	} types[] = {
+		{ "cmd", { BTSNOOP_OPCODE_COMMAND_PKT,
+				BTSNOOP_OPCODE_COMMAND_PKT } },
+		{ "evt", { BTSNOOP_OPCODE_EVENT_PKT,
+				BTSNOOP_OPCODE_EVENT_PKT } },
+		{ "acl", { BTSNOOP_OPCODE_ACL_TX_PKT,
+				BTSNOOP_OPCODE_ACL_RX_PKT } },
+		{ "sco", { BTSNOOP_OPCODE_SCO_TX_PKT,
+				BTSNOOP_OPCODE_SCO_RX_PKT } },
+		{ "iso", { BTSNOOP_OPCODE_ISO_TX_PKT,
+				BTSNOOP_OPCODE_ISO_RX_PKT } },
+	};
+	unsigned long val;
+	unsigned int i;
+	char *end;
+
+	for (i = 0; i < NELEM(types); i++) {
+		if (strcasecmp(str, types[i].str))
+			continue;
+
+		return filter_list_add(list, types[i].opcode[0]) &&
+				filter_list_add(list, types[i].opcode[1]);
+	}
+
+	val = strtoul(str, &end, 0);
+	if (end == str || *end != '\0' || val > 0xffff)
+		return false;
+
+	return filter_list_add(list, val);
+}
+
+static bool parse_filter_value(const char *str, struct filter_list *list)
+{
+	unsigned long val;
+	char *end;
+
+	if (!strncasecmp(str, "hci", 3))
+		str += 3;
+
+	val = strtoul(str, &end, 0);
+	if (end == str || *end != '\0' || val > 0xffff)
+		return false;
+
+	return filter_list_add(list, val);
+}
+
+static bool parse_filter_time(const char *str, struct timeval *tv)
+{
+	struct tm tm;
+	const char *end;
+	char *frac;
+
+	memset(&tm, 0, sizeof(tm));
+
+	end = strptime(str, "%Y-%m-%dT%H:%M:%S", &tm);
+	if (!end)
+		end = strptime(str, "%Y-%m-%d %H:%M:%S", &tm);
+
+	if (end && *end == '\0') {
+		tm.tm_isdst = -1;
+		tv->tv_sec = mktime(&tm);
+		tv->tv_usec = 0;
+		return tv->tv_sec > 0;
+	}
+
+	tv->tv_sec = strtoul(str, &frac, 10);
+	tv->tv_usec = 0;
+
+	if (frac == str || tv->tv_sec <= 0)
+		return false;
+
+	if (*frac == '.') {
+		unsigned int i;
+
+		str = frac + 1;
+
+		for (i = 0; i < 6; i++) {
+			tv->tv_usec *= 10;
+			if (*str >= '0' && *str <= '9')
+				tv->tv_usec += *str++ - '0';
+		}
+
+		frac = (char *) str;
+	}
+
+	return *frac == '\0';
+}
+
+static bool parse_filter_file(const char *key, const char *value)
+{
+	struct btsnoop_filter *file = &prefilter.file;
+
+	prefilter.file_enabled = true;
+
+	if (!strcasecmp(key, "since"))
+		return parse_filter_time(value, &file->start);
+
+	if (!strcasecmp(key, "until"))
+		return parse_filter_time(value, &file->end);
+
+	if (bachk(value) < 0)
+		return false;
+
+	str2ba(value, (bdaddr_t *) file->bdaddr);
+	file->match_bdaddr = true;
+
+	return true;
+}
+
+bool control_filter(const char *expr)
+{
+	char *str, *term, *saveptr = NULL;
+	bool result = true;
+
+	str = strdup(expr);
+	if (!str)
+		return false;
+
+	for (term = strtok_r(str, ",", &saveptr); term && result;
+				term = strtok_r(NULL, ",", &saveptr)) {
+		char *value = strchr(term, '=');
+
+		if (!value) {
+			result = false;
+			break;
+		}
+
+		*value++ = '\0';
+
+		if (!strcasecmp(term, "index"))
+			result = parse_filter_value(value, &prefilter.index);
+		else if (!strcasecmp(term, "type"))
+			result = parse_filter_type(value, &prefilter.type);
+		else if (!strcasecmp(term, "opcode"))
+			result = parse_filter_value(value, &prefilter.opcode);
+		else if (!strcasecmp(term, "handle"))
+			result = parse_filter_value(value, &prefilter.handle);
+		else if (!strcasecmp(term, "cid"))
+			result = parse_filter_value(value, &prefilter.cid);
+		else if (!strcasecmp(term, "since") ||
+					!strcasecmp(term, "until") ||
+					!strcasecmp(term, "device"))
+			result = parse_filter_file(term, value);
+		else
+			result = false;
+	}
+
+	free(str);
+
+	if (!result)
+		return false;
+
+	if (!prefilter.acl_chans)
+		prefilter.acl_chans = queue_new();
+
+	prefilter.enabled = true;
+
+	return true;
+}
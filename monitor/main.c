@@ -51,13 +51,20 @@ static void usage(void)
 		"\t-r, --read <file>      Read traces in btsnoop format\n"
 		"\t-w, --write <file>     Save traces in btsnoop format\n"
 		"\t-a, --analyze <file>   Analyze traces in btsnoop format\n"
+		"\t-L, --live-analyze     Analyze live traces\n"
+		"\t-I, --interval <msec>  Analyzer time series interval\n"
+		"\t-X, --export <file>    Export analyzer results (CSV/JSON)\n"
 		"\t-s, --server <socket>  Start monitor server socket\n"
 		"\t-p, --priority <level> Show only priority or lower\n"
 		"\t-i, --index <num>      Show only specified controller\n"
+		"\t-F, --filter <expr>    Filter by index, type, opcode, handle\n"
+		"\t                       or cid (e.g. handle=64,cid=4), and\n"
+		"\t                       since, until or device when reading\n"
 		"\t-d, --tty <tty>        Read data from TTY\n"
 		"\t-B, --tty-speed <rate> Set TTY speed (default 115200)\n"
 		"\t-V, --vendor <compid>  Set default company identifier\n"
 		"\t-M, --mgmt             Open channel for mgmt events\n"
+		"\t-Z, --stats            Show socket read statistics on exit\n"
 		"\t-t, --time             Show time instead of time offset\n"
 		"\t-T, --date             Show time and date information\n"
 		"\t-S, --sco              Dump SCO traffic\n"
@@ -77,13 +84,18 @@ static const struct option main_options[] = {
 	{ "read",      required_argument, NULL, 'r' },
 	{ "write",     required_argument, NULL, 'w' },
 	{ "analyze",   required_argument, NULL, 'a' },
+	{ "live-analyze", no_argument,    NULL, 'L' },
+	{ "interval",  required_argument, NULL, 'I' },
+	{ "export",    required_argument, NULL, 'X' },
 	{ "server",    required_argument, NULL, 's' },
 	{ "priority",  required_argument, NULL, 'p' },
 	{ "index",     required_argument, NULL, 'i' },
+	{ "filter",    required_argument, NULL, 'F' },
 	{ "tty",       required_argument, NULL, 'd' },
 	{ "tty-speed", required_argument, NULL, 'B' },
 	{ "vendor",    required_argument, NULL, 'V' },
 	{ "mgmt",      no_argument,       NULL, 'M' },
+	{ "stats",     no_argument,       NULL, 'Z' },
 	{ "no-time",   no_argument,       NULL, 'N' },
 	{ "time",      no_argument,       NULL, 't' },
 	{ "date",      no_argument,       NULL, 'T' },
@@ -108,6 +120,9 @@ int main(int argc, char *argv[])
 	const char *reader_path = NULL;
 	const char *writer_path = NULL;
 	const char *analyze_path = NULL;
+	const char *export_path = NULL;
+	bool live_analyze = false;
+	bool show_stats = false;
 	const char *ellisys_server = NULL;
 	const char *tty = NULL;
 	unsigned int tty_speed = B115200;
@@ -126,7 +141,7 @@ int main(int argc, char *argv[])
 		struct sockaddr_un addr;
 
 		opt = getopt_long(argc, argv,
-					"r:w:a:s:p:i:d:B:V:MNtTSAE:PJ:R:C:c:vh",
+					"r:w:a:LI:X:s:p:i:F:d:B:V:MZNtTSAE:PJ:R:C:c:vh",
 					main_options, NULL);
 		if (opt < 0)
 			break;
@@ -141,6 +156,15 @@ int main(int argc, char *argv[])
 		case 'a':
 			analyze_path = optarg;
 			break;
+		case 'L':
+			live_analyze = true;
+			break;
+		case 'I':
+			analyze_set_interval(atoi(optarg));
+			break;
+		case 'X':
+			export_path = optarg;
+			break;
 		case 's':
 			if (strlen(optarg) > sizeof(addr.sun_path) - 1) {
 				fprintf(stderr, "Socket name too long\n");
@@ -162,6 +186,15 @@ int main(int argc, char *argv[])
 			}
 			packet_select_index(atoi(str));
 			break;
+		case 'F':
+			if (!control_filter(optarg)) {
+				fprintf(stderr, "Invalid filter: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'Z':
+			show_stats = true;
+			break;
 		case 'd':
 			tty = optarg;
 			break;
@@ -246,11 +279,24 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	if (reader_path && analyze_path) {
+	if (reader_path && (analyze_path || live_analyze)) {
 		fprintf(stderr, "Display and analyze can't be combined\n");
 		return EXIT_FAILURE;
 	}
 
+	if (analyze_path && live_analyze) {
+		fprintf(stderr, "Trace and live analyze can't be combined\n");
+		return EXIT_FAILURE;
+	}
+
+	if (export_path && !analyze_path && !live_analyze) {
+		fprintf(stderr, "Export requires analyze mode\n");
+		return EXIT_FAILURE;
+	}
+
+	if (export_path && !analyze_set_export(export_path))
+		return EXIT_FAILURE;
+
 	printf("Bluetooth monitor ver %s\n", VERSION);
 
 	keys_setup();
@@ -278,6 +324,15 @@ int main(int argc, char *argv[])
 	if (ellisys_server)
 		ellisys_enable(ellisys_server, ellisys_port);
 
+	if (live_analyze) {
+		if (analyze_live_start() < 0) {
+			fprintf(stderr, "Failed to start live analyze\n");
+			return EXIT_FAILURE;
+		}
+
+		control_analyze();
+	}
+
 	if (!tty && !jlink && control_tracing() < 0)
 		return EXIT_FAILURE;
 
@@ -289,6 +344,12 @@ int main(int argc, char *argv[])
 
 	exit_status = mainloop_run_with_signal(signal_callback, NULL);
 
+	if (live_analyze)
+		analyze_live_stop();
+
+	if (show_stats)
+		control_print_stats();
+
 	keys_cleanup();
 
 	return exit_status;
@@ -9332,6 +9332,21 @@ static const char *get_supported_command(int bit)
 	return NULL;
 }
 
+const char *packet_opcode_str(uint16_t opcode)
+{
+	int i;
+
+	for (i = 0; opcode_table[i].str; i++) {
+		if (opcode_table[i].opcode == opcode)
+			return opcode_table[i].str;
+	}
+
+	if (cmd_opcode_ogf(opcode) == 0x3f)
+		return "Vendor";
+
+	return "Unknown";
+}
+
 static const char *current_vendor_str(void)
 {
 	uint16_t manufacturer, msft_opcode;
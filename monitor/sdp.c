@@ -533,6 +533,8 @@ static const char *error_str(uint16_t code)
 		return "Invalid PDU Size";
 	case 0x0005:
 		return "Invalid Continuation State";
+	case 0x0006:
+		return "Insufficient Resources";
 	default:
 		return "Unknown";
 	}
@@ -40,6 +40,7 @@
 #include "src/service.h"
 #include "src/log.h"
 #include "src/sdpd.h"
+#include "src/storage.h"
 #include "src/shared/queue.h"
 #include "src/shared/timeout.h"
 #include "src/shared/util.h"
@@ -817,7 +818,6 @@ static void store_remote_seps(struct a2dp_channel *chan)
 	char dst_addr[18];
 	GKeyFile *key_file;
 	char *data;
-	gsize length = 0;
 
 	if (queue_isempty(chan->seps))
 		return;
@@ -828,7 +828,7 @@ static void store_remote_seps(struct a2dp_channel *chan)
 			btd_adapter_get_storage_dir(device_get_adapter(device)),
 			dst_addr);
 	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	btd_storage_load(key_file, filename);
 
 	data = g_key_file_get_string(key_file, "Endpoints", "LastUsed",
 								NULL);
@@ -844,10 +844,7 @@ static void store_remote_seps(struct a2dp_channel *chan)
 		g_free(data);
 	}
 
-	data = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, data, length, NULL);
-
-	g_free(data);
+	btd_storage_store(key_file, filename);
 	g_key_file_free(key_file);
 }
 
@@ -984,8 +981,6 @@ static void store_last_used(struct a2dp_channel *chan, uint8_t lseid,
 	char filename[PATH_MAX];
 	char dst_addr[18];
 	char value[6];
-	char *data;
-	size_t len = 0;
 
 	ba2str(device_get_address(chan->device), dst_addr);
 
@@ -993,16 +988,13 @@ static void store_last_used(struct a2dp_channel *chan, uint8_t lseid,
 		btd_adapter_get_storage_dir(device_get_adapter(chan->device)),
 		dst_addr);
 	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	btd_storage_load(key_file, filename);
 
 	sprintf(value, "%02hhx:%02hhx", lseid, rseid);
 
 	g_key_file_set_string(key_file, "Endpoints", "LastUsed", value);
 
-	data = g_key_file_to_data(key_file, &len, NULL);
-	g_file_set_contents(filename, data, len, NULL);
-
-	g_free(data);
+	btd_storage_store(key_file, filename);
 	g_key_file_free(key_file);
 }
 
@@ -2225,7 +2217,7 @@ static void load_remote_seps(struct a2dp_channel *chan)
 			btd_adapter_get_storage_dir(device_get_adapter(device)),
 			dst_addr);
 	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	btd_storage_load(key_file, filename);
 	keys = g_key_file_get_keys(key_file, "Endpoints", NULL, NULL);
 
 	load_remote_sep(chan, key_file, keys);
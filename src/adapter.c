@@ -78,6 +78,7 @@
 #define IDLE_DISCOV_TIMEOUT (5)
 #define TEMP_DEV_TIMEOUT (3 * 60)
 #define BONDING_TIMEOUT (2 * 60)
+#define STORED_DEVICES_BATCH (32)
 
 #define SCAN_TYPE_BREDR (1 << BDADDR_BREDR)
 #define SCAN_TYPE_LE ((1 << BDADDR_LE_PUBLIC) | (1 << BDADDR_LE_RANDOM))
@@ -208,6 +209,24 @@ struct discovery_filter {
 	bool discoverable;
 };
 
+/* Merged RSSI and pathloss thresholds of the filters sharing a UUID */
+struct discovery_proximity {
+	bool any;
+	int16_t rssi;
+	uint16_t pathloss;
+};
+
+struct discovery_uuid {
+	uint128_t uuid;
+	struct discovery_proximity proximity;
+};
+
+struct discovery_match {
+	struct discovery_proximity proximity;	/* filters without UUIDs */
+	struct discovery_uuid *uuids;		/* sorted by UUID */
+	unsigned int uuid_count;
+};
+
 struct discovery_client {
 	struct btd_adapter *adapter;
 	DBusMessage *msg;
@@ -275,6 +294,7 @@ struct btd_adapter {
 					 */
 	/* current discovery filter, if any */
 	struct mgmt_cp_start_service_discovery *current_discovery_filter;
+	struct discovery_match *discovery_match; /* compiled client filters */
 	struct discovery_client *client;	/* active discovery client */
 
 	GSList *discovery_found;	/* list of found devices */
@@ -289,6 +309,10 @@ struct btd_adapter {
 	bool pincode_requested;		/* PIN requested during last bonding */
 	GSList *connections;		/* Connected devices */
 	GSList *devices;		/* Devices structure pointers */
+	struct queue *stored_devices;	/* Stored devices not yet created */
+	GHashTable *stored_index;	/* Stored devices by address */
+	guint stored_devices_id;	/* Deferred stored device creation */
+	int64_t load_start;		/* Start of stored device loading */
 	GSList *connect_list;		/* Devices to connect when found */
 	struct btd_device *connect_le;	/* LE device waiting to be connected */
 	sdp_list_t *services;		/* Services associated to adapter */
@@ -903,6 +927,12 @@ int adapter_set_name(struct btd_adapter *adapter, const char *name)
 	return set_name(adapter, name);
 }
 
+static struct btd_device *load_stored_device(struct btd_adapter *adapter,
+							const bdaddr_t *bdaddr);
+static struct btd_device *load_stored_device_by_path(
+						struct btd_adapter *adapter,
+						const char *path);
+
 struct btd_device *btd_adapter_find_device(struct btd_adapter *adapter,
 							const bdaddr_t *dst,
 							uint8_t bdaddr_type)
@@ -919,6 +949,9 @@ struct btd_device *btd_adapter_find_device(struct btd_adapter *adapter,
 
 	list = g_slist_find_custom(adapter->devices, &addr,
 							device_addr_type_cmp);
+	if (!list && load_stored_device(adapter, dst))
+		list = g_slist_find_custom(adapter->devices, &addr,
+							device_addr_type_cmp);
 	if (!list)
 		return NULL;
 
@@ -955,6 +988,9 @@ struct btd_device *btd_adapter_find_device_by_path(struct btd_adapter *adapter,
 		return NULL;
 
 	list = g_slist_find_custom(adapter->devices, path, device_path_cmp);
+	if (!list && load_stored_device_by_path(adapter, path))
+		list = g_slist_find_custom(adapter->devices, path,
+							device_path_cmp);
 	if (!list)
 		return NULL;
 
@@ -1553,6 +1589,16 @@ static void free_discovery_filter(struct discovery_filter *discovery_filter)
 	g_free(discovery_filter);
 }
 
+static void discovery_match_free(struct btd_adapter *adapter)
+{
+	if (!adapter->discovery_match)
+		return;
+
+	free(adapter->discovery_match->uuids);
+	free(adapter->discovery_match);
+	adapter->discovery_match = NULL;
+}
+
 static void invalidate_rssi_and_tx_power(gpointer a)
 {
 	struct btd_device *dev = a;
@@ -1628,6 +1674,7 @@ static void discovery_remove(struct discovery_client *client)
 
 	adapter->discovery_list = g_slist_remove(adapter->discovery_list,
 								client);
+	discovery_match_free(adapter);
 
 	if (adapter->client == client)
 		adapter->client = NULL;
@@ -2215,6 +2262,9 @@ static int update_discovery_filter(struct btd_adapter *adapter)
 
 	DBG("");
 
+	/* Client filters have changed, recompile them on next use */
+	discovery_match_free(adapter);
+
 	if (discovery_filter_to_mgmt_cp(adapter, &sd_cp)) {
 		btd_error(adapter->dev_id,
 				"discovery_filter_to_mgmt_cp returned error");
@@ -4045,6 +4095,27 @@ static int set_privacy(struct btd_adapter *adapter, uint8_t privacy)
 	return -1;
 }
 
+static size_t get_load_count(struct btd_adapter *adapter, const char *name,
+					size_t count, size_t hdr_size,
+					size_t size)
+{
+	size_t max_count;
+
+	/*
+	 * The kernel replaces its whole list with every load command,
+	 * so splitting the entries over multiple commands is not an
+	 * option. Load as many as fit instead of failing altogether.
+	 */
+	max_count = (mgmt_get_mtu(adapter->mgmt) - hdr_size) / size;
+	if (count <= max_count)
+		return count;
+
+	btd_warn(adapter->dev_id, "Too many %s for hci%u, loading %zu of %zu",
+				name, adapter->dev_id, max_count, count);
+
+	return max_count;
+}
+
 static void load_link_keys_complete(uint8_t status, uint16_t length,
 					const void *param, void *user_data)
 {
@@ -4060,14 +4131,14 @@ static void load_link_keys_complete(uint8_t status, uint16_t length,
 	DBG("link keys loaded for hci%u", adapter->dev_id);
 }
 
-static void load_link_keys(struct btd_adapter *adapter, GSList *keys,
+static void load_link_keys(struct btd_adapter *adapter, struct queue *keys,
 							bool debug_keys)
 {
 	struct mgmt_cp_load_link_keys *cp;
 	struct mgmt_link_key_info *key;
+	const struct queue_entry *entry;
 	size_t key_count, cp_size;
 	unsigned int id;
-	GSList *l;
 
 	/*
 	 * If the controller does not support BR/EDR operation,
@@ -4079,7 +4150,8 @@ static void load_link_keys(struct btd_adapter *adapter, GSList *keys,
 	if (!(adapter->supported_settings & MGMT_SETTING_BREDR))
 		return;
 
-	key_count = g_slist_length(keys);
+	key_count = get_load_count(adapter, "link keys", queue_length(keys),
+						sizeof(*cp), sizeof(*key));
 
 	DBG("hci%u keys %zu debug_keys %d", adapter->dev_id, key_count,
 								debug_keys);
@@ -4104,8 +4176,10 @@ static void load_link_keys(struct btd_adapter *adapter, GSList *keys,
 	cp->debug_keys = debug_keys;
 	cp->key_count = htobs(key_count);
 
-	for (l = keys, key = cp->keys; l != NULL; l = g_slist_next(l), key++) {
-		struct link_key_info *info = l->data;
+	for (entry = queue_get_entries(keys), key = cp->keys;
+				entry && key_count;
+				entry = entry->next, key++, key_count--) {
+		struct link_key_info *info = entry->data;
 
 		bacpy(&key->addr.bdaddr, &info->bdaddr);
 		key->addr.type = BDADDR_BREDR;
@@ -4140,6 +4214,49 @@ static bool load_ltks_timeout(gpointer user_data)
 	return FALSE;
 }
 
+struct stored_device {
+	char addr[18];
+	bdaddr_t bdaddr;
+	GKeyFile *key_file;
+	bool paired;
+	bool le_paired;		/* LTKs loaded for le_type */
+	uint8_t le_type;
+	uint8_t ltk_enc_size;
+};
+
+static void stored_device_free(void *data)
+{
+	struct stored_device *stored = data;
+
+	g_key_file_free(stored->key_file);
+	free(stored);
+}
+
+static guint stored_device_hash(gconstpointer key)
+{
+	const bdaddr_t *bdaddr = key;
+	uint32_t val;
+
+	/* The lower part of the address is the device specific one */
+	memcpy(&val, bdaddr->b, sizeof(val));
+
+	return val;
+}
+
+static gboolean stored_device_equal(gconstpointer v1, gconstpointer v2)
+{
+	return !bacmp(v1, v2);
+}
+
+static struct stored_device *stored_device_find(struct btd_adapter *adapter,
+							const bdaddr_t *bdaddr)
+{
+	if (!adapter->stored_index)
+		return NULL;
+
+	return g_hash_table_lookup(adapter->stored_index, bdaddr);
+}
+
 static void load_ltks_complete(uint8_t status, uint16_t length,
 					const void *param, void *user_data)
 {
@@ -4159,13 +4276,12 @@ static void load_ltks_complete(uint8_t status, uint16_t length,
 	DBG("LTKs loaded for hci%u", adapter->dev_id);
 }
 
-static void load_ltks(struct btd_adapter *adapter, GSList *keys)
+static void load_ltks(struct btd_adapter *adapter, struct queue *keys)
 {
 	struct mgmt_cp_load_long_term_keys *cp;
 	struct mgmt_ltk_info *key;
-	size_t key_count, max_key_count, cp_size;
-	GSList *l;
-	uint16_t mtu;
+	const struct queue_entry *entry;
+	size_t key_count, cp_size;
 
 	/*
 	 * If the controller does not support Low Energy operation,
@@ -4180,10 +4296,8 @@ static void load_ltks(struct btd_adapter *adapter, GSList *keys)
 	if (!(adapter->supported_settings & MGMT_SETTING_LE))
 		return;
 
-	key_count = g_slist_length(keys);
-	mtu = mgmt_get_mtu(adapter->mgmt);
-	max_key_count = (mtu - sizeof(*cp)) / sizeof(*key);
-	key_count = MIN(max_key_count, key_count);
+	key_count = get_load_count(adapter, "LTKs", queue_length(keys),
+						sizeof(*cp), sizeof(*key));
 
 	DBG("hci%u keys %zu", adapter->dev_id, key_count);
 
@@ -4203,9 +4317,11 @@ static void load_ltks(struct btd_adapter *adapter, GSList *keys)
 	 */
 	cp->key_count = htobs(key_count);
 
-	for (l = keys, key = cp->keys; l && key_count;
-			l = g_slist_next(l), key++, key_count--) {
-		struct smp_ltk_info *info = l->data;
+	for (entry = queue_get_entries(keys), key = cp->keys;
+				entry && key_count;
+				entry = entry->next, key++, key_count--) {
+		struct smp_ltk_info *info = entry->data;
+		struct stored_device *stored;
 		struct btd_device *dev;
 
 		bacpy(&key->addr.bdaddr, &info->bdaddr);
@@ -4217,7 +4333,19 @@ static void load_ltks(struct btd_adapter *adapter, GSList *keys)
 		key->central = info->central;
 		key->enc_size = info->enc_size;
 
-		/* Mark device as paired as their LTKs can be loaded. */
+		/*
+		 * Mark device as paired as their LTKs can be loaded. Devices
+		 * that are still queued for creation get it applied once they
+		 * are created, so only look up objects that already exist.
+		 */
+		stored = stored_device_find(adapter, &info->bdaddr);
+		if (stored) {
+			stored->le_paired = true;
+			stored->le_type = info->bdaddr_type;
+			stored->ltk_enc_size = info->enc_size;
+			continue;
+		}
+
 		dev = btd_adapter_find_device(adapter, &info->bdaddr,
 							info->bdaddr_type);
 		if (dev) {
@@ -4272,13 +4400,13 @@ static void load_irks_complete(uint8_t status, uint16_t length,
 	DBG("IRKs loaded for hci%u", adapter->dev_id);
 }
 
-static void load_irks(struct btd_adapter *adapter, GSList *irks)
+static void load_irks(struct btd_adapter *adapter, struct queue *irks)
 {
 	struct mgmt_cp_load_irks *cp;
 	struct mgmt_irk_info *irk;
+	const struct queue_entry *entry;
 	size_t irk_count, cp_size;
 	unsigned int id;
-	GSList *l;
 
 	/*
 	 * If the controller does not support LE Privacy operation,
@@ -4288,7 +4416,8 @@ static void load_irks(struct btd_adapter *adapter, GSList *irks)
 	if (!(adapter->supported_settings & MGMT_SETTING_PRIVACY))
 		return;
 
-	irk_count = g_slist_length(irks);
+	irk_count = get_load_count(adapter, "IRKs", queue_length(irks),
+						sizeof(*cp), sizeof(*irk));
 
 	DBG("hci%u irks %zu", adapter->dev_id, irk_count);
 
@@ -4308,8 +4437,10 @@ static void load_irks(struct btd_adapter *adapter, GSList *irks)
 	 */
 	cp->irk_count = htobs(irk_count);
 
-	for (l = irks, irk = cp->irks; l != NULL; l = g_slist_next(l), irk++) {
-		struct irk_info *info = l->data;
+	for (entry = queue_get_entries(irks), irk = cp->irks;
+				entry && irk_count;
+				entry = entry->next, irk++, irk_count--) {
+		struct irk_info *info = entry->data;
 
 		bacpy(&irk->addr.bdaddr, &info->bdaddr);
 		irk->addr.type = info->bdaddr_type;
@@ -4341,13 +4472,14 @@ static void load_conn_params_complete(uint8_t status, uint16_t length,
 	DBG("Connection Parameters loaded for hci%u", adapter->dev_id);
 }
 
-static void load_conn_params(struct btd_adapter *adapter, GSList *params)
+static void load_conn_params(struct btd_adapter *adapter,
+							struct queue *params)
 {
 	struct mgmt_cp_load_conn_param *cp;
 	struct mgmt_conn_param *param;
+	const struct queue_entry *entry;
 	size_t param_count, cp_size;
 	unsigned int id;
-	GSList *l;
 
 	/*
 	 * If the controller does not support Low Energy operation,
@@ -4357,7 +4489,9 @@ static void load_conn_params(struct btd_adapter *adapter, GSList *params)
 	if (!(adapter->supported_settings & MGMT_SETTING_LE))
 		return;
 
-	param_count = g_slist_length(params);
+	param_count = get_load_count(adapter, "connection parameters",
+					queue_length(params), sizeof(*cp),
+					sizeof(*param));
 
 	DBG("hci%u conn params %zu", adapter->dev_id, param_count);
 
@@ -4372,8 +4506,10 @@ static void load_conn_params(struct btd_adapter *adapter, GSList *params)
 
 	cp->param_count = htobs(param_count);
 
-	for (l = params, param = cp->params; l; l = g_slist_next(l), param++) {
-		struct conn_param *info = l->data;
+	for (entry = queue_get_entries(params), param = cp->params;
+				entry && param_count;
+				entry = entry->next, param++, param_count--) {
+		struct conn_param *info = entry->data;
 
 		bacpy(&param->addr.bdaddr, &info->bdaddr);
 		param->addr.type = info->bdaddr_type;
@@ -4656,63 +4792,213 @@ done:
 	mgmt_tlv_list_free(list);
 }
 
+static struct btd_device *create_stored_device(struct btd_adapter *adapter,
+						struct stored_device *stored)
+{
+	struct btd_device *device;
+	GSList *list;
+
+	list = g_slist_find_custom(adapter->devices, stored->addr,
+							device_address_cmp);
+	if (list) {
+		device = list->data;
+		goto done;
+	}
+
+	device = device_create_from_storage(adapter, stored->addr,
+							stored->key_file);
+	if (!device)
+		return NULL;
+
+	btd_device_set_temporary(device, false);
+	adapter_add_device(adapter, device);
+
+	/* TODO: register services from pre-loaded list of primaries */
+
+done:
+	if (stored->paired) {
+		device_set_paired(device, BDADDR_BREDR);
+		device_set_bonded(device, BDADDR_BREDR);
+	}
+
+	if (stored->le_paired) {
+		device_set_le_support(device, stored->le_type);
+		device_set_paired(device, stored->le_type);
+		device_set_bonded(device, stored->le_type);
+		device_set_ltk_enc_size(device, stored->ltk_enc_size);
+	}
+
+	if (!list)
+		probe_devices(device);
+
+	return device;
+}
+
+/*
+ * Create the object of a stored device that has not been created yet so that
+ * lookups, e.g. due to an incoming connection, don't have to wait for the
+ * deferred loading to reach it.
+ */
+static struct btd_device *load_stored_device(struct btd_adapter *adapter,
+							const bdaddr_t *bdaddr)
+{
+	struct stored_device *stored;
+
+	stored = stored_device_find(adapter, bdaddr);
+	if (!stored)
+		return NULL;
+
+	DBG("%s", stored->addr);
+
+	/* The entry stays queued and is skipped once the deferred loading
+	 * reaches it, removing it from the queue here would be a linear scan.
+	 */
+	g_hash_table_remove(adapter->stored_index, &stored->bdaddr);
+
+	return create_stored_device(adapter, stored);
+}
+
+static struct btd_device *load_stored_device_by_path(
+						struct btd_adapter *adapter,
+						const char *path)
+{
+	size_t len = strlen(adapter->path);
+	char addr[18];
+	bdaddr_t bdaddr;
+	int i;
+
+	if (!adapter->stored_index ||
+			!g_hash_table_size(adapter->stored_index))
+		return NULL;
+
+	if (strncmp(path, adapter->path, len) ||
+				strncmp(path + len, "/dev_", 5) ||
+				strlen(path + len + 5) != sizeof(addr) - 1)
+		return NULL;
+
+	for (i = 0; i < (int) sizeof(addr) - 1; i++) {
+		char c = path[len + 5 + i];
+
+		addr[i] = c == '_' ? ':' : c;
+	}
+
+	addr[i] = '\0';
+
+	if (bachk(addr) < 0)
+		return NULL;
+
+	str2ba(addr, &bdaddr);
+
+	return load_stored_device(adapter, &bdaddr);
+}
+
+static void stored_devices_complete(struct btd_adapter *adapter)
+{
+	queue_destroy(adapter->stored_devices, NULL);
+	adapter->stored_devices = NULL;
+	g_hash_table_destroy(adapter->stored_index);
+	adapter->stored_index = NULL;
+
+	/* restore Service Changed CCC value for bonded devices */
+	btd_gatt_database_restore_svc_chng_ccc(adapter->database);
+
+	btd_info(adapter->dev_id, "Loaded %u devices in %" PRId64 " ms",
+				g_slist_length(adapter->devices),
+				(g_get_monotonic_time() - adapter->load_start) /
+				1000);
+}
+
+static bool create_stored_devices(struct btd_adapter *adapter)
+{
+	unsigned int i;
+
+	for (i = 0; i < STORED_DEVICES_BATCH; i++) {
+		struct stored_device *stored;
+
+		stored = queue_pop_head(adapter->stored_devices);
+		if (!stored) {
+			stored_devices_complete(adapter);
+			return false;
+		}
+
+		/* Devices created by load_stored_device() are not indexed */
+		if (g_hash_table_remove(adapter->stored_index, &stored->bdaddr))
+			create_stored_device(adapter, stored);
+
+		stored_device_free(stored);
+	}
+
+	return true;
+}
+
+static gboolean create_stored_devices_idle(gpointer user_data)
+{
+	struct btd_adapter *adapter = user_data;
+
+	if (create_stored_devices(adapter))
+		return TRUE;
+
+	adapter->stored_devices_id = 0;
+
+	return FALSE;
+}
+
 static void load_devices(struct btd_adapter *adapter)
 {
 	char dirname[PATH_MAX];
-	GSList *keys = NULL;
-	GSList *ltks = NULL;
-	GSList *irks = NULL;
-	GSList *params = NULL;
-	GSList *added_devices = NULL;
-	DIR *dir;
-	struct dirent *entry;
+	struct queue *keys, *ltks, *irks, *params;
+	char **devices, **addr;
+
+	adapter->load_start = g_get_monotonic_time();
 
 	snprintf(dirname, PATH_MAX, STORAGEDIR "/%s",
 					btd_adapter_get_storage_dir(adapter));
 
-	dir = opendir(dirname);
-	if (!dir) {
+	devices = btd_storage_get_devices(dirname);
+	if (!devices) {
 		btd_error(adapter->dev_id,
 				"Unable to open adapter storage directory: %s",
 								dirname);
 		return;
 	}
 
-	while ((entry = readdir(dir)) != NULL) {
-		struct btd_device *device;
+	adapter->stored_devices = queue_new();
+	adapter->stored_index = g_hash_table_new(stored_device_hash,
+							stored_device_equal);
+
+	keys = queue_new();
+	ltks = queue_new();
+	irks = queue_new();
+	params = queue_new();
+
+	for (addr = devices; *addr; addr++) {
+		struct stored_device *stored;
 		char filename[PATH_MAX];
 		GKeyFile *key_file;
 		struct link_key_info *key_info;
 		struct smp_ltk_info *ltk_info;
 		struct smp_ltk_info *peripheral_ltk_info;
-		GSList *list;
 		struct irk_info *irk_info;
 		struct conn_param *param;
 		uint8_t bdaddr_type;
 
-		if (entry->d_type == DT_UNKNOWN)
-			entry->d_type = util_get_dt(dirname, entry->d_name);
-
-		if (entry->d_type != DT_DIR || bachk(entry->d_name) < 0)
-			continue;
-
 		snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/info",
 					btd_adapter_get_storage_dir(adapter),
-					entry->d_name);
+					*addr);
 
 		key_file = g_key_file_new();
-		g_key_file_load_from_file(key_file, filename, 0, NULL);
+		btd_storage_load(key_file, filename);
 
-		key_info = get_key_info(key_file, entry->d_name);
+		key_info = get_key_info(key_file, *addr);
 
 		bdaddr_type = get_le_addr_type(key_file);
 
-		ltk_info = get_ltk_info(key_file, entry->d_name, bdaddr_type);
+		ltk_info = get_ltk_info(key_file, *addr, bdaddr_type);
 
 		peripheral_ltk_info = get_peripheral_ltk_info(key_file,
-						entry->d_name, bdaddr_type);
+						*addr, bdaddr_type);
 
-		irk_info = get_irk_info(key_file, entry->d_name, bdaddr_type);
+		irk_info = get_irk_info(key_file, *addr, bdaddr_type);
 
 		// If any key for the device is blocked, we discard all.
 		if ((key_info && key_info->is_blocked) ||
@@ -4741,67 +5027,70 @@ static void load_devices(struct btd_adapter *adapter)
 				irk_info = NULL;
 			}
 
-			goto free;
+			g_key_file_free(key_file);
+			continue;
 		}
 
 		if (key_info)
-			keys = g_slist_append(keys, key_info);
+			queue_push_tail(keys, key_info);
 
 		if (ltk_info)
-			ltks = g_slist_append(ltks, ltk_info);
+			queue_push_tail(ltks, ltk_info);
 
 		if (peripheral_ltk_info)
-			ltks = g_slist_append(ltks, peripheral_ltk_info);
+			queue_push_tail(ltks, peripheral_ltk_info);
 
 		if (irk_info)
-			irks = g_slist_append(irks, irk_info);
+			queue_push_tail(irks, irk_info);
 
-		param = get_conn_param(key_file, entry->d_name, bdaddr_type);
+		param = get_conn_param(key_file, *addr, bdaddr_type);
 		if (param)
-			params = g_slist_append(params, param);
-
-		list = g_slist_find_custom(adapter->devices, entry->d_name,
-							device_address_cmp);
-		if (list) {
-			device = list->data;
-			goto device_exist;
-		}
-
-		device = device_create_from_storage(adapter, entry->d_name,
-							key_file);
-		if (!device)
-			goto free;
+			queue_push_tail(params, param);
 
-		btd_device_set_temporary(device, false);
-		adapter_add_device(adapter, device);
-
-		/* TODO: register services from pre-loaded list of primaries */
-
-		added_devices = g_slist_append(added_devices, device);
-
-device_exist:
-		if (key_info) {
-			device_set_paired(device, BDADDR_BREDR);
-			device_set_bonded(device, BDADDR_BREDR);
-		}
+		/* The device object is created later on, keep the parsed
+		 * file around so it doesn't have to be loaded again.
+		 */
+		stored = new0(struct stored_device, 1);
+		strncpy(stored->addr, *addr, sizeof(stored->addr) - 1);
+		str2ba(stored->addr, &stored->bdaddr);
+		stored->key_file = key_file;
+		stored->paired = key_info != NULL;
 
-free:
-		g_key_file_free(key_file);
+		queue_push_tail(adapter->stored_devices, stored);
+		g_hash_table_insert(adapter->stored_index, &stored->bdaddr,
+								stored);
 	}
 
-	closedir(dir);
+	g_strfreev(devices);
 
+	/* Hand the key material over to the kernel before creating any
+	 * device object so that it is able to handle encryption as soon as
+	 * possible.
+	 */
 	load_link_keys(adapter, keys, btd_opts.debug_keys);
-	g_slist_free_full(keys, g_free);
+	queue_destroy(keys, g_free);
 
 	load_ltks(adapter, ltks);
-	g_slist_free_full(ltks, g_free);
+	queue_destroy(ltks, g_free);
 	load_irks(adapter, irks);
-	g_slist_free_full(irks, g_free);
+	queue_destroy(irks, g_free);
 	load_conn_params(adapter, params);
-	g_slist_free_full(params, g_free);
+	queue_destroy(params, g_free);
 
-	g_slist_free_full(added_devices, probe_devices);
+	DBG("Loaded keys of %u devices in %" PRId64 " ms",
+				queue_length(adapter->stored_devices),
+				(g_get_monotonic_time() - adapter->load_start) /
+				1000);
+
+	/* Creating device objects and probing their profiles is what makes
+	 * startup slow with many stored devices, so only a first batch is
+	 * created right away and the rest from idle callbacks. Devices that
+	 * are looked up in the meantime are created on demand.
+	 */
+	if (create_stored_devices(adapter))
+		adapter->stored_devices_id = g_idle_add(
+						create_stored_devices_idle,
+						adapter);
 }
 
 int btd_adapter_block_address(struct btd_adapter *adapter,
@@ -5581,6 +5870,8 @@ static void remove_discovery_list(struct btd_adapter *adapter)
 
 	g_slist_free_full(adapter->discovery_list, discovery_free);
 	adapter->discovery_list = NULL;
+
+	discovery_match_free(adapter);
 }
 
 static void adapter_free(gpointer user_data)
@@ -5616,10 +5907,18 @@ static void adapter_free(gpointer user_data)
 	if (adapter->auth_idle_id)
 		g_source_remove(adapter->auth_idle_id);
 
+	if (adapter->stored_devices_id)
+		g_source_remove(adapter->stored_devices_id);
+
 	g_queue_foreach(adapter->auths, free_service_auth, NULL);
 	g_queue_free(adapter->auths);
 	queue_destroy(adapter->exps, NULL);
 
+	if (adapter->stored_index)
+		g_hash_table_destroy(adapter->stored_index);
+
+	queue_destroy(adapter->stored_devices, stored_device_free);
+
 	/*
 	 * Unregister all handlers for this specific index since
 	 * the adapter bound to them is no longer valid.
@@ -6604,6 +6903,19 @@ static void adapter_remove(struct btd_adapter *adapter)
 	g_slist_free(adapter->connect_list);
 	adapter->connect_list = NULL;
 
+	if (adapter->stored_devices_id > 0) {
+		g_source_remove(adapter->stored_devices_id);
+		adapter->stored_devices_id = 0;
+	}
+
+	if (adapter->stored_index) {
+		g_hash_table_destroy(adapter->stored_index);
+		adapter->stored_index = NULL;
+	}
+
+	queue_destroy(adapter->stored_devices, stored_device_free);
+	adapter->stored_devices = NULL;
+
 	for (l = adapter->devices; l; l = l->next) {
 		device_removed_drivers(adapter, l->data);
 		device_remove(l->data, FALSE);
@@ -6764,58 +7076,181 @@ static void adapter_msd_notify(struct btd_adapter *adapter,
 	}
 }
 
-static bool is_filter_match(GSList *discovery_filter, struct eir_data *eir_data,
-								int8_t rssi)
+/*
+ * A filter only rejects devices by proximity when both thresholds are set,
+ * which SetDiscoveryFilter doesn't allow, so the kernel side RSSI filtering
+ * is the only one applied in practice.
+ */
+static void filter_proximity(const struct discovery_filter *filter,
+					struct discovery_proximity *proximity)
+{
+	proximity->any = !filter || filter->rssi == DISTANCE_VAL_INVALID ||
+				filter->pathloss == DISTANCE_VAL_INVALID;
+	proximity->rssi = filter ? filter->rssi : DISTANCE_VAL_INVALID;
+	proximity->pathloss = filter ? filter->pathloss : DISTANCE_VAL_INVALID;
+}
+
+/* Devices matching either proximity match the merged one */
+static void merge_proximity(struct discovery_proximity *dst,
+				const struct discovery_proximity *src)
+{
+	dst->any |= src->any;
+
+	if (src->rssi != DISTANCE_VAL_INVALID &&
+			(dst->rssi == DISTANCE_VAL_INVALID ||
+			src->rssi < dst->rssi))
+		dst->rssi = src->rssi;
+
+	if (src->pathloss != DISTANCE_VAL_INVALID &&
+			(dst->pathloss == DISTANCE_VAL_INVALID ||
+			src->pathloss > dst->pathloss))
+		dst->pathloss = src->pathloss;
+}
+
+static bool is_proximity_match(const struct discovery_proximity *proximity,
+					int8_t rssi, int8_t tx_power)
+{
+	if (proximity->any)
+		return true;
+
+	if (proximity->rssi != DISTANCE_VAL_INVALID && rssi >= proximity->rssi)
+		return true;
+
+	return proximity->pathloss != DISTANCE_VAL_INVALID &&
+				tx_power != 127 &&
+				tx_power - rssi <= proximity->pathloss;
+}
+
+static int discovery_uuid_cmp(const void *a, const void *b)
+{
+	/* The key is either a struct discovery_uuid or just its UUID */
+	return memcmp(a, b, sizeof(uint128_t));
+}
+
+/*
+ * Compile the filters of all discovery clients into a sorted table of
+ * binary UUIDs, each with the merged proximity of the clients looking
+ * for it, so matching an advertisement needs no allocation or string
+ * handling.
+ */
+static struct discovery_match *discovery_match_new(struct btd_adapter *adapter)
 {
+	struct discovery_match *match;
+	struct discovery_proximity none = { .any = false,
+					.rssi = DISTANCE_VAL_INVALID,
+					.pathloss = DISTANCE_VAL_INVALID };
+	unsigned int i, count = 0;
 	GSList *l, *m;
-	bool got_match = false;
 
-	for (l = discovery_filter; l != NULL && got_match != true;
-							l = g_slist_next(l)) {
+	match = new0(struct discovery_match, 1);
+	match->proximity = none;
+
+	for (l = adapter->discovery_list; l; l = g_slist_next(l)) {
 		struct discovery_client *client = l->data;
-		struct discovery_filter *item = client->discovery_filter;
 
-		/*
-		 * If one of currently running scans is regular scan, then
-		 * return all devices as matches
-		 */
-		if (!item) {
-			got_match = true;
+		if (client->discovery_filter)
+			count += g_slist_length(client->discovery_filter->uuids);
+	}
+
+	if (count)
+		match->uuids = new0(struct discovery_uuid, count);
+
+	for (l = adapter->discovery_list; l; l = g_slist_next(l)) {
+		struct discovery_client *client = l->data;
+		struct discovery_filter *filter = client->discovery_filter;
+		struct discovery_proximity proximity;
+
+		filter_proximity(filter, &proximity);
+
+		/* Regular discovery or filter for all devices in range */
+		if (!filter || !filter->uuids) {
+			merge_proximity(&match->proximity, &proximity);
 			continue;
 		}
 
-		/* if someone started discovery with empty uuids, he wants all
-		 * devices in given proximity.
-		 */
-		if (!item->uuids)
-			got_match = true;
-		else {
-			for (m = item->uuids; m != NULL && got_match != true;
-							m = g_slist_next(m)) {
-				/* m->data contains string representation of
-				 * uuid.
-				 */
-				if (g_slist_find_custom(eir_data->services,
-							m->data,
-							g_strcmp) != NULL)
-					got_match = true;
-			}
+		for (m = filter->uuids; m; m = g_slist_next(m)) {
+			struct discovery_uuid *entry;
+			bt_uuid_t uuid, u128;
+
+			if (bt_string_to_uuid(&uuid, m->data) < 0)
+				continue;
+
+			bt_uuid_to_uuid128(&uuid, &u128);
+
+			entry = &match->uuids[match->uuid_count++];
+			entry->uuid = u128.value.u128;
+			entry->proximity = proximity;
 		}
+	}
+
+	if (!match->uuid_count)
+		return match;
+
+	qsort(match->uuids, match->uuid_count, sizeof(*match->uuids),
+							discovery_uuid_cmp);
 
-		if (got_match) {
-			/* we have service match, check proximity */
-			if (item->rssi == DISTANCE_VAL_INVALID ||
-			    item->rssi <= rssi ||
-			    item->pathloss == DISTANCE_VAL_INVALID ||
-			    (eir_data->tx_power != 127 &&
-			     eir_data->tx_power - rssi <= item->pathloss))
-				return true;
+	/* Collapse clients looking for the same UUID into one entry */
+	for (i = 1, count = 1; i < match->uuid_count; i++) {
+		struct discovery_uuid *prev = &match->uuids[count - 1];
 
-			got_match = false;
+		if (!discovery_uuid_cmp(prev, &match->uuids[i])) {
+			merge_proximity(&prev->proximity,
+					&match->uuids[i].proximity);
+			continue;
 		}
+
+		match->uuids[count++] = match->uuids[i];
 	}
 
-	return got_match;
+	match->uuid_count = count;
+
+	return match;
+}
+
+struct filter_match_data {
+	const struct discovery_match *match;
+	int8_t rssi;
+	int8_t tx_power;
+};
+
+static bool match_filter_uuid(const bt_uuid_t *uuid, void *user_data)
+{
+	struct filter_match_data *data = user_data;
+	const struct discovery_uuid *entry;
+	bt_uuid_t u128;
+
+	bt_uuid_to_uuid128(uuid, &u128);
+
+	entry = bsearch(&u128.value.u128, data->match->uuids,
+				data->match->uuid_count, sizeof(*entry),
+				discovery_uuid_cmp);
+	if (!entry)
+		return false;
+
+	return is_proximity_match(&entry->proximity, data->rssi,
+							data->tx_power);
+}
+
+static bool is_filter_match(struct btd_adapter *adapter,
+					const uint8_t *eir, uint8_t eir_len,
+					int8_t tx_power, int8_t rssi)
+{
+	struct filter_match_data data;
+
+	if (!adapter->discovery_match)
+		adapter->discovery_match = discovery_match_new(adapter);
+
+	data.match = adapter->discovery_match;
+	data.rssi = rssi;
+	data.tx_power = tx_power;
+
+	if (is_proximity_match(&data.match->proximity, rssi, tx_power))
+		return true;
+
+	if (!data.match->uuid_count)
+		return false;
+
+	return eir_find_uuid(eir, eir_len, match_filter_uuid, &data);
 }
 
 static void filter_duplicate_data(void *data, void *user_data)
@@ -6964,8 +7399,9 @@ static void update_found_devices(struct btd_adapter *adapter,
 	 * discoverable or if active discovery filter don't match.
 	 */
 	if (!matched_monitors && (!discoverable ||
-		(adapter->filtered_discovery && !is_filter_match(
-				adapter->discovery_list, &eir_data, rssi)))) {
+		(adapter->filtered_discovery && !is_filter_match(adapter,
+						data, data_len,
+						eir_data.tx_power, rssi)))) {
 		eir_data_free(&eir_data);
 		return;
 	}
@@ -8222,9 +8658,7 @@ static void store_link_key(struct btd_adapter *adapter,
 	char device_addr[18];
 	char filename[PATH_MAX];
 	GKeyFile *key_file;
-	gsize length = 0;
 	char key_str[33];
-	char *str;
 	int i;
 
 	ba2str(device_get_address(device), device_addr);
@@ -8232,7 +8666,7 @@ static void store_link_key(struct btd_adapter *adapter,
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/info",
 			btd_adapter_get_storage_dir(adapter), device_addr);
 	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	btd_storage_load(key_file, filename);
 
 	for (i = 0; i < 16; i++)
 		sprintf(key_str + (i * 2), "%2.2X", key[i]);
@@ -8242,11 +8676,7 @@ static void store_link_key(struct btd_adapter *adapter,
 	g_key_file_set_integer(key_file, "LinkKey", "Type", type);
 	g_key_file_set_integer(key_file, "LinkKey", "PINLength", pin_length);
 
-	create_file(filename, 0600);
-
-	str = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, str, length, NULL);
-	g_free(str);
+	btd_storage_sync(key_file, filename);
 
 	g_key_file_free(key_file);
 }
@@ -8308,8 +8738,6 @@ static void store_longtermkey(struct btd_adapter *adapter, const bdaddr_t *peer,
 	char filename[PATH_MAX];
 	GKeyFile *key_file;
 	char key_str[33];
-	gsize length = 0;
-	char *str;
 	int i;
 
 	if (central != 0x00 && central != 0x01) {
@@ -8322,7 +8750,7 @@ static void store_longtermkey(struct btd_adapter *adapter, const bdaddr_t *peer,
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/info",
 			btd_adapter_get_storage_dir(adapter), device_addr);
 	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	btd_storage_load(key_file, filename);
 
 	/* Old files may contain this so remove it in case it exists */
 	g_key_file_remove_key(key_file, "LongTermKey", "Master", NULL);
@@ -8339,11 +8767,7 @@ static void store_longtermkey(struct btd_adapter *adapter, const bdaddr_t *peer,
 	g_key_file_set_integer(key_file, group, "EDiv", ediv);
 	g_key_file_set_uint64(key_file, group, "Rand", rand);
 
-	create_file(filename, 0600);
-
-	str = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, str, length, NULL);
-	g_free(str);
+	btd_storage_sync(key_file, filename);
 
 	g_key_file_free(key_file);
 }
@@ -8421,9 +8845,7 @@ static void store_csrk(struct btd_adapter *adapter, const bdaddr_t *peer,
 	char filename[PATH_MAX];
 	GKeyFile *key_file;
 	char key_str[33];
-	gsize length = 0;
 	gboolean auth;
-	char *str;
 	int i;
 
 	switch (type) {
@@ -8454,7 +8876,7 @@ static void store_csrk(struct btd_adapter *adapter, const bdaddr_t *peer,
 			btd_adapter_get_storage_dir(adapter), device_addr);
 
 	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	btd_storage_load(key_file, filename);
 
 	for (i = 0; i < 16; i++)
 		sprintf(key_str + (i * 2), "%2.2X", key[i]);
@@ -8463,11 +8885,7 @@ static void store_csrk(struct btd_adapter *adapter, const bdaddr_t *peer,
 	g_key_file_set_integer(key_file, group, "Counter", counter);
 	g_key_file_set_boolean(key_file, group, "Authenticated", auth);
 
-	create_file(filename, 0600);
-
-	str = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, str, length, NULL);
-	g_free(str);
+	btd_storage_sync(key_file, filename);
 
 	g_key_file_free(key_file);
 }
@@ -8514,9 +8932,7 @@ static void store_irk(struct btd_adapter *adapter, const bdaddr_t *peer,
 	char device_addr[18];
 	char filename[PATH_MAX];
 	GKeyFile *key_file;
-	char *store_data;
 	char str[33];
-	size_t length = 0;
 	int i;
 
 	ba2str(peer, device_addr);
@@ -8524,18 +8940,14 @@ static void store_irk(struct btd_adapter *adapter, const bdaddr_t *peer,
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/info",
 			btd_adapter_get_storage_dir(adapter), device_addr);
 	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	btd_storage_load(key_file, filename);
 
 	for (i = 0; i < 16; i++)
 		sprintf(str + (i * 2), "%2.2X", key[i]);
 
 	g_key_file_set_string(key_file, "IdentityResolvingKey", "Key", str);
 
-	create_file(filename, 0600);
-
-	store_data = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, store_data, length, NULL);
-	g_free(store_data);
+	btd_storage_sync(key_file, filename);
 
 	g_key_file_free(key_file);
 }
@@ -8602,8 +9014,6 @@ static void store_conn_param(struct btd_adapter *adapter, const bdaddr_t *peer,
 	char device_addr[18];
 	char filename[PATH_MAX];
 	GKeyFile *key_file;
-	char *store_data;
-	size_t length = 0;
 
 	ba2str(peer, device_addr);
 
@@ -8612,7 +9022,7 @@ static void store_conn_param(struct btd_adapter *adapter, const bdaddr_t *peer,
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/info",
 			btd_adapter_get_storage_dir(adapter), device_addr);
 	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	btd_storage_load(key_file, filename);
 
 	g_key_file_set_integer(key_file, "ConnectionParameters",
 						"MinInterval", min_interval);
@@ -8623,11 +9033,7 @@ static void store_conn_param(struct btd_adapter *adapter, const bdaddr_t *peer,
 	g_key_file_set_integer(key_file, "ConnectionParameters",
 						"Timeout", timeout);
 
-	create_file(filename, 0600);
-
-	store_data = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, store_data, length, NULL);
-	g_free(store_data);
+	btd_storage_store(key_file, filename);
 
 	g_key_file_free(key_file);
 }
@@ -8984,9 +9390,6 @@ load:
 	load_defaults(adapter);
 	load_devices(adapter);
 
-	/* restore Service Changed CCC value for bonded devices */
-	btd_gatt_database_restore_svc_chng_ccc(adapter->database);
-
 	/* retrieve the active connections: address the scenario where
 	 * the are active connections before the daemon've started */
 	if (btd_adapter_get_powered(adapter))
@@ -9254,15 +9657,13 @@ static void remove_keys(struct btd_adapter *adapter,
 	char device_addr[18];
 	char filename[PATH_MAX];
 	GKeyFile *key_file;
-	gsize length = 0;
-	char *str;
 
 	ba2str(device_get_address(device), device_addr);
 
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/info",
 			btd_adapter_get_storage_dir(adapter), device_addr);
 	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	btd_storage_load(key_file, filename);
 
 	if (type == BDADDR_BREDR) {
 		g_key_file_remove_group(key_file, "LinkKey", NULL);
@@ -9273,9 +9674,7 @@ static void remove_keys(struct btd_adapter *adapter,
 		g_key_file_remove_group(key_file, "IdentityResolvingKey", NULL);
 	}
 
-	str = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, str, length, NULL);
-	g_free(str);
+	btd_storage_sync(key_file, filename);
 
 	g_key_file_free(key_file);
 }
@@ -10246,8 +10645,19 @@ static void mgmt_debug(const char *str, void *user_data)
 	info("%s%s", prefix, str);
 }
 
+static void mgmt_print_stats(const struct mgmt_stats *stats,
+							void *user_data)
+{
+	DBG("%s (0x%04x): %u commands, avg %" PRIu64 " usec, max %" PRIu64
+			" usec", mgmt_opstr(stats->opcode), stats->opcode,
+			stats->count, stats->total_usec / stats->count,
+			stats->max_usec);
+}
+
 int adapter_init(void)
 {
+	const char *str;
+
 	dbus_conn = btd_get_dbus_connection();
 
 	mgmt_primary = mgmt_new_default();
@@ -10259,6 +10669,14 @@ int adapter_init(void)
 	if (getenv("MGMT_DEBUG"))
 		mgmt_set_debug(mgmt_primary, mgmt_debug, "mgmt: ", NULL);
 
+	/*
+	 * By default only a single command is outstanding at a time, allow
+	 * independent commands to be pipelined for faster initialization.
+	 */
+	str = getenv("MGMT_PIPELINE");
+	if (str)
+		mgmt_set_pipeline(mgmt_primary, atoi(str));
+
 	DBG("sending read version command");
 
 	if (mgmt_send(mgmt_primary, MGMT_OP_READ_VERSION,
@@ -10302,6 +10720,8 @@ void adapter_cleanup(void)
 	 */
 	mgmt_cancel_index(mgmt_primary, MGMT_INDEX_NONE);
 
+	mgmt_foreach_stats(mgmt_primary, mgmt_print_stats, NULL);
+
 	mgmt_unref(mgmt_primary);
 	mgmt_primary = NULL;
 
@@ -30,6 +30,11 @@ enum jw_repairing_t {
 	JW_REPAIRING_ALWAYS,
 };
 
+enum device_storage_t {
+	DEVICE_STORAGE_FILES,
+	DEVICE_STORAGE_DATABASE,
+};
+
 enum mps_mode_t {
 	MPS_OFF,
 	MPS_SINGLE,
@@ -130,6 +135,8 @@ struct btd_opts {
 
 	enum jw_repairing_t jw_repairing;
 
+	enum device_storage_t device_storage;
+
 	struct btd_advmon_opts	advmon;
 };
 
@@ -272,6 +272,8 @@ struct btd_device {
 
 	GIOChannel	*att_io;
 	guint		store_id;
+	guint		gatt_store_id;
+	bool		gatt_db_changed;
 };
 
 static const uint16_t uuid_list[] = {
@@ -381,10 +383,8 @@ static gboolean store_device_info_cb(gpointer user_data)
 	GKeyFile *key_file;
 	char filename[PATH_MAX];
 	char device_addr[18];
-	char *str;
 	char class[9];
 	char **uuids = NULL;
-	gsize length = 0;
 
 	device->store_id = 0;
 
@@ -394,7 +394,7 @@ static gboolean store_device_info_cb(gpointer user_data)
 				device_addr);
 
 	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	btd_storage_load(key_file, filename);
 
 	g_key_file_set_string(key_file, "General", "Name", device->name);
 
@@ -464,11 +464,7 @@ static gboolean store_device_info_cb(gpointer user_data)
 	if (device->remote_csrk)
 		store_csrk(device->remote_csrk, key_file, "RemoteSignatureKey");
 
-	create_file(filename, 0600);
-
-	str = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, str, length, NULL);
-	g_free(str);
+	btd_storage_store(key_file, filename);
 
 	g_key_file_free(key_file);
 	g_free(uuids);
@@ -509,10 +505,6 @@ void device_store_cached_name(struct btd_device *dev, const char *name)
 	char filename[PATH_MAX];
 	char d_addr[18];
 	GKeyFile *key_file;
-	char *data;
-	char *data_old;
-	gsize length = 0;
-	gsize length_old = 0;
 
 	if (device_address_is_private(dev)) {
 		DBG("Can't store name for private addressed device %s",
@@ -523,22 +515,12 @@ void device_store_cached_name(struct btd_device *dev, const char *name)
 	ba2str(&dev->bdaddr, d_addr);
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s",
 			btd_adapter_get_storage_dir(dev->adapter), d_addr);
-	create_file(filename, 0600);
 
+	/* The storage only writes the file back if the name has changed */
 	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
-	data_old = g_key_file_to_data(key_file, &length_old, NULL);
-
+	btd_storage_load(key_file, filename);
 	g_key_file_set_string(key_file, "General", "Name", name);
-
-	data = g_key_file_to_data(key_file, &length, NULL);
-
-	if ((length != length_old) || (memcmp(data, data_old, length)))
-		g_file_set_contents(filename, data, length, NULL);
-
-	g_free(data);
-	g_free(data_old);
-
+	btd_storage_store(key_file, filename);
 	g_key_file_free(key_file);
 }
 
@@ -701,6 +683,9 @@ static void device_free(gpointer user_data)
 	if (device->temporary_timer)
 		timeout_remove(device->temporary_timer);
 
+	if (device->gatt_store_id > 0)
+		g_source_remove(device->gatt_store_id);
+
 	if (device->connect)
 		dbus_message_unref(device->connect);
 
@@ -2361,12 +2346,76 @@ static void store_services(struct btd_device *device)
 	g_key_file_free(key_file);
 }
 
+/* Binary GATT cache, stored next to the text cache file as <addr>.gatt:
+ *
+ *   magic (le32) | version (u8) | flags (u8) | count (le16) | hash (16)
+ *
+ * followed by count records, in the order they need to be inserted:
+ *
+ *   service:        type | handle (le16) | end (le16) | uuid
+ *   include:        type | handle (le16) | start (le16) | end (le16)
+ *   characteristic: type | handle (le16) | value handle (le16) |
+ *                   properties (u8) | value length (u8) | value | uuid
+ *   descriptor:     type | handle (le16) | ext props (le16) | uuid
+ *
+ * where uuid is a length byte (2 or 16) followed by the little endian
+ * value.
+ */
+#define GATT_CACHE_MAGIC	0x43544147	/* "GATC" */
+#define GATT_CACHE_VERSION	1
+#define GATT_CACHE_HDR_LEN	24
+#define GATT_CACHE_FLAG_HASH	0x01
+
+enum {
+	GATT_CACHE_PRIM = 1,
+	GATT_CACHE_SND,
+	GATT_CACHE_INCL,
+	GATT_CACHE_CHRC,
+	GATT_CACHE_DESC,
+};
+
 struct gatt_saver {
 	struct btd_device *device;
 	uint16_t ext_props;
-	GKeyFile *key_file;
+	GByteArray *buf;
+	uint16_t count;
 };
 
+static void gatt_cache_filename(struct btd_device *device, char *filename)
+{
+	char dst_addr[18];
+
+	ba2str(&device->bdaddr, dst_addr);
+
+	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s.gatt",
+				btd_adapter_get_storage_dir(device->adapter),
+				dst_addr);
+}
+
+static void gatt_cache_put_u8(GByteArray *buf, uint8_t val)
+{
+	g_byte_array_append(buf, &val, sizeof(val));
+}
+
+static void gatt_cache_put_le16(GByteArray *buf, uint16_t val)
+{
+	uint8_t le[2];
+
+	put_le16(val, le);
+	g_byte_array_append(buf, le, sizeof(le));
+}
+
+static void gatt_cache_put_uuid(GByteArray *buf, const bt_uuid_t *uuid)
+{
+	uint8_t le[16];
+	uint8_t len = uuid->type == BT_UUID16 ? 2 : 16;
+
+	bt_uuid_to_le(uuid, le);
+
+	gatt_cache_put_u8(buf, len);
+	g_byte_array_append(buf, le, len);
+}
+
 static void db_hash_read_value_cb(struct gatt_db_attribute *attrib,
 						int err, const uint8_t *value,
 						size_t length, void *user_data)
@@ -2379,38 +2428,53 @@ static void db_hash_read_value_cb(struct gatt_db_attribute *attrib,
 	*hash = value;
 }
 
+static void db_hash_find_cb(struct gatt_db_attribute *attrib,
+							void *user_data)
+{
+	gatt_db_attribute_read(attrib, 0, BT_ATT_OP_READ_REQ, NULL,
+					db_hash_read_value_cb, user_data);
+}
+
+/* Returns the Database Hash value cached for the remote, if any */
+static const uint8_t *device_get_db_hash(struct btd_device *device)
+{
+	const uint8_t *hash = NULL;
+	bt_uuid_t uuid;
+
+	bt_uuid16_create(&uuid, GATT_CHARAC_DB_HASH);
+	gatt_db_find_by_type(device->db, 0x0001, 0xffff, &uuid,
+						db_hash_find_cb, &hash);
+
+	return hash;
+}
+
 static void store_desc(struct gatt_db_attribute *attr, void *user_data)
 {
 	struct gatt_saver *saver = user_data;
-	GKeyFile *key_file = saver->key_file;
-	char handle[6], value[100], uuid_str[MAX_LEN_UUID_STR];
 	const bt_uuid_t *uuid;
 	bt_uuid_t ext_uuid;
-	uint16_t handle_num;
-
-	handle_num = gatt_db_attribute_get_handle(attr);
-	sprintf(handle, "%04hx", handle_num);
+	uint16_t ext_props = 0;
 
 	uuid = gatt_db_attribute_get_type(attr);
-	bt_uuid_to_string(uuid, uuid_str, sizeof(uuid_str));
 
 	bt_uuid16_create(&ext_uuid, GATT_CHARAC_EXT_PROPER_UUID);
-	if (!bt_uuid_cmp(uuid, &ext_uuid) && saver->ext_props)
-		sprintf(value, "%04hx:%s", saver->ext_props, uuid_str);
-	else
-		sprintf(value, "%s", uuid_str);
+	if (!bt_uuid_cmp(uuid, &ext_uuid))
+		ext_props = saver->ext_props;
 
-	g_key_file_set_string(key_file, "Attributes", handle, value);
+	gatt_cache_put_u8(saver->buf, GATT_CACHE_DESC);
+	gatt_cache_put_le16(saver->buf, gatt_db_attribute_get_handle(attr));
+	gatt_cache_put_le16(saver->buf, ext_props);
+	gatt_cache_put_uuid(saver->buf, uuid);
+	saver->count++;
 }
 
 static void store_chrc(struct gatt_db_attribute *attr, void *user_data)
 {
 	struct gatt_saver *saver = user_data;
-	GKeyFile *key_file = saver->key_file;
-	char handle[6], value[100], uuid_str[MAX_LEN_UUID_STR];
 	uint16_t handle_num, value_handle;
 	uint8_t properties;
 	bt_uuid_t uuid, hash_uuid;
+	const uint8_t *hash = NULL;
 
 	if (!gatt_db_attribute_get_char_data(attr, &handle_num, &value_handle,
 						&properties, &saver->ext_props,
@@ -2419,37 +2483,26 @@ static void store_chrc(struct gatt_db_attribute *attr, void *user_data)
 		return;
 	}
 
-	sprintf(handle, "%04hx", handle_num);
-	bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
-
 	/* Store Database Hash  value if available */
 	bt_uuid16_create(&hash_uuid, GATT_CHARAC_DB_HASH);
 	if (!bt_uuid_cmp(&uuid, &hash_uuid)) {
-		const uint8_t *hash = NULL;
+		struct gatt_db_attribute *value;
 
-		attr = gatt_db_get_attribute(saver->device->db, value_handle);
+		value = gatt_db_get_attribute(saver->device->db, value_handle);
 
-		gatt_db_attribute_read(attr, 0, BT_ATT_OP_READ_REQ, NULL,
+		gatt_db_attribute_read(value, 0, BT_ATT_OP_READ_REQ, NULL,
 					db_hash_read_value_cb, &hash);
-		if (hash)
-			sprintf(value, GATT_CHARAC_UUID_STR ":%04hx:%02hhx:"
-				"%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx"
-				"%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx"
-				"%02hhx%02hhx:%s", value_handle, properties,
-				hash[0], hash[1], hash[2], hash[3],
-				hash[4], hash[5], hash[6], hash[7],
-				hash[8], hash[9], hash[10], hash[11],
-				hash[12], hash[13], hash[14], hash[15],
-				uuid_str);
-		else
-			sprintf(value, GATT_CHARAC_UUID_STR ":%04hx:%02hhx:%s",
-				value_handle, properties, uuid_str);
-
-	} else
-		sprintf(value, GATT_CHARAC_UUID_STR ":%04hx:%02hhx:%s",
-				value_handle, properties, uuid_str);
+	}
 
-	g_key_file_set_string(key_file, "Attributes", handle, value);
+	gatt_cache_put_u8(saver->buf, GATT_CACHE_CHRC);
+	gatt_cache_put_le16(saver->buf, handle_num);
+	gatt_cache_put_le16(saver->buf, value_handle);
+	gatt_cache_put_u8(saver->buf, properties);
+	gatt_cache_put_u8(saver->buf, hash ? 16 : 0);
+	if (hash)
+		g_byte_array_append(saver->buf, hash, 16);
+	gatt_cache_put_uuid(saver->buf, &uuid);
+	saver->count++;
 
 	gatt_db_service_foreach_desc(attr, store_desc, saver);
 }
@@ -2457,42 +2510,31 @@ static void store_chrc(struct gatt_db_attribute *attr, void *user_data)
 static void store_incl(struct gatt_db_attribute *attr, void *user_data)
 {
 	struct gatt_saver *saver = user_data;
-	GKeyFile *key_file = saver->key_file;
-	struct gatt_db_attribute *service;
-	char handle[6], value[100], uuid_str[MAX_LEN_UUID_STR];
 	uint16_t handle_num, start, end;
-	bt_uuid_t uuid;
 
 	if (!gatt_db_attribute_get_incl_data(attr, &handle_num, &start, &end)) {
 		warn("Error storing included service - can't get data");
 		return;
 	}
 
-	service = gatt_db_get_attribute(saver->device->db, start);
-	if (!service) {
+	if (!gatt_db_get_attribute(saver->device->db, start)) {
 		warn("Error storing included service - can't find it");
 		return;
 	}
 
-	sprintf(handle, "%04hx", handle_num);
-
-	gatt_db_attribute_get_service_uuid(service, &uuid);
-	bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
-	sprintf(value, GATT_INCLUDE_UUID_STR ":%04hx:%04hx:%s", start,
-								end, uuid_str);
-
-	g_key_file_set_string(key_file, "Attributes", handle, value);
+	gatt_cache_put_u8(saver->buf, GATT_CACHE_INCL);
+	gatt_cache_put_le16(saver->buf, handle_num);
+	gatt_cache_put_le16(saver->buf, start);
+	gatt_cache_put_le16(saver->buf, end);
+	saver->count++;
 }
 
 static void store_service(struct gatt_db_attribute *attr, void *user_data)
 {
 	struct gatt_saver *saver = user_data;
-	GKeyFile *key_file = saver->key_file;
-	char uuid_str[MAX_LEN_UUID_STR], handle[6], value[256];
 	uint16_t start, end;
 	bt_uuid_t uuid;
 	bool primary;
-	char *type;
 
 	if (!gatt_db_attribute_get_service_data(attr, &start, &end, &primary,
 								&uuid)) {
@@ -2500,66 +2542,114 @@ static void store_service(struct gatt_db_attribute *attr, void *user_data)
 		return;
 	}
 
-	sprintf(handle, "%04hx", start);
+	gatt_cache_put_u8(saver->buf, primary ? GATT_CACHE_PRIM :
+							GATT_CACHE_SND);
+	gatt_cache_put_le16(saver->buf, start);
+	gatt_cache_put_le16(saver->buf, end);
+	gatt_cache_put_uuid(saver->buf, &uuid);
+	saver->count++;
 
-	bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+	gatt_db_service_foreach_incl(attr, store_incl, saver);
+	gatt_db_service_foreach_char(attr, store_chrc, saver);
+}
 
-	if (primary)
-		type = GATT_PRIM_SVC_UUID_STR;
-	else
-		type = GATT_SND_SVC_UUID_STR;
+/* Check if the stored cache was generated from the same Database Hash */
+static bool gatt_cache_hash_match(const char *filename, const uint8_t *hash)
+{
+	uint8_t hdr[GATT_CACHE_HDR_LEN];
+	ssize_t len;
+	int fd;
 
-	sprintf(value, "%s:%04hx:%s", type, end, uuid_str);
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
 
-	g_key_file_set_string(key_file, "Attributes", handle, value);
+	len = read(fd, hdr, sizeof(hdr));
+	close(fd);
 
-	gatt_db_service_foreach_incl(attr, store_incl, saver);
-	gatt_db_service_foreach_char(attr, store_chrc, saver);
+	if (len != sizeof(hdr))
+		return false;
+
+	if (get_le32(hdr) != GATT_CACHE_MAGIC ||
+			hdr[4] != GATT_CACHE_VERSION ||
+			!(hdr[5] & GATT_CACHE_FLAG_HASH))
+		return false;
+
+	return !memcmp(hdr + 8, hash, 16);
 }
 
-static void store_gatt_db(struct btd_device *device)
+static gboolean store_gatt_db_cb(gpointer user_data)
 {
+	struct btd_device *device = user_data;
 	char filename[PATH_MAX];
-	char dst_addr[18];
-	GKeyFile *key_file;
-	char *data;
-	gsize length = 0;
+	const uint8_t *hash;
 	struct gatt_saver saver;
+	uint8_t *hdr;
+
+	device->gatt_store_id = 0;
 
 	if (device_address_is_private(device)) {
 		DBG("Can't store GATT db for private addressed device %s",
 								device->path);
-		return;
+		return FALSE;
 	}
 
 	if (!gatt_cache_is_enabled(device))
-		return;
-
-	ba2str(&device->bdaddr, dst_addr);
-
-	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s",
-				btd_adapter_get_storage_dir(device->adapter),
-				dst_addr);
-	create_file(filename, 0600);
+		return FALSE;
 
-	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	gatt_cache_filename(device, filename);
 
-	/* Remove current attributes since it might have changed */
-	g_key_file_remove_group(key_file, "Attributes", NULL);
+	/* The remote database is identified by its hash, so if the cache on
+	 * disk was stored for the same hash there is nothing to write. This
+	 * does not hold while services are being added or removed, since the
+	 * hash is only read back once the rediscovery completes.
+	 */
+	hash = device_get_db_hash(device);
+	if (!device->gatt_db_changed && hash &&
+				gatt_cache_hash_match(filename, hash)) {
+		DBG("GATT cache for %s is up to date", device->path);
+		return FALSE;
+	}
 
-	saver.key_file = key_file;
 	saver.device = device;
+	saver.ext_props = 0;
+	saver.count = 0;
+	saver.buf = g_byte_array_sized_new(1024);
+	g_byte_array_set_size(saver.buf, GATT_CACHE_HDR_LEN);
+
+	device->gatt_db_changed = false;
 
 	gatt_db_foreach_service(device->db, NULL, store_service, &saver);
 
-	data = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, data, length, NULL);
+	hdr = saver.buf->data;
+	memset(hdr, 0, GATT_CACHE_HDR_LEN);
+	put_le32(GATT_CACHE_MAGIC, hdr);
+	hdr[4] = GATT_CACHE_VERSION;
+	put_le16(saver.count, hdr + 6);
+	if (hash) {
+		hdr[5] |= GATT_CACHE_FLAG_HASH;
+		memcpy(hdr + 8, hash, 16);
+	}
 
-	g_free(data);
-	g_key_file_free(key_file);
+	create_file(filename, 0600);
+	g_file_set_contents(filename, (const char *) saver.buf->data,
+						saver.buf->len, NULL);
+
+	g_byte_array_free(saver.buf, TRUE);
+
+	return FALSE;
 }
 
+/* Writing the cache is deferred so that the burst of changes generated by
+ * a discovery results in a single write.
+ */
+static void store_gatt_db(struct btd_device *device)
+{
+	if (device->gatt_store_id > 0)
+		return;
+
+	device->gatt_store_id = g_idle_add(store_gatt_db_cb, device);
+}
 
 static void browse_request_complete(struct browse_req *req, uint8_t type,
 						uint8_t bdaddr_type, int err)
@@ -3207,7 +3297,7 @@ static char *load_cached_name(struct btd_device *device, const char *local,
 
 	key_file = g_key_file_new();
 
-	if (!g_key_file_load_from_file(key_file, filename, 0, NULL))
+	if (!btd_storage_load(key_file, filename))
 		goto failed;
 
 	str = g_key_file_get_string(key_file, "General", "Name", NULL);
@@ -3279,8 +3369,6 @@ static void convert_info(struct btd_device *device, GKeyFile *key_file)
 	char adapter_addr[18];
 	char device_addr[18];
 	char **uuids;
-	char *str;
-	gsize length = 0;
 
 	/* Load device profile list from legacy properties */
 	uuids = g_key_file_get_string_list(key_file, "General", "SDPServices",
@@ -3305,9 +3393,7 @@ static void convert_info(struct btd_device *device, GKeyFile *key_file)
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/info", adapter_addr,
 			device_addr);
 
-	str = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, str, length, NULL);
-	g_free(str);
+	btd_storage_store(key_file, filename);
 
 	store_device_info(device);
 }
@@ -3582,14 +3668,44 @@ static ssize_t str2val(const char *str, uint8_t *val, size_t len)
 	return i;
 }
 
+static int insert_desc(struct gatt_db_attribute *service, uint16_t handle,
+					const bt_uuid_t *uuid, uint16_t val)
+{
+	struct gatt_db_attribute *att;
+	bt_uuid_t ext_uuid;
+
+	bt_uuid16_create(&ext_uuid, GATT_CHARAC_EXT_PROPER_UUID);
+
+	/* If it is CEP then it must contain the value */
+	if (!bt_uuid_cmp(uuid, &ext_uuid) && !val) {
+		warn("cannot load CEP descriptor without value");
+		return -EIO;
+	}
+
+	att = gatt_db_service_insert_descriptor(service, handle, uuid,
+							0, NULL, NULL, NULL);
+	if (!att || gatt_db_attribute_get_handle(att) != handle) {
+		warn("loading descriptor to db failed");
+		return -EIO;
+	}
+
+	if (val) {
+		if (!gatt_db_attribute_write(att, 0, (uint8_t *)&val,
+						sizeof(val), 0, NULL,
+						load_desc_value, NULL))
+			return -EIO;
+	}
+
+	return 0;
+}
+
 static int load_desc(char *handle, char *value,
 					struct gatt_db_attribute *service)
 {
 	char uuid_str[MAX_LEN_UUID_STR];
-	struct gatt_db_attribute *att;
 	uint16_t handle_int;
 	uint16_t val;
-	bt_uuid_t uuid, ext_uuid;
+	bt_uuid_t uuid;
 
 	if (sscanf(handle, "%04hx", &handle_int) != 1)
 		return -EIO;
@@ -3605,24 +3721,27 @@ static int load_desc(char *handle, char *value,
 				handle_int, val, uuid_str);
 
 	bt_string_to_uuid(&uuid, uuid_str);
-	bt_uuid16_create(&ext_uuid, GATT_CHARAC_EXT_PROPER_UUID);
 
-	/* If it is CEP then it must contain the value */
-	if (!bt_uuid_cmp(&uuid, &ext_uuid) && !val) {
-		warn("cannot load CEP descriptor without value");
-		return -EIO;
-	}
+	return insert_desc(service, handle_int, &uuid, val);
+}
 
-	att = gatt_db_service_insert_descriptor(service, handle_int, &uuid,
-							0, NULL, NULL, NULL);
-	if (!att || gatt_db_attribute_get_handle(att) != handle_int) {
-		warn("loading descriptor to db failed");
+static int insert_chrc(struct gatt_db_attribute *service,
+				uint16_t value_handle, const bt_uuid_t *uuid,
+				uint8_t properties, const uint8_t *val,
+				size_t val_len)
+{
+	struct gatt_db_attribute *att;
+
+	att = gatt_db_service_insert_characteristic(service, value_handle,
+							uuid, 0, properties,
+							NULL, NULL, NULL);
+	if (!att || gatt_db_attribute_get_handle(att) != value_handle) {
+		warn("loading characteristic to db failed");
 		return -EIO;
 	}
 
-	if (val) {
-		if (!gatt_db_attribute_write(att, 0, (uint8_t *)&val,
-						sizeof(val), 0, NULL,
+	if (val_len) {
+		if (!gatt_db_attribute_write(att, 0, val, val_len, 0, NULL,
 						load_desc_value, NULL))
 			return -EIO;
 	}
@@ -3635,7 +3754,6 @@ static int load_chrc(char *handle, char *value,
 {
 	uint16_t properties, value_handle, handle_int;
 	char uuid_str[MAX_LEN_UUID_STR];
-	struct gatt_db_attribute *att;
 	char val_str[32];
 	uint8_t val[16];
 	size_t val_len;
@@ -3662,18 +3780,25 @@ static int load_chrc(char *handle, char *value,
 				handle_int, value_handle, properties,
 				val_len ? val_str : "", uuid_str);
 
-	att = gatt_db_service_insert_characteristic(service, value_handle,
-							&uuid, 0, properties,
-							NULL, NULL, NULL);
-	if (!att || gatt_db_attribute_get_handle(att) != value_handle) {
-		warn("loading characteristic to db failed");
+	return insert_chrc(service, value_handle, &uuid, properties, val,
+								val_len);
+}
+
+static int insert_incl(struct gatt_db *db, struct gatt_db_attribute *service,
+								uint16_t start)
+{
+	struct gatt_db_attribute *att;
+
+	att = gatt_db_get_attribute(db, start);
+	if (!att) {
+		warn("loading included service to db failed - no such service");
 		return -EIO;
 	}
 
-	if (val_len) {
-		if (!gatt_db_attribute_write(att, 0, val, val_len, 0, NULL,
-						load_desc_value, NULL))
-			return -EIO;
+	att = gatt_db_service_add_included(service, att);
+	if (!att) {
+		warn("loading included service to db failed");
+		return -EIO;
 	}
 
 	return 0;
@@ -3683,7 +3808,6 @@ static int load_incl(struct gatt_db *db, char *handle, char *value,
 					struct gatt_db_attribute *service)
 {
 	char uuid_str[MAX_LEN_UUID_STR];
-	struct gatt_db_attribute *att;
 	uint16_t start, end;
 
 	if (sscanf(handle, "%04hx", &start) != 1)
@@ -3697,15 +3821,21 @@ static int load_incl(struct gatt_db *db, char *handle, char *value,
 	DBG("loading included service: 0x%04x, end: 0x%04x, uuid: %s", start,
 								end, uuid_str);
 
-	att = gatt_db_get_attribute(db, start);
-	if (!att) {
-		warn("loading included service to db failed - no such service");
+	return insert_incl(db, service, start);
+}
+
+static int insert_service(struct gatt_db *db, uint16_t start, uint16_t end,
+					const bt_uuid_t *uuid, bool primary)
+{
+	struct gatt_db_attribute *att;
+
+	if (end < start)
 		return -EIO;
-	}
 
-	att = gatt_db_service_add_included(service, att);
+	att = gatt_db_insert_service(db, start, uuid, primary,
+							end - start + 1);
 	if (!att) {
-		warn("loading included service to db failed");
+		error("Unable load service into db!");
 		return -EIO;
 	}
 
@@ -3714,7 +3844,6 @@ static int load_incl(struct gatt_db *db, char *handle, char *value,
 
 static int load_service(struct gatt_db *db, char *handle, char *value)
 {
-	struct gatt_db_attribute *att;
 	uint16_t start, end;
 	char type[MAX_LEN_UUID_STR], uuid_str[MAX_LEN_UUID_STR];
 	bt_uuid_t uuid;
@@ -3739,14 +3868,7 @@ static int load_service(struct gatt_db *db, char *handle, char *value)
 	DBG("loading service: 0x%04x, end: 0x%04x, uuid: %s",
 							start, end, uuid_str);
 
-	att = gatt_db_insert_service(db, start, &uuid, primary,
-							end - start + 1);
-	if (!att) {
-		error("Unable load service into db!");
-		return -EIO;
-	}
-
-	return 0;
+	return insert_service(db, start, end, &uuid, primary);
 }
 
 static int load_gatt_db_impl(GKeyFile *key_file, char **keys,
@@ -3837,6 +3959,250 @@ static int load_gatt_db_impl(GKeyFile *key_file, char **keys,
 	return 0;
 }
 
+struct gatt_cache_record {
+	uint8_t type;
+	uint16_t handle;
+	uint16_t start;
+	uint16_t end;
+	uint16_t value_handle;
+	uint8_t properties;
+	uint16_t ext_props;
+	const uint8_t *value;
+	uint8_t value_len;
+	bt_uuid_t uuid;
+};
+
+struct gatt_cache_reader {
+	const uint8_t *data;
+	size_t len;
+};
+
+static const uint8_t *gatt_cache_pull(struct gatt_cache_reader *reader,
+								size_t len)
+{
+	const uint8_t *data = reader->data;
+
+	if (reader->len < len)
+		return NULL;
+
+	reader->data += len;
+	reader->len -= len;
+
+	return data;
+}
+
+static bool gatt_cache_pull_u8(struct gatt_cache_reader *reader,
+							uint8_t *val)
+{
+	const uint8_t *data = gatt_cache_pull(reader, sizeof(*val));
+
+	if (!data)
+		return false;
+
+	*val = *data;
+
+	return true;
+}
+
+static bool gatt_cache_pull_le16(struct gatt_cache_reader *reader,
+							uint16_t *val)
+{
+	const uint8_t *data = gatt_cache_pull(reader, sizeof(*val));
+
+	if (!data)
+		return false;
+
+	*val = get_le16(data);
+
+	return true;
+}
+
+static bool gatt_cache_pull_uuid(struct gatt_cache_reader *reader,
+							bt_uuid_t *uuid)
+{
+	const uint8_t *data;
+	uint128_t u128;
+	uint8_t len;
+
+	if (!gatt_cache_pull_u8(reader, &len))
+		return false;
+
+	data = gatt_cache_pull(reader, len);
+	if (!data)
+		return false;
+
+	switch (len) {
+	case 2:
+		bt_uuid16_create(uuid, get_le16(data));
+		return true;
+	case 16:
+		bswap_128(data, &u128);
+		bt_uuid128_create(uuid, u128);
+		return true;
+	}
+
+	return false;
+}
+
+static bool gatt_cache_pull_record(struct gatt_cache_reader *reader,
+					struct gatt_cache_record *rec)
+{
+	memset(rec, 0, sizeof(*rec));
+
+	if (!gatt_cache_pull_u8(reader, &rec->type) ||
+			!gatt_cache_pull_le16(reader, &rec->handle))
+		return false;
+
+	switch (rec->type) {
+	case GATT_CACHE_PRIM:
+	case GATT_CACHE_SND:
+		rec->start = rec->handle;
+		return gatt_cache_pull_le16(reader, &rec->end) &&
+				gatt_cache_pull_uuid(reader, &rec->uuid);
+	case GATT_CACHE_INCL:
+		return gatt_cache_pull_le16(reader, &rec->start) &&
+				gatt_cache_pull_le16(reader, &rec->end);
+	case GATT_CACHE_CHRC:
+		if (!gatt_cache_pull_le16(reader, &rec->value_handle) ||
+			!gatt_cache_pull_u8(reader, &rec->properties) ||
+			!gatt_cache_pull_u8(reader, &rec->value_len))
+			return false;
+
+		rec->value = gatt_cache_pull(reader, rec->value_len);
+		if (!rec->value)
+			return false;
+
+		return gatt_cache_pull_uuid(reader, &rec->uuid);
+	case GATT_CACHE_DESC:
+		return gatt_cache_pull_le16(reader, &rec->ext_props) &&
+				gatt_cache_pull_uuid(reader, &rec->uuid);
+	}
+
+	return false;
+}
+
+static int load_gatt_db_bin_impl(const uint8_t *data, size_t len,
+							struct gatt_db *db)
+{
+	struct gatt_db_attribute *current_service = NULL;
+	struct gatt_cache_reader reader;
+	struct gatt_cache_record rec;
+	const uint8_t *hash = NULL;
+	bt_uuid_t hash_uuid;
+	uint16_t count, i;
+	int ret = 0;
+
+	if (len < GATT_CACHE_HDR_LEN || get_le32(data) != GATT_CACHE_MAGIC ||
+					data[4] != GATT_CACHE_VERSION)
+		return -EIO;
+
+	if (data[5] & GATT_CACHE_FLAG_HASH)
+		hash = data + 8;
+
+	count = get_le16(data + 6);
+
+	/* first load service definitions */
+	reader.data = data + GATT_CACHE_HDR_LEN;
+	reader.len = len - GATT_CACHE_HDR_LEN;
+
+	for (i = 0; i < count; i++) {
+		if (!gatt_cache_pull_record(&reader, &rec))
+			return -EIO;
+
+		if (rec.type != GATT_CACHE_PRIM && rec.type != GATT_CACHE_SND)
+			continue;
+
+		ret = insert_service(db, rec.start, rec.end, &rec.uuid,
+						rec.type == GATT_CACHE_PRIM);
+		if (ret)
+			return ret;
+	}
+
+	bt_uuid16_create(&hash_uuid, GATT_CHARAC_DB_HASH);
+
+	/* then fill them with data */
+	reader.data = data + GATT_CACHE_HDR_LEN;
+	reader.len = len - GATT_CACHE_HDR_LEN;
+
+	for (i = 0; i < count && !ret; i++) {
+		gatt_cache_pull_record(&reader, &rec);
+
+		if (rec.type == GATT_CACHE_PRIM ||
+					rec.type == GATT_CACHE_SND) {
+			if (current_service)
+				gatt_db_service_set_active(current_service,
+									true);
+
+			current_service = gatt_db_get_attribute(db, rec.start);
+			continue;
+		}
+
+		if (!current_service) {
+			ret = -EIO;
+			break;
+		}
+
+		switch (rec.type) {
+		case GATT_CACHE_INCL:
+			ret = insert_incl(db, current_service, rec.start);
+			break;
+		case GATT_CACHE_CHRC:
+			/* The stored hash must match the one in the header */
+			if (hash && !bt_uuid_cmp(&rec.uuid, &hash_uuid) &&
+					(rec.value_len != 16 ||
+					memcmp(rec.value, hash, 16))) {
+				warn("GATT cache Database Hash mismatch");
+				ret = -EIO;
+				break;
+			}
+
+			ret = insert_chrc(current_service, rec.value_handle,
+						&rec.uuid, rec.properties,
+						rec.value, rec.value_len);
+			break;
+		case GATT_CACHE_DESC:
+			ret = insert_desc(current_service, rec.handle,
+						&rec.uuid, rec.ext_props);
+			break;
+		}
+	}
+
+	if (ret) {
+		gatt_db_clear(db);
+		return ret;
+	}
+
+	if (current_service)
+		gatt_db_service_set_active(current_service, true);
+
+	return 0;
+}
+
+static int load_gatt_db_bin(struct btd_device *device)
+{
+	char filename[PATH_MAX];
+	GMappedFile *file;
+	int ret;
+
+	gatt_cache_filename(device, filename);
+
+	file = g_mapped_file_new(filename, FALSE, NULL);
+	if (!file)
+		return -ENOENT;
+
+	ret = load_gatt_db_bin_impl(
+			(const uint8_t *) g_mapped_file_get_contents(file),
+			g_mapped_file_get_length(file), device->db);
+
+	g_mapped_file_unref(file);
+
+	/* Don't let a corrupted cache be considered up to date */
+	if (ret)
+		unlink(filename);
+
+	return ret;
+}
+
 static void load_gatt_db(struct btd_device *device, const char *local,
 							const char *peer)
 {
@@ -3848,10 +4214,14 @@ static void load_gatt_db(struct btd_device *device, const char *local,
 
 	DBG("Restoring %s gatt database from file", peer);
 
+	if (!load_gatt_db_bin(device))
+		goto done;
+
+	/* Fallback to the text format which is then migrated */
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s", local, peer);
 
 	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	btd_storage_load(key_file, filename);
 	keys = g_key_file_get_keys(key_file, "Attributes", NULL, NULL);
 
 	if (!keys) {
@@ -3860,12 +4230,19 @@ static void load_gatt_db(struct btd_device *device, const char *local,
 		return;
 	}
 
-	if (load_gatt_db_impl(key_file, keys, device->db))
+	if (load_gatt_db_impl(key_file, keys, device->db)) {
 		warn("Unable to load gatt db from file for %s", peer);
+	} else {
+		g_key_file_remove_group(key_file, "Attributes", NULL);
+		btd_storage_store(key_file, filename);
+
+		store_gatt_db(device);
+	}
 
 	g_strfreev(keys);
 	g_key_file_free(key_file);
 
+done:
 	g_slist_free_full(device->primaries, g_free);
 	device->primaries = NULL;
 	gatt_db_foreach_service(device->db, NULL, add_primary,
@@ -3997,6 +4374,7 @@ static gboolean gatt_services_changed(gpointer user_data)
 {
 	struct btd_device *device = user_data;
 
+	device->gatt_db_changed = true;
 	store_gatt_db(device);
 
 	return FALSE;
@@ -4502,8 +4880,6 @@ static void device_remove_stored(struct btd_device *device)
 	char device_addr[18];
 	char filename[PATH_MAX];
 	GKeyFile *key_file;
-	char *data;
-	gsize length = 0;
 
 	if (device->bredr_state.bonded)
 		device_remove_bonding(device, BDADDR_BREDR);
@@ -4522,6 +4898,7 @@ static void device_remove_stored(struct btd_device *device)
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s",
 				btd_adapter_get_storage_dir(device->adapter),
 				device_addr);
+	btd_storage_forget(filename);
 	delete_folder_tree(filename);
 
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s",
@@ -4529,18 +4906,14 @@ static void device_remove_stored(struct btd_device *device)
 				device_addr);
 
 	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	btd_storage_load(key_file, filename);
 	g_key_file_remove_group(key_file, "ServiceRecords", NULL);
 	g_key_file_remove_group(key_file, "Attributes", NULL);
-
-	data = g_key_file_to_data(key_file, &length, NULL);
-	if (length > 0) {
-		create_file(filename, 0600);
-		g_file_set_contents(filename, data, length, NULL);
-	}
-
-	g_free(data);
+	btd_storage_store(key_file, filename);
 	g_key_file_free(key_file);
+
+	gatt_cache_filename(device, filename);
+	unlink(filename);
 }
 
 void device_remove(struct btd_device *device, gboolean remove_stored)
@@ -4592,6 +4965,14 @@ void device_remove(struct btd_device *device, gboolean remove_stored)
 			store_device_info_cb(device);
 	}
 
+	if (device->gatt_store_id > 0) {
+		g_source_remove(device->gatt_store_id);
+		device->gatt_store_id = 0;
+
+		if (!remove_stored)
+			store_gatt_db_cb(device);
+	}
+
 	if (remove_stored)
 		device_remove_stored(device);
 
@@ -4925,7 +5306,7 @@ static void update_bredr_services(struct browse_req *req, sdp_list_t *recs)
 								dstaddr);
 
 	sdp_key_file = g_key_file_new();
-	g_key_file_load_from_file(sdp_key_file, sdp_file, 0, NULL);
+	btd_storage_load(sdp_key_file, sdp_file);
 
 	snprintf(att_file, PATH_MAX, STORAGEDIR "/%s/%s/attributes", srcaddr,
 								dstaddr);
@@ -4983,13 +5364,7 @@ next:
 	}
 
 	if (sdp_key_file) {
-		data = g_key_file_to_data(sdp_key_file, &length, NULL);
-		if (length > 0) {
-			create_file(sdp_file, 0600);
-			g_file_set_contents(sdp_file, data, length, NULL);
-		}
-
-		g_free(data);
+		btd_storage_store(sdp_key_file, sdp_file);
 		g_key_file_free(sdp_key_file);
 	}
 
@@ -5274,7 +5649,14 @@ static void gatt_client_service_changed(uint16_t start_handle,
 							uint16_t end_handle,
 							void *user_data)
 {
+	struct btd_device *device = user_data;
+
 	DBG("start 0x%04x, end: 0x%04x", start_handle, end_handle);
+
+	/* The Database Hash has been read again by now, so store the cache
+	 * once more in case it was written with the hash it replaced.
+	 */
+	store_gatt_db(device);
 }
 
 static void gatt_debug(const char *str, void *user_data)
@@ -5884,8 +6266,6 @@ void device_store_svc_chng_ccc(struct btd_device *device, uint8_t bdaddr_type,
 	char device_addr[18];
 	GKeyFile *key_file;
 	uint16_t old_value;
-	gsize length = 0;
-	char *str;
 
 	ba2str(&device->bdaddr, device_addr);
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/info",
@@ -5893,7 +6273,7 @@ void device_store_svc_chng_ccc(struct btd_device *device, uint8_t bdaddr_type,
 				device_addr);
 
 	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	btd_storage_load(key_file, filename);
 
 	/* for bonded devices this is done on every connection so limit writes
 	 * to storage if no change needed
@@ -5916,11 +6296,7 @@ void device_store_svc_chng_ccc(struct btd_device *device, uint8_t bdaddr_type,
 									value);
 	}
 
-	create_file(filename, 0600);
-
-	str = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, str, length, NULL);
-	g_free(str);
+	btd_storage_store(key_file, filename);
 
 done:
 	g_key_file_free(key_file);
@@ -5938,7 +6314,7 @@ void device_load_svc_chng_ccc(struct btd_device *device, uint16_t *ccc_le,
 				device_addr);
 
 	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	btd_storage_load(key_file, filename);
 
 	if (!g_key_file_has_group(key_file, "ServiceChanged")) {
 		if (ccc_le)
@@ -6791,7 +7167,7 @@ static sdp_list_t *read_device_records(struct btd_device *device)
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s", local, peer);
 
 	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	btd_storage_load(key_file, filename);
 	keys = g_key_file_get_keys(key_file, "ServiceRecords", NULL, NULL);
 
 	for (handle = keys; handle && *handle; handle++) {
@@ -24,6 +24,7 @@
 #include "lib/bluetooth.h"
 #include "lib/hci.h"
 #include "lib/sdp.h"
+#include "lib/uuid.h"
 
 #include "src/shared/util.h"
 #include "uuid-helper.h"
@@ -367,6 +368,70 @@ void eir_parse(struct eir_data *eir, const uint8_t *eir_data, uint8_t eir_len)
 	}
 }
 
+bool eir_find_uuid(const uint8_t *eir_data, uint8_t eir_len,
+					eir_uuid_func_t func, void *user_data)
+{
+	uint16_t len = 0;
+
+	if (eir_data == NULL || func == NULL)
+		return false;
+
+	while (len < eir_len - 1) {
+		uint8_t field_len = eir_data[0];
+		const uint8_t *data;
+		uint8_t data_len, i;
+		uint128_t u128;
+		bt_uuid_t uuid;
+
+		/* Check for the end of EIR */
+		if (field_len == 0)
+			break;
+
+		len += field_len + 1;
+
+		/* Do not continue EIR Data parsing if got incorrect length */
+		if (len > eir_len)
+			break;
+
+		data = &eir_data[2];
+		data_len = field_len - 1;
+
+		switch (eir_data[1]) {
+		case EIR_UUID16_SOME:
+		case EIR_UUID16_ALL:
+			for (i = 0; i + 2 <= data_len; i += 2) {
+				bt_uuid16_create(&uuid, get_le16(data + i));
+				if (func(&uuid, user_data))
+					return true;
+			}
+			break;
+
+		case EIR_UUID32_SOME:
+		case EIR_UUID32_ALL:
+			for (i = 0; i + 4 <= data_len; i += 4) {
+				bt_uuid32_create(&uuid, get_le32(data + i));
+				if (func(&uuid, user_data))
+					return true;
+			}
+			break;
+
+		case EIR_UUID128_SOME:
+		case EIR_UUID128_ALL:
+			for (i = 0; i + 16 <= data_len; i += 16) {
+				bswap_128(data + i, &u128);
+				bt_uuid128_create(&uuid, u128);
+				if (func(&uuid, user_data))
+					return true;
+			}
+			break;
+		}
+
+		eir_data += field_len + 1;
+	}
+
+	return false;
+}
+
 int eir_parse_oob(struct eir_data *eir, uint8_t *eir_data, uint16_t eir_len)
 {
 
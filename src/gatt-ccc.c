@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "src/shared/util.h"
+#include "src/shared/queue.h"
+#include "src/gatt-ccc.h"
+
+/* Subscribers of a single CCC handle */
+struct ccc_subs {
+	uint16_t handle;
+	struct queue *subs;
+};
+
+struct gatt_ccc_index {
+	struct queue *handles;
+};
+
+static bool match_handle(const void *a, const void *b)
+{
+	const struct ccc_subs *subs = a;
+	uint16_t handle = PTR_TO_UINT(b);
+
+	return subs->handle == handle;
+}
+
+static bool match_ptr(const void *a, const void *b)
+{
+	return a == b;
+}
+
+static void ccc_subs_free(void *data)
+{
+	struct ccc_subs *subs = data;
+
+	queue_destroy(subs->subs, NULL);
+	free(subs);
+}
+
+static struct ccc_subs *find_subs(struct gatt_ccc_index *index,
+							uint16_t handle)
+{
+	return queue_find(index->handles, match_handle, UINT_TO_PTR(handle));
+}
+
+struct gatt_ccc_index *gatt_ccc_index_new(void)
+{
+	struct gatt_ccc_index *index;
+
+	index = new0(struct gatt_ccc_index, 1);
+	index->handles = queue_new();
+
+	return index;
+}
+
+void gatt_ccc_index_free(struct gatt_ccc_index *index)
+{
+	if (!index)
+		return;
+
+	queue_destroy(index->handles, ccc_subs_free);
+	free(index);
+}
+
+/*
+ * Add or remove a subscriber of a CCC handle. Returns true if the index
+ * changed, setting the current state again is a no-op.
+ */
+bool gatt_ccc_index_set(struct gatt_ccc_index *index, uint16_t handle,
+						void *sub, bool subscribed)
+{
+	struct ccc_subs *subs;
+
+	if (!index || !sub)
+		return false;
+
+	subs = find_subs(index, handle);
+
+	if (!subscribed) {
+		if (!subs || !queue_remove(subs->subs, sub))
+			return false;
+
+		if (queue_isempty(subs->subs)) {
+			queue_remove(index->handles, subs);
+			ccc_subs_free(subs);
+		}
+
+		return true;
+	}
+
+	if (!subs) {
+		subs = new0(struct ccc_subs, 1);
+		subs->handle = handle;
+		subs->subs = queue_new();
+		queue_push_tail(index->handles, subs);
+	} else if (queue_find(subs->subs, match_ptr, sub))
+		return false;
+
+	queue_push_tail(subs->subs, sub);
+
+	return true;
+}
+
+unsigned int gatt_ccc_index_count(struct gatt_ccc_index *index,
+							uint16_t handle)
+{
+	struct ccc_subs *subs;
+
+	if (!index)
+		return 0;
+
+	subs = find_subs(index, handle);
+
+	return subs ? queue_length(subs->subs) : 0;
+}
+
+void gatt_ccc_index_foreach(struct gatt_ccc_index *index, uint16_t handle,
+					gatt_ccc_func_t func, void *user_data)
+{
+	struct ccc_subs *subs;
+
+	if (!index || !func)
+		return;
+
+	subs = find_subs(index, handle);
+	if (subs)
+		queue_foreach(subs->subs, func, user_data);
+}
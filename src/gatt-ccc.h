@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ */
+
+struct gatt_ccc_index;
+
+typedef void (*gatt_ccc_func_t)(void *sub, void *user_data);
+
+struct gatt_ccc_index *gatt_ccc_index_new(void);
+void gatt_ccc_index_free(struct gatt_ccc_index *index);
+
+bool gatt_ccc_index_set(struct gatt_ccc_index *index, uint16_t handle,
+						void *sub, bool subscribed);
+unsigned int gatt_ccc_index_count(struct gatt_ccc_index *index,
+							uint16_t handle);
+void gatt_ccc_index_foreach(struct gatt_ccc_index *index, uint16_t handle,
+					gatt_ccc_func_t func, void *user_data);
@@ -15,9 +15,11 @@
 #define _GNU_SOURCE
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/socket.h>
 
 #include <dbus/dbus.h>
 
@@ -35,9 +37,11 @@
 #include "device.h"
 #include "src/shared/io.h"
 #include "src/shared/queue.h"
+#include "src/shared/timeout.h"
 #include "src/shared/att.h"
 #include "src/shared/gatt-db.h"
 #include "src/shared/gatt-client.h"
+#include "src/shared/notify-ring.h"
 #include "src/shared/util.h"
 #include "gatt-client.h"
 #include "dbus-common.h"
@@ -50,6 +54,9 @@
 #define GATT_CHARACTERISTIC_IFACE	"org.bluez.GattCharacteristic1"
 #define GATT_DESCRIPTOR_IFACE		"org.bluez.GattDescriptor1"
 
+#define NOTIFY_INTERVAL_DEFAULT		100	/* ms */
+#define NOTIFY_BATCH_MAX		64
+
 struct btd_gatt_client {
 	struct btd_device *device;
 	uint8_t features;
@@ -90,6 +97,10 @@ struct sock_io {
 	struct io *io;
 	void (*destroy)(void *data);
 	void *data;
+	uint32_t ring_size;
+	struct notify_ring *ring;
+	guint ring_id;
+	unsigned int dropped;
 };
 
 struct characteristic {
@@ -115,6 +126,30 @@ struct characteristic {
 
 	bool notifying;
 	struct queue *notify_clients;
+
+	uint8_t notify_policy;
+	uint16_t notify_interval;
+	unsigned int notify_timer;
+	bool notify_pending;
+	struct queue *notify_batch;	/* Values received in this interval */
+	struct queue *notify_values;	/* Values emitted with NotifyValues */
+};
+
+enum {
+	NOTIFY_POLICY_IMMEDIATE,
+	NOTIFY_POLICY_LATEST,
+	NOTIFY_POLICY_BATCH,
+};
+
+static const char *notify_policy_str[] = {
+	[NOTIFY_POLICY_IMMEDIATE] = "immediate",
+	[NOTIFY_POLICY_LATEST] = "latest",
+	[NOTIFY_POLICY_BATCH] = "batch",
+};
+
+struct notify_value {
+	uint16_t len;
+	uint8_t data[];
 };
 
 struct descriptor {
@@ -907,6 +942,266 @@ static void write_characteristic_cb(struct gatt_db_attribute *attr, int err,
 
 }
 
+static void store_characteristic_cb(struct gatt_db_attribute *attr, int err,
+								void *user_data)
+{
+	struct characteristic *chrc = user_data;
+
+	if (err)
+		error("Failed to store value of %s", chrc->path);
+}
+
+static void notify_batch_push(struct characteristic *chrc,
+					const uint8_t *value, uint16_t length)
+{
+	struct notify_value *val;
+
+	if (!chrc->notify_batch)
+		chrc->notify_batch = queue_new();
+
+	/* Drop the oldest value if the client cannot keep up */
+	if (queue_length(chrc->notify_batch) >= NOTIFY_BATCH_MAX)
+		free(queue_pop_head(chrc->notify_batch));
+
+	val = malloc(sizeof(*val) + length);
+	if (!val)
+		return;
+
+	val->len = length;
+	if (length)
+		memcpy(val->data, value, length);
+
+	queue_push_tail(chrc->notify_batch, val);
+}
+
+static void notify_flush(struct characteristic *chrc)
+{
+	chrc->notify_pending = false;
+
+	/*
+	 * Both properties are emitted in a single PropertiesChanged signal
+	 * since only the last one is flushed.
+	 */
+	if (chrc->notify_policy == NOTIFY_POLICY_BATCH) {
+		queue_destroy(chrc->notify_values, free);
+		chrc->notify_values = chrc->notify_batch;
+		chrc->notify_batch = NULL;
+
+		g_dbus_emit_property_changed(btd_get_dbus_connection(),
+					chrc->path, GATT_CHARACTERISTIC_IFACE,
+					"NotifyValues");
+	}
+
+	g_dbus_emit_property_changed_full(btd_get_dbus_connection(),
+				chrc->path, GATT_CHARACTERISTIC_IFACE,
+				"Value", G_DBUS_PROPERTY_CHANGED_FLAG_FLUSH);
+}
+
+static bool notify_timeout(void *user_data)
+{
+	struct characteristic *chrc = user_data;
+
+	/* Nothing arrived during the last interval, stop rate limiting */
+	if (!chrc->notify_pending) {
+		chrc->notify_timer = 0;
+		return false;
+	}
+
+	notify_flush(chrc);
+
+	return true;
+}
+
+static void notify_throttle(struct characteristic *chrc,
+					const uint8_t *value, uint16_t length)
+{
+	gatt_db_attribute_write(chrc->attr, 0, value, length, 0, NULL,
+					store_characteristic_cb, chrc);
+
+	if (chrc->notify_policy == NOTIFY_POLICY_BATCH)
+		notify_batch_push(chrc, value, length);
+
+	/*
+	 * The first value of a burst is emitted right away, the following
+	 * ones are coalesced until the interval expires.
+	 */
+	if (chrc->notify_timer) {
+		chrc->notify_pending = true;
+		return;
+	}
+
+	notify_flush(chrc);
+
+	chrc->notify_timer = timeout_add(chrc->notify_interval, notify_timeout,
+								chrc, NULL);
+}
+
+static void notify_policy_reset(struct characteristic *chrc)
+{
+	if (chrc->notify_timer) {
+		timeout_remove(chrc->notify_timer);
+		chrc->notify_timer = 0;
+	}
+
+	if (chrc->notify_pending)
+		notify_flush(chrc);
+
+	queue_destroy(chrc->notify_batch, free);
+	chrc->notify_batch = NULL;
+}
+
+static gboolean characteristic_get_notify_policy(
+					const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *data)
+{
+	struct characteristic *chrc = data;
+	const char *str = notify_policy_str[chrc->notify_policy];
+
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &str);
+
+	return TRUE;
+}
+
+static void characteristic_set_notify_policy(
+					const GDBusPropertyTable *property,
+					DBusMessageIter *value,
+					GDBusPendingPropertySet id, void *data)
+{
+	struct characteristic *chrc = data;
+	const char *str;
+	uint8_t policy;
+
+	if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_STRING)
+		goto invalid;
+
+	dbus_message_iter_get_basic(value, &str);
+
+	for (policy = 0; policy < NELEM(notify_policy_str); policy++) {
+		if (!strcmp(str, notify_policy_str[policy]))
+			break;
+	}
+
+	if (policy == NELEM(notify_policy_str))
+		goto invalid;
+
+	g_dbus_pending_property_success(id);
+
+	if (policy == chrc->notify_policy)
+		return;
+
+	notify_policy_reset(chrc);
+
+	if (policy != NOTIFY_POLICY_BATCH) {
+		queue_destroy(chrc->notify_values, free);
+		chrc->notify_values = NULL;
+	}
+
+	chrc->notify_policy = policy;
+
+	g_dbus_emit_property_changed(btd_get_dbus_connection(), chrc->path,
+					GATT_CHARACTERISTIC_IFACE,
+					"NotifyPolicy");
+	return;
+
+invalid:
+	g_dbus_pending_property_error(id, ERROR_INTERFACE ".InvalidArguments",
+					"Invalid arguments in method call");
+}
+
+static gboolean
+characteristic_notify_policy_exists(const GDBusPropertyTable *property,
+								void *data)
+{
+	struct characteristic *chrc = data;
+
+	return !!(chrc->props & (BT_GATT_CHRC_PROP_NOTIFY |
+					BT_GATT_CHRC_PROP_INDICATE));
+}
+
+static gboolean characteristic_get_notify_interval(
+					const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *data)
+{
+	struct characteristic *chrc = data;
+
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT16,
+						&chrc->notify_interval);
+
+	return TRUE;
+}
+
+static void characteristic_set_notify_interval(
+					const GDBusPropertyTable *property,
+					DBusMessageIter *value,
+					GDBusPendingPropertySet id, void *data)
+{
+	struct characteristic *chrc = data;
+	uint16_t interval;
+
+	if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_UINT16) {
+		g_dbus_pending_property_error(id,
+					ERROR_INTERFACE ".InvalidArguments",
+					"Invalid arguments in method call");
+		return;
+	}
+
+	dbus_message_iter_get_basic(value, &interval);
+	if (!interval) {
+		g_dbus_pending_property_error(id,
+					ERROR_INTERFACE ".InvalidArguments",
+					"Invalid arguments in method call");
+		return;
+	}
+
+	g_dbus_pending_property_success(id);
+
+	if (interval == chrc->notify_interval)
+		return;
+
+	/* The new interval applies starting with the next burst */
+	chrc->notify_interval = interval;
+
+	g_dbus_emit_property_changed(btd_get_dbus_connection(), chrc->path,
+					GATT_CHARACTERISTIC_IFACE,
+					"NotifyInterval");
+}
+
+static void append_notify_value(void *data, void *user_data)
+{
+	struct notify_value *val = data;
+	DBusMessageIter *array = user_data;
+	DBusMessageIter iter;
+	const uint8_t *ptr = val->data;
+
+	dbus_message_iter_open_container(array, DBUS_TYPE_ARRAY, "y", &iter);
+	dbus_message_iter_append_fixed_array(&iter, DBUS_TYPE_BYTE, &ptr,
+								val->len);
+	dbus_message_iter_close_container(array, &iter);
+}
+
+static gboolean characteristic_get_notify_values(
+					const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *data)
+{
+	struct characteristic *chrc = data;
+	DBusMessageIter array;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "ay", &array);
+	queue_foreach(chrc->notify_values, append_notify_value, &array);
+	dbus_message_iter_close_container(iter, &array);
+
+	return TRUE;
+}
+
+static gboolean
+characteristic_notify_values_exists(const GDBusPropertyTable *property,
+								void *data)
+{
+	struct characteristic *chrc = data;
+
+	return chrc->notify_policy == NOTIFY_POLICY_BATCH;
+}
+
 static void chrc_read_cb(bool success, uint8_t att_ecode, const uint8_t *value,
 					uint16_t length, void *user_data)
 {
@@ -1120,6 +1415,17 @@ static void sock_io_destroy(struct sock_io *io)
 	if (io->destroy)
 		io->destroy(io->data);
 
+	if (io->ring_id)
+		g_source_remove(io->ring_id);
+
+	if (io->ring)
+		DBG("ring %p dropped %" PRIu64, io->ring,
+					notify_ring_get_dropped(io->ring));
+	else if (io->dropped)
+		DBG("io %p dropped %u", io->io, io->dropped);
+
+	notify_ring_free(io->ring);
+
 	if (io->msg)
 		dbus_message_unref(io->msg);
 
@@ -1159,6 +1465,55 @@ static bool sock_hup(struct io *io, void *user_data)
 	return false;
 }
 
+/* Pass the ring memfd and eventfd to the client over the socket, this is
+ * queued before the socket itself is handed out.
+ */
+static int send_ring(struct sock_io *sock, int fd)
+{
+	uint8_t version = NOTIFY_RING_VERSION;
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int fds[2];
+
+	sock->ring = notify_ring_new(sock->ring_size);
+	if (!sock->ring)
+		return -errno;
+
+	fds[0] = notify_ring_get_fd(sock->ring);
+	fds[1] = notify_ring_get_event_fd(sock->ring);
+
+	iov.iov_base = &version;
+	iov.iov_len = sizeof(version);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+		int err = -errno;
+
+		notify_ring_free(sock->ring);
+		sock->ring = NULL;
+		return err;
+	}
+
+	DBG("ring %p size %zu", sock->ring,
+					notify_ring_capacity(sock->ring));
+
+	return 0;
+}
+
 static DBusMessage *create_sock(struct characteristic *chrc, DBusMessage *msg)
 {
 	struct bt_gatt_client *gatt = chrc->service->client->gatt;
@@ -1192,6 +1547,10 @@ static DBusMessage *create_sock(struct characteristic *chrc, DBusMessage *msg)
 	if (!io_set_disconnect_handler(io, sock_hup, chrc, NULL))
 		goto fail;
 
+	if (!dir && chrc->notify_io->ring_size &&
+				send_ring(chrc->notify_io, fds[!dir]) < 0)
+		goto fail;
+
 	mtu = bt_gatt_client_get_mtu(gatt);
 
 	reply = g_dbus_create_reply(msg, DBUS_TYPE_UNIX_FD, &fds[dir],
@@ -1406,6 +1765,12 @@ static void notify_cb(uint16_t value_handle, const uint8_t *value,
 	 * applications.
 	 */
 	gatt_db_attribute_reset(chrc->attr);
+
+	if (chrc->notify_policy != NOTIFY_POLICY_IMMEDIATE) {
+		notify_throttle(chrc, value, length);
+		return;
+	}
+
 	gatt_db_attribute_write(chrc->attr, 0, value, length, 0, NULL,
 						write_characteristic_cb, chrc);
 }
@@ -1449,6 +1814,31 @@ static void register_notify_cb(uint16_t att_ecode, void *user_data)
 	create_notify_reply(op, true, 0);
 }
 
+static gboolean notify_ring_kick_cb(gpointer user_data)
+{
+	struct sock_io *sock = user_data;
+
+	sock->ring_id = 0;
+	notify_ring_kick(sock->ring);
+
+	return FALSE;
+}
+
+static void notify_ring_cb(struct sock_io *sock, const uint8_t *value,
+							uint16_t length)
+{
+	/* Dropped records are accounted in the ring itself */
+	notify_ring_push(sock->ring, value, length);
+
+	/* Wake up the client once per batch of notifications, unless the
+	 * ring is filling up.
+	 */
+	if (notify_ring_len(sock->ring) > notify_ring_capacity(sock->ring) / 2)
+		notify_ring_kick(sock->ring);
+	else if (!sock->ring_id)
+		sock->ring_id = g_idle_add(notify_ring_kick_cb, sock);
+}
+
 static void notify_io_cb(uint16_t value_handle, const uint8_t *value,
 					uint16_t length, void *user_data)
 {
@@ -1462,6 +1852,11 @@ static void notify_io_cb(uint16_t value_handle, const uint8_t *value,
 	if (!chrc->notify_io || !chrc->notify_io->io)
 		return;
 
+	if (chrc->notify_io->ring) {
+		notify_ring_cb(chrc->notify_io, value, length);
+		return;
+	}
+
 	iov.iov_base = (void *) value;
 	iov.iov_len = length;
 
@@ -1470,7 +1865,13 @@ static void notify_io_cb(uint16_t value_handle, const uint8_t *value,
 	msg.msg_iovlen = 1;
 
 	err = sendmsg(io_get_fd(chrc->notify_io->io), &msg, MSG_NOSIGNAL);
-	if (err < 0)
+	if (err >= 0)
+		return;
+
+	/* Count notifications the client was not fast enough to read */
+	if (errno == EAGAIN || errno == ENOBUFS)
+		chrc->notify_io->dropped++;
+	else
 		error("sendmsg: %s", strerror(errno));
 }
 
@@ -1505,6 +1906,39 @@ static void notify_io_destroy(void *data)
 		notify_client_unref(client);
 }
 
+static int parse_acquire_options(DBusMessageIter *iter, uint32_t *ring)
+{
+	DBusMessageIter dict;
+
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY)
+		return -EINVAL;
+
+	dbus_message_iter_recurse(iter, &dict);
+
+	while (dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY) {
+		const char *key;
+		DBusMessageIter value, entry;
+		int var;
+
+		dbus_message_iter_recurse(&dict, &entry);
+		dbus_message_iter_get_basic(&entry, &key);
+
+		dbus_message_iter_next(&entry);
+		dbus_message_iter_recurse(&entry, &value);
+
+		var = dbus_message_iter_get_arg_type(&value);
+		if (strcasecmp(key, "ring") == 0) {
+			if (var != DBUS_TYPE_UINT32)
+				return -EINVAL;
+			dbus_message_iter_get_basic(&value, ring);
+		}
+
+		dbus_message_iter_next(&dict);
+	}
+
+	return 0;
+}
+
 static DBusMessage *characteristic_acquire_notify(DBusConnection *conn,
 					DBusMessage *msg, void *user_data)
 {
@@ -1512,10 +1946,17 @@ static DBusMessage *characteristic_acquire_notify(DBusConnection *conn,
 	struct bt_gatt_client *gatt = chrc->service->client->gatt;
 	const char *sender = dbus_message_get_sender(msg);
 	struct notify_client *client;
+	DBusMessageIter iter;
+	uint32_t ring = 0;
 
 	if (!gatt)
 		return btd_error_failed(msg, "Not connected");
 
+	dbus_message_iter_init(msg, &iter);
+
+	if (parse_acquire_options(&iter, &ring))
+		return btd_error_invalid_args(msg);
+
 	if (chrc->notify_io)
 		return btd_error_not_permitted(msg, "Notify acquired");
 
@@ -1546,6 +1987,7 @@ static DBusMessage *characteristic_acquire_notify(DBusConnection *conn,
 	chrc->notify_io->data = client;
 	chrc->notify_io->msg = dbus_message_ref(msg);
 	chrc->notify_io->destroy = notify_io_destroy;
+	chrc->notify_io->ring_size = ring;
 
 	return NULL;
 }
@@ -1667,6 +2109,17 @@ static const GDBusPropertyTable characteristic_properties[] = {
 	{ "NotifyAcquired", "b", characteristic_get_notify_acquired, NULL,
 				characteristic_notify_acquired_exists },
 	{ "MTU", "q", characteristic_get_mtu, NULL, NULL },
+	{ "NotifyPolicy", "s", characteristic_get_notify_policy,
+				characteristic_set_notify_policy,
+				characteristic_notify_policy_exists,
+				G_DBUS_PROPERTY_FLAG_EXPERIMENTAL },
+	{ "NotifyInterval", "q", characteristic_get_notify_interval,
+				characteristic_set_notify_interval,
+				characteristic_notify_policy_exists,
+				G_DBUS_PROPERTY_FLAG_EXPERIMENTAL },
+	{ "NotifyValues", "aay", characteristic_get_notify_values, NULL,
+				characteristic_notify_values_exists,
+				G_DBUS_PROPERTY_FLAG_EXPERIMENTAL },
 	{ }
 };
 
@@ -1726,6 +2179,10 @@ static void characteristic_free(void *data)
 
 	queue_destroy(chrc->notify_clients, remove_client);
 
+	timeout_remove(chrc->notify_timer);
+	queue_destroy(chrc->notify_batch, free);
+	queue_destroy(chrc->notify_values, free);
+
 	att = bt_gatt_client_get_att(gatt);
 	if (att)
 		bt_att_unregister_exchange(att, chrc->exchange_id);
@@ -1754,6 +2211,7 @@ static struct characteristic *characteristic_create(
 	chrc = new0(struct characteristic, 1);
 	chrc->descs = queue_new();
 	chrc->notify_clients = queue_new();
+	chrc->notify_interval = NOTIFY_INTERVAL_DEFAULT;
 	chrc->service = service;
 
 	gatt_db_attribute_get_char_data(attr, &chrc->handle,
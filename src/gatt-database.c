@@ -35,6 +35,7 @@
 #include "adapter.h"
 #include "device.h"
 #include "gatt-database.h"
+#include "gatt-ccc.h"
 #include "dbus-common.h"
 #include "profile.h"
 #include "service.h"
@@ -69,6 +70,7 @@ struct btd_gatt_database {
 	GIOChannel *bredr_io;
 	struct queue *records;
 	struct queue *device_states;
+	struct gatt_ccc_index *ccc_subs;
 	struct queue *ccc_callbacks;
 	struct gatt_db_attribute *svc_chngd;
 	struct gatt_db_attribute *svc_chngd_ccc;
@@ -174,6 +176,7 @@ struct device_state {
 	bool out_of_sync;
 	struct queue *ccc_states;
 	struct notify *pending;
+	struct bt_gatt_server *server;
 };
 
 typedef uint8_t (*btd_gatt_database_ccc_write_t) (struct pending_op *op,
@@ -181,6 +184,7 @@ typedef uint8_t (*btd_gatt_database_ccc_write_t) (struct pending_op *op,
 typedef void (*btd_gatt_database_destroy_t) (void *data);
 
 struct ccc_state {
+	struct device_state *state;
 	uint16_t handle;
 	uint16_t value;
 };
@@ -265,6 +269,45 @@ static struct ccc_state *find_ccc_state(struct device_state *dev_state,
 							UINT_TO_PTR(handle));
 }
 
+static void ccc_state_set(struct ccc_state *ccc, uint16_t value)
+{
+	gatt_ccc_index_set(ccc->state->db->ccc_subs, ccc->handle, ccc, !!value);
+	ccc->value = value;
+}
+
+static struct ccc_state *ccc_state_new(struct device_state *dev_state,
+							uint16_t handle)
+{
+	struct ccc_state *ccc;
+
+	ccc = new0(struct ccc_state, 1);
+	ccc->state = dev_state;
+	ccc->handle = handle;
+	queue_push_tail(dev_state->ccc_states, ccc);
+
+	return ccc;
+}
+
+static void ccc_state_free(void *data)
+{
+	struct ccc_state *ccc = data;
+
+	if (ccc->value)
+		gatt_ccc_index_set(ccc->state->db->ccc_subs, ccc->handle, ccc,
+									false);
+
+	free(ccc);
+}
+
+static void device_state_set_server(struct device_state *state,
+					struct bt_gatt_server *server)
+{
+	if (state->server)
+		bt_gatt_server_unref(state->server);
+
+	state->server = server ? bt_gatt_server_ref(server) : NULL;
+}
+
 static struct device_state *device_state_create(struct btd_gatt_database *db,
 							const bdaddr_t *bdaddr,
 							uint8_t bdaddr_type)
@@ -284,7 +327,8 @@ static void device_state_free(void *data)
 {
 	struct device_state *state = data;
 
-	queue_destroy(state->ccc_states, free);
+	queue_destroy(state->ccc_states, ccc_state_free);
+	device_state_set_server(state, NULL);
 
 	if (state->pending) {
 		free(state->pending->value);
@@ -321,6 +365,7 @@ static void att_disconnected(int err, void *user_data)
 
 	state->disc_id = 0;
 	state->out_of_sync = false;
+	device_state_set_server(state, NULL);
 
 	device = btd_adapter_find_device(state->db->adapter, &state->bdaddr,
 							state->bdaddr_type);
@@ -422,11 +467,7 @@ static struct ccc_state *get_ccc_state(struct btd_gatt_database *database,
 	if (ccc)
 		return ccc;
 
-	ccc = new0(struct ccc_state, 1);
-	ccc->handle = handle;
-	queue_push_tail(dev_state->ccc_states, ccc);
-
-	return ccc;
+	return ccc_state_new(dev_state, handle);
 }
 
 static void cancel_pending_read(void *data)
@@ -599,10 +640,12 @@ static void gatt_database_free(void *data)
 
 	queue_destroy(database->records, gatt_record_free);
 	queue_destroy(database->device_states, device_state_free);
+	gatt_ccc_index_free(database->ccc_subs);
 	queue_destroy(database->apps, app_free);
 	queue_destroy(database->profiles, profile_free);
 	queue_destroy(database->ccc_callbacks, ccc_cb_free);
 	database->device_states = NULL;
+	database->ccc_subs = NULL;
 	database->ccc_callbacks = NULL;
 
 	gatt_db_unref(database->db);
@@ -1049,7 +1092,7 @@ static void gatt_ccc_write_cb(struct gatt_db_attribute *attrib,
 	}
 
 	if (!ecode)
-		ccc->value = val;
+		ccc_state_set(ccc, val);
 
 done:
 	gatt_db_attribute_write_result(attrib, id, ecode);
@@ -1363,25 +1406,16 @@ static void state_set_pending(struct device_state *state, struct notify *notify)
 	memcpy(state->pending->value, notify->value, notify->len);
 }
 
-static void send_notification_to_device(void *data, void *user_data)
+static void send_notification_to_state(struct device_state *device_state,
+						struct ccc_state *ccc,
+						struct notify *notify)
 {
-	struct device_state *device_state = data;
-	struct notify *notify = user_data;
-	struct ccc_state *ccc;
 	struct btd_device *device;
 	struct bt_gatt_server *server;
 
-	if (notify->conf == service_changed_conf) {
-		if (device_state->cli_feat[0] &
-				BT_GATT_CHRC_CLI_FEAT_ROBUST_CACHING) {
-			device_state->change_aware = false;
-			notify->user_data = device_state;
-		}
-	}
-
-	ccc = find_ccc_state(device_state, notify->ccc_handle);
-	if (!ccc || !(ccc->value & 0x0003))
-		return;
+	server = device_state->server;
+	if (server)
+		goto send;
 
 	device = btd_adapter_find_device(notify->database->adapter,
 						&device_state->bdaddr,
@@ -1403,15 +1437,21 @@ static void send_notification_to_device(void *data, void *user_data)
 		return;
 	}
 
+	/* Cache the server until the bearer disconnects */
+	if (device_state->disc_id)
+		device_state_set_server(device_state, server);
+
+send:
 	/*
 	 * TODO: If the device is not connected but bonded, send the
 	 * notification/indication when it becomes connected.
 	 */
 	if (!(ccc->value & 0x0002)) {
 		DBG("GATT server sending notification");
-		bt_gatt_server_send_notification(server,
-					notify->handle, notify->value,
-					notify->len, device_state->cli_feat[0] &
+
+		bt_gatt_server_send_notification(server, notify->handle,
+					notify->value, notify->len,
+					device_state->cli_feat[0] &
 					BT_GATT_CHRC_CLI_FEAT_NFY_MULTI);
 		return;
 	}
@@ -1432,6 +1472,37 @@ remove:
 	}
 }
 
+static void send_notification_to_device(void *data, void *user_data)
+{
+	struct device_state *device_state = data;
+	struct notify *notify = user_data;
+	struct ccc_state *ccc;
+
+	if (notify->conf == service_changed_conf) {
+		if (device_state->cli_feat[0] &
+				BT_GATT_CHRC_CLI_FEAT_ROBUST_CACHING) {
+			device_state->change_aware = false;
+			notify->user_data = device_state;
+		}
+	}
+
+	ccc = find_ccc_state(device_state, notify->ccc_handle);
+	if (!ccc || !(ccc->value & 0x0003))
+		return;
+
+	send_notification_to_state(device_state, ccc, notify);
+}
+
+static void send_notification_to_subscriber(void *data, void *user_data)
+{
+	struct ccc_state *ccc = data;
+
+	if (!(ccc->value & 0x0003))
+		return;
+
+	send_notification_to_state(ccc->state, ccc, user_data);
+}
+
 static void send_notification_to_devices(struct btd_gatt_database *database,
 					uint16_t handle, uint8_t *value,
 					uint16_t len, uint16_t ccc_handle,
@@ -1450,8 +1521,16 @@ static void send_notification_to_devices(struct btd_gatt_database *database,
 	notify.conf = conf;
 	notify.user_data = user_data;
 
-	queue_foreach(database->device_states, send_notification_to_device,
-								&notify);
+	/* Service Changed also updates the state of devices that have not
+	 * subscribed, all other values only go to the subscribers.
+	 */
+	if (conf == service_changed_conf)
+		queue_foreach(database->device_states,
+					send_notification_to_device, &notify);
+	else
+		gatt_ccc_index_foreach(database->ccc_subs, ccc_handle,
+					send_notification_to_subscriber,
+					&notify);
 }
 
 static void send_service_changed(struct btd_gatt_database *database,
@@ -1510,7 +1589,8 @@ static void remove_device_ccc(void *data, void *user_data)
 {
 	struct device_state *state = data;
 
-	queue_remove_all(state->ccc_states, ccc_match_service, user_data, free);
+	queue_remove_all(state->ccc_states, ccc_match_service, user_data,
+							ccc_state_free);
 }
 
 static bool match_gatt_record(const void *data, const void *user_data)
@@ -3688,6 +3768,7 @@ struct btd_gatt_database *btd_gatt_database_new(struct btd_adapter *adapter)
 	database->db = gatt_db_new();
 	database->records = queue_new();
 	database->device_states = queue_new();
+	database->ccc_subs = gatt_ccc_index_new();
 	database->apps = queue_new();
 	database->profiles = queue_new();
 	database->ccc_callbacks = queue_new();
@@ -3840,10 +3921,9 @@ static void restore_ccc(struct btd_gatt_database *database,
 	dev_state = device_state_create(database, addr, addr_type);
 	queue_push_tail(database->device_states, dev_state);
 
-	ccc = new0(struct ccc_state, 1);
-	ccc->handle = gatt_db_attribute_get_handle(database->svc_chngd_ccc);
-	ccc->value = value;
-	queue_push_tail(dev_state->ccc_states, ccc);
+	ccc = ccc_state_new(dev_state,
+			gatt_db_attribute_get_handle(database->svc_chngd_ccc));
+	ccc_state_set(ccc, value);
 }
 
 static void restore_state(struct btd_device *device, void *data)
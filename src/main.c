@@ -52,6 +52,7 @@
 #include "dbus-common.h"
 #include "agent.h"
 #include "profile.h"
+#include "storage.h"
 
 #define BLUEZ_NAME "org.bluez"
 
@@ -81,6 +82,7 @@ static const char *supported_options[] = {
 	"Privacy",
 	"JustWorksRepairing",
 	"TemporaryTimeout",
+	"DeviceStorage",
 	"Experimental",
 	NULL
 };
@@ -244,6 +246,18 @@ static bt_gatt_cache_t parse_gatt_cache(const char *cache)
 	}
 }
 
+static enum device_storage_t parse_device_storage(const char *storage)
+{
+	if (!strcmp(storage, "files")) {
+		return DEVICE_STORAGE_FILES;
+	} else if (!strcmp(storage, "database")) {
+		return DEVICE_STORAGE_DATABASE;
+	} else {
+		DBG("Invalid value for DeviceStorage=%s", storage);
+		return DEVICE_STORAGE_FILES;
+	}
+}
+
 static enum jw_repairing_t parse_jw_repairing(const char *jw_repairing)
 {
 	if (!strcmp(jw_repairing, "never")) {
@@ -690,6 +704,16 @@ static void parse_config(GKeyFile *config)
 		g_free(str);
 	}
 
+	str = g_key_file_get_string(config, "General", "DeviceStorage", &err);
+	if (err) {
+		DBG("%s", err->message);
+		g_clear_error(&err);
+	} else {
+		DBG("device_storage=%s", str);
+		btd_opts.device_storage = parse_device_storage(str);
+		g_free(str);
+	}
+
 	val = g_key_file_get_integer(config, "General",
 						"TemporaryTimeout", &err);
 	if (err) {
@@ -1219,6 +1243,8 @@ int main(int argc, char *argv[])
 
 	adapter_cleanup();
 
+	btd_storage_cleanup();
+
 	rfkill_exit();
 
 	if (btd_opts.mode != BT_MODE_LE)
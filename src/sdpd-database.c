@@ -17,6 +17,7 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "lib/bluetooth.h"
 #include "lib/sdp.h"
@@ -33,6 +34,30 @@ typedef struct {
 	bdaddr_t device;
 } sdp_access_t;
 
+/*
+ * Search index, one entry per UUID of each record pattern sorted by UUID
+ * and then by record handle. It is rebuilt on the first search after the
+ * repository changed since record patterns keep changing after a record
+ * got added.
+ */
+typedef struct {
+	uint128_t uuid;
+	uint32_t handle;
+	sdp_record_t *rec;
+} sdp_index_t;
+
+static sdp_index_t *uuid_index;
+static unsigned int uuid_index_len;
+static bool uuid_index_valid;
+
+/* Serialized records, kept until the repository changes */
+typedef struct {
+	sdp_record_t *rec;
+	sdp_buf_t pdu;
+} sdp_pdu_cache_t;
+
+static sdp_list_t *pdu_cache;
+
 /*
  * Ordering function called when inserting a service record.
  * The service repository is a linked list in sorted order
@@ -69,11 +94,37 @@ static void access_free(void *p)
 	free(p);
 }
 
+static void pdu_cache_free(void *p)
+{
+	sdp_pdu_cache_t *cache = p;
+
+	free(cache->pdu.data);
+	free(cache);
+}
+
+/*
+ * Drop the search index and the serialized records, needs to be called
+ * whenever a record in the repository is changed.
+ */
+void sdp_svcdb_changed(void)
+{
+	uuid_index_valid = false;
+
+	sdp_list_free(pdu_cache, pdu_cache_free);
+	pdu_cache = NULL;
+}
+
 /*
  * Reset the service repository by deleting its contents
  */
 void sdp_svcdb_reset(void)
 {
+	sdp_svcdb_changed();
+
+	free(uuid_index);
+	uuid_index = NULL;
+	uuid_index_len = 0;
+
 	sdp_list_free(service_db, (sdp_free_func_t) sdp_record_free);
 	service_db = NULL;
 
@@ -167,6 +218,7 @@ void sdp_record_add(const bdaddr_t *device, sdp_record_t *rec)
 	SDPDBG("with handle : 0x%x", rec->handle);
 
 	service_db = sdp_list_insert_sorted(service_db, rec, record_sort);
+	sdp_svcdb_changed();
 
 	dev = malloc(sizeof(*dev));
 	if (!dev)
@@ -241,6 +293,8 @@ int sdp_record_remove(uint32_t handle)
 	if (r)
 		service_db = sdp_list_remove(service_db, r);
 
+	sdp_svcdb_changed();
+
 	p = access_locate(handle);
 	if (p == NULL || p->data == NULL)
 		return 0;
@@ -261,6 +315,212 @@ sdp_list_t *sdp_get_record_list(void)
 	return service_db;
 }
 
+static int index_sort(const void *p1, const void *p2)
+{
+	const sdp_index_t *i1 = p1;
+	const sdp_index_t *i2 = p2;
+	int ret;
+
+	ret = memcmp(&i1->uuid, &i2->uuid, sizeof(i1->uuid));
+	if (ret)
+		return ret;
+
+	return i1->handle < i2->handle ? -1 : i1->handle > i2->handle;
+}
+
+static void index_build(void)
+{
+	unsigned int len = 0;
+	sdp_list_t *l, *p;
+
+	for (l = service_db; l; l = l->next) {
+		sdp_record_t *rec = l->data;
+
+		len += sdp_list_len(rec->pattern);
+	}
+
+	free(uuid_index);
+	uuid_index = malloc(sizeof(*uuid_index) * (len ? len : 1));
+	uuid_index_len = 0;
+
+	if (!uuid_index)
+		return;
+
+	for (l = service_db; l; l = l->next) {
+		sdp_record_t *rec = l->data;
+
+		for (p = rec->pattern; p; p = p->next) {
+			uuid_t *uuid = p->data;
+			sdp_index_t *entry = &uuid_index[uuid_index_len++];
+
+			entry->uuid = uuid->value.uuid128;
+			entry->handle = rec->handle;
+			entry->rec = rec;
+		}
+	}
+
+	qsort(uuid_index, uuid_index_len, sizeof(*uuid_index), index_sort);
+
+	uuid_index_valid = true;
+}
+
+/* Find the first index entry not ordered before the given UUID and handle */
+static unsigned int index_lower_bound(const uint128_t *uuid, uint32_t handle)
+{
+	unsigned int low = 0, high = uuid_index_len;
+	sdp_index_t key;
+
+	key.uuid = *uuid;
+	key.handle = handle;
+
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+
+		if (index_sort(&uuid_index[mid], &key) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+static bool index_lookup(const uint128_t *uuid, uint32_t handle)
+{
+	unsigned int i = index_lower_bound(uuid, handle);
+
+	return i < uuid_index_len && uuid_index[i].handle == handle &&
+		!memcmp(&uuid_index[i].uuid, uuid, sizeof(*uuid));
+}
+
+static void uuid_to_uuid128(uuid_t *uuid128, const uuid_t *uuid)
+{
+	switch (uuid->type) {
+	case SDP_UUID128:
+		*uuid128 = *uuid;
+		break;
+	case SDP_UUID32:
+		sdp_uuid32_to_uuid128(uuid128, uuid);
+		break;
+	case SDP_UUID16:
+		sdp_uuid16_to_uuid128(uuid128, uuid);
+		break;
+	default:
+		memset(uuid128, 0, sizeof(*uuid128));
+		break;
+	}
+}
+
+/*
+ * Call func, in handle order, for every record whose pattern contains each
+ * and every UUID of the search pattern until it returns false.
+ */
+void sdp_svcdb_search(sdp_list_t *search, sdp_svcdb_func_t func,
+							void *user_data)
+{
+	unsigned int start = 0, end = 0, i;
+	int search_len = 0;
+	sdp_list_t *l;
+	uuid_t uuid;
+
+	if (!uuid_index_valid)
+		index_build();
+
+	if (!uuid_index_valid)
+		return;
+
+	/* Start from the UUID matching the fewest records */
+	for (l = search; l; l = l->next) {
+		unsigned int first, last;
+
+		if (!l->data)
+			return;
+
+		uuid_to_uuid128(&uuid, l->data);
+
+		first = index_lower_bound(&uuid.value.uuid128, 0);
+		last = index_lower_bound(&uuid.value.uuid128, UINT32_MAX);
+		if (last < uuid_index_len && !memcmp(&uuid_index[last].uuid,
+					&uuid.value.uuid128, sizeof(uint128_t)))
+			last++;
+
+		if (!search_len || last - first < end - start) {
+			start = first;
+			end = last;
+		}
+
+		search_len++;
+	}
+
+	/* An empty search pattern matches every record */
+	if (!search_len) {
+		for (l = service_db; l; l = l->next) {
+			if (!func(l->data, user_data))
+				return;
+		}
+
+		return;
+	}
+
+	for (i = start; i < end; i++) {
+		sdp_record_t *rec = uuid_index[i].rec;
+
+		/* A search pattern longer than the record pattern never
+		 * matches, even if some of its UUIDs are repeated.
+		 */
+		if (sdp_list_len(rec->pattern) < search_len)
+			continue;
+
+		for (l = search; l; l = l->next) {
+			uuid_to_uuid128(&uuid, l->data);
+
+			if (!index_lookup(&uuid.value.uuid128, rec->handle))
+				break;
+		}
+
+		if (l)
+			continue;
+
+		if (!func(rec, user_data))
+			return;
+	}
+}
+
+static int pdu_cache_cmp(const void *data, const void *user_data)
+{
+	const sdp_pdu_cache_t *cache = data;
+
+	return cache->rec == user_data ? 0 : 1;
+}
+
+/*
+ * Get the serialized form of a record, it is generated only once until
+ * the repository changes.
+ */
+const sdp_buf_t *sdp_svcdb_get_pdu(sdp_record_t *rec)
+{
+	sdp_pdu_cache_t *cache;
+	sdp_list_t *p;
+
+	p = sdp_list_find(pdu_cache, rec, pdu_cache_cmp);
+	if (p)
+		return &((sdp_pdu_cache_t *) p->data)->pdu;
+
+	cache = malloc(sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	if (sdp_gen_record_pdu(rec, &cache->pdu) < 0) {
+		free(cache);
+		return NULL;
+	}
+
+	cache->rec = rec;
+	pdu_cache = sdp_list_append(pdu_cache, cache);
+
+	return &cache->pdu;
+}
+
 int sdp_check_access(uint32_t handle, bdaddr_t *device)
 {
 	sdp_list_t *p = access_locate(handle);
@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include "lib/bluetooth.h"
 #include "lib/l2cap.h"
@@ -42,50 +43,230 @@ typedef struct {
 
 #define MIN(x, y) ((x) < (y)) ? (x): (y)
 
+/*
+ * Cached responses waiting for continuation requests. Entries are hashed by
+ * the socket of the connection they belong to, so they can only be
+ * retrieved by that connection, and are kept in least recently used order
+ * to bound the memory used by clients not fetching their responses.
+ *
+ * There is no timer for CSTATE_TIMEOUT, expired entries are only dropped
+ * when the next request looks at the cache. Until then they are still
+ * bounded by CSTATE_MAX_SIZE.
+ */
+#define CSTATE_HASH_SIZE	32
+#define CSTATE_MAX_SIZE		(256 * 1024)
+#define CSTATE_MAX_PER_SOCK	4
+#define CSTATE_TIMEOUT		30
+
 typedef struct _sdp_cstate_list sdp_cstate_list_t;
 
 struct _sdp_cstate_list {
 	sdp_cstate_list_t *next;
+	sdp_cstate_list_t *lru_prev;
+	sdp_cstate_list_t *lru_next;
+	int sock;
 	uint32_t timestamp;
+	time_t expire;
 	sdp_buf_t buf;
 };
 
-static sdp_cstate_list_t *cstates;
+static sdp_cstate_list_t *cstates[CSTATE_HASH_SIZE];
+static sdp_cstate_list_t *cstates_lru;
+static sdp_cstate_list_t *cstates_lru_tail;
+static size_t cstates_size;
+static uint32_t cstates_id;
 
-/* FIXME: should probably remove it when it's found */
-static sdp_buf_t *sdp_get_cached_rsp(sdp_cont_state_t *cstate)
+static time_t cstate_now(void)
 {
-	sdp_cstate_list_t *p;
+	struct timespec ts;
 
-	for (p = cstates; p; p = p->next) {
-		/* Check timestamp */
-		if (p->timestamp != cstate->timestamp)
-			continue;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static sdp_cstate_list_t **cstate_bucket(int sock)
+{
+	return &cstates[(unsigned int) sock % CSTATE_HASH_SIZE];
+}
+
+static void cstate_lru_unlink(sdp_cstate_list_t *cstate)
+{
+	if (cstate->lru_prev)
+		cstate->lru_prev->lru_next = cstate->lru_next;
+	else
+		cstates_lru = cstate->lru_next;
+
+	if (cstate->lru_next)
+		cstate->lru_next->lru_prev = cstate->lru_prev;
+	else
+		cstates_lru_tail = cstate->lru_prev;
+
+	cstate->lru_prev = NULL;
+	cstate->lru_next = NULL;
+}
 
-		/* Check if requesting more than available */
-		if (cstate->cStateValue.maxBytesSent < p->buf.data_size)
-			return &p->buf;
+static void cstate_lru_push(sdp_cstate_list_t *cstate)
+{
+	cstate->lru_prev = NULL;
+	cstate->lru_next = cstates_lru;
+
+	if (cstates_lru)
+		cstates_lru->lru_prev = cstate;
+	else
+		cstates_lru_tail = cstate;
+
+	cstates_lru = cstate;
+	cstate->expire = cstate_now() + CSTATE_TIMEOUT;
+}
+
+static void cstate_free(sdp_cstate_list_t *cstate)
+{
+	sdp_cstate_list_t **p;
+
+	for (p = cstate_bucket(cstate->sock); *p; p = &(*p)->next) {
+		if (*p == cstate) {
+			*p = cstate->next;
+			break;
+		}
 	}
 
-	return 0;
+	cstate_lru_unlink(cstate);
+
+	cstates_size -= cstate->buf.data_size;
+
+	free(cstate->buf.data);
+	free(cstate);
+}
+
+/* Drop responses nobody asked for in a while or to make room for size */
+static void cstate_expire(size_t size)
+{
+	time_t now = cstate_now();
+
+	while (cstates_lru_tail) {
+		if (cstates_lru_tail->expire > now &&
+				cstates_size + size <= CSTATE_MAX_SIZE)
+			break;
+
+		cstate_free(cstates_lru_tail);
+	}
+}
+
+static sdp_cstate_list_t *cstate_find(sdp_req_t *req, uint32_t timestamp)
+{
+	sdp_cstate_list_t *p;
+
+	for (p = *cstate_bucket(req->sock); p; p = p->next) {
+		if (p->sock == req->sock && p->timestamp == timestamp)
+			return p;
+	}
+
+	return NULL;
+}
+
+static sdp_buf_t *sdp_get_cached_rsp(sdp_req_t *req,
+						sdp_cont_state_t *cstate)
+{
+	sdp_cstate_list_t *p;
+
+	cstate_expire(0);
+
+	p = cstate_find(req, cstate->timestamp);
+	if (!p)
+		return NULL;
+
+	/* Check if requesting more than available */
+	if (cstate->cStateValue.maxBytesSent >= p->buf.data_size)
+		return NULL;
+
+	cstate_lru_unlink(p);
+	cstate_lru_push(p);
+
+	return &p->buf;
 }
 
-static uint32_t sdp_cstate_alloc_buf(sdp_buf_t *buf)
+/* The last part of the response got sent, the client won't ask again */
+static void sdp_cstate_done(sdp_req_t *req, sdp_cont_state_t *cstate)
 {
-	sdp_cstate_list_t *cstate = malloc(sizeof(sdp_cstate_list_t));
-	uint8_t *data = malloc(buf->data_size);
+	sdp_cstate_list_t *p;
+
+	p = cstate_find(req, cstate->timestamp);
+	if (p)
+		cstate_free(p);
+}
 
-	memcpy(data, buf->data, buf->data_size);
-	memset((char *)cstate, 0, sizeof(sdp_cstate_list_t));
-	cstate->buf.data = data;
+static uint32_t sdp_cstate_alloc_buf(sdp_req_t *req, sdp_buf_t *buf)
+{
+	sdp_cstate_list_t *cstate, *p, *oldest = NULL;
+	unsigned int count = 0;
+
+	cstate_expire(buf->data_size);
+
+	/* Limit the responses a single connection may keep cached */
+	for (p = *cstate_bucket(req->sock); p; p = p->next) {
+		if (p->sock != req->sock)
+			continue;
+
+		count++;
+
+		if (!oldest || p->expire < oldest->expire)
+			oldest = p;
+	}
+
+	if (count >= CSTATE_MAX_PER_SOCK)
+		cstate_free(oldest);
+
+	cstate = malloc(sizeof(sdp_cstate_list_t));
+	if (!cstate)
+		return 0;
+
+	memset(cstate, 0, sizeof(sdp_cstate_list_t));
+
+	cstate->buf.data = malloc(buf->data_size);
+	if (!cstate->buf.data) {
+		free(cstate);
+		return 0;
+	}
+
+	memcpy(cstate->buf.data, buf->data, buf->data_size);
 	cstate->buf.data_size = buf->data_size;
 	cstate->buf.buf_size = buf->data_size;
-	cstate->timestamp = sdp_get_time();
-	cstate->next = cstates;
-	cstates = cstate;
+	cstate->sock = req->sock;
+
+	/* Zero is used for no continuation state */
+	if (++cstates_id == 0)
+		cstates_id++;
+
+	cstate->timestamp = cstates_id;
+
+	cstate->next = *cstate_bucket(req->sock);
+	*cstate_bucket(req->sock) = cstate;
+	cstate_lru_push(cstate);
+	cstates_size += buf->data_size;
+
 	return cstate->timestamp;
 }
 
+/* Drop the cached responses of a connection once it is gone */
+void sdp_cstate_cleanup(int sock)
+{
+	sdp_cstate_list_t *p, *next;
+
+	for (p = *cstate_bucket(sock); p; p = next) {
+		next = p->next;
+
+		if (p->sock == sock)
+			cstate_free(p);
+	}
+}
+
+void sdp_cstate_reset(void)
+{
+	while (cstates_lru)
+		cstate_free(cstates_lru);
+}
+
 /* Additional values for checking datatype (not in spec) */
 #define SDP_TYPE_UUID	0xfe
 #define SDP_TYPE_ATTRID	0xff
@@ -309,43 +490,27 @@ static int sdp_cstate_get(uint8_t *buffer, size_t len,
 	return 0;
 }
 
-/*
- * The matching process is defined as "each and every UUID
- * specified in the "search pattern" must be present in the
- * "target pattern". Here "search pattern" is the set of UUIDs
- * specified by the service discovery client and "target pattern"
- * is the set of UUIDs present in a service record.
- *
- * Return 1 if each and every UUID in the search
- * pattern exists in the target pattern, 0 if the
- * match succeeds and -1 on error.
- */
-static int sdp_match_uuid(sdp_list_t *search, sdp_list_t *pattern)
+struct search_data {
+	sdp_req_t *req;
+	uint8_t *pdata;
+	uint16_t expected;
+	uint16_t count;
+};
+
+static bool search_handle(sdp_record_t *rec, void *user_data)
 {
-	/*
-	 * The target is a sorted list, so we need not look
-	 * at all elements to confirm existence of an element
-	 * from the search pattern
-	 */
-	int patlen = sdp_list_len(pattern);
+	struct search_data *data = user_data;
 
-	if (patlen < sdp_list_len(search))
-		return -1;
-	for (; search; search = search->next) {
-		uuid_t *uuid128;
-		void *data = search->data;
-		sdp_list_t *list;
-		if (data == NULL)
-			return -1;
+	SDPDBG("Checking svcRec : 0x%x", rec->handle);
 
-		/* create 128-bit form of the search UUID */
-		uuid128 = sdp_uuid_to_uuid128((uuid_t *)data);
-		list = sdp_list_find(pattern, uuid128, sdp_uuid128_cmp);
-		bt_free(uuid128);
-		if (!list)
-			return 0;
-	}
-	return 1;
+	if (!sdp_check_access(rec->handle, &data->req->device))
+		return true;
+
+	put_be32(rec->handle, data->pdata);
+	data->pdata += sizeof(uint32_t);
+	data->count++;
+
+	return data->count < data->expected;
 }
 
 /*
@@ -425,23 +590,19 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 	buf->data_size += sizeof(uint16_t);
 
 	if (cstate == NULL) {
-		/* for every record in the DB, do a pattern search */
-		sdp_list_t *list = sdp_get_record_list();
-
-		handleSize = 0;
-		for (; list && rsp_count < expected; list = list->next) {
-			sdp_record_t *rec = list->data;
+		/* look up the records matching the search pattern */
+		struct search_data data = {
+			.req = req,
+			.pdata = pdata,
+			.expected = expected,
+		};
 
-			SDPDBG("Checking svcRec : 0x%x", rec->handle);
+		if (expected)
+			sdp_svcdb_search(pattern, search_handle, &data);
 
-			if (sdp_match_uuid(pattern, rec->pattern) > 0 &&
-					sdp_check_access(rec->handle, &req->device)) {
-				rsp_count++;
-				put_be32(rec->handle, pdata);
-				pdata += sizeof(uint32_t);
-				handleSize += sizeof(uint32_t);
-			}
-		}
+		rsp_count = data.count;
+		pdata = data.pdata;
+		handleSize = rsp_count * sizeof(uint32_t);
 
 		SDPDBG("Match count: %d", rsp_count);
 
@@ -451,7 +612,12 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 
 		if (rsp_count > actual) {
 			/* cache the rsp and generate a continuation state */
-			cStateId = sdp_cstate_alloc_buf(buf);
+			cStateId = sdp_cstate_alloc_buf(req, buf);
+			if (!cStateId) {
+				status = SDP_INSUFFICIENT_RESOURCES;
+				goto done;
+			}
+
 			/*
 			 * subtract handleSize since we now send only
 			 * a subset of handles
@@ -464,15 +630,15 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 	}
 
 	/* under both the conditions below, the rsp buffer is not built yet */
-	if (cstate || cStateId > 0) {
-		short lastIndex = 0;
+	if (cstate || rsp_count > actual) {
+		uint16_t lastIndex = 0;
 
 		if (cstate) {
 			/*
 			 * Get the previous sdp_cont_state_t and obtain
 			 * the cached rsp
 			 */
-			sdp_buf_t *pCache = sdp_get_cached_rsp(cstate);
+			sdp_buf_t *pCache = sdp_get_cached_rsp(req, cstate);
 			if (pCache) {
 				pCacheBuffer = pCache->data;
 				/* get the rsp_count from the cached buffer */
@@ -480,7 +646,9 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 
 				/* get index of the last sdp_record_t sent */
 				lastIndex = cstate->cStateValue.lastIndexSent;
-			} else {
+			}
+
+			if (!pCache || lastIndex > rsp_count) {
 				status = SDP_INVALID_CSTATE;
 				goto done;
 			}
@@ -500,12 +668,12 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 		pCacheBuffer += 2 * sizeof(uint16_t);
 
 		if (cstate) {
-			handleSize = 0;
-			for (i = lastIndex; (i - lastIndex) < actual && i < rsp_count; i++) {
-				memcpy(pdata, pCacheBuffer + i * sizeof(uint32_t), sizeof(uint32_t));
-				pdata += sizeof(uint32_t);
-				handleSize += sizeof(uint32_t);
-			}
+			/* handles are cached in their PDU form already */
+			i = MIN(rsp_count, lastIndex + actual);
+			handleSize = (i - lastIndex) * sizeof(uint32_t);
+			memcpy(pdata, pCacheBuffer +
+					lastIndex * sizeof(uint32_t), handleSize);
+			pdata += handleSize;
 		} else {
 			handleSize = actual << 2;
 			i = actual;
@@ -517,6 +685,9 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 
 		if (i == rsp_count) {
 			/* set "null" continuationState */
+			if (cstate)
+				sdp_cstate_done(req, cstate);
+
 			sdp_set_cstate_pdu(buf, NULL);
 		} else {
 			/*
@@ -555,8 +726,6 @@ done:
  */
 static int extract_attrs(sdp_record_t *rec, sdp_list_t *seq, sdp_buf_t *buf)
 {
-	sdp_buf_t pdu;
-
 	if (!rec)
 		return SDP_INVALID_RECORD_HANDLE;
 
@@ -567,8 +736,6 @@ static int extract_attrs(sdp_record_t *rec, sdp_list_t *seq, sdp_buf_t *buf)
 
 	SDPDBG("Entries in attr seq : %d", sdp_list_len(seq));
 
-	sdp_gen_record_pdu(rec, &pdu);
-
 	for (; seq; seq = seq->next) {
 		struct attrid *aid = seq->data;
 
@@ -590,11 +757,16 @@ static int extract_attrs(sdp_record_t *rec, sdp_list_t *seq, sdp_buf_t *buf)
 			SDPDBG("Low id : 0x%x", low);
 			SDPDBG("High id : 0x%x", high);
 
-			if (low == 0x0000 && high == 0xffff && pdu.data_size <= buf->buf_size) {
-				/* copy it */
-				memcpy(buf->data, pdu.data, pdu.data_size);
-				buf->data_size = pdu.data_size;
-				break;
+			if (low == 0x0000 && high == 0xffff) {
+				const sdp_buf_t *pdu = sdp_svcdb_get_pdu(rec);
+
+				if (pdu && pdu->data_size <= buf->buf_size) {
+					/* copy it */
+					memcpy(buf->data, pdu->data,
+							pdu->data_size);
+					buf->data_size = pdu->data_size;
+					break;
+				}
 			}
 			/* (else) sub-range of attributes */
 			for (attr = low; attr < high; attr++) {
@@ -608,22 +780,19 @@ static int extract_attrs(sdp_record_t *rec, sdp_list_t *seq, sdp_buf_t *buf)
 		} else {
 			error("Unexpected data type : 0x%x", aid->dtd);
 			error("Expect uint16_t or uint32_t");
-			free(pdu.data);
 			return SDP_INVALID_SYNTAX;
 		}
 	}
 
-	free(pdu.data);
-
 	return 0;
 }
 
 /* Build cstate response */
-static int sdp_cstate_rsp(sdp_cont_state_t *cstate, sdp_buf_t *buf,
-							uint16_t max)
+static int sdp_cstate_rsp(sdp_req_t *req, sdp_cont_state_t *cstate,
+						sdp_buf_t *buf, uint16_t max)
 {
 	/* continuation State exists -> get from cache */
-	sdp_buf_t *cache = sdp_get_cached_rsp(cstate);
+	sdp_buf_t *cache = sdp_get_cached_rsp(req, cstate);
 	uint16_t sent;
 
 	if (!cache)
@@ -637,8 +806,10 @@ static int sdp_cstate_rsp(sdp_cont_state_t *cstate, sdp_buf_t *buf,
 	SDPDBG("Response size : %d sending now : %d bytes sent so far : %d",
 		cache->data_size, sent, cstate->cStateValue.maxBytesSent);
 
-	if (cstate->cStateValue.maxBytesSent == cache->data_size)
+	if (cstate->cStateValue.maxBytesSent == cache->data_size) {
+		sdp_cstate_done(req, cstate);
 		return sdp_set_cstate_pdu(buf, NULL);
+	}
 
 	return sdp_set_cstate_pdu(buf, cstate);
 }
@@ -737,7 +908,7 @@ static int service_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 	buf->buf_size -= sizeof(uint16_t);
 
 	if (cstate) {
-		cstate_size = sdp_cstate_rsp(cstate, buf, max_rsp_size);
+		cstate_size = sdp_cstate_rsp(req, cstate, buf, max_rsp_size);
 		if (!cstate_size) {
 			status = SDP_INVALID_CSTATE;
 			error("NULL cache buffer and non-NULL continuation state");
@@ -749,7 +920,10 @@ static int service_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 			sdp_cont_state_t newState;
 
 			memset((char *)&newState, 0, sizeof(sdp_cont_state_t));
-			newState.timestamp = sdp_cstate_alloc_buf(buf);
+			newState.timestamp = sdp_cstate_alloc_buf(req, buf);
+			if (!newState.timestamp)
+				status = SDP_INSUFFICIENT_RESOURCES;
+
 			/*
 			 * Reset the buffer size to the maximum expected and
 			 * set the sdp_cont_state_t
@@ -782,6 +956,49 @@ done:
 	return 0;
 }
 
+struct search_attr_data {
+	sdp_req_t *req;
+	sdp_list_t *seq;
+	sdp_buf_t *buf;
+	sdp_buf_t *tmpbuf;
+	int count;
+	int status;
+};
+
+static bool search_attrs(sdp_record_t *rec, void *user_data)
+{
+	struct search_attr_data *data = user_data;
+	sdp_buf_t *buf = data->buf;
+	sdp_buf_t *tmpbuf = data->tmpbuf;
+
+	if (!sdp_check_access(rec->handle, &data->req->device))
+		return true;
+
+	data->count++;
+	data->status = extract_attrs(rec, data->seq, tmpbuf);
+
+	SDPDBG("Response count : %d", data->count);
+	SDPDBG("Local PDU size : %d", tmpbuf->data_size);
+	if (data->status) {
+		SDPDBG("Extract attr from record returns err");
+		return false;
+	}
+
+	if (buf->data_size + tmpbuf->data_size >= buf->buf_size) {
+		error("Relocation needed");
+		return false;
+	}
+
+	/* to be sure no relocations */
+	sdp_append_to_buf(buf, tmpbuf->data, tmpbuf->data_size);
+	tmpbuf->data_size = 0;
+	memset(tmpbuf->data, 0, USHRT_MAX);
+
+	SDPDBG("Net PDU size : %d", buf->data_size);
+
+	return true;
+}
+
 /*
  * combined service search and attribute extraction
  */
@@ -791,7 +1008,7 @@ static int service_search_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 	uint8_t *pdata;
 	unsigned int max;
 	int scanned, rsp_count = 0;
-	sdp_list_t *pattern = NULL, *seq = NULL, *svcList;
+	sdp_list_t *pattern = NULL, *seq = NULL;
 	sdp_cont_state_t *cstate = NULL;
 	short cstate_size = 0;
 	uint8_t dtd = 0;
@@ -857,8 +1074,6 @@ static int service_search_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 		goto done;
 	}
 
-	svcList = sdp_get_record_list();
-
 	tmpbuf.data = malloc(USHRT_MAX);
 	tmpbuf.data_size = 0;
 	tmpbuf.buf_size = USHRT_MAX;
@@ -876,37 +1091,25 @@ static int service_search_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 
 	if (cstate == NULL) {
 		/* no continuation state -> create new response */
-		sdp_list_t *p;
-		for (p = svcList; p; p = p->next) {
-			sdp_record_t *rec = p->data;
-			if (sdp_match_uuid(pattern, rec->pattern) > 0 &&
-					sdp_check_access(rec->handle, &req->device)) {
-				rsp_count++;
-				status = extract_attrs(rec, seq, &tmpbuf);
-
-				SDPDBG("Response count : %d", rsp_count);
-				SDPDBG("Local PDU size : %d", tmpbuf.data_size);
-				if (status) {
-					SDPDBG("Extract attr from record returns err");
-					break;
-				}
-				if (buf->data_size + tmpbuf.data_size < buf->buf_size) {
-					/* to be sure no relocations */
-					sdp_append_to_buf(buf, tmpbuf.data, tmpbuf.data_size);
-					tmpbuf.data_size = 0;
-					memset(tmpbuf.data, 0, USHRT_MAX);
-				} else {
-					error("Relocation needed");
-					break;
-				}
-				SDPDBG("Net PDU size : %d", buf->data_size);
-			}
-		}
+		struct search_attr_data data = {
+			.req = req,
+			.seq = seq,
+			.buf = buf,
+			.tmpbuf = &tmpbuf,
+		};
+
+		sdp_svcdb_search(pattern, search_attrs, &data);
+
+		rsp_count = data.count;
+		status = data.status;
 		if (buf->data_size > max) {
 			sdp_cont_state_t newState;
 
 			memset((char *)&newState, 0, sizeof(sdp_cont_state_t));
-			newState.timestamp = sdp_cstate_alloc_buf(buf);
+			newState.timestamp = sdp_cstate_alloc_buf(req, buf);
+			if (!newState.timestamp)
+				status = SDP_INSUFFICIENT_RESOURCES;
+
 			/*
 			 * Reset the buffer size to the maximum expected and
 			 * set the sdp_cont_state_t
@@ -917,7 +1120,7 @@ static int service_search_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 		} else
 			cstate_size = sdp_set_cstate_pdu(buf, NULL);
 	} else {
-		cstate_size = sdp_cstate_rsp(cstate, buf, max);
+		cstate_size = sdp_cstate_rsp(req, cstate, buf, max);
 		if (!cstate_size) {
 			status = SDP_INVALID_CSTATE;
 			SDPDBG("Non-null continuation state, but null cache buffer");
@@ -305,6 +305,8 @@ static void update_db_timestamp(void)
 		sdp_data_t *d = sdp_data_alloc(SDP_UINT32, &dbts);
 		sdp_attr_replace(server, SDP_ATTR_SVCDB_STATE, d);
 	}
+
+	sdp_svcdb_changed();
 }
 
 void set_fixed_db_timestamp(uint32_t dbts)
@@ -333,6 +335,8 @@ void register_public_browse_group(void)
 	sdp_uuid16_create(&pbgid, PUBLIC_BROWSE_GROUP);
 	sdp_attr_add_new(browse, SDP_ATTR_GROUP_ID,
 				SDP_UUID16, &pbgid.value.uuid16);
+
+	sdp_svcdb_changed();
 }
 
 /*
@@ -31,6 +31,8 @@ typedef struct request {
 
 void handle_internal_request(int sk, int mtu, void *data, int len);
 void handle_request(int sk, uint8_t *data, int len);
+void sdp_cstate_cleanup(int sock);
+void sdp_cstate_reset(void);
 
 void set_fixed_db_timestamp(uint32_t dbts);
 
@@ -54,6 +56,12 @@ void sdp_record_add(const bdaddr_t *device, sdp_record_t *rec);
 int sdp_record_remove(uint32_t handle);
 sdp_list_t *sdp_get_record_list(void);
 int sdp_check_access(uint32_t handle, bdaddr_t *device);
+
+typedef bool (*sdp_svcdb_func_t)(sdp_record_t *rec, void *user_data);
+void sdp_svcdb_search(sdp_list_t *search, sdp_svcdb_func_t func,
+							void *user_data);
+const sdp_buf_t *sdp_svcdb_get_pdu(sdp_record_t *rec);
+void sdp_svcdb_changed(void);
 uint32_t sdp_next_handle(void);
 
 uint32_t sdp_get_time(void);
@@ -12,9 +12,13 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/socket.h>
 
 #include "src/shared/io.h"
 #include "src/shared/queue.h"
@@ -30,6 +34,8 @@
 #define ATT_OP_CMD_MASK			0x40
 #define ATT_OP_SIGNED_MASK		0x80
 #define ATT_TIMEOUT_INTERVAL		30000  /* 30000 ms */
+#define ATT_POOL_SIZE			8  /* Cached PDU buffers */
+#define ATT_TX_BATCH			16 /* PDUs written per wakeup */
 
 /* Length of signature in write signed packet */
 #define BT_ATT_SIGNATURE_LEN		12
@@ -42,6 +48,7 @@ struct bt_att_chan {
 	struct io *io;
 	uint8_t type;
 	int sec_level;			/* Only used for non-L2CAP */
+	int sec_cache;			/* Last level read from the socket */
 
 	struct queue *queue;		/* Channel dedicated queue */
 
@@ -53,6 +60,10 @@ struct bt_att_chan {
 
 	uint8_t *buf;
 	uint16_t mtu;
+
+	struct bt_att_tx_stats stats;
+	uint64_t created;		/* Bearer creation time (usec) */
+	uint64_t req_sent;		/* Pending request write time (usec) */
 };
 
 struct bt_att {
@@ -87,6 +98,9 @@ struct bt_att {
 
 	struct sign_info *local_sign;
 	struct sign_info *remote_sign;
+
+	struct att_send_op *pool;	/* Unused PDU buffers */
+	unsigned int pool_len;
 };
 
 struct sign_info {
@@ -124,6 +138,8 @@ static const struct {
 	{ BT_ATT_OP_READ_BLOB_RSP,		ATT_OP_TYPE_RSP },
 	{ BT_ATT_OP_READ_MULT_REQ,		ATT_OP_TYPE_REQ },
 	{ BT_ATT_OP_READ_MULT_RSP,		ATT_OP_TYPE_RSP },
+	{ BT_ATT_OP_READ_MULT_VL_REQ,		ATT_OP_TYPE_REQ },
+	{ BT_ATT_OP_READ_MULT_VL_RSP,		ATT_OP_TYPE_RSP },
 	{ BT_ATT_OP_READ_BY_GRP_TYPE_REQ,	ATT_OP_TYPE_REQ },
 	{ BT_ATT_OP_READ_BY_GRP_TYPE_RSP,	ATT_OP_TYPE_RSP },
 	{ BT_ATT_OP_WRITE_REQ,			ATT_OP_TYPE_REQ },
@@ -167,6 +183,7 @@ static const struct {
 	{ BT_ATT_OP_READ_REQ,			BT_ATT_OP_READ_RSP },
 	{ BT_ATT_OP_READ_BLOB_REQ,		BT_ATT_OP_READ_BLOB_RSP },
 	{ BT_ATT_OP_READ_MULT_REQ,		BT_ATT_OP_READ_MULT_RSP },
+	{ BT_ATT_OP_READ_MULT_VL_REQ,		BT_ATT_OP_READ_MULT_VL_RSP },
 	{ BT_ATT_OP_READ_BY_GRP_TYPE_REQ,	BT_ATT_OP_READ_BY_GRP_TYPE_RSP },
 	{ BT_ATT_OP_WRITE_REQ,			BT_ATT_OP_WRITE_RSP },
 	{ BT_ATT_OP_PREP_WRITE_REQ,		BT_ATT_OP_PREP_WRITE_RSP },
@@ -196,8 +213,68 @@ struct att_send_op {
 	bt_att_response_func_t callback;
 	bt_att_destroy_func_t destroy;
 	void *user_data;
+	struct bt_att *pool;		/* Set for ops with an inline PDU */
+	struct att_send_op *next;
+	uint16_t size;
 };
 
+static void pool_put(struct bt_att *att, struct att_send_op *op)
+{
+	if (att->pool_len >= ATT_POOL_SIZE) {
+		free(op);
+		return;
+	}
+
+	op->next = att->pool;
+	att->pool = op;
+	att->pool_len++;
+}
+
+static struct att_send_op *pool_get(struct bt_att *att, uint16_t size)
+{
+	struct att_send_op *op = att->pool;
+
+	if (op) {
+		att->pool = op->next;
+		att->pool_len--;
+
+		/* Buffers allocated before an MTU increase are too small */
+		if (op->size < size) {
+			free(op);
+			op = NULL;
+		}
+	}
+
+	if (!op) {
+		/* The PDU buffer follows the op in the same allocation */
+		op = malloc(sizeof(*op) + size);
+		if (!op)
+			return NULL;
+
+		op->size = size;
+	}
+
+	size = op->size;
+	memset(op, 0, sizeof(*op));
+	op->pdu = op + 1;
+	op->pool = att;
+	op->size = size;
+
+	return op;
+}
+
+static void pool_free(struct bt_att *att)
+{
+	while (att->pool) {
+		struct att_send_op *op = att->pool;
+
+		att->pool = op->next;
+		free(op);
+	}
+
+	att->pool_len = 0;
+}
+
 static void destroy_att_send_op(void *data)
 {
 	struct att_send_op *op = data;
@@ -208,6 +285,11 @@ static void destroy_att_send_op(void *data)
 	if (op->destroy)
 		op->destroy(op->user_data);
 
+	if (op->pool) {
+		pool_put(op->pool, op);
+		return;
+	}
+
 	free(op->pdu);
 	free(op);
 }
@@ -410,17 +492,58 @@ static struct att_send_op *create_att_send_op(struct bt_att *att,
 	return op;
 }
 
-static struct att_send_op *pick_next_send_op(struct bt_att_chan *chan)
+static void wakeup_chan_writer(void *data, void *user_data);
+
+/* Pick the bearer a queued request should go out on: among the bearers
+ * without an outstanding request and with a large enough MTU, prefer the
+ * one with the least queued traffic and then the largest MTU.
+ */
+static struct bt_att_chan *pick_req_chan(struct bt_att *att,
+						struct att_send_op *op)
+{
+	const struct queue_entry *entry;
+	struct bt_att_chan *best = NULL;
+	unsigned int best_load = UINT_MAX;
+
+	for (entry = queue_get_entries(att->chans); entry;
+						entry = entry->next) {
+		struct bt_att_chan *chan = entry->data;
+		unsigned int load;
+
+		if (chan->pending_req || op->len > chan->mtu)
+			continue;
+
+		/* Don't send Exchange MTU over EATT */
+		if (op->opcode == BT_ATT_OP_MTU_REQ &&
+					chan->type == BT_ATT_EATT)
+			continue;
+
+		load = queue_length(chan->queue) + (chan->pending_ind ? 1 : 0);
+
+		if (load < best_load ||
+				(load == best_load && chan->mtu > best->mtu)) {
+			best = chan;
+			best_load = load;
+		}
+	}
+
+	return best;
+}
+
+static struct att_send_op *pick_next_send_op(struct bt_att_chan *chan,
+							struct queue **from)
 {
 	struct bt_att *att = chan->att;
 	struct att_send_op *op;
 
 	/* Check if there is anything queued on the channel */
+	*from = chan->queue;
 	op = queue_pop_head(chan->queue);
 	if (op)
 		return op;
 
 	/* See if any operations are already in the write queue */
+	*from = att->write_queue;
 	op = queue_peek_head(att->write_queue);
 	if (op && op->len <= chan->mtu)
 		return queue_pop_head(att->write_queue);
@@ -431,12 +554,28 @@ static struct att_send_op *pick_next_send_op(struct bt_att_chan *chan)
 	if (!chan->pending_req) {
 		op = queue_peek_head(att->req_queue);
 		if (op && op->len <= chan->mtu) {
-			/* Don't send Exchange MTU over EATT */
-			if (op->opcode == BT_ATT_OP_MTU_REQ &&
-					chan->type == BT_ATT_EATT)
+			struct bt_att_chan *best = pick_req_chan(att, op);
+
+			/* Leave it to a better suited bearer, making sure its
+			 * writer is running.
+			 */
+			if (best != chan) {
+				if (best)
+					wakeup_chan_writer(best, NULL);
 				goto indicate;
+			}
+
+			*from = att->req_queue;
+			op = queue_pop_head(att->req_queue);
+
+			/* Bearers that left this request to us may have
+			 * stopped writing, wake them up for the next one.
+			 */
+			if (!queue_isempty(att->req_queue))
+				queue_foreach(att->chans, wakeup_chan_writer,
+									NULL);
 
-			return queue_pop_head(att->req_queue);
+			return op;
 		}
 	}
 
@@ -446,8 +585,10 @@ indicate:
 	 */
 	if (!chan->pending_ind) {
 		op = queue_peek_head(att->ind_queue);
-		if (op && op->len <= chan->mtu)
+		if (op && op->len <= chan->mtu) {
+			*from = att->ind_queue;
 			return queue_pop_head(att->ind_queue);
+		}
 	}
 
 	return NULL;
@@ -468,6 +609,24 @@ struct timeout_data {
 	unsigned int id;
 };
 
+static uint64_t att_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void chan_req_done(struct bt_att_chan *chan)
+{
+	if (!chan->pending_req)
+		return;
+
+	chan->stats.busy_usec += att_now() - chan->req_sent;
+	chan->pending_req = NULL;
+}
+
 static bool timeout_cb(void *user_data)
 {
 	struct timeout_data *timeout = user_data;
@@ -477,7 +636,7 @@ static bool timeout_cb(void *user_data)
 
 	if (chan->pending_req && chan->pending_req->id == timeout->id) {
 		op = chan->pending_req;
-		chan->pending_req = NULL;
+		chan_req_done(chan);
 	} else if (chan->pending_ind && chan->pending_ind->id == timeout->id) {
 		op = chan->pending_ind;
 		chan->pending_ind = NULL;
@@ -538,34 +697,20 @@ static ssize_t bt_att_chan_write(struct bt_att_chan *chan, uint8_t opcode,
 	return ret;
 }
 
-static bool can_write_data(struct io *io, void *user_data)
+static void write_complete(struct bt_att_chan *chan, struct att_send_op *op)
 {
-	struct bt_att_chan *chan = user_data;
-	struct att_send_op *op;
 	struct timeout_data *timeout;
 
-	op = pick_next_send_op(chan);
-	if (!op)
-		return false;
-
-	if (!bt_att_chan_write(chan, op->opcode, op->pdu, op->len)) {
-		if (op->callback)
-			op->callback(BT_ATT_OP_ERROR_RSP, NULL, 0,
-							op->user_data);
-		destroy_att_send_op(op);
-		return true;
-	}
-
-	/* Based on the operation type, set either the pending request or the
-	 * pending indication. If it came from the write queue, then there is
-	 * no need to keep it around.
+	/* Based on the operation type, keep either the pending request or
+	 * the pending indication around. If it came from the write queue,
+	 * then there is no need to keep it around.
 	 */
 	switch (op->type) {
 	case ATT_OP_TYPE_REQ:
-		chan->pending_req = op;
+		chan->req_sent = att_now();
+		chan->stats.reqs++;
 		break;
 	case ATT_OP_TYPE_IND:
-		chan->pending_ind = op;
 		break;
 	case ATT_OP_TYPE_RSP:
 		/* Set in_req to false to indicate that no request is pending */
@@ -577,7 +722,7 @@ static bool can_write_data(struct io *io, void *user_data)
 	case ATT_OP_TYPE_UNKNOWN:
 	default:
 		destroy_att_send_op(op);
-		return true;
+		return;
 	}
 
 	timeout = new0(struct timeout_data, 1);
@@ -585,8 +730,157 @@ static bool can_write_data(struct io *io, void *user_data)
 	timeout->id = op->id;
 	op->timeout_id = timeout_add(ATT_TIMEOUT_INTERVAL, timeout_cb,
 								timeout, free);
+}
+
+static void write_failed(struct bt_att_chan *chan, struct att_send_op *op)
+{
+	if (chan->pending_req == op)
+		chan->pending_req = NULL;
+	else if (chan->pending_ind == op)
+		chan->pending_ind = NULL;
+
+	if (op->callback)
+		op->callback(BT_ATT_OP_ERROR_RSP, NULL, 0, op->user_data);
+
+	destroy_att_send_op(op);
+}
+
+static void write_requeue(struct bt_att_chan *chan, struct att_send_op *op,
+							struct queue *queue)
+{
+	if (chan->pending_req == op)
+		chan->pending_req = NULL;
+	else if (chan->pending_ind == op)
+		chan->pending_ind = NULL;
+
+	queue_push_head(queue, op);
+}
+
+/* Write a batch of PDUs with a single system call, returns the number of
+ * PDUs written or a negative error if none could be written.
+ */
+static int bt_att_chan_write_batch(struct bt_att_chan *chan,
+					struct att_send_op **ops, int count)
+{
+	struct bt_att *att = chan->att;
+	struct mmsghdr msgs[ATT_TX_BATCH];
+	struct iovec iov[ATT_TX_BATCH];
+	int i, ret;
+
+	if (count == 1)
+		goto fallback;
+
+	memset(msgs, 0, sizeof(*msgs) * count);
+
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = ops[i]->pdu;
+		iov[i].iov_len = ops[i]->len;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	ret = sendmmsg(chan->fd, msgs, count, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (ret < 0) {
+		/* Not a socket, write each PDU on its own */
+		if (errno == ENOTSOCK)
+			goto fallback;
+
+		att_debug(att, "(chan %p) write failed: %s", chan,
+							strerror(errno));
+		return -errno;
+	}
+
+	for (i = 0; i < ret; i++) {
+		att_verbose(att, "(chan %p) ATT op 0x%02x", chan,
+							ops[i]->opcode);
+
+		if (att->debug_level)
+			util_hexdump('<', ops[i]->pdu, ops[i]->len,
+					att->debug_callback, att->debug_data);
+	}
+
+	return ret;
+
+fallback:
+	for (i = 0; i < count; i++) {
+		ret = bt_att_chan_write(chan, ops[i]->opcode, ops[i]->pdu,
+								ops[i]->len);
+		if (ret < 0)
+			return i ? i : ret;
+	}
+
+	return count;
+}
+
+static bool can_write_data(struct io *io, void *user_data)
+{
+	struct bt_att_chan *chan = user_data;
+	struct att_send_op *ops[ATT_TX_BATCH];
+	struct queue *from[ATT_TX_BATCH];
+	unsigned int depth;
+	int i, count, ret;
+
+	depth = queue_length(chan->queue) +
+				queue_length(chan->att->write_queue) +
+				queue_length(chan->att->req_queue) +
+				queue_length(chan->att->ind_queue);
+
+	/* Drain as many PDUs as possible, the pending request and
+	 * indication are reserved as soon as they are picked so that the
+	 * sequencing rules still only allow one of each outstanding.
+	 */
+	for (count = 0; count < ATT_TX_BATCH; count++) {
+		struct att_send_op *op;
+
+		op = pick_next_send_op(chan, &from[count]);
+		if (!op)
+			break;
+
+		if (op->type == ATT_OP_TYPE_REQ)
+			chan->pending_req = op;
+		else if (op->type == ATT_OP_TYPE_IND)
+			chan->pending_ind = op;
+
+		ops[count] = op;
+	}
+
+	if (!count)
+		return false;
+
+	ret = bt_att_chan_write_batch(chan, ops, count);
+
+	chan->stats.wakeups++;
+
+	if (depth > chan->stats.queue_max)
+		chan->stats.queue_max = depth;
+
+	if (ret > 0) {
+		chan->stats.pdus += ret;
+
+		if ((unsigned int) ret > chan->stats.batch_max)
+			chan->stats.batch_max = ret;
+	}
+
+	for (i = 0; i < ret; i++)
+		write_complete(chan, ops[i]);
+
+	if (ret == count)
+		return true;
+
+	/* Put back what the socket could not take in the original order
+	 * and wait for the next wakeup. An error is only reported once
+	 * nothing could be written, in which case it belongs to the first
+	 * PDU of the batch which is the only one failed, as if it had been
+	 * written on its own.
+	 */
+	for (i = count - 1; i > (ret > 0 ? ret : 0); i--)
+		write_requeue(chan, ops[i], from[i]);
+
+	if (ret < 0 && ret != -EAGAIN && ret != -ENOBUFS)
+		write_failed(chan, ops[0]);
+	else
+		write_requeue(chan, ops[i], from[i]);
 
-	/* Return true as there may be more operations ready to write. */
 	return true;
 }
 
@@ -712,11 +1006,19 @@ static int bt_att_chan_get_security(struct bt_att_chan *chan)
 	if (chan->type == BT_ATT_LOCAL)
 		return chan->sec_level;
 
+	/* The security of a link is never lowered while connected so the
+	 * cached level stays valid until a change is requested or signalled.
+	 */
+	if (chan->sec_cache)
+		return chan->sec_cache;
+
 	memset(&sec, 0, sizeof(sec));
 	len = sizeof(sec);
 	if (getsockopt(chan->fd, SOL_BLUETOOTH, BT_SECURITY, &sec, &len) < 0)
 		return -EIO;
 
+	chan->sec_cache = sec.level;
+
 	return sec.level;
 }
 
@@ -732,6 +1034,9 @@ static bool bt_att_chan_set_security(struct bt_att_chan *chan, int level)
 	memset(&sec, 0, sizeof(sec));
 	sec.level = level;
 
+	/* Elevation completes asynchronously, read it back next time */
+	chan->sec_cache = 0;
+
 	if (setsockopt(chan->fd, SOL_BLUETOOTH, BT_SECURITY, &sec,
 							sizeof(sec)) < 0)
 		return false;
@@ -795,7 +1100,7 @@ static bool handle_error_rsp(struct bt_att_chan *chan, uint8_t *pdu,
 
 	att_debug(att, "(chan %p) Retrying operation %p", chan, op);
 
-	chan->pending_req = NULL;
+	chan_req_done(chan);
 
 	/* Push operation back to request queue */
 	return queue_push_head(att->req_queue, op);
@@ -858,7 +1163,7 @@ done:
 		op->callback(rsp_opcode, rsp_pdu, rsp_pdu_len, op->user_data);
 
 	destroy_att_send_op(op);
-	chan->pending_req = NULL;
+	chan_req_done(chan);
 
 	wakeup_chan_writer(chan, NULL);
 }
@@ -1138,6 +1443,8 @@ static void bt_att_free(struct bt_att *att)
 	queue_destroy(att->exchange_list, NULL);
 	queue_destroy(att->chans, bt_att_chan_free);
 
+	pool_free(att);
+
 	free(att);
 }
 
@@ -1196,6 +1503,7 @@ static struct bt_att_chan *bt_att_chan_new(int fd, uint8_t type)
 		goto fail;
 
 	chan->type = type;
+	chan->created = att_now();
 	switch (chan->type) {
 	case BT_ATT_LOCAL:
 		chan->sec_level = BT_ATT_SECURITY_LOW;
@@ -1352,6 +1660,33 @@ int bt_att_get_channels(struct bt_att *att)
 	return queue_length(att->chans);
 }
 
+int bt_att_get_tx_stats(struct bt_att *att, struct bt_att_tx_stats *stats,
+								int max)
+{
+	const struct queue_entry *entry;
+	int count = 0;
+
+	if (!att || !stats)
+		return -EINVAL;
+
+	for (entry = queue_get_entries(att->chans); entry && count < max;
+						entry = entry->next) {
+		struct bt_att_chan *chan = entry->data;
+
+		stats[count] = chan->stats;
+		stats[count].type = chan->type;
+		stats[count].mtu = chan->mtu;
+		stats[count].queue_len = queue_length(chan->queue);
+		stats[count].active_usec = att_now() - chan->created;
+
+		if (chan->pending_req)
+			stats[count].busy_usec += att_now() - chan->req_sent;
+		count++;
+	}
+
+	return count;
+}
+
 bool bt_att_set_debug(struct bt_att *att, uint8_t level,
 			bt_att_debug_func_t callback, void *user_data,
 			bt_att_destroy_func_t destroy)
@@ -1615,6 +1950,89 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 	return op->id;
 }
 
+void *bt_att_get_pdu(struct bt_att *att, uint8_t opcode, uint16_t *len)
+{
+	struct att_send_op *op;
+	enum att_op_type type;
+
+	if (!att || !len || queue_isempty(att->chans))
+		return NULL;
+
+	/* Only PDUs not expecting a response and not requiring a signature
+	 * can be encoded in place.
+	 */
+	type = get_op_type(opcode);
+	if ((type != ATT_OP_TYPE_NFY && type != ATT_OP_TYPE_CMD) ||
+					(opcode & ATT_OP_SIGNED_MASK))
+		return NULL;
+
+	op = pool_get(att, att->mtu);
+	if (!op)
+		return NULL;
+
+	op->type = type;
+	op->opcode = opcode;
+	((uint8_t *) op->pdu)[0] = opcode;
+
+	*len = op->size - 1;
+
+	return op->pdu + 1;
+}
+
+static bool chan_is_idle(const void *data, const void *match_data)
+{
+	const struct bt_att_chan *chan = data;
+	const struct att_send_op *op = match_data;
+
+	return !chan->writer_active && queue_isempty(chan->queue) &&
+							op->len <= chan->mtu;
+}
+
+unsigned int bt_att_send_pdu(struct bt_att *att, void *pdu, uint16_t len)
+{
+	struct att_send_op *op;
+	struct bt_att_chan *chan;
+	unsigned int id;
+
+	if (!att || !pdu)
+		return 0;
+
+	op = (struct att_send_op *) ((uint8_t *) pdu - 1) - 1;
+
+	if (op->pool != att || len >= op->size) {
+		destroy_att_send_op(op);
+		return 0;
+	}
+
+	op->len = len + 1;
+
+	if (att->next_send_id < 1)
+		att->next_send_id = 1;
+
+	op->id = id = att->next_send_id++;
+
+	/* Write directly if nothing is queued ahead of this PDU and a
+	 * channel is idle, otherwise queue it like bt_att_send does.
+	 */
+	if (queue_isempty(att->write_queue)) {
+		chan = queue_find(att->chans, chan_is_idle, op);
+		if (chan && bt_att_chan_write(chan, op->opcode, op->pdu,
+							op->len) == op->len) {
+			destroy_att_send_op(op);
+			return id;
+		}
+	}
+
+	if (!queue_push_tail(att->write_queue, op)) {
+		destroy_att_send_op(op);
+		return 0;
+	}
+
+	wakeup_writer(att);
+
+	return id;
+}
+
 unsigned int bt_att_chan_send(struct bt_att_chan *chan, uint8_t opcode,
 				const void *pdu, uint16_t len,
 				bt_att_response_func_t callback,
@@ -1918,12 +2336,30 @@ bool bt_att_set_security(struct bt_att *att, int level)
 	return bt_att_chan_set_security(chan, level);
 }
 
+static void chan_reset_security(void *data, void *user_data)
+{
+	struct bt_att_chan *chan = data;
+
+	chan->sec_cache = 0;
+}
+
+void bt_att_reset_security(struct bt_att *att)
+{
+	if (!att)
+		return;
+
+	queue_foreach(att->chans, chan_reset_security, NULL);
+}
+
 void bt_att_set_enc_key_size(struct bt_att *att, uint8_t enc_size)
 {
 	if (!att)
 		return;
 
 	att->enc_size = enc_size;
+
+	/* A new key means the link has been (re)encrypted */
+	bt_att_reset_security(att);
 }
 
 static bool sign_set_key(struct sign_info **sign, uint8_t key[16],
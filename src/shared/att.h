@@ -33,6 +33,22 @@ int bt_att_attach_fd(struct bt_att *att, int fd);
 
 int bt_att_get_channels(struct bt_att *att);
 
+struct bt_att_tx_stats {
+	uint8_t type;			/* BT_ATT_LOCAL, BT_ATT_LE, ... */
+	uint16_t mtu;
+	unsigned int queue_len;		/* PDUs currently queued */
+	unsigned int queue_max;		/* Deepest queue seen on wakeup */
+	unsigned long wakeups;		/* Writer wakeups */
+	unsigned long pdus;		/* PDUs written */
+	unsigned int batch_max;		/* Most PDUs written in one wakeup */
+	unsigned long reqs;		/* Requests sent */
+	uint64_t busy_usec;		/* Time spent with a request pending */
+	uint64_t active_usec;		/* Time since the bearer was attached */
+};
+
+int bt_att_get_tx_stats(struct bt_att *att, struct bt_att_tx_stats *stats,
+								int max);
+
 typedef void (*bt_att_response_func_t)(uint8_t opcode, const void *pdu,
 					uint16_t length, void *user_data);
 typedef void (*bt_att_notify_func_t)(struct bt_att_chan *chan,
@@ -68,6 +84,8 @@ unsigned int bt_att_chan_send(struct bt_att_chan *chan, uint8_t opcode,
 					bt_att_response_func_t callback,
 					void *user_data,
 					bt_att_destroy_func_t destroy);
+void *bt_att_get_pdu(struct bt_att *att, uint8_t opcode, uint16_t *len);
+unsigned int bt_att_send_pdu(struct bt_att *att, void *pdu, uint16_t len);
 #define bt_att_chan_send_rsp(chan, opcode, pdu, len) \
 	bt_att_chan_send(chan, opcode, pdu, len, NULL, NULL, NULL)
 bool bt_att_chan_cancel(struct bt_att_chan *chan, unsigned int id);
@@ -98,6 +116,7 @@ bool bt_att_unregister_all(struct bt_att *att);
 
 int bt_att_get_security(struct bt_att *att, uint8_t *enc_size);
 bool bt_att_set_security(struct bt_att *att, int level);
+void bt_att_reset_security(struct bt_att *att);
 void bt_att_set_enc_key_size(struct bt_att *att, uint8_t enc_size);
 
 bool bt_att_set_local_key(struct bt_att *att, uint8_t sign_key[16],
@@ -22,7 +22,9 @@
 #include <limits.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
+#include "src/shared/util.h"
 #include "src/shared/btsnoop.h"
 
 struct btsnoop_hdr {
@@ -47,6 +49,59 @@ static const uint8_t btsnoop_id[] = { 0x62, 0x74, 0x73, 0x6e,
 
 static const uint32_t btsnoop_version = 1;
 
+/* Archives use the BTSnoop header with a different identification
+ * pattern followed by compressed blocks of BTSnoop packet records.
+ */
+static const uint8_t btsnoop_archive_id[] = { 0x62, 0x74, 0x73, 0x6e,
+					      0x61, 0x72, 0x63, 0x00 };
+
+#define ARC_BLK_MAGIC		0x424c4b31	/* BLK1 */
+#define ARC_BLK_COMPRESSED	0x01
+#define ARC_BLK_CONN_OVERFLOW	0x02
+#define ARC_BLK_INDEX_OVERFLOW	0x04
+
+#define ARC_MAX_INDEX		8
+#define ARC_MAX_CONN		32
+#define ARC_MAX_ACTIVE		64
+#define ARC_BLOOM_SIZE		256
+
+struct arc_conn {
+	uint16_t	index;
+	uint16_t	handle;
+	uint8_t		bdaddr[6];
+} __attribute__ ((packed));
+
+struct arc_blk {
+	uint32_t	magic;
+	uint32_t	raw_len;	/* Length of packet records */
+	uint32_t	comp_len;	/* Length of compressed records */
+	uint32_t	count;		/* Number of packets */
+	uint64_t	ts_first;	/* Timestamp of first packet */
+	uint64_t	ts_last;	/* Timestamp of last packet */
+	uint8_t		flags;
+	uint8_t		num_index;
+	uint8_t		num_conn;
+	uint8_t		reserved;
+	uint16_t	index[ARC_MAX_INDEX];
+	uint8_t		bloom[ARC_BLOOM_SIZE];	/* BD_ADDRs */
+	struct arc_conn	conn[0];
+} __attribute__ ((packed));
+#define ARC_BLK_SIZE (sizeof(struct arc_blk))
+
+struct btsnoop_archive {
+	size_t block_size;
+	uint8_t *raw;
+	size_t raw_len;
+	uint8_t *comp;
+	struct arc_blk blk;
+	struct arc_conn conn[ARC_MAX_CONN];
+	struct arc_conn active[ARC_MAX_ACTIVE];
+	unsigned int num_active;
+	size_t offset;
+	uint8_t bdaddr[6];
+	bool matched;
+};
+
 struct pklg_pkt {
 	uint32_t	len;
 	uint64_t	ts;
@@ -68,8 +123,477 @@ struct btsnoop {
 	size_t cur_size;
 	unsigned int max_count;
 	unsigned int cur_count;
+	struct btsnoop_archive *archive;
+	struct btsnoop_archive *track;
+	bool filter_set;
+	struct btsnoop_filter filter;
+	uint64_t filter_start;
+	uint64_t filter_end;
 };
 
+static uint64_t tv_to_ts(const struct timeval *tv)
+{
+	uint64_t ts;
+
+	ts = (tv->tv_sec - 946684800ll) * 1000000ll + tv->tv_usec;
+
+	return ts + 0x00E03AB44A676000ll;
+}
+
+/* Minimal LZ77 block compressor using the LZ4 sequence layout: a token
+ * with literal and match lengths, the literals, a 16-bit offset and any
+ * extra match length bytes. The last sequence only carries literals.
+ */
+#define LZ_MIN_MATCH		4
+#define LZ_HASH_BITS		12
+#define LZ_MAX_OFFSET		0xffff
+
+static uint32_t lz_hash(const uint8_t *ptr)
+{
+	uint32_t val;
+
+	memcpy(&val, ptr, sizeof(val));
+
+	return (val * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_put_len(uint8_t *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+
+	*op++ = len;
+
+	return op;
+}
+
+static size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst,
+							size_t dst_len)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	const uint8_t *ip = src, *anchor = src;
+	const uint8_t *end = src + len;
+	uint8_t *op = dst;
+
+	memset(table, 0, sizeof(table));
+
+	while (len >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+		uint32_t h = lz_hash(ip);
+		const uint8_t *ref = src + table[h];
+		size_t lit, match;
+		uint8_t *token;
+
+		table[h] = ip - src;
+
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+					memcmp(ref, ip, LZ_MIN_MATCH)) {
+			ip++;
+			continue;
+		}
+
+		match = LZ_MIN_MATCH;
+		while (ip + match < end && ref[match] == ip[match])
+			match++;
+
+		lit = ip - anchor;
+
+		/* Worst case size of this sequence */
+		if ((size_t) (op - dst) + lit + lit / 255 + match / 255 + 8 >
+								dst_len)
+			return 0;
+
+		token = op++;
+		*token = (lit < 15 ? lit : 15) << 4;
+		if (lit >= 15)
+			op = lz_put_len(op, lit - 15);
+
+		memcpy(op, anchor, lit);
+		op += lit;
+
+		put_le16(ip - ref, op);
+		op += 2;
+
+		match -= LZ_MIN_MATCH;
+		*token |= match < 15 ? match : 15;
+		if (match >= 15)
+			op = lz_put_len(op, match - 15);
+
+		ip += match + LZ_MIN_MATCH;
+		anchor = ip;
+	}
+
+	len = end - anchor;
+
+	if ((size_t) (op - dst) + len + len / 255 + 2 > dst_len)
+		return 0;
+
+	*op++ = (len < 15 ? len : 15) << 4;
+	if (len >= 15)
+		op = lz_put_len(op, len - 15);
+
+	memcpy(op, anchor, len);
+	op += len;
+
+	return op - dst;
+}
+
+static bool lz_get_len(const uint8_t **ip, const uint8_t *end, size_t *len)
+{
+	uint8_t val;
+
+	do {
+		if (*ip >= end)
+			return false;
+
+		val = *(*ip)++;
+		*len += val;
+	} while (val == 255);
+
+	return true;
+}
+
+static size_t lz_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+							size_t dst_len)
+{
+	const uint8_t *ip = src, *end = src + len;
+	uint8_t *op = dst, *op_end = dst + dst_len;
+
+	while (ip < end) {
+		uint8_t token = *ip++;
+		size_t lit = token >> 4, match = token & 0x0f;
+		uint16_t offset;
+
+		if (lit == 15 && !lz_get_len(&ip, end, &lit))
+			return 0;
+
+		if ((size_t) (end - ip) < lit || (size_t) (op_end - op) < lit)
+			return 0;
+
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+
+		/* Last sequence */
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return 0;
+
+		offset = get_le16(ip);
+		ip += 2;
+
+		if (match == 15 && !lz_get_len(&ip, end, &match))
+			return 0;
+
+		match += LZ_MIN_MATCH;
+
+		if (!offset || offset > op - dst ||
+					(size_t) (op_end - op) < match)
+			return 0;
+
+		/* Overlapping copy for repeated patterns */
+		while (match--) {
+			*op = *(op - offset);
+			op++;
+		}
+	}
+
+	return op - dst;
+}
+
+/* The bloom bits are three 11-bit slices of a 64-bit FNV-1a hash over
+ * the whole address, run through a final mix so that the slices are
+ * independent of each other.
+ */
+#define ARC_BLOOM_BITS		11
+#define ARC_BLOOM_HASHES	3
+
+static uint64_t arc_bloom_hash(const uint8_t *bdaddr)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	unsigned int i;
+
+	for (i = 0; i < 6; i++) {
+		h ^= bdaddr[i];
+		h *= 0x100000001b3ull;
+	}
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static unsigned int arc_bloom_bit(uint64_t h, unsigned int i)
+{
+	return (h >> (i * ARC_BLOOM_BITS)) & (ARC_BLOOM_SIZE * 8 - 1);
+}
+
+static void arc_bloom_add(struct arc_blk *blk, const uint8_t *bdaddr)
+{
+	uint64_t h = arc_bloom_hash(bdaddr);
+	unsigned int i;
+
+	for (i = 0; i < ARC_BLOOM_HASHES; i++) {
+		unsigned int bit = arc_bloom_bit(h, i);
+
+		blk->bloom[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+static bool arc_bloom_has(const struct arc_blk *blk, const uint8_t *bdaddr)
+{
+	uint64_t h = arc_bloom_hash(bdaddr);
+	unsigned int i;
+
+	for (i = 0; i < ARC_BLOOM_HASHES; i++) {
+		unsigned int bit = arc_bloom_bit(h, i);
+
+		if (!(blk->bloom[bit / 8] & (1 << (bit % 8))))
+			return false;
+	}
+
+	return true;
+}
+
+static struct arc_conn *arc_active_find(struct btsnoop_archive *arc,
+						uint16_t index, uint16_t handle)
+{
+	unsigned int i;
+
+	for (i = 0; i < arc->num_active; i++) {
+		struct arc_conn *conn = &arc->active[i];
+
+		if (conn->index == index && conn->handle == handle)
+			return conn;
+	}
+
+	return NULL;
+}
+
+static void arc_active_add(struct btsnoop_archive *arc, uint16_t index,
+				uint16_t handle, const uint8_t *bdaddr)
+{
+	struct arc_conn *conn;
+
+	conn = arc_active_find(arc, index, handle);
+	if (!conn) {
+		if (arc->num_active < ARC_MAX_ACTIVE)
+			conn = &arc->active[arc->num_active++];
+		else
+			conn = &arc->active[handle % ARC_MAX_ACTIVE];
+	}
+
+	conn->index = index;
+	conn->handle = handle;
+	memcpy(conn->bdaddr, bdaddr, 6);
+}
+
+static void arc_active_remove(struct btsnoop_archive *arc, uint16_t index,
+							uint16_t handle)
+{
+	struct arc_conn *conn;
+
+	conn = arc_active_find(arc, index, handle);
+	if (!conn)
+		return;
+
+	*conn = arc->active[--arc->num_active];
+}
+
+/* Track connections and report the BD_ADDRs referenced by a packet */
+static void arc_track(struct btsnoop_archive *arc, uint16_t index,
+				uint16_t opcode, const uint8_t *data,
+				uint16_t size,
+				void (*func)(struct btsnoop_archive *arc,
+						uint16_t index, uint16_t handle,
+						const uint8_t *bdaddr))
+{
+	struct arc_conn *conn;
+	uint8_t num, i;
+
+	switch (opcode) {
+	case BTSNOOP_OPCODE_ACL_TX_PKT:
+	case BTSNOOP_OPCODE_ACL_RX_PKT:
+	case BTSNOOP_OPCODE_SCO_TX_PKT:
+	case BTSNOOP_OPCODE_SCO_RX_PKT:
+	case BTSNOOP_OPCODE_ISO_TX_PKT:
+	case BTSNOOP_OPCODE_ISO_RX_PKT:
+		if (size < 2)
+			return;
+
+		conn = arc_active_find(arc, index, get_le16(data) & 0x0fff);
+		if (conn)
+			func(arc, index, conn->handle, conn->bdaddr);
+		return;
+
+	case BTSNOOP_OPCODE_EVENT_PKT:
+		break;
+
+	default:
+		return;
+	}
+
+	if (size < 2)
+		return;
+
+	switch (data[0]) {
+	case 0x03:	/* Connection Complete */
+		if (size < 11 || data[2])
+			return;
+
+		arc_active_add(arc, index, get_le16(data + 3), data + 5);
+		func(arc, index, get_le16(data + 3), data + 5);
+		break;
+
+	case 0x05:	/* Disconnection Complete */
+		if (size < 5 || data[2])
+			return;
+
+		conn = arc_active_find(arc, index, get_le16(data + 3));
+		if (!conn)
+			return;
+
+		func(arc, index, conn->handle, conn->bdaddr);
+		arc_active_remove(arc, index, get_le16(data + 3));
+		break;
+
+	case 0x3e:	/* LE Meta Event */
+		if (size < 3)
+			return;
+
+		switch (data[2]) {
+		case 0x01:	/* LE Connection Complete */
+		case 0x0a:	/* LE Enhanced Connection Complete */
+			if (size < 13 || data[3])
+				return;
+
+			arc_active_add(arc, index, get_le16(data + 4),
+								data + 8);
+			func(arc, index, get_le16(data + 4), data + 8);
+			break;
+
+		case 0x02:	/* LE Advertising Report */
+			if (size < 4)
+				return;
+
+			num = data[3];
+			data += 4;
+			size -= 4;
+
+			for (i = 0; i < num && size >= 9; i++) {
+				func(arc, index, 0xffff, data + 2);
+
+				if (size < 10 + data[8])
+					return;
+
+				size -= 10 + data[8];
+				data += 10 + data[8];
+			}
+			break;
+
+		case 0x0d:	/* LE Extended Advertising Report */
+			if (size < 4)
+				return;
+
+			num = data[3];
+			data += 4;
+			size -= 4;
+
+			for (i = 0; i < num && size >= 24; i++) {
+				func(arc, index, 0xffff, data + 3);
+
+				if (size < 24 + data[23])
+					return;
+
+				size -= 24 + data[23];
+				data += 24 + data[23];
+			}
+			break;
+		}
+		break;
+	}
+}
+
+static void arc_index_bdaddr(struct btsnoop_archive *arc, uint16_t index,
+				uint16_t handle, const uint8_t *bdaddr)
+{
+	struct arc_blk *blk = &arc->blk;
+	unsigned int i;
+
+	arc_bloom_add(blk, bdaddr);
+
+	if (handle == 0xffff)
+		return;
+
+	for (i = 0; i < blk->num_conn; i++) {
+		if (arc->conn[i].index == index &&
+					arc->conn[i].handle == handle &&
+					!memcmp(arc->conn[i].bdaddr, bdaddr, 6))
+			return;
+	}
+
+	if (blk->num_conn >= ARC_MAX_CONN) {
+		blk->flags |= ARC_BLK_CONN_OVERFLOW;
+		return;
+	}
+
+	arc->conn[blk->num_conn].index = index;
+	arc->conn[blk->num_conn].handle = handle;
+	memcpy(arc->conn[blk->num_conn].bdaddr, bdaddr, 6);
+	blk->num_conn++;
+}
+
+static void arc_index_packet(struct btsnoop_archive *arc, uint64_t ts,
+				uint16_t index, uint16_t opcode,
+				const uint8_t *data, uint16_t size)
+{
+	struct arc_blk *blk = &arc->blk;
+	unsigned int i;
+
+	if (!blk->count)
+		blk->ts_first = ts;
+
+	blk->ts_last = ts;
+	blk->count++;
+
+	if (index == 0xffff)
+		goto track;
+
+	for (i = 0; i < blk->num_index; i++) {
+		if (blk->index[i] == index)
+			goto track;
+	}
+
+	if (blk->num_index < ARC_MAX_INDEX)
+		blk->index[blk->num_index++] = index;
+	else
+		blk->flags |= ARC_BLK_INDEX_OVERFLOW;
+
+track:
+	arc_track(arc, index, opcode, data, size, arc_index_bdaddr);
+}
+
+static void arc_blk_reset(struct btsnoop_archive *arc)
+{
+	unsigned int i;
+
+	memset(&arc->blk, 0, sizeof(arc->blk));
+	arc->raw_len = 0;
+
+	/* Connections still active are part of every following block so
+	 * that a reader starting there knows their addresses.
+	 */
+	for (i = 0; i < arc->num_active && i < ARC_MAX_CONN; i++)
+		arc_index_bdaddr(arc, arc->active[i].index,
+					arc->active[i].handle,
+					arc->active[i].bdaddr);
+}
+
 struct btsnoop *btsnoop_open(const char *path, unsigned long flags)
 {
 	struct btsnoop *btsnoop;
@@ -99,6 +623,22 @@ struct btsnoop *btsnoop_open(const char *path, unsigned long flags)
 
 		btsnoop->format = be32toh(hdr.type);
 		btsnoop->index = 0xffff;
+	} else if (!memcmp(hdr.id, btsnoop_archive_id,
+					sizeof(btsnoop_archive_id))) {
+		if (be32toh(hdr.version) != btsnoop_version)
+			goto failed;
+
+		btsnoop->format = be32toh(hdr.type);
+		btsnoop->index = 0xffff;
+
+		/* Only monitor records can be indexed */
+		if (btsnoop->format != BTSNOOP_FORMAT_MONITOR)
+			goto failed;
+
+		/* Block buffers are allocated when reading the first block */
+		btsnoop->archive = calloc(1, sizeof(*btsnoop->archive));
+		if (!btsnoop->archive)
+			goto failed;
 	} else {
 		if (!(btsnoop->flags & BTSNOOP_FLAG_PKLG_SUPPORT))
 			goto failed;
@@ -126,14 +666,74 @@ failed:
 	return NULL;
 }
 
+static void archive_free(struct btsnoop_archive *arc)
+{
+	if (!arc)
+		return;
+
+	free(arc->raw);
+	free(arc->comp);
+	free(arc);
+}
+
+static struct btsnoop_archive *archive_new(size_t block_size)
+{
+	struct btsnoop_archive *arc;
+
+	if (block_size < BTSNOOP_PKT_SIZE + BTSNOOP_MAX_PACKET_SIZE)
+		block_size = BTSNOOP_PKT_SIZE + BTSNOOP_MAX_PACKET_SIZE;
+
+	arc = calloc(1, sizeof(*arc));
+	if (!arc)
+		return NULL;
+
+	arc->block_size = block_size;
+	arc->raw = malloc(block_size);
+	arc->comp = malloc(block_size);
+
+	if (!arc->raw || !arc->comp) {
+		archive_free(arc);
+		return NULL;
+	}
+
+	return arc;
+}
+
+static bool write_header(struct btsnoop *btsnoop)
+{
+	struct btsnoop_hdr hdr;
+	ssize_t written;
+
+	if (btsnoop->archive)
+		memcpy(hdr.id, btsnoop_archive_id, sizeof(btsnoop_archive_id));
+	else
+		memcpy(hdr.id, btsnoop_id, sizeof(btsnoop_id));
+
+	hdr.version = htobe32(btsnoop_version);
+	hdr.type = htobe32(btsnoop->format);
+
+	written = write(btsnoop->fd, &hdr, BTSNOOP_HDR_SIZE);
+	if (written < 0)
+		return false;
+
+	btsnoop->cur_size = BTSNOOP_HDR_SIZE;
+
+	return true;
+}
+
 struct btsnoop *btsnoop_create(const char *path, size_t max_size,
 					unsigned int max_count, uint32_t format)
+{
+	return btsnoop_create_archive(path, max_size, max_count, format, 0);
+}
+
+struct btsnoop *btsnoop_create_archive(const char *path, size_t max_size,
+					unsigned int max_count, uint32_t format,
+					size_t block_size)
 {
 	struct btsnoop *btsnoop;
-	struct btsnoop_hdr hdr;
 	const char *real_path;
 	char tmp[PATH_MAX];
-	ssize_t written;
 
 	if (!max_size && max_count)
 		return NULL;
@@ -163,20 +763,22 @@ struct btsnoop *btsnoop_create(const char *path, size_t max_size,
 	btsnoop->max_count = max_count;
 	btsnoop->max_size = max_size;
 
-	memcpy(hdr.id, btsnoop_id, sizeof(btsnoop_id));
-	hdr.version = htobe32(btsnoop_version);
-	hdr.type = htobe32(btsnoop->format);
-
-	written = write(btsnoop->fd, &hdr, BTSNOOP_HDR_SIZE);
-	if (written < 0) {
-		close(btsnoop->fd);
-		free(btsnoop);
-		return NULL;
+	if (block_size) {
+		btsnoop->archive = archive_new(block_size);
+		if (!btsnoop->archive)
+			goto failed;
 	}
 
-	btsnoop->cur_size = BTSNOOP_HDR_SIZE;
+	if (!write_header(btsnoop))
+		goto failed;
 
 	return btsnoop_ref(btsnoop);
+
+failed:
+	archive_free(btsnoop->archive);
+	close(btsnoop->fd);
+	free(btsnoop);
+	return NULL;
 }
 
 struct btsnoop *btsnoop_ref(struct btsnoop *btsnoop)
@@ -197,9 +799,14 @@ void btsnoop_unref(struct btsnoop *btsnoop)
 	if (__sync_sub_and_fetch(&btsnoop->ref_count, 1))
 		return;
 
+	if (btsnoop->archive && btsnoop->path)
+		btsnoop_flush(btsnoop);
+
 	if (btsnoop->fd >= 0)
 		close(btsnoop->fd);
 
+	archive_free(btsnoop->archive);
+	archive_free(btsnoop->track);
 	free(btsnoop);
 }
 
@@ -213,9 +820,7 @@ uint32_t btsnoop_get_format(struct btsnoop *btsnoop)
 
 static bool btsnoop_rotate(struct btsnoop *btsnoop)
 {
-	struct btsnoop_hdr hdr;
 	char path[PATH_MAX];
-	ssize_t written;
 
 	close(btsnoop->fd);
 
@@ -234,15 +839,108 @@ static bool btsnoop_rotate(struct btsnoop *btsnoop)
 	if (btsnoop->fd < 0)
 		return false;
 
-	memcpy(hdr.id, btsnoop_id, sizeof(btsnoop_id));
-	hdr.version = htobe32(btsnoop_version);
-	hdr.type = htobe32(btsnoop->format);
+	return write_header(btsnoop);
+}
+
+bool btsnoop_flush(struct btsnoop *btsnoop)
+{
+	struct btsnoop_archive *arc;
+	struct arc_blk *blk;
+	size_t comp_len, conn_len;
+	struct iovec iov[3];
+	ssize_t written;
+	unsigned int i;
+
+	if (!btsnoop || !btsnoop->archive)
+		return false;
+
+	arc = btsnoop->archive;
+	blk = &arc->blk;
+
+	if (!blk->count)
+		return true;
+
+	comp_len = lz_compress(arc->raw, arc->raw_len, arc->comp,
+							arc->block_size);
+	if (comp_len && comp_len < arc->raw_len) {
+		blk->flags |= ARC_BLK_COMPRESSED;
+		iov[2].iov_base = arc->comp;
+	} else {
+		comp_len = arc->raw_len;
+		iov[2].iov_base = arc->raw;
+	}
+
+	conn_len = blk->num_conn * sizeof(struct arc_conn);
+
+	if (btsnoop->max_size && btsnoop->max_size <= btsnoop->cur_size +
+					ARC_BLK_SIZE + conn_len + comp_len)
+		if (!btsnoop_rotate(btsnoop))
+			return false;
+
+	blk->magic = htobe32(ARC_BLK_MAGIC);
+	blk->raw_len = htobe32(arc->raw_len);
+	blk->comp_len = htobe32(comp_len);
+	blk->count = htobe32(blk->count);
+	blk->ts_first = htobe64(blk->ts_first);
+	blk->ts_last = htobe64(blk->ts_last);
+
+	for (i = 0; i < blk->num_index; i++)
+		blk->index[i] = htobe16(blk->index[i]);
+
+	for (i = 0; i < blk->num_conn; i++) {
+		arc->conn[i].index = htobe16(arc->conn[i].index);
+		arc->conn[i].handle = htobe16(arc->conn[i].handle);
+	}
+
+	iov[0].iov_base = blk;
+	iov[0].iov_len = ARC_BLK_SIZE;
+	iov[1].iov_base = arc->conn;
+	iov[1].iov_len = conn_len;
+	iov[2].iov_len = comp_len;
+
+	written = writev(btsnoop->fd, iov, 3);
+
+	arc_blk_reset(arc);
 
-	written = write(btsnoop->fd, &hdr, BTSNOOP_HDR_SIZE);
 	if (written < 0)
 		return false;
 
-	btsnoop->cur_size = BTSNOOP_HDR_SIZE;
+	btsnoop->cur_size += written;
+
+	return true;
+}
+
+static bool archive_write(struct btsnoop *btsnoop, struct timeval *tv,
+				uint32_t flags, uint32_t drops,
+				const void *data, uint16_t size)
+{
+	struct btsnoop_archive *arc = btsnoop->archive;
+	struct btsnoop_pkt pkt;
+	uint64_t ts = tv_to_ts(tv);
+
+	if (arc->raw_len + BTSNOOP_PKT_SIZE + size > arc->block_size &&
+						!btsnoop_flush(btsnoop))
+		return false;
+
+	pkt.size  = htobe32(size);
+	pkt.len   = htobe32(size);
+	pkt.flags = htobe32(flags);
+	pkt.drops = htobe32(drops);
+	pkt.ts    = htobe64(ts);
+
+	memcpy(arc->raw + arc->raw_len, &pkt, BTSNOOP_PKT_SIZE);
+	arc->raw_len += BTSNOOP_PKT_SIZE;
+
+	if (data && size > 0) {
+		memcpy(arc->raw + arc->raw_len, data, size);
+		arc->raw_len += size;
+	}
+
+	if (btsnoop->format == BTSNOOP_FORMAT_MONITOR)
+		arc_index_packet(arc, ts, flags >> 16, flags & 0xffff,
+								data, size);
+	else
+		arc_index_packet(arc, ts, 0xffff, 0xffff, data, size);
 
 	return true;
 }
@@ -258,18 +956,21 @@ bool btsnoop_write(struct btsnoop *btsnoop, struct timeval *tv,
 	if (!btsnoop || !tv)
 		return false;
 
+	if (btsnoop->archive)
+		return archive_write(btsnoop, tv, flags, drops, data, size);
+
 	if (btsnoop->max_size && btsnoop->max_size <=
 			btsnoop->cur_size + size + BTSNOOP_PKT_SIZE)
 		if (!btsnoop_rotate(btsnoop))
 			return false;
 
-	ts = (tv->tv_sec - 946684800ll) * 1000000ll + tv->tv_usec;
+	ts = tv_to_ts(tv);
 
 	pkt.size  = htobe32(size);
 	pkt.len   = htobe32(size);
 	pkt.flags = htobe32(flags);
 	pkt.drops = htobe32(drops);
-	pkt.ts    = htobe64(ts + 0x00E03AB44A676000ll);
+	pkt.ts    = htobe64(ts);
 
 	written = write(btsnoop->fd, &pkt, BTSNOOP_PKT_SIZE);
 	if (written < 0)
@@ -488,7 +1189,231 @@ static uint16_t get_opcode_from_flags(uint8_t type, uint32_t flags)
 	return 0xffff;
 }
 
-bool btsnoop_read_hci(struct btsnoop *btsnoop, struct timeval *tv,
+bool btsnoop_set_filter(struct btsnoop *btsnoop,
+					const struct btsnoop_filter *filter)
+{
+	if (!btsnoop || btsnoop->path)
+		return false;
+
+	archive_free(btsnoop->track);
+	btsnoop->track = NULL;
+
+	if (!filter) {
+		btsnoop->filter_set = false;
+		return true;
+	}
+
+	if (filter->match_bdaddr && !btsnoop->archive) {
+		btsnoop->track = calloc(1, sizeof(*btsnoop->track));
+		if (!btsnoop->track)
+			return false;
+	}
+
+	btsnoop->filter = *filter;
+	btsnoop->filter_set = true;
+	btsnoop->filter_start = 0;
+	btsnoop->filter_end = UINT64_MAX;
+
+	if (filter->start.tv_sec)
+		btsnoop->filter_start = tv_to_ts(&filter->start);
+
+	if (filter->end.tv_sec)
+		btsnoop->filter_end = tv_to_ts(&filter->end);
+
+	return true;
+}
+
+static bool archive_blk_match(struct btsnoop *btsnoop)
+{
+	const struct btsnoop_filter *filter = &btsnoop->filter;
+	const struct arc_blk *blk = &btsnoop->archive->blk;
+	unsigned int i;
+
+	if (!btsnoop->filter_set)
+		return true;
+
+	if (blk->ts_last < btsnoop->filter_start ||
+				blk->ts_first > btsnoop->filter_end)
+		return false;
+
+	if (filter->index != 0xffff &&
+				!(blk->flags & ARC_BLK_INDEX_OVERFLOW)) {
+		for (i = 0; i < blk->num_index; i++) {
+			if (be16toh(blk->index[i]) == filter->index)
+				break;
+		}
+
+		if (i == blk->num_index)
+			return false;
+	}
+
+	if (filter->match_bdaddr && !arc_bloom_has(blk, filter->bdaddr))
+		return false;
+
+	return true;
+}
+
+/* Load the next block matching the filter, skipping over all others
+ * without reading or decompressing their packet records.
+ */
+static bool archive_next_blk(struct btsnoop *btsnoop)
+{
+	struct btsnoop_archive *arc = btsnoop->archive;
+	struct arc_blk *blk = &arc->blk;
+	uint32_t raw_len, comp_len;
+	size_t conn_len;
+	uint8_t *buf;
+	unsigned int i;
+	ssize_t len;
+
+	while (1) {
+		len = read(btsnoop->fd, blk, ARC_BLK_SIZE);
+		if (len == 0)
+			return false;
+
+		if (len != ARC_BLK_SIZE || be32toh(blk->magic) != ARC_BLK_MAGIC)
+			goto failed;
+
+		raw_len = be32toh(blk->raw_len);
+		comp_len = be32toh(blk->comp_len);
+		blk->count = be32toh(blk->count);
+		blk->ts_first = be64toh(blk->ts_first);
+		blk->ts_last = be64toh(blk->ts_last);
+
+		if (blk->num_conn > ARC_MAX_CONN ||
+					blk->num_index > ARC_MAX_INDEX)
+			goto failed;
+
+		conn_len = blk->num_conn * sizeof(struct arc_conn);
+
+		len = read(btsnoop->fd, arc->conn, conn_len);
+		if (len < 0 || (size_t) len != conn_len)
+			goto failed;
+
+		if (archive_blk_match(btsnoop))
+			break;
+
+		if (lseek(btsnoop->fd, comp_len, SEEK_CUR) < 0)
+			goto failed;
+	}
+
+	if (raw_len > arc->block_size || comp_len > arc->block_size) {
+		size_t size = raw_len > comp_len ? raw_len : comp_len;
+
+		buf = realloc(arc->raw, size);
+		if (!buf)
+			goto failed;
+
+		arc->raw = buf;
+
+		buf = realloc(arc->comp, size);
+		if (!buf)
+			goto failed;
+
+		arc->comp = buf;
+		arc->block_size = size;
+	}
+
+	buf = (blk->flags & ARC_BLK_COMPRESSED) ? arc->comp : arc->raw;
+
+	len = read(btsnoop->fd, buf, comp_len);
+	if (len < 0 || (size_t) len != comp_len)
+		goto failed;
+
+	if ((blk->flags & ARC_BLK_COMPRESSED) &&
+			lz_decompress(arc->comp, comp_len, arc->raw,
+						raw_len) != raw_len)
+		goto failed;
+
+	arc->raw_len = raw_len;
+	arc->offset = 0;
+
+	/* Blocks list the connections that are active at their start */
+	for (i = 0; i < blk->num_conn; i++)
+		arc_active_add(arc, be16toh(arc->conn[i].index),
+					be16toh(arc->conn[i].handle),
+					arc->conn[i].bdaddr);
+
+	return true;
+
+failed:
+	btsnoop->aborted = true;
+	return false;
+}
+
+static ssize_t read_data(struct btsnoop *btsnoop, void *data, size_t size)
+{
+	struct btsnoop_archive *arc = btsnoop->archive;
+
+	if (!arc)
+		return read(btsnoop->fd, data, size);
+
+	/* Packet records never cross block boundaries */
+	if (arc->offset == arc->raw_len && !archive_next_blk(btsnoop))
+		return 0;
+
+	if (size > arc->raw_len - arc->offset)
+		return -1;
+
+	memcpy(data, arc->raw + arc->offset, size);
+	arc->offset += size;
+
+	return size;
+}
+
+static void match_bdaddr(struct btsnoop_archive *arc, uint16_t index,
+				uint16_t handle, const uint8_t *bdaddr)
+{
+	if (!memcmp(arc->bdaddr, bdaddr, 6))
+		arc->matched = true;
+}
+
+static bool filter_match(struct btsnoop *btsnoop, struct timeval *tv,
+				uint16_t index, uint16_t opcode,
+				const void *data, uint16_t size)
+{
+	const struct btsnoop_filter *filter = &btsnoop->filter;
+	struct btsnoop_archive *arc;
+	uint64_t ts = tv_to_ts(tv);
+
+	if (ts < btsnoop->filter_start || ts > btsnoop->filter_end)
+		return false;
+
+	switch (opcode) {
+	case BTSNOOP_OPCODE_NEW_INDEX:
+	case BTSNOOP_OPCODE_DEL_INDEX:
+	case BTSNOOP_OPCODE_OPEN_INDEX:
+	case BTSNOOP_OPCODE_CLOSE_INDEX:
+	case BTSNOOP_OPCODE_INDEX_INFO:
+		/* Keep controller information for decoding */
+		return filter->index == 0xffff || filter->index == index;
+	}
+
+	if (filter->index != 0xffff && filter->index != index)
+		return false;
+
+	if (!filter->match_bdaddr)
+		return true;
+
+	arc = btsnoop->archive ? btsnoop->archive : btsnoop->track;
+
+	memcpy(arc->bdaddr, filter->bdaddr, 6);
+	arc->matched = false;
+
+	arc_track(arc, index, opcode, data, size, match_bdaddr);
+	if (arc->matched)
+		return true;
+
+	switch (opcode) {
+	case BTSNOOP_OPCODE_COMMAND_PKT:
+	case BTSNOOP_OPCODE_EVENT_PKT:
+		return memmem(data, size, filter->bdaddr, 6) != NULL;
+	}
+
+	return false;
+}
+
+static bool read_hci(struct btsnoop *btsnoop, struct timeval *tv,
 					uint16_t *index, uint16_t *opcode,
 					void *data, uint16_t *size)
 {
@@ -501,10 +1426,7 @@ bool btsnoop_read_hci(struct btsnoop *btsnoop, struct timeval *tv,
 	if (!btsnoop || btsnoop->aborted)
 		return false;
 
-	if (btsnoop->pklg_format)
-		return pklg_read_hci(btsnoop, tv, index, opcode, data, size);
-
-	len = read(btsnoop->fd, &pkt, BTSNOOP_PKT_SIZE);
+	len = read_data(btsnoop, &pkt, BTSNOOP_PKT_SIZE);
 	if (len == 0)
 		return false;
 
@@ -532,7 +1454,7 @@ bool btsnoop_read_hci(struct btsnoop *btsnoop, struct timeval *tv,
 		break;
 
 	case BTSNOOP_FORMAT_UART:
-		len = read(btsnoop->fd, &pkt_type, 1);
+		len = read_data(btsnoop, &pkt_type, 1);
 		if (len < 0) {
 			btsnoop->aborted = true;
 			return false;
@@ -553,7 +1475,7 @@ bool btsnoop_read_hci(struct btsnoop *btsnoop, struct timeval *tv,
 		return false;
 	}
 
-	len = read(btsnoop->fd, data, toread);
+	len = read_data(btsnoop, data, toread);
 	if (len < 0) {
 		btsnoop->aborted = true;
 		return false;
@@ -564,6 +1486,33 @@ bool btsnoop_read_hci(struct btsnoop *btsnoop, struct timeval *tv,
 	return true;
 }
 
+bool btsnoop_read_hci(struct btsnoop *btsnoop, struct timeval *tv,
+					uint16_t *index, uint16_t *opcode,
+					void *data, uint16_t *size)
+{
+	if (!btsnoop || btsnoop->aborted)
+		return false;
+
+	while (1) {
+		bool result;
+
+		if (btsnoop->pklg_format)
+			result = pklg_read_hci(btsnoop, tv, index, opcode,
+								data, size);
+		else
+			result = read_hci(btsnoop, tv, index, opcode,
+								data, size);
+
+		if (!result)
+			return false;
+
+		if (!btsnoop->filter_set ||
+				filter_match(btsnoop, tv, *index, *opcode,
+								data, *size))
+			return true;
+	}
+}
+
 bool btsnoop_read_phy(struct btsnoop *btsnoop, struct timeval *tv,
 			uint16_t *frequency, void *data, uint16_t *size)
 {
@@ -87,10 +87,25 @@ struct btsnoop_opcode_user_logging {
 
 struct btsnoop;
 
+struct btsnoop_filter {
+	struct timeval start;		/* tv_sec of 0 means no lower bound */
+	struct timeval end;		/* tv_sec of 0 means no upper bound */
+	uint16_t index;			/* 0xffff matches any index */
+	bool match_bdaddr;
+	uint8_t bdaddr[6];		/* Little endian as on the wire */
+};
+
 struct btsnoop *btsnoop_open(const char *path, unsigned long flags);
 struct btsnoop *btsnoop_create(const char *path, size_t max_size,
 				unsigned int max_count, uint32_t format);
 
+struct btsnoop *btsnoop_create_archive(const char *path, size_t max_size,
+					unsigned int max_count, uint32_t format,
+					size_t block_size);
+bool btsnoop_flush(struct btsnoop *btsnoop);
+bool btsnoop_set_filter(struct btsnoop *btsnoop,
+					const struct btsnoop_filter *filter);
+
 struct btsnoop *btsnoop_ref(struct btsnoop *btsnoop);
 void btsnoop_unref(struct btsnoop *btsnoop);
 
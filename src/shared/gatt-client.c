@@ -103,6 +103,7 @@ struct bt_gatt_client {
 	unsigned int next_request_id;
 
 	struct bt_gatt_request *discovery_req;
+	struct queue *discovery_reqs;
 	unsigned int mtu_req_id;
 };
 
@@ -334,6 +335,47 @@ struct handle_range {
 	uint16_t end;
 };
 
+struct chrc_desc {
+	uint16_t handle;
+	bt_uuid_t uuid;
+};
+
+struct chrc {
+	uint16_t start_handle;
+	uint16_t end_handle;
+	uint16_t value_handle;
+	uint8_t properties;
+	bt_uuid_t uuid;
+	struct queue *descs;
+	bool discovered;
+	uint16_t ext_prop_handle;	/* Pending bulk read */
+	uint8_t ext_prop[2];
+	uint16_t ext_prop_len;
+};
+
+static void chrc_free(void *data)
+{
+	struct chrc *chrc = data;
+
+	queue_destroy(chrc->descs, free);
+	free(chrc);
+}
+
+/* Handle range of a single service discovered in parallel */
+struct svc_range {
+	uint16_t start;
+	uint16_t end;
+	struct queue *chrcs;
+};
+
+static void svc_range_free(void *data)
+{
+	struct svc_range *range = data;
+
+	queue_destroy(range->chrcs, chrc_free);
+	free(range);
+}
+
 struct discovery_op;
 
 typedef void (*discovery_op_complete_func_t)(struct discovery_op *op,
@@ -346,7 +388,12 @@ struct discovery_op {
 	struct queue *discov_ranges;
 	struct queue *pending_svcs;
 	struct queue *pending_chrcs;
-	struct queue *ext_prop_desc;
+	struct queue *disc_chrcs;
+	struct queue *svc_ranges;
+	const struct queue_entry *next_range;
+	struct queue *ext_props;
+	unsigned int disc_reqs;
+	bool read_mult;
 	struct gatt_db_attribute *cur_svc;
 	struct gatt_db_attribute *hash;
 	uint8_t server_feat;
@@ -362,6 +409,24 @@ struct discovery_op {
 	discovery_op_fail_func_t failure_func;
 };
 
+/*
+ * Parallel discovery request: either included services and characteristics
+ * of a service range, descriptors of a single characteristic or a bulk read
+ * of extended properties.
+ */
+struct disc_req {
+	struct discovery_op *op;
+	struct svc_range *range;
+	struct chrc *chrc;
+	struct queue *chrcs;
+	struct bt_gatt_request *req;
+	unsigned int read_id;
+	uint8_t read_opcode;
+	unsigned int index;
+	uint8_t att_ecode;
+	bool failed;
+};
+
 static void discovery_op_free(struct discovery_op *op)
 {
 	if (op->db_id > 0)
@@ -369,8 +434,10 @@ static void discovery_op_free(struct discovery_op *op)
 
 	queue_destroy(op->discov_ranges, free);
 	queue_destroy(op->pending_svcs, NULL);
-	queue_destroy(op->pending_chrcs, free);
-	queue_destroy(op->ext_prop_desc, NULL);
+	queue_destroy(op->pending_chrcs, chrc_free);
+	queue_destroy(op->disc_chrcs, chrc_free);
+	queue_destroy(op->svc_ranges, svc_range_free);
+	queue_destroy(op->ext_props, NULL);
 	free(op);
 }
 
@@ -448,7 +515,9 @@ static struct discovery_op *discovery_op_create(struct bt_gatt_client *client,
 	op->discov_ranges = queue_new();
 	op->pending_svcs = queue_new();
 	op->pending_chrcs = queue_new();
-	op->ext_prop_desc = queue_new();
+	op->disc_chrcs = queue_new();
+	op->svc_ranges = queue_new();
+	op->ext_props = queue_new();
 	op->client = client;
 	op->complete_func = complete_func;
 	op->failure_func = failure_func;
@@ -512,10 +581,9 @@ static void discover_chrcs_cb(bool success, uint8_t att_ecode,
 						struct bt_gatt_result *result,
 						void *user_data);
 
-static void discover_incl_cb(bool success, uint8_t att_ecode,
-				struct bt_gatt_result *result, void *user_data)
+static bool discovery_insert_includes(struct discovery_op *op,
+						struct bt_gatt_result *result)
 {
-	struct discovery_op *op = user_data;
 	struct bt_gatt_client *client = op->client;
 	struct bt_gatt_iter iter;
 	struct gatt_db_attribute *attr;
@@ -524,23 +592,13 @@ static void discover_incl_cb(bool success, uint8_t att_ecode,
 	bt_uuid_t uuid;
 	char uuid_str[MAX_LEN_UUID_STR];
 	unsigned int includes_count, i;
-	struct handle_range *range;
-
-	discovery_req_clear(client);
-
-	if (!success) {
-		if (att_ecode == BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND)
-			goto next;
-
-		goto failed;
-	}
 
 	if (!result || !bt_gatt_iter_init(&iter, result))
-		goto failed;
+		return false;
 
 	includes_count = bt_gatt_result_included_count(result);
 	if (includes_count == 0)
-		goto failed;
+		return false;
 
 	util_debug(client->debug_callback, client->debug_data,
 						"Included services found: %u",
@@ -563,7 +621,7 @@ static void discover_incl_cb(bool success, uint8_t att_ecode,
 		if (!attr) {
 			util_debug(client->debug_callback, client->debug_data,
 				"Unable to find attribute at 0x%04x", start);
-			goto failed;
+			return false;
 		}
 
 		attr = gatt_db_insert_included(client->db, handle, attr);
@@ -571,7 +629,7 @@ static void discover_incl_cb(bool success, uint8_t att_ecode,
 			util_debug(client->debug_callback, client->debug_data,
 				"Unable to add include attribute at 0x%04x",
 				handle);
-			goto failed;
+			return false;
 		}
 
 		/*
@@ -584,10 +642,32 @@ static void discover_incl_cb(bool success, uint8_t att_ecode,
 			util_debug(client->debug_callback, client->debug_data,
 				"Invalid attribute 0x%04x expect it at 0x%04x",
 				gatt_db_attribute_get_handle(attr), handle);
-			goto failed;
+			return false;
 		}
 	}
 
+	return true;
+}
+
+static void discover_incl_cb(bool success, uint8_t att_ecode,
+				struct bt_gatt_result *result, void *user_data)
+{
+	struct discovery_op *op = user_data;
+	struct bt_gatt_client *client = op->client;
+	struct handle_range *range;
+
+	discovery_req_clear(client);
+
+	if (!success) {
+		if (att_ecode == BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND)
+			goto next;
+
+		goto failed;
+	}
+
+	if (!discovery_insert_includes(op, result))
+		goto failed;
+
 next:
 	range = queue_pop_head(op->discov_ranges);
 	if (!range)
@@ -610,138 +690,205 @@ failed:
 	discovery_op_complete(op, false, att_ecode);
 }
 
-struct chrc {
-	uint16_t start_handle;
-	uint16_t end_handle;
-	uint16_t value_handle;
+static bool discovery_parse_chrcs(struct discovery_op *op,
+						struct bt_gatt_result *result,
+						struct queue *chrcs)
+{
+	struct bt_gatt_client *client = op->client;
+	struct bt_gatt_iter iter;
+	struct chrc *chrc_data;
+	uint16_t start, end, value;
 	uint8_t properties;
+	uint128_t u128;
 	bt_uuid_t uuid;
-};
+	char uuid_str[MAX_LEN_UUID_STR];
+	unsigned int chrc_count;
+
+	if (!result || !bt_gatt_iter_init(&iter, result))
+		return false;
+
+	chrc_count = bt_gatt_result_characteristic_count(result);
+	util_debug(client->debug_callback, client->debug_data,
+				"Characteristics found: %u", chrc_count);
+
+	if (chrc_count == 0)
+		return false;
+
+	while (bt_gatt_iter_next_characteristic(&iter, &start, &end, &value,
+						&properties, u128.data)) {
+		bt_uuid128_create(&uuid, u128);
+
+		/* Log debug message */
+		bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+		util_debug(client->debug_callback, client->debug_data,
+				"start: 0x%04x, end: 0x%04x, value: 0x%04x, "
+				"props: 0x%02x, uuid: %s",
+				start, end, value, properties, uuid_str);
+
+		chrc_data = new0(struct chrc, 1);
+
+		chrc_data->start_handle = start;
+		chrc_data->end_handle = end;
+		chrc_data->value_handle = value;
+		chrc_data->properties = properties;
+		chrc_data->uuid = uuid;
+		chrc_data->descs = queue_new();
+
+		queue_push_tail(chrcs, chrc_data);
+	}
+
+	return true;
+}
 
 static void discover_descs_cb(bool success, uint8_t att_ecode,
 						struct bt_gatt_result *result,
 						void *user_data);
 
-static bool discover_descs(struct discovery_op *op, bool *discovering)
+static struct disc_req *disc_req_new(struct discovery_op *op)
 {
-	struct bt_gatt_client *client = op->client;
-	struct gatt_db_attribute *attr;
-	struct chrc *chrc_data;
-	uint16_t desc_start;
+	struct disc_req *dreq;
 
-	*discovering = false;
+	dreq = new0(struct disc_req, 1);
+	dreq->op = discovery_op_ref(op);
 
-	while ((chrc_data = queue_pop_head(op->pending_chrcs))) {
-		struct gatt_db_attribute *svc;
-		uint16_t start, end;
+	op->disc_reqs++;
+	queue_push_tail(op->client->discovery_reqs, dreq);
 
-		/* Adjust current service */
-		svc = gatt_db_get_service(client->db, chrc_data->value_handle);
-		if (op->cur_svc != svc) {
-			if (op->cur_svc) {
-				queue_remove(op->pending_svcs, op->cur_svc);
+	return dreq;
+}
 
-				/* Done with the current service */
-				gatt_db_service_set_active(op->cur_svc, true);
-			}
+static void disc_req_free(struct disc_req *dreq)
+{
+	struct discovery_op *op = dreq->op;
 
-			op->cur_svc = svc;
-		}
+	queue_remove(op->client->discovery_reqs, dreq);
+	op->disc_reqs--;
 
-		attr = gatt_db_insert_characteristic(client->db,
-							chrc_data->value_handle,
-							&chrc_data->uuid, 0,
-							chrc_data->properties,
-							NULL, NULL, NULL);
+	queue_destroy(dreq->chrcs, NULL);
+	bt_gatt_request_unref(dreq->req);
+	free(dreq);
 
-		if (!attr) {
-			util_debug(client->debug_callback, client->debug_data,
-				"Failed to insert characteristic at 0x%04x",
-				chrc_data->value_handle);
+	discovery_op_unref(op);
+}
 
-			/* Some devices have been seen reporting orphaned
-			 * characteristics.  In order to favor interoperability
-			 * we skip over characteristics in error
-			 */
-			free(chrc_data);
-			continue;
-		}
+static void disc_req_cancel(void *data)
+{
+	struct disc_req *dreq = data;
+	unsigned int read_id = dreq->read_id;
 
-		if (gatt_db_attribute_get_handle(attr) !=
-							chrc_data->value_handle)
-			goto failed;
+	bt_gatt_request_cancel(dreq->req);
 
-		gatt_db_attribute_get_service_handles(svc, &start, &end);
+	/* Reset read_id first so the destroy callback knows it was canceled */
+	dreq->read_id = 0;
+	if (read_id)
+		bt_gatt_client_cancel(dreq->op->client, read_id);
 
-		/*
-		 * Adjust end_handle in case the next chrc is not within the
-		 * same service.
-		 */
-		if (chrc_data->end_handle > end)
-			chrc_data->end_handle = end;
+	disc_req_free(dreq);
+}
 
-		/*
-		 * check for descriptors presence, before initializing the
-		 * desc_handle and avoid integer overflow during desc_handle
-		 * initialization.
+static bool match_disc_req_op(const void *data, const void *user_data)
+{
+	const struct disc_req *dreq = data;
+
+	return dreq->op == user_data;
+}
+
+static void discovery_reqs_cancel(struct discovery_op *op)
+{
+	queue_remove_all(op->client->discovery_reqs, match_disc_req_op, op,
+							disc_req_cancel);
+}
+
+/*
+ * Insert the characteristic declaration and start discovering its
+ * descriptors. Returns false on error, sets *orphan if the declaration
+ * could not be inserted in which case the characteristic is skipped.
+ */
+static bool discover_chrc_descs(struct discovery_op *op, struct chrc *chrc,
+								bool *orphan)
+{
+	struct bt_gatt_client *client = op->client;
+	struct gatt_db_attribute *svc, *attr;
+	struct disc_req *dreq;
+	uint16_t start, end, desc_start;
+
+	*orphan = false;
+
+	attr = gatt_db_insert_characteristic(client->db, chrc->value_handle,
+							&chrc->uuid, 0,
+							chrc->properties,
+							NULL, NULL, NULL);
+	if (!attr) {
+		util_debug(client->debug_callback, client->debug_data,
+				"Failed to insert characteristic at 0x%04x",
+				chrc->value_handle);
+
+		/* Some devices have been seen reporting orphaned
+		 * characteristics.  In order to favor interoperability
+		 * we skip over characteristics in error
 		 */
-		if (chrc_data->value_handle >= chrc_data->end_handle) {
-			free(chrc_data);
-			continue;
-		}
+		*orphan = true;
+		return true;
+	}
+
+	if (gatt_db_attribute_get_handle(attr) != chrc->value_handle)
+		return false;
 
-		desc_start = chrc_data->value_handle + 1;
+	svc = gatt_db_get_service(client->db, chrc->value_handle);
+
+	/*
+	 * Adjust end_handle in case the next chrc is not within the
+	 * same service.
+	 */
+	if (gatt_db_attribute_get_service_handles(svc, &start, &end) &&
+						chrc->end_handle > end)
+		chrc->end_handle = end;
+
+	/*
+	 * check for descriptors presence, before initializing the
+	 * desc_handle and avoid integer overflow during desc_handle
+	 * initialization.
+	 */
+	if (chrc->value_handle >= chrc->end_handle) {
+		chrc->discovered = true;
+		return true;
+	}
 
-		if (desc_start == chrc_data->end_handle &&
-			(chrc_data->properties & BT_GATT_CHRC_PROP_NOTIFY ||
-			 chrc_data->properties & BT_GATT_CHRC_PROP_INDICATE)) {
-			bt_uuid_t ccc_uuid;
+	desc_start = chrc->value_handle + 1;
 
-			/* If there is only one descriptor that must be the CCC
-			 * in case either notify or indicate are supported.
-			 */
-			bt_uuid16_create(&ccc_uuid,
-					GATT_CLIENT_CHARAC_CFG_UUID);
-			attr = gatt_db_insert_descriptor(client->db, desc_start,
+	if (desc_start == chrc->end_handle &&
+			(chrc->properties & BT_GATT_CHRC_PROP_NOTIFY ||
+			 chrc->properties & BT_GATT_CHRC_PROP_INDICATE)) {
+		bt_uuid_t ccc_uuid;
+
+		/* If there is only one descriptor that must be the CCC
+		 * in case either notify or indicate are supported.
+		 */
+		bt_uuid16_create(&ccc_uuid, GATT_CLIENT_CHARAC_CFG_UUID);
+		attr = gatt_db_insert_descriptor(client->db, desc_start,
 							&ccc_uuid, 0, NULL,
 							NULL, NULL);
-			if (attr) {
-				free(chrc_data);
-				continue;
-			}
+		if (attr) {
+			chrc->discovered = true;
+			return true;
 		}
+	}
 
-		/* Check if the start range is within characteristic range */
-		if (desc_start > chrc_data->end_handle) {
-			free(chrc_data);
-			continue;
-		}
+	dreq = disc_req_new(op);
+	dreq->chrc = chrc;
 
-		client->discovery_req = bt_gatt_discover_descriptors(
-							client->att, desc_start,
-							chrc_data->end_handle,
+	dreq->req = bt_gatt_discover_descriptors(client->att, desc_start,
+							chrc->end_handle,
 							discover_descs_cb,
-							discovery_op_ref(op),
-							discovery_op_unref);
-		if (client->discovery_req) {
-			*discovering = true;
-			goto done;
-		}
-
+							dreq, NULL);
+	if (!dreq->req) {
 		util_debug(client->debug_callback, client->debug_data,
 					"Failed to start descriptor discovery");
-		discovery_op_unref(op);
-
-		goto failed;
+		disc_req_free(dreq);
+		return false;
 	}
 
-done:
-	free(chrc_data);
 	return true;
-
-failed:
-	free(chrc_data);
-	return false;
 }
 
 static void ext_prop_write_cb(struct gatt_db_attribute *attrib,
@@ -753,59 +900,309 @@ static void ext_prop_write_cb(struct gatt_db_attribute *attrib,
 						"Value set status: %d", err);
 }
 
+static bool insert_descs(struct discovery_op *op, struct chrc *chrc)
+{
+	struct bt_gatt_client *client = op->client;
+	struct gatt_db_attribute *svc, *attr;
+	const struct queue_entry *entry;
+	bt_uuid_t ext_prop_uuid;
+
+	/* Adjust current service */
+	svc = gatt_db_get_service(client->db, chrc->value_handle);
+	if (op->cur_svc != svc) {
+		if (op->cur_svc) {
+			queue_remove(op->pending_svcs, op->cur_svc);
+
+			/* Done with the current service */
+			gatt_db_service_set_active(op->cur_svc, true);
+		}
+
+		op->cur_svc = svc;
+	}
+
+	bt_uuid16_create(&ext_prop_uuid, GATT_CHARAC_EXT_PROPER_UUID);
+
+	for (entry = queue_get_entries(chrc->descs); entry;
+						entry = entry->next) {
+		struct chrc_desc *desc = entry->data;
+
+		attr = gatt_db_insert_descriptor(client->db, desc->handle,
+							&desc->uuid, 0, NULL,
+							NULL, NULL);
+		if (!attr) {
+			attr = gatt_db_get_attribute(client->db, desc->handle);
+			if (attr && !bt_uuid_cmp(&desc->uuid,
+					gatt_db_attribute_get_type(attr)))
+				continue;
+
+			util_debug(client->debug_callback, client->debug_data,
+				"Failed to insert descriptor at 0x%04x",
+				desc->handle);
+			return false;
+		}
+
+		if (gatt_db_attribute_get_handle(attr) != desc->handle)
+			return false;
+
+		if (bt_uuid_cmp(&ext_prop_uuid, &desc->uuid) ||
+						!chrc->ext_prop_len)
+			continue;
+
+		if (!gatt_db_attribute_write(attr, 0, chrc->ext_prop,
+						chrc->ext_prop_len, 0, NULL,
+						ext_prop_write_cb, client))
+			return false;
+	}
+
+	return true;
+}
+
 static void ext_prop_read_cb(bool success, uint8_t att_ecode,
 					const uint8_t *value, uint16_t length,
 					void *user_data);
 
-static bool read_ext_prop_desc(struct discovery_op *op)
-{
-	struct bt_gatt_client *client = op->client;
-	uint16_t handle;
-	struct gatt_db_attribute *attr;
+static bool read_ext_prop(struct discovery_op *op, struct chrc *chrc)
+{
+	struct disc_req *dreq;
+	uint16_t handle = chrc->ext_prop_handle;
+
+	chrc->ext_prop_handle = 0;
+
+	dreq = disc_req_new(op);
+	dreq->chrc = chrc;
+
+	dreq->read_id = bt_gatt_client_read_value(op->client, handle,
+							ext_prop_read_cb,
+							dreq, NULL);
+	if (!dreq->read_id) {
+		disc_req_free(dreq);
+		return false;
+	}
+
+	return true;
+}
+
+static void ext_prop_set(struct chrc *chrc, const uint8_t *value,
+							uint16_t length)
+{
+	chrc->ext_prop_len = MIN(length, sizeof(chrc->ext_prop));
+	memcpy(chrc->ext_prop, value, chrc->ext_prop_len);
+}
+
+static void ext_props_read_cb(bool success, uint8_t att_ecode,
+					const uint8_t *value, uint16_t length,
+					void *user_data)
+{
+	struct disc_req *dreq = user_data;
+	const struct queue_entry *entry;
+	unsigned int i, count = queue_length(dreq->chrcs);
+
+	if (!success) {
+		dreq->failed = true;
+		dreq->att_ecode = att_ecode;
+		return;
+	}
+
+	entry = queue_get_entries(dreq->chrcs);
+
+	/* Read Multiple responses carry all the fixed size values at once */
+	if (dreq->read_opcode == BT_ATT_OP_READ_MULT_REQ) {
+		for (; entry && length >= 2; entry = entry->next) {
+			ext_prop_set(entry->data, value, 2);
+			value += 2;
+			length -= 2;
+		}
+
+		dreq->index = count;
+		return;
+	}
+
+	/* Read Multiple Variable responses are reported per value */
+	for (i = 0; entry && i < dreq->index; i++)
+		entry = entry->next;
+
+	if (!entry)
+		return;
+
+	ext_prop_set(entry->data, value, length);
+	dreq->index++;
+}
+
+static void discover_descs_done(struct disc_req *dreq, bool success,
+							uint8_t att_ecode);
+
+static void ext_props_read_destroy(void *user_data)
+{
+	struct disc_req *dreq = user_data;
+	struct discovery_op *op = dreq->op;
+	const struct queue_entry *entry;
+	bool success = true;
+
+	/* Canceled */
+	if (!dreq->read_id)
+		return;
+
+	dreq->read_id = 0;
+
+	/* Fall back to reading the values one by one if the remote does not
+	 * support reading multiple values.
+	 */
+	if (dreq->failed) {
+		if (dreq->att_ecode != BT_ATT_ERROR_REQUEST_NOT_SUPPORTED) {
+			discover_descs_done(dreq, false, dreq->att_ecode);
+			return;
+		}
+
+		op->read_mult = false;
+	}
+
+	for (entry = queue_get_entries(dreq->chrcs); entry;
+						entry = entry->next) {
+		struct chrc *chrc = entry->data;
+
+		if (!op->read_mult) {
+			if (!read_ext_prop(op, chrc))
+				success = false;
+			continue;
+		}
+
+		chrc->ext_prop_handle = 0;
+		chrc->discovered = true;
+	}
+
+	discover_descs_done(dreq, success, 0);
+}
+
+/* Read Multiple Variable is used when the server supports EATT */
+static uint8_t read_multiple_opcode(struct bt_gatt_client *client)
+{
+	if (bt_gatt_client_get_features(client) & BT_GATT_CHRC_CLI_FEAT_EATT)
+		return BT_ATT_OP_READ_MULT_VL_REQ;
+
+	return BT_ATT_OP_READ_MULT_REQ;
+}
+
+/*
+ * Read the pending extended properties in bulk once there is enough of
+ * them to fill a request or nothing else is left to discover.
+ */
+static bool read_ext_props(struct discovery_op *op)
+{
+	struct bt_gatt_client *client = op->client;
+	struct disc_req *dreq;
+	uint16_t handles[UINT8_MAX];
+	unsigned int max, count;
+
+	if (queue_isempty(op->ext_props))
+		return true;
+
+	/* Each value takes 4 octets in a Read Multiple Variable response */
+	max = MIN((bt_att_get_mtu(client->att) - 1) / 4, UINT8_MAX);
+
+	if (queue_length(op->ext_props) < max &&
+			(!queue_isempty(op->pending_chrcs) || op->disc_reqs))
+		return true;
+
+	if (queue_length(op->ext_props) == 1 || max < 2)
+		return read_ext_prop(op, queue_pop_head(op->ext_props));
+
+	dreq = disc_req_new(op);
+	dreq->chrcs = queue_new();
+
+	for (count = 0; count < max; count++) {
+		struct chrc *chrc = queue_pop_head(op->ext_props);
+
+		if (!chrc)
+			break;
+
+		handles[count] = chrc->ext_prop_handle;
+		queue_push_tail(dreq->chrcs, chrc);
+	}
+
+	dreq->read_opcode = read_multiple_opcode(client);
+	dreq->read_id = bt_gatt_client_read_multiple(client, handles, count,
+							ext_props_read_cb,
+							dreq,
+							ext_props_read_destroy);
+	if (!dreq->read_id) {
+		disc_req_free(dreq);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Descriptors are discovered for as many characteristics in parallel as
+ * there are ATT bearers, but the results are inserted into the database
+ * in handle order so services are still completed one at a time.
+ */
+static bool discover_descs(struct discovery_op *op, bool *discovering)
+{
+	struct bt_gatt_client *client = op->client;
+	struct chrc *chrc;
+	unsigned int max;
+	bool orphan;
+
+	max = bt_att_get_channels(client->att);
+	if (!max)
+		max = 1;
+
+	while (1) {
+		/* Insert characteristics whose descriptors are known */
+		while ((chrc = queue_peek_head(op->disc_chrcs)) &&
+							chrc->discovered) {
+			bool ok;
+
+			queue_pop_head(op->disc_chrcs);
+			ok = insert_descs(op, chrc);
+			chrc_free(chrc);
+
+			if (!ok)
+				goto failed;
+		}
+
+		if (op->disc_reqs >= max)
+			break;
+
+		chrc = queue_pop_head(op->pending_chrcs);
+		if (!chrc)
+			break;
+
+		queue_push_tail(op->disc_chrcs, chrc);
 
-	attr = queue_peek_head(op->ext_prop_desc);
-	if (!attr)
-		return false;
+		if (!discover_chrc_descs(op, chrc, &orphan))
+			goto failed;
 
-	handle = gatt_db_attribute_get_handle(attr);
+		/* Skip orphaned characteristics without any request */
+		if (orphan) {
+			queue_remove(op->disc_chrcs, chrc);
+			chrc_free(chrc);
+		}
+	}
 
-	if (!bt_gatt_client_read_value(client, handle, ext_prop_read_cb,
-							discovery_op_ref(op),
-							discovery_op_unref))
-		return false;
+	if (!read_ext_props(op))
+		goto failed;
+
+	*discovering = !queue_isempty(op->disc_chrcs);
 
 	return true;
+
+failed:
+	discovery_reqs_cancel(op);
+	return false;
 }
 
-static void ext_prop_read_cb(bool success, uint8_t att_ecode,
-					const uint8_t *value, uint16_t length,
-					void *user_data)
+static void discovery_descs_next(struct discovery_op *op, bool success,
+							uint8_t att_ecode)
 {
-	struct discovery_op *op = user_data;
-	struct bt_gatt_client *client = op->client;
 	bool discovering;
-	struct gatt_db_attribute *desc_attr = NULL;
 
 	if (!success)
 		goto done;
 
-	util_debug(client->debug_callback, client->debug_data,
-				"Ext. prop value: 0x%04x", (uint16_t)value[0]);
-
-	desc_attr = queue_pop_head(op->ext_prop_desc);
-	if (!desc_attr)
-		goto failed;
-
-	if (!gatt_db_attribute_write(desc_attr, 0, value, length, 0, NULL,
-						ext_prop_write_cb, client))
-		goto failed;
-
-	/* Any other descriptor to read? */
-	if (read_ext_prop_desc(op))
-		return;
-
 	if (!discover_descs(op, &discovering))
-			goto failed;
+		goto failed;
 
 	if (discovering)
 		return;
@@ -819,32 +1216,65 @@ failed:
 	success = false;
 
 done:
+	if (!success)
+		discovery_reqs_cancel(op);
+
 	discovery_op_complete(op, success, att_ecode);
 }
 
+static void discover_descs_done(struct disc_req *dreq, bool success,
+							uint8_t att_ecode)
+{
+	struct discovery_op *op = discovery_op_ref(dreq->op);
+
+	if (success && dreq->chrc && !dreq->chrc->ext_prop_handle)
+		dreq->chrc->discovered = true;
+
+	disc_req_free(dreq);
+
+	discovery_descs_next(op, success, att_ecode);
+
+	discovery_op_unref(op);
+}
+
+static void ext_prop_read_cb(bool success, uint8_t att_ecode,
+					const uint8_t *value, uint16_t length,
+					void *user_data)
+{
+	struct disc_req *dreq = user_data;
+	struct bt_gatt_client *client = dreq->op->client;
+
+	dreq->read_id = 0;
+
+	if (success && length) {
+		util_debug(client->debug_callback, client->debug_data,
+				"Ext. prop value: 0x%04x", (uint16_t)value[0]);
+
+		ext_prop_set(dreq->chrc, value, length);
+	}
+
+	discover_descs_done(dreq, success, att_ecode);
+}
+
 static void discover_descs_cb(bool success, uint8_t att_ecode,
 						struct bt_gatt_result *result,
 						void *user_data)
 {
-	struct discovery_op *op = user_data;
+	struct disc_req *dreq = user_data;
+	struct discovery_op *op = dreq->op;
+	struct chrc *chrc = dreq->chrc;
 	struct bt_gatt_client *client = op->client;
 	struct bt_gatt_iter iter;
-	struct gatt_db_attribute *attr;
+	struct chrc_desc *desc;
 	uint16_t handle;
 	uint128_t u128;
-	bt_uuid_t uuid;
 	char uuid_str[MAX_LEN_UUID_STR];
 	unsigned int desc_count;
-	bool discovering;
 	bt_uuid_t ext_prop_uuid;
 
-	discovery_req_clear(client);
-
 	if (!success) {
-		if (att_ecode == BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND) {
+		if (att_ecode == BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND)
 			success = true;
-			goto next;
-		}
 
 		goto done;
 	}
@@ -862,118 +1292,266 @@ static void discover_descs_cb(bool success, uint8_t att_ecode,
 	bt_uuid16_create(&ext_prop_uuid, GATT_CHARAC_EXT_PROPER_UUID);
 
 	while (bt_gatt_iter_next_descriptor(&iter, &handle, u128.data)) {
-		bt_uuid128_create(&uuid, u128);
+		desc = new0(struct chrc_desc, 1);
+		desc->handle = handle;
+		bt_uuid128_create(&desc->uuid, u128);
+		queue_push_tail(chrc->descs, desc);
 
 		/* Log debug message */
-		bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+		bt_uuid_to_string(&desc->uuid, uuid_str, sizeof(uuid_str));
 		util_debug(client->debug_callback, client->debug_data,
 						"handle: 0x%04x, uuid: %s",
 						handle, uuid_str);
 
-		attr = gatt_db_insert_descriptor(client->db, handle,
-							&uuid, 0, NULL, NULL,
-							NULL);
-		if (!attr) {
-			attr = gatt_db_get_attribute(client->db, handle);
-			if (attr && !bt_uuid_cmp(&uuid,
-					gatt_db_attribute_get_type(attr)))
-				continue;
+		if (bt_uuid_cmp(&ext_prop_uuid, &desc->uuid) ||
+				chrc->ext_prop_handle || dreq->read_id)
+			continue;
 
-			util_debug(client->debug_callback, client->debug_data,
-				"Failed to insert descriptor at 0x%04x",
-				handle);
-			goto failed;
+		/* Queue extended properties to be read in bulk */
+		if (op->read_mult) {
+			chrc->ext_prop_handle = handle;
+			queue_push_tail(op->ext_props, chrc);
+			continue;
 		}
 
-		if (gatt_db_attribute_get_handle(attr) != handle)
+		/* If we got extended prop descriptor, lets read it right
+		 * away.
+		 */
+		dreq->read_id = bt_gatt_client_read_value(client, handle,
+							ext_prop_read_cb,
+							dreq, NULL);
+		if (!dreq->read_id)
 			goto failed;
-
-		if (!bt_uuid_cmp(&ext_prop_uuid, &uuid))
-			queue_push_tail(op->ext_prop_desc, attr);
 	}
 
-	/* If we got extended prop descriptor, lets read it right away */
-	if (read_ext_prop_desc(op))
-		return;
-
-next:
-	if (!discover_descs(op, &discovering))
-		goto failed;
-
-	if (discovering)
+	/* Wait for the extended properties before completing */
+	if (dreq->read_id)
 		return;
 
-	/* Done with the current service */
-	gatt_db_service_set_active(op->cur_svc, true);
-
 	goto done;
 
 failed:
 	success = false;
 
 done:
-	discovery_op_complete(op, success, att_ecode);
+	discover_descs_done(dreq, success, att_ecode);
 }
 
-static void discover_chrcs_cb(bool success, uint8_t att_ecode,
+static void svc_range_add(struct discovery_op *op, uint16_t start,
+								uint16_t end)
+{
+	const struct queue_entry *entry, *prev = NULL;
+	struct svc_range *range;
+
+	range = new0(struct svc_range, 1);
+	range->start = start;
+	range->end = end;
+	range->chrcs = queue_new();
+
+	/* Keep ranges sorted by handle */
+	for (entry = queue_get_entries(op->svc_ranges); entry;
+						entry = entry->next) {
+		struct svc_range *r = entry->data;
+
+		if (r->start > start)
+			break;
+
+		prev = entry;
+	}
+
+	if (prev)
+		queue_push_after(op->svc_ranges, prev->data, range);
+	else
+		queue_push_head(op->svc_ranges, range);
+}
+
+/*
+ * Split the ranges left to discover at service boundaries so included
+ * services and characteristics of several services can be discovered in
+ * parallel.
+ */
+static void discovery_split_ranges(struct discovery_op *op)
+{
+	const struct queue_entry *svc, *entry;
+
+	for (svc = queue_get_entries(op->pending_svcs); svc; svc = svc->next) {
+		uint16_t start, end;
+
+		if (!gatt_db_attribute_get_service_handles(svc->data, &start,
+									&end))
+			continue;
+
+		for (entry = queue_get_entries(op->discov_ranges); entry;
+							entry = entry->next) {
+			struct handle_range *range = entry->data;
+
+			if (start > range->end || end < range->start)
+				continue;
+
+			svc_range_add(op, start > range->start ? start :
+							range->start,
+							end < range->end ? end :
+							range->end);
+		}
+	}
+
+	queue_remove_all(op->discov_ranges, NULL, NULL, free);
+
+	op->next_range = queue_get_entries(op->svc_ranges);
+	op->read_mult = true;
+}
+
+static void discover_range_incl_cb(bool success, uint8_t att_ecode,
 						struct bt_gatt_result *result,
-						void *user_data)
+						void *user_data);
+
+static bool discover_ranges(struct discovery_op *op, bool *discovering)
 {
-	struct discovery_op *op = user_data;
 	struct bt_gatt_client *client = op->client;
-	struct bt_gatt_iter iter;
-	struct chrc *chrc_data;
-	uint16_t start, end, value;
-	uint8_t properties;
-	uint128_t u128;
-	bt_uuid_t uuid;
-	char uuid_str[MAX_LEN_UUID_STR];
-	unsigned int chrc_count;
+	const struct queue_entry *entry;
+	unsigned int max;
+
+	max = bt_att_get_channels(client->att);
+	if (!max)
+		max = 1;
+
+	while (op->next_range && op->disc_reqs < max) {
+		struct svc_range *range = op->next_range->data;
+		struct disc_req *dreq;
+
+		op->next_range = op->next_range->next;
+
+		dreq = disc_req_new(op);
+		dreq->range = range;
+		dreq->req = bt_gatt_discover_included_services(client->att,
+							range->start,
+							range->end,
+							discover_range_incl_cb,
+							dreq, NULL);
+		if (!dreq->req) {
+			util_debug(client->debug_callback, client->debug_data,
+				"Failed to start included services discovery");
+			disc_req_free(dreq);
+			discovery_reqs_cancel(op);
+			return false;
+		}
+	}
+
+	*discovering = op->disc_reqs > 0;
+	if (*discovering)
+		return true;
+
+	/* All ranges are done, process characteristics in handle order */
+	for (entry = queue_get_entries(op->svc_ranges); entry;
+						entry = entry->next) {
+		struct svc_range *range = entry->data;
+		struct chrc *chrc;
+
+		while ((chrc = queue_pop_head(range->chrcs)))
+			queue_push_tail(op->pending_chrcs, chrc);
+	}
+
+	return true;
+}
+
+static void discover_ranges_done(struct disc_req *dreq, bool success,
+							uint8_t att_ecode)
+{
+	struct discovery_op *op = discovery_op_ref(dreq->op);
 	bool discovering;
 
-	discovery_req_clear(client);
+	disc_req_free(dreq);
+
+	if (success) {
+		if (!discover_ranges(op, &discovering))
+			success = false;
+		else if (discovering)
+			goto done;
+	}
+
+	discovery_descs_next(op, success, att_ecode);
+
+done:
+	discovery_op_unref(op);
+}
+
+static void discover_range_chrcs_cb(bool success, uint8_t att_ecode,
+						struct bt_gatt_result *result,
+						void *user_data)
+{
+	struct disc_req *dreq = user_data;
 
 	if (!success) {
-		if (att_ecode == BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND) {
+		if (att_ecode == BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND)
 			success = true;
-			goto next;
-		}
 
 		goto done;
 	}
 
-	if (!result || !bt_gatt_iter_init(&iter, result))
-		goto failed;
+	if (!discovery_parse_chrcs(dreq->op, result, dreq->range->chrcs))
+		success = false;
 
-	chrc_count = bt_gatt_result_characteristic_count(result);
-	util_debug(client->debug_callback, client->debug_data,
-				"Characteristics found: %u", chrc_count);
+done:
+	discover_ranges_done(dreq, success, att_ecode);
+}
+
+static void discover_range_incl_cb(bool success, uint8_t att_ecode,
+						struct bt_gatt_result *result,
+						void *user_data)
+{
+	struct disc_req *dreq = user_data;
+	struct discovery_op *op = dreq->op;
+	struct bt_gatt_client *client = op->client;
+
+	if (!success) {
+		if (att_ecode == BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND)
+			goto next;
 
-	if (chrc_count == 0)
 		goto failed;
+	}
 
-	while (bt_gatt_iter_next_characteristic(&iter, &start, &end, &value,
-						&properties, u128.data)) {
-		bt_uuid128_create(&uuid, u128);
+	if (!discovery_insert_includes(op, result))
+		goto failed;
 
-		/* Log debug message */
-		bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
-		util_debug(client->debug_callback, client->debug_data,
-				"start: 0x%04x, end: 0x%04x, value: 0x%04x, "
-				"props: 0x%02x, uuid: %s",
-				start, end, value, properties, uuid_str);
+next:
+	bt_gatt_request_unref(dreq->req);
+
+	dreq->req = bt_gatt_discover_characteristics(client->att,
+							dreq->range->start,
+							dreq->range->end,
+							discover_range_chrcs_cb,
+							dreq, NULL);
+	if (dreq->req)
+		return;
 
-		chrc_data = new0(struct chrc, 1);
+	util_debug(client->debug_callback, client->debug_data,
+				"Failed to start characteristic discovery");
+failed:
+	discover_ranges_done(dreq, false, att_ecode);
+}
 
-		chrc_data->start_handle = start;
-		chrc_data->end_handle = end;
-		chrc_data->value_handle = value;
-		chrc_data->properties = properties;
-		chrc_data->uuid = uuid;
+static void discover_chrcs_cb(bool success, uint8_t att_ecode,
+						struct bt_gatt_result *result,
+						void *user_data)
+{
+	struct discovery_op *op = user_data;
+	struct bt_gatt_client *client = op->client;
+	bool discovering;
+
+	discovery_req_clear(client);
+
+	if (!success) {
+		if (att_ecode == BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND) {
+			success = true;
+			goto next;
+		}
 
-		queue_push_tail(op->pending_chrcs, chrc_data);
+		goto done;
 	}
 
+	if (!discovery_parse_chrcs(op, result, op->pending_chrcs))
+		goto failed;
+
 next:
 	/*
 	 * Before attempting to process discovered characteristics make sure we
@@ -1187,6 +1765,23 @@ next:
 	if (op->svc_last < 0xffff)
 		remove_discov_range(op, op->svc_last + 1, 0xffff);
 
+	/* With multiple bearers discover each service range in parallel */
+	if (bt_att_get_channels(client->att) > 1) {
+		bool discovering;
+
+		discovery_split_ranges(op);
+
+		if (!discover_ranges(op, &discovering)) {
+			success = false;
+			goto done;
+		}
+
+		if (!discovering)
+			discovery_descs_next(op, true, 0);
+
+		return;
+	}
+
 	range = queue_peek_head(op->discov_ranges);
 
 	client->discovery_req = bt_gatt_discover_included_services(client->att,
@@ -2228,6 +2823,7 @@ static void bt_gatt_client_free(struct bt_gatt_client *client)
 	queue_destroy(client->svc_chngd_queue, free);
 	queue_destroy(client->long_write_queue, request_unref);
 	queue_destroy(client->pending_requests, request_unref);
+	queue_destroy(client->discovery_reqs, NULL);
 
 	if (client->parent) {
 		queue_remove(client->parent->clones, client);
@@ -2273,6 +2869,7 @@ static struct bt_gatt_client *gatt_client_new(struct gatt_db *db,
 	client->notify_list = queue_new();
 	client->notify_chrcs = queue_new();
 	client->pending_requests = queue_new();
+	client->discovery_reqs = queue_new();
 
 	client->nfy_id = bt_att_register(att, BT_ATT_OP_HANDLE_NFY,
 						notify_cb, client, NULL);
@@ -2570,6 +3167,7 @@ bool bt_gatt_client_cancel_all(struct bt_gatt_client *client)
 	if (!client || !client->att)
 		return false;
 
+	queue_remove_all(client->discovery_reqs, NULL, NULL, disc_req_cancel);
 	queue_remove_all(client->pending_requests, NULL, NULL, cancel_pending);
 
 	if (client->discovery_req) {
@@ -2725,9 +3323,12 @@ static void read_multiple_cb(uint8_t opcode, const void *pdu, uint16_t length,
 		 * current ATT_MTU.
 		 */
 		if (len > length)
-			length = len;
+			len = length;
 
 		op->callback(success, att_ecode, pdu, len, op->user_data);
+
+		pdu += len;
+		length -= len;
 	}
 }
 
@@ -2770,9 +3371,7 @@ unsigned int bt_gatt_client_read_multiple(struct bt_gatt_client *client,
 	for (i = 0; i < num_handles; i++)
 		put_le16(handles[i], pdu + (2 * i));
 
-	opcode = bt_gatt_client_get_features(client) &
-		BT_GATT_CHRC_CLI_FEAT_EATT ? BT_ATT_OP_READ_MULT_VL_REQ :
-		BT_ATT_OP_READ_MULT_REQ;
+	opcode = read_multiple_opcode(client);
 
 	req->att_id = bt_att_send(client->att, opcode, pdu, sizeof(pdu),
 							read_multiple_cb, req,
@@ -2978,8 +3577,12 @@ unsigned int bt_gatt_client_write_without_response(
 	if (!req)
 		return 0;
 
-	/* Only use signed write if unencrypted */
+	/*
+	 * Only use signed write if unencrypted. The link may have been
+	 * encrypted without bt_att noticing, so don't trust a cached level.
+	 */
 	if (signed_write) {
+		bt_att_reset_security(client->att);
 		security = bt_att_get_security(client->att, NULL);
 		op = security > BT_SECURITY_LOW ?  BT_ATT_OP_WRITE_CMD :
 						BT_ATT_OP_SIGNED_WRITE_CMD;
@@ -3696,5 +4299,7 @@ int bt_gatt_client_get_security(struct bt_gatt_client *client)
 	if (!client)
 		return -1;
 
+	bt_att_reset_security(client->att);
+
 	return bt_att_get_security(client->att, NULL);
 }
@@ -41,15 +41,29 @@
 
 #define NFY_MULT_TIMEOUT 10
 
+/*
+ * Result of one of the attribute reads of a compound request. The reads are
+ * issued concurrently and the response is assembled in request order once
+ * all of them have completed.
+ */
+struct read_value {
+	void *op;
+	struct gatt_db_attribute *attr;
+	int err;
+	uint8_t *value;
+	size_t len;
+};
+
 struct async_read_op {
 	struct bt_att_chan *chan;
 	struct bt_gatt_server *server;
 	uint8_t opcode;
-	bool done;
 	uint8_t *pdu;
 	size_t pdu_len;
 	size_t value_len;
-	struct queue *db_data;
+	struct read_value *values;
+	size_t num_values;
+	size_t pending;
 };
 
 struct async_write_op {
@@ -313,62 +327,105 @@ error:
 	bt_att_chan_send_error_rsp(chan, opcode, ehandle, ecode);
 }
 
+static void read_value_store(struct read_value *val, int err,
+					const uint8_t *value, size_t len,
+					size_t max_len)
+{
+	val->err = err;
+	val->len = len;
+
+	if (err || !len)
+		return;
+
+	/* Only keep what can possibly end up in the response */
+	val->value = malloc(MIN(len, max_len));
+	if (!val->value) {
+		val->err = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
+		return;
+	}
+
+	memcpy(val->value, value, MIN(len, max_len));
+}
+
+static void read_values_free(struct read_value *values, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		free(values[i].value);
+
+	free(values);
+}
+
 static void async_read_op_destroy(struct async_read_op *op)
 {
 	bt_gatt_server_unref(op->server);
-	queue_destroy(op->db_data, NULL);
+	read_values_free(op->values, op->num_values);
 	free(op->pdu);
 	free(op);
 }
 
-static void process_read_by_type(struct async_read_op *op);
-
-static void read_by_type_read_complete_cb(struct gatt_db_attribute *attr,
-						int err, const uint8_t *value,
-						size_t len, void *user_data)
+static void read_by_type_complete(struct async_read_op *op)
 {
-	struct async_read_op *op = user_data;
-	struct bt_gatt_server *server = op->server;
-	uint16_t mtu;
-	uint16_t handle;
+	uint16_t mtu = bt_att_get_mtu(op->server->att);
+	size_t i;
+
+	/* Encode the values as if they had been read one after the other */
+	for (i = 0; i < op->num_values; i++) {
+		struct read_value *val = &op->values[i];
+
+		/* Terminate the operation if there was an error */
+		if (val->err) {
+			bt_att_chan_send_error_rsp(op->chan,
+					BT_ATT_OP_READ_BY_TYPE_REQ,
+					gatt_db_attribute_get_handle(val->attr),
+					val->err);
+			async_read_op_destroy(op);
+			return;
+		}
 
-	mtu = bt_att_get_mtu(server->att);
-	handle = gatt_db_attribute_get_handle(attr);
+		if (op->pdu_len == 0) {
+			op->value_len = MIN(MIN((unsigned) mtu - 4, 253),
+								val->len);
+			op->pdu[0] = op->value_len + 2;
+			op->pdu_len++;
+		} else if (val->len != op->value_len)
+			break;
 
-	/* Terminate the operation if there was an error */
-	if (err) {
-		bt_att_chan_send_error_rsp(op->chan, BT_ATT_OP_READ_BY_TYPE_REQ,
-								handle, err);
-		async_read_op_destroy(op);
-		return;
-	}
+		/* Stop if this would surpass the MTU */
+		if (op->pdu_len + op->value_len + 2 > (unsigned) mtu - 1)
+			break;
 
-	if (op->pdu_len == 0) {
-		op->value_len = MIN(MIN((unsigned) mtu - 4, 253), len);
-		op->pdu[0] = op->value_len + 2;
-		op->pdu_len++;
-	} else if (len != op->value_len) {
-		op->done = true;
-		goto done;
-	}
+		/* Encode the current value */
+		put_le16(gatt_db_attribute_get_handle(val->attr),
+						op->pdu + op->pdu_len);
+		if (op->value_len)
+			memcpy(op->pdu + op->pdu_len + 2, val->value,
+							op->value_len);
+
+		op->pdu_len += op->value_len + 2;
 
-	/* Stop if this would surpass the MTU */
-	if (op->pdu_len + op->value_len + 2 > (unsigned) mtu - 1) {
-		op->done = true;
-		goto done;
+		if (op->pdu_len == (unsigned) mtu - 1)
+			break;
 	}
 
-	/* Encode the current value */
-	put_le16(handle, op->pdu + op->pdu_len);
-	memcpy(op->pdu + op->pdu_len + 2, value, op->value_len);
+	bt_att_chan_send_rsp(op->chan, BT_ATT_OP_READ_BY_TYPE_RSP, op->pdu,
+								op->pdu_len);
+	async_read_op_destroy(op);
+}
 
-	op->pdu_len += op->value_len + 2;
+static void read_by_type_read_complete_cb(struct gatt_db_attribute *attr,
+						int err, const uint8_t *value,
+						size_t len, void *user_data)
+{
+	struct read_value *val = user_data;
+	struct async_read_op *op = val->op;
+	uint16_t mtu = bt_att_get_mtu(op->server->att);
 
-	if (op->pdu_len == (unsigned) mtu - 1)
-		op->done = true;
+	read_value_store(val, err, value, len, MIN((unsigned) mtu - 4, 253));
 
-done:
-	process_read_by_type(op);
+	if (!--op->pending)
+		read_by_type_complete(op);
 }
 
 static bool check_min_key_size(uint8_t min_size, uint8_t size)
@@ -379,12 +436,27 @@ static bool check_min_key_size(uint8_t min_size, uint8_t size)
 	return min_size <= size;
 }
 
+/* Security level required by the permission bits covered by mask */
+static int perm_security(uint32_t perm)
+{
+	if (perm & BT_ATT_PERM_SECURE)
+		return BT_ATT_SECURITY_FIPS;
+
+	if (perm & BT_ATT_PERM_AUTHEN)
+		return BT_ATT_SECURITY_HIGH;
+
+	if (perm & BT_ATT_PERM_ENCRYPT)
+		return BT_ATT_SECURITY_MEDIUM;
+
+	return BT_ATT_SECURITY_AUTO;
+}
+
 static uint8_t check_permissions(struct bt_gatt_server *server,
 				struct gatt_db_attribute *attr, uint32_t mask)
 {
 	uint8_t enc_size;
 	uint32_t perm;
-	int security;
+	int required, security;
 
 	perm = gatt_db_attribute_get_permissions(attr);
 
@@ -394,70 +466,87 @@ static uint8_t check_permissions(struct bt_gatt_server *server,
 	if (perm && mask & BT_ATT_PERM_WRITE && !(perm & BT_ATT_PERM_WRITE))
 		return BT_ATT_ERROR_WRITE_NOT_PERMITTED;
 
-	perm &= mask;
-	if (!perm)
+	required = perm_security(perm & mask);
+	if (!required)
 		return 0;
 
+	/* The level is cached by bt_att so this is cheap for every attribute
+	 * of a Read By Type or Read Multiple request.
+	 */
 	security = bt_att_get_security(server->att, &enc_size);
 	if (security < 0)
 		return BT_ATT_ERROR_UNLIKELY;
 
-	if (perm & BT_ATT_PERM_SECURE) {
-		if (security < BT_ATT_SECURITY_FIPS)
-			return BT_ATT_ERROR_AUTHENTICATION;
-
-		if (!check_min_key_size(server->min_enc_size, enc_size))
-			return BT_ATT_ERROR_INSUFFICIENT_ENCRYPTION_KEY_SIZE;
-	}
-
-	if (perm & BT_ATT_PERM_AUTHEN) {
-		if (security < BT_ATT_SECURITY_HIGH)
-			return BT_ATT_ERROR_AUTHENTICATION;
+	/*
+	 * The remote may have raised the security since it was cached,
+	 * re-read it before rejecting the request.
+	 */
+	if (security < required) {
+		bt_att_reset_security(server->att);
 
-		if (!check_min_key_size(server->min_enc_size, enc_size))
-			return BT_ATT_ERROR_INSUFFICIENT_ENCRYPTION_KEY_SIZE;
+		security = bt_att_get_security(server->att, &enc_size);
+		if (security < 0)
+			return BT_ATT_ERROR_UNLIKELY;
 	}
 
-	if (perm & BT_ATT_PERM_ENCRYPT) {
-		if (security < BT_ATT_SECURITY_MEDIUM)
-			return BT_ATT_ERROR_INSUFFICIENT_ENCRYPTION;
+	if (security < required)
+		return required == BT_ATT_SECURITY_MEDIUM ?
+				BT_ATT_ERROR_INSUFFICIENT_ENCRYPTION :
+				BT_ATT_ERROR_AUTHENTICATION;
 
-		if (!check_min_key_size(server->min_enc_size, enc_size))
-			return BT_ATT_ERROR_INSUFFICIENT_ENCRYPTION_KEY_SIZE;
-	}
+	if (!check_min_key_size(server->min_enc_size, enc_size))
+		return BT_ATT_ERROR_INSUFFICIENT_ENCRYPTION_KEY_SIZE;
 
 	return 0;
 }
 
-static void process_read_by_type(struct async_read_op *op)
+static void process_read_by_type(struct async_read_op *op,
+							struct queue *q)
 {
 	struct bt_gatt_server *server = op->server;
-	uint8_t ecode;
 	struct gatt_db_attribute *attr;
+	size_t max;
 
-	attr = queue_pop_head(op->db_data);
+	/*
+	 * Each entry takes at least 2 octets so don't read attributes that
+	 * cannot fit in the response anyway.
+	 */
+	max = MIN(queue_length(q),
+			(unsigned int) (bt_att_get_mtu(server->att) - 2) / 2);
 
-	if (op->done || !attr) {
-		bt_att_chan_send_rsp(op->chan, BT_ATT_OP_READ_BY_TYPE_RSP,
-						op->pdu, op->pdu_len);
-		async_read_op_destroy(op);
-		return;
-	}
+	op->values = new0(struct read_value, max);
 
-	ecode = check_permissions(server, attr, BT_ATT_PERM_READ_MASK);
-	if (ecode)
-		goto error;
+	/* Hold a reference so the response is not sent while still issuing
+	 * reads that complete immediately.
+	 */
+	op->pending = 1;
 
-	if (gatt_db_attribute_read(attr, 0, op->opcode, server->att,
-					read_by_type_read_complete_cb, op))
-		return;
+	while (op->num_values < max && (attr = queue_pop_head(q))) {
+		struct read_value *val = &op->values[op->num_values++];
 
-	ecode = BT_ATT_ERROR_UNLIKELY;
+		val->op = op;
+		val->attr = attr;
 
-error:
-	bt_att_chan_send_error_rsp(op->chan, BT_ATT_OP_READ_BY_TYPE_REQ,
-				gatt_db_attribute_get_handle(attr), ecode);
-	async_read_op_destroy(op);
+		/* Attributes past the first failing one would not be
+		 * reached by the response so don't bother reading them.
+		 */
+		val->err = check_permissions(server, attr,
+						BT_ATT_PERM_READ_MASK);
+		if (val->err)
+			break;
+
+		op->pending++;
+
+		if (!gatt_db_attribute_read(attr, 0, op->opcode, server->att,
+					read_by_type_read_complete_cb, val)) {
+			op->pending--;
+			val->err = BT_ATT_ERROR_UNLIKELY;
+			break;
+		}
+	}
+
+	if (!--op->pending)
+		read_by_type_complete(op);
 }
 
 static void read_by_type_cb(struct bt_att_chan *chan, uint8_t opcode,
@@ -517,9 +606,9 @@ static void read_by_type_cb(struct bt_att_chan *chan, uint8_t opcode,
 	op->chan = chan;
 	op->opcode = opcode;
 	op->server = bt_gatt_server_ref(server);
-	op->db_data = q;
 
-	process_read_by_type(op);
+	process_read_by_type(op, q);
+	queue_destroy(q, NULL);
 
 	return;
 
@@ -972,8 +1061,10 @@ struct read_mult_data {
 	struct bt_gatt_server *server;
 	uint8_t opcode;
 	uint16_t *handles;
-	size_t cur_handle;
 	size_t num_handles;
+	struct read_value *values;
+	size_t num_values;
+	size_t pending;
 	uint8_t *rsp_data;
 	size_t length;
 	size_t mtu;
@@ -981,85 +1072,66 @@ struct read_mult_data {
 
 static void read_mult_data_free(struct read_mult_data *data)
 {
+	read_values_free(data->values, data->num_values);
 	free(data->handles);
 	free(data->rsp_data);
 	free(data);
 }
 
-static void read_multiple_complete_cb(struct gatt_db_attribute *attr, int err,
-					const uint8_t *value, size_t len,
-					void *user_data)
+static void read_multiple_complete(struct read_mult_data *data)
 {
-	struct read_mult_data *data = user_data;
-	struct gatt_db_attribute *next_attr;
-	uint16_t handle = gatt_db_attribute_get_handle(attr);
-	uint8_t ecode;
-	uint16_t length;
+	size_t i;
 
-	if (err != 0) {
-		ecode = err;
-		goto error;
-	}
+	for (i = 0; i < data->num_values; i++) {
+		struct read_value *val = &data->values[i];
+		uint16_t length;
 
-	length = data->opcode == BT_ATT_OP_READ_MULT_VL_REQ ?
-			MIN(len, MAX(data->mtu - data->length, 3) - 3) :
-			MIN(len, data->mtu - data->length - 1);
-
-	if (data->opcode == BT_ATT_OP_READ_MULT_VL_REQ) {
-		/* The Length Value Tuple List may be truncated within the first
-		 * two octets of a tuple due to the size limits of the current
-		 * ATT_MTU, but the first two octets cannot be separated.
-		 */
-		if (data->mtu - data->length >= 3) {
-			put_le16(len, data->rsp_data + data->length);
-			data->length += 2;
+		if (val->err) {
+			bt_att_chan_send_error_rsp(data->chan, data->opcode,
+						data->handles[i], val->err);
+			read_mult_data_free(data);
+			return;
 		}
-	}
-
-	memcpy(data->rsp_data + data->length, value, length);
-	data->length += length;
-
-	data->cur_handle++;
 
-	if (data->cur_handle == data->num_handles) {
-		bt_att_chan_send_rsp(data->chan, data->opcode + 1,
-						data->rsp_data, data->length);
-		read_mult_data_free(data);
-		return;
-	}
-
-	handle = data->handles[data->cur_handle];
-
-	util_debug(data->server->debug_callback, data->server->debug_data,
-				"%s Req - #%zu of %zu: 0x%04x",
-				data->opcode == BT_ATT_OP_READ_MULT_REQ ?
-				"Read Multiple" :
-				"Read Multiple Variable Length",
-				data->cur_handle + 1, data->num_handles,
-				handle);
-
-	next_attr = gatt_db_get_attribute(data->server->db, handle);
+		length = data->opcode == BT_ATT_OP_READ_MULT_VL_REQ ?
+			MIN(val->len, MAX(data->mtu - data->length, 3) - 3) :
+			MIN(val->len, data->mtu - data->length - 1);
+
+		if (data->opcode == BT_ATT_OP_READ_MULT_VL_REQ) {
+			/* The Length Value Tuple List may be truncated within
+			 * the first two octets of a tuple due to the size
+			 * limits of the current ATT_MTU, but the first two
+			 * octets cannot be separated.
+			 */
+			if (data->mtu - data->length >= 3) {
+				put_le16(val->len,
+					data->rsp_data + data->length);
+				data->length += 2;
+			}
+		}
 
-	if (!next_attr) {
-		ecode = BT_ATT_ERROR_INVALID_HANDLE;
-		goto error;
+		if (length)
+			memcpy(data->rsp_data + data->length, val->value,
+									length);
+		data->length += length;
 	}
 
-	ecode = check_permissions(data->server, next_attr,
-						BT_ATT_PERM_READ_MASK);
-	if (ecode)
-		goto error;
+	bt_att_chan_send_rsp(data->chan, data->opcode + 1, data->rsp_data,
+								data->length);
+	read_mult_data_free(data);
+}
 
-	if (gatt_db_attribute_read(next_attr, 0, data->opcode,
-					data->server->att,
-					read_multiple_complete_cb, data))
-		return;
+static void read_multiple_complete_cb(struct gatt_db_attribute *attr, int err,
+					const uint8_t *value, size_t len,
+					void *user_data)
+{
+	struct read_value *val = user_data;
+	struct read_mult_data *data = val->op;
 
-	ecode = BT_ATT_ERROR_UNLIKELY;
+	read_value_store(val, err, value, len, data->mtu - 1);
 
-error:
-	bt_att_chan_send_error_rsp(data->chan, data->opcode, handle, ecode);
-	read_mult_data_free(data);
+	if (!--data->pending)
+		read_multiple_complete(data);
 }
 
 static struct read_mult_data *read_mult_data_new(struct bt_gatt_server *server,
@@ -1073,10 +1145,9 @@ static struct read_mult_data *read_mult_data_new(struct bt_gatt_server *server,
 	data->chan = chan;
 	data->opcode = opcode;
 	data->handles = new0(uint16_t, num_handles);
-	data->rsp_data = NULL;
+	data->values = new0(struct read_value, num_handles);
 	data->server = server;
 	data->num_handles = num_handles;
-	data->cur_handle = 0;
 	data->mtu = bt_att_get_mtu(server->att);
 	data->length = 0;
 	data->rsp_data = new0(uint8_t, data->mtu - 1);
@@ -1089,54 +1160,63 @@ static void read_multiple_cb(struct bt_att_chan *chan, uint8_t opcode,
 					void *user_data)
 {
 	struct bt_gatt_server *server = user_data;
-	struct gatt_db_attribute *attr;
-	struct read_mult_data *data = NULL;
-	uint8_t ecode;
-	size_t i = 0;
-	uint16_t handle = 0;
+	struct read_mult_data *data;
+	size_t i;
 
 	if (length < 4) {
-		ecode = BT_ATT_ERROR_INVALID_PDU;
-		goto error;
+		bt_att_chan_send_error_rsp(chan, opcode, 0,
+						BT_ATT_ERROR_INVALID_PDU);
+		return;
 	}
 
 	data = read_mult_data_new(server, chan, opcode, length / 2);
-	if (!data)
-		goto error;
 
 	for (i = 0; i < data->num_handles; i++)
 		data->handles[i] = get_le16(pdu + i * 2);
 
-	handle = data->handles[0];
-
 	util_debug(server->debug_callback, server->debug_data,
 			"%s Req - %zu handles, 1st: 0x%04x",
 			data->opcode == BT_ATT_OP_READ_MULT_REQ ?
 			"Read Multiple" : "Read Multiple Variable Length",
-			data->num_handles, handle);
-
-	attr = gatt_db_get_attribute(server->db, handle);
+			data->num_handles, data->handles[0]);
 
-	if (!attr) {
-		ecode = BT_ATT_ERROR_INVALID_HANDLE;
-		goto error;
-	}
+	/* Hold a reference so the response is not sent while still issuing
+	 * reads that complete immediately.
+	 */
+	data->pending = 1;
 
-	ecode = check_permissions(data->server, attr, BT_ATT_PERM_READ_MASK);
-	if (ecode)
-		goto error;
+	/*
+	 * Read all attributes at once, handles past the first one failing
+	 * would never be reached by the response so they are not read.
+	 */
+	for (i = 0; i < data->num_handles; i++) {
+		struct read_value *val = &data->values[data->num_values++];
+
+		val->op = data;
+		val->attr = gatt_db_get_attribute(server->db,
+							data->handles[i]);
+		if (!val->attr) {
+			val->err = BT_ATT_ERROR_INVALID_HANDLE;
+			break;
+		}
 
-	if (gatt_db_attribute_read(attr, 0, opcode, server->att,
-					read_multiple_complete_cb, data))
-		return;
+		val->err = check_permissions(server, val->attr,
+						BT_ATT_PERM_READ_MASK);
+		if (val->err)
+			break;
 
-	ecode = BT_ATT_ERROR_UNLIKELY;
+		data->pending++;
 
-error:
-	if (data)
-		read_mult_data_free(data);
+		if (!gatt_db_attribute_read(val->attr, 0, opcode, server->att,
+					read_multiple_complete_cb, val)) {
+			data->pending--;
+			val->err = BT_ATT_ERROR_UNLIKELY;
+			break;
+		}
+	}
 
-	bt_att_chan_send_error_rsp(chan, opcode, handle, ecode);
+	if (!--data->pending)
+		read_multiple_complete(data);
 }
 
 static bool append_prep_data(struct prep_write_data *prep_data, uint16_t handle,
@@ -1706,23 +1786,35 @@ bool bt_gatt_server_send_notification(struct bt_gatt_server *server,
 					uint16_t length, bool multiple)
 {
 	struct nfy_mult_data *data = NULL;
-	bool result;
+	uint8_t *pdu;
+	uint16_t len;
 
 	if (!server || (length && !value))
 		return false;
 
-	if (multiple) {
-		data = server->nfy_mult;
+	if (!multiple) {
+		/* Encode in place to avoid any allocation per notification */
+		pdu = bt_att_get_pdu(server->att, BT_ATT_OP_HANDLE_NFY, &len);
+		if (!pdu || len < 2)
+			return false;
 
-		/* flush buffered data if this request hits buffer size limit */
-		if (data && data->offset > 0 &&
+		put_le16(handle, pdu);
+		length = MIN(len - 2, length);
+		memcpy(pdu + 2, value, length);
+
+		return !!bt_att_send_pdu(server->att, pdu, length + 2);
+	}
+
+	data = server->nfy_mult;
+
+	/* flush buffered data if this request hits buffer size limit */
+	if (data && data->offset > 0 &&
 				data->len - data->offset < 4 + length) {
-			if (server->nfy_mult->id)
-				timeout_remove(server->nfy_mult->id);
-			notify_multiple(server);
-			/* data has been freed by notify_multiple */
-			data = NULL;
-		}
+		if (server->nfy_mult->id)
+			timeout_remove(server->nfy_mult->id);
+		notify_multiple(server);
+		/* data has been freed by notify_multiple */
+		data = NULL;
 	}
 
 	if (!data) {
@@ -1734,35 +1826,21 @@ bool bt_gatt_server_send_notification(struct bt_gatt_server *server,
 	if (!notify_append_le16(data, handle))
 		goto error;
 
-	if (multiple) {
-		length = MIN(data->len - data->offset - 2, length);
-		if (!notify_append_le16(data, length))
-			goto error;
-	} else {
-		length = MIN(data->len - data->offset, length);
-	}
+	length = MIN(data->len - data->offset - 2, length);
+	if (!notify_append_le16(data, length))
+		goto error;
 
 	memcpy(data->pdu + data->offset, value, length);
 	data->offset += length;
 
-	if (multiple) {
-		if (!server->nfy_mult)
-			server->nfy_mult = data;
-
-		if (!server->nfy_mult->id)
-			server->nfy_mult->id = timeout_add(NFY_MULT_TIMEOUT,
-						   notify_multiple, server,
-						   NULL);
-
-		return true;
-	}
+	if (!server->nfy_mult)
+		server->nfy_mult = data;
 
-	result = !!bt_att_send(server->att, BT_ATT_OP_HANDLE_NFY,
-				data->pdu, data->offset, NULL, NULL, NULL);
-	free(data->pdu);
-	free(data);
+	if (!server->nfy_mult->id)
+		server->nfy_mult->id = timeout_add(NFY_MULT_TIMEOUT,
+						notify_multiple, server, NULL);
 
-	return result;
+	return true;
 
 error:
 	if (data)
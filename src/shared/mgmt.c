@@ -16,6 +16,8 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <time.h>
 
 #include "lib/bluetooth.h"
 #include "lib/mgmt.h"
@@ -26,6 +28,10 @@
 #include "src/shared/util.h"
 #include "src/shared/mgmt.h"
 
+#define PENDING_HASH_SIZE 16
+#define NOTIFY_HASH_SIZE 64
+#define STATS_MAX (MGMT_OP_ADD_ADV_PATTERNS_MONITOR_RSSI + 1)
+
 struct mgmt {
 	int ref_count;
 	int fd;
@@ -34,8 +40,14 @@ struct mgmt {
 	bool writer_active;
 	struct queue *request_queue;
 	struct queue *reply_queue;
-	struct queue *pending_list;
-	struct queue *notify_list;
+	struct queue *pending_list[PENDING_HASH_SIZE];
+	unsigned int pending_count;
+	unsigned int pending_serial;
+	unsigned int pending_seq;
+	unsigned int pipeline;
+	struct mgmt_stats *stats;
+	unsigned int stats_len;
+	struct queue *notify_list[NOTIFY_HASH_SIZE];
 	unsigned int next_request_id;
 	unsigned int next_notify_id;
 	bool need_notify_cleanup;
@@ -54,6 +66,8 @@ struct mgmt_request {
 	uint16_t index;
 	void *buf;
 	uint16_t len;
+	unsigned int seq;
+	uint64_t sent;
 	mgmt_request_func_t callback;
 	mgmt_destroy_func_t destroy;
 	void *user_data;
@@ -143,6 +157,40 @@ static void mark_notify_removed(void *data , void *user_data)
 		notify->removed = true;
 }
 
+static struct queue *notify_bucket(struct mgmt *mgmt, uint16_t event)
+{
+	return mgmt->notify_list[event % NOTIFY_HASH_SIZE];
+}
+
+static void notify_cleanup(struct mgmt *mgmt)
+{
+	unsigned int i;
+
+	for (i = 0; i < NOTIFY_HASH_SIZE; i++)
+		queue_remove_all(mgmt->notify_list[i], match_notify_removed,
+							NULL, destroy_notify);
+
+	mgmt->need_notify_cleanup = false;
+}
+
+static void notify_remove_all(struct mgmt *mgmt, queue_match_func_t match,
+								void *data)
+{
+	unsigned int i;
+
+	for (i = 0; i < NOTIFY_HASH_SIZE; i++) {
+		if (mgmt->in_notify)
+			queue_foreach(mgmt->notify_list[i],
+						mark_notify_removed, data);
+		else
+			queue_remove_all(mgmt->notify_list[i], match, data,
+							destroy_notify);
+	}
+
+	if (mgmt->in_notify)
+		mgmt->need_notify_cleanup = true;
+}
+
 static void write_watch_destroy(void *user_data)
 {
 	struct mgmt *mgmt = user_data;
@@ -150,6 +198,162 @@ static void write_watch_destroy(void *user_data)
 	mgmt->writer_active = false;
 }
 
+static uint64_t get_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Commands the kernel completes on their own, without failing with busy
+ * when another command is still pending, so they can be pipelined.
+ */
+static bool opcode_is_independent(uint16_t opcode)
+{
+	switch (opcode) {
+	case MGMT_OP_READ_VERSION:
+	case MGMT_OP_READ_COMMANDS:
+	case MGMT_OP_READ_INDEX_LIST:
+	case MGMT_OP_READ_INFO:
+	case MGMT_OP_BLOCK_DEVICE:
+	case MGMT_OP_UNBLOCK_DEVICE:
+	case MGMT_OP_ADD_DEVICE:
+	case MGMT_OP_REMOVE_DEVICE:
+	case MGMT_OP_READ_UNCONF_INDEX_LIST:
+	case MGMT_OP_READ_CONFIG_INFO:
+	case MGMT_OP_READ_EXT_INDEX_LIST:
+	case MGMT_OP_READ_ADV_FEATURES:
+	case MGMT_OP_READ_EXT_INFO:
+	case MGMT_OP_READ_CONTROLLER_CAP:
+	case MGMT_OP_READ_EXP_FEATURES_INFO:
+	case MGMT_OP_READ_DEF_SYSTEM_CONFIG:
+	case MGMT_OP_READ_DEF_RUNTIME_CONFIG:
+	case MGMT_OP_GET_DEVICE_FLAGS:
+	case MGMT_OP_SET_DEVICE_FLAGS:
+	case MGMT_OP_READ_ADV_MONITOR_FEATURES:
+		return true;
+	}
+
+	return false;
+}
+
+static struct queue *pending_bucket(struct mgmt *mgmt, uint16_t opcode,
+							uint16_t index)
+{
+	return mgmt->pending_list[(opcode ^ index) % PENDING_HASH_SIZE];
+}
+
+static void pending_add(struct mgmt *mgmt, struct mgmt_request *request)
+{
+	request->seq = mgmt->pending_seq++;
+	request->sent = get_usec();
+
+	queue_push_tail(pending_bucket(mgmt, request->opcode, request->index),
+								request);
+
+	mgmt->pending_count++;
+
+	if (!opcode_is_independent(request->opcode))
+		mgmt->pending_serial++;
+}
+
+static void pending_removed(struct mgmt *mgmt, struct mgmt_request *request)
+{
+	mgmt->pending_count--;
+
+	if (!opcode_is_independent(request->opcode))
+		mgmt->pending_serial--;
+}
+
+/* Remove the oldest pending request matching, whatever its bucket */
+static struct mgmt_request *pending_remove_if(struct mgmt *mgmt,
+					queue_match_func_t match,
+					void *match_data)
+{
+	struct mgmt_request *request = NULL, *found;
+	struct queue *bucket = NULL;
+	unsigned int i;
+
+	for (i = 0; i < PENDING_HASH_SIZE; i++) {
+		found = queue_find(mgmt->pending_list[i], match, match_data);
+		if (!found)
+			continue;
+
+		if (!request || (int) (found->seq - request->seq) < 0) {
+			request = found;
+			bucket = mgmt->pending_list[i];
+		}
+	}
+
+	if (!request)
+		return NULL;
+
+	queue_remove(bucket, request);
+	pending_removed(mgmt, request);
+
+	return request;
+}
+
+static void pending_remove_all(struct mgmt *mgmt, queue_match_func_t match,
+							void *match_data)
+{
+	struct mgmt_request *request;
+	unsigned int i;
+
+	for (i = 0; i < PENDING_HASH_SIZE; i++) {
+		while ((request = queue_remove_if(mgmt->pending_list[i],
+							match, match_data))) {
+			pending_removed(mgmt, request);
+			destroy_request(request);
+		}
+	}
+}
+
+static bool match_any_request(const void *a, const void *b)
+{
+	return true;
+}
+
+static void update_stats(struct mgmt *mgmt, struct mgmt_request *request)
+{
+	struct mgmt_stats *stats;
+	uint64_t latency;
+
+	latency = get_usec() - request->sent;
+
+	util_debug(mgmt->debug_callback, mgmt->debug_data,
+			"[0x%04x] command 0x%04x latency %" PRIu64 " usec",
+			request->index, request->opcode, latency);
+
+	/* Unknown opcodes are only logged, they would bloat the table */
+	if (request->opcode >= STATS_MAX)
+		return;
+
+	if (request->opcode >= mgmt->stats_len) {
+		stats = realloc(mgmt->stats, (request->opcode + 1) *
+							sizeof(*stats));
+		if (!stats)
+			return;
+
+		memset(stats + mgmt->stats_len, 0, (request->opcode + 1 -
+				mgmt->stats_len) * sizeof(*stats));
+
+		mgmt->stats = stats;
+		mgmt->stats_len = request->opcode + 1;
+	}
+
+	stats = &mgmt->stats[request->opcode];
+	stats->opcode = request->opcode;
+	stats->count++;
+	stats->total_usec += latency;
+
+	if (latency > stats->max_usec)
+		stats->max_usec = latency;
+}
+
 static bool send_request(struct mgmt *mgmt, struct mgmt_request *request)
 {
 	struct iovec iov;
@@ -176,11 +380,30 @@ static bool send_request(struct mgmt *mgmt, struct mgmt_request *request)
 	util_hexdump('<', request->buf, ret, mgmt->debug_callback,
 							mgmt->debug_data);
 
-	queue_push_tail(mgmt->pending_list, request);
+	pending_add(mgmt, request);
 
 	return true;
 }
 
+/*
+ * Only a single command is on the wire at a time unless pipelining got
+ * enabled, then independent commands may be sent while others of them are
+ * still pending. The queue order is kept in either case.
+ */
+static bool can_send_request(struct mgmt *mgmt, struct mgmt_request *request)
+{
+	if (!request)
+		return false;
+
+	if (!mgmt->pending_count)
+		return true;
+
+	if (mgmt->pending_count >= mgmt->pipeline || mgmt->pending_serial)
+		return false;
+
+	return opcode_is_independent(request->opcode);
+}
+
 static bool can_write_data(struct io *io, void *user_data)
 {
 	struct mgmt *mgmt = user_data;
@@ -190,14 +413,14 @@ static bool can_write_data(struct io *io, void *user_data)
 	request = queue_pop_head(mgmt->reply_queue);
 	if (!request) {
 		/* only reply commands can jump the queue */
-		if (!queue_isempty(mgmt->pending_list))
+		if (!can_send_request(mgmt,
+				queue_peek_head(mgmt->request_queue)))
 			return false;
 
 		request = queue_pop_head(mgmt->request_queue);
-		if (!request)
-			return false;
 
-		can_write = false;
+		/* more might follow when pipelining */
+		can_write = mgmt->pipeline > 1;
 	} else {
 		/* allow multiple replies to jump the queue */
 		can_write = !queue_isempty(mgmt->reply_queue);
@@ -211,9 +434,10 @@ static bool can_write_data(struct io *io, void *user_data)
 
 static void wakeup_writer(struct mgmt *mgmt)
 {
-	if (!queue_isempty(mgmt->pending_list)) {
+	if (mgmt->pending_count) {
 		/* only queued reply commands trigger wakeup */
-		if (queue_isempty(mgmt->reply_queue))
+		if (queue_isempty(mgmt->reply_queue) && !can_send_request(mgmt,
+					queue_peek_head(mgmt->request_queue)))
 			return;
 	}
 
@@ -247,20 +471,23 @@ static void request_complete(struct mgmt *mgmt, uint8_t status,
 	struct opcode_index match = { .opcode = opcode, .index = index };
 	struct mgmt_request *request;
 
-	request = queue_remove_if(mgmt->pending_list,
+	request = queue_remove_if(pending_bucket(mgmt, opcode, index),
 					match_request_opcode_index, &match);
-	if (!request) {
+	if (request)
+		pending_removed(mgmt, request);
+	else {
 		util_debug(mgmt->debug_callback, mgmt->debug_data,
 				"Unable to find request for opcode 0x%04x",
 				opcode);
 
 		/* Attempt to remove with no opcode */
-		request = queue_remove_if(mgmt->pending_list,
-						match_request_index,
-						UINT_TO_PTR(index));
+		request = pending_remove_if(mgmt, match_request_index,
+							UINT_TO_PTR(index));
 	}
 
 	if (request) {
+		update_stats(mgmt, request);
+
 		if (request->callback)
 			request->callback(status, length, param,
 							request->user_data);
@@ -305,15 +532,12 @@ static void process_notify(struct mgmt *mgmt, uint16_t event, uint16_t index,
 
 	mgmt->in_notify = true;
 
-	queue_foreach(mgmt->notify_list, notify_handler, &match);
+	queue_foreach(notify_bucket(mgmt, event), notify_handler, &match);
 
 	mgmt->in_notify = false;
 
-	if (mgmt->need_notify_cleanup) {
-		queue_remove_all(mgmt->notify_list, match_notify_removed,
-							NULL, destroy_notify);
-		mgmt->need_notify_cleanup = false;
-	}
+	if (mgmt->need_notify_cleanup)
+		notify_cleanup(mgmt);
 }
 
 static bool can_read_data(struct io *io, void *user_data)
@@ -410,6 +634,7 @@ static void mgmt_set_mtu(struct mgmt *mgmt)
 struct mgmt *mgmt_new(int fd)
 {
 	struct mgmt *mgmt;
+	unsigned int i;
 
 	if (fd < 0)
 		return NULL;
@@ -434,12 +659,18 @@ struct mgmt *mgmt_new(int fd)
 
 	mgmt->request_queue = queue_new();
 	mgmt->reply_queue = queue_new();
-	mgmt->pending_list = queue_new();
-	mgmt->notify_list = queue_new();
+
+	for (i = 0; i < NOTIFY_HASH_SIZE; i++)
+		mgmt->notify_list[i] = queue_new();
+
+	for (i = 0; i < PENDING_HASH_SIZE; i++)
+		mgmt->pending_list[i] = queue_new();
 
 	if (!io_set_read_handler(mgmt->io, can_read_data, mgmt, NULL)) {
-		queue_destroy(mgmt->notify_list, NULL);
-		queue_destroy(mgmt->pending_list, NULL);
+		for (i = 0; i < NOTIFY_HASH_SIZE; i++)
+			queue_destroy(mgmt->notify_list[i], NULL);
+		for (i = 0; i < PENDING_HASH_SIZE; i++)
+			queue_destroy(mgmt->pending_list[i], NULL);
 		queue_destroy(mgmt->reply_queue, NULL);
 		queue_destroy(mgmt->request_queue, NULL);
 		io_destroy(mgmt->io);
@@ -529,9 +760,16 @@ void mgmt_unref(struct mgmt *mgmt)
 	free(mgmt->buf);
 	mgmt->buf = NULL;
 
+	free(mgmt->stats);
+	mgmt->stats = NULL;
+
 	if (!mgmt->in_notify) {
-		queue_destroy(mgmt->notify_list, NULL);
-		queue_destroy(mgmt->pending_list, NULL);
+		unsigned int i;
+
+		for (i = 0; i < NOTIFY_HASH_SIZE; i++)
+			queue_destroy(mgmt->notify_list[i], NULL);
+		for (i = 0; i < PENDING_HASH_SIZE; i++)
+			queue_destroy(mgmt->pending_list[i], NULL);
 		free(mgmt);
 		return;
 	}
@@ -553,6 +791,32 @@ bool mgmt_set_debug(struct mgmt *mgmt, mgmt_debug_func_t callback,
 	return true;
 }
 
+bool mgmt_set_pipeline(struct mgmt *mgmt, unsigned int depth)
+{
+	if (!mgmt)
+		return false;
+
+	mgmt->pipeline = depth;
+
+	wakeup_writer(mgmt);
+
+	return true;
+}
+
+void mgmt_foreach_stats(struct mgmt *mgmt, mgmt_stats_func_t func,
+							void *user_data)
+{
+	unsigned int i;
+
+	if (!mgmt || !func)
+		return;
+
+	for (i = 0; i < mgmt->stats_len; i++) {
+		if (mgmt->stats[i].count)
+			func(&mgmt->stats[i], user_data);
+	}
+}
+
 bool mgmt_set_close_on_unref(struct mgmt *mgmt, bool do_close)
 {
 	if (!mgmt)
@@ -840,8 +1104,7 @@ bool mgmt_cancel(struct mgmt *mgmt, unsigned int id)
 	if (request)
 		goto done;
 
-	request = queue_remove_if(mgmt->pending_list, match_request_id,
-							UINT_TO_PTR(id));
+	request = pending_remove_if(mgmt, match_request_id, UINT_TO_PTR(id));
 	if (!request)
 		return false;
 
@@ -862,8 +1125,7 @@ bool mgmt_cancel_index(struct mgmt *mgmt, uint16_t index)
 					UINT_TO_PTR(index), destroy_request);
 	queue_remove_all(mgmt->reply_queue, match_request_index,
 					UINT_TO_PTR(index), destroy_request);
-	queue_remove_all(mgmt->pending_list, match_request_index,
-					UINT_TO_PTR(index), destroy_request);
+	pending_remove_all(mgmt, match_request_index, UINT_TO_PTR(index));
 
 	return true;
 }
@@ -873,7 +1135,7 @@ bool mgmt_cancel_all(struct mgmt *mgmt)
 	if (!mgmt)
 		return false;
 
-	queue_remove_all(mgmt->pending_list, NULL, NULL, destroy_request);
+	pending_remove_all(mgmt, match_any_request, NULL);
 	queue_remove_all(mgmt->reply_queue, NULL, NULL, destroy_request);
 	queue_remove_all(mgmt->request_queue, NULL, NULL, destroy_request);
 
@@ -902,7 +1164,7 @@ unsigned int mgmt_register(struct mgmt *mgmt, uint16_t event, uint16_t index,
 
 	notify->id = mgmt->next_notify_id++;
 
-	if (!queue_push_tail(mgmt->notify_list, notify)) {
+	if (!queue_push_tail(notify_bucket(mgmt, event), notify)) {
 		free(notify);
 		return 0;
 	}
@@ -912,14 +1174,26 @@ unsigned int mgmt_register(struct mgmt *mgmt, uint16_t event, uint16_t index,
 
 bool mgmt_unregister(struct mgmt *mgmt, unsigned int id)
 {
-	struct mgmt_notify *notify;
+	struct mgmt_notify *notify = NULL;
+	unsigned int i;
 
 	if (!mgmt || !id)
 		return false;
 
-	notify = queue_remove_if(mgmt->notify_list, match_notify_id,
-							UINT_TO_PTR(id));
-	if (!notify)
+	for (i = 0; i < NOTIFY_HASH_SIZE && !notify; i++) {
+		/*
+		 * While dispatching only mark the entry, it is removed and
+		 * freed once the dispatch loop is done with the list.
+		 */
+		if (mgmt->in_notify)
+			notify = queue_find(mgmt->notify_list[i],
+					match_notify_id, UINT_TO_PTR(id));
+		else
+			notify = queue_remove_if(mgmt->notify_list[i],
+					match_notify_id, UINT_TO_PTR(id));
+	}
+
+	if (!notify || notify->removed)
 		return false;
 
 	if (!mgmt->in_notify) {
@@ -938,13 +1212,7 @@ bool mgmt_unregister_index(struct mgmt *mgmt, uint16_t index)
 	if (!mgmt)
 		return false;
 
-	if (mgmt->in_notify) {
-		queue_foreach(mgmt->notify_list, mark_notify_removed,
-							UINT_TO_PTR(index));
-		mgmt->need_notify_cleanup = true;
-	} else
-		queue_remove_all(mgmt->notify_list, match_notify_index,
-					UINT_TO_PTR(index), destroy_notify);
+	notify_remove_all(mgmt, match_notify_index, UINT_TO_PTR(index));
 
 	return true;
 }
@@ -954,12 +1222,7 @@ bool mgmt_unregister_all(struct mgmt *mgmt)
 	if (!mgmt)
 		return false;
 
-	if (mgmt->in_notify) {
-		queue_foreach(mgmt->notify_list, mark_notify_removed,
-						UINT_TO_PTR(MGMT_INDEX_NONE));
-		mgmt->need_notify_cleanup = true;
-	} else
-		queue_remove_all(mgmt->notify_list, NULL, NULL, destroy_notify);
+	notify_remove_all(mgmt, NULL, UINT_TO_PTR(MGMT_INDEX_NONE));
 
 	return true;
 }
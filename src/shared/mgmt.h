@@ -31,6 +31,21 @@ bool mgmt_set_debug(struct mgmt *mgmt, mgmt_debug_func_t callback,
 
 bool mgmt_set_close_on_unref(struct mgmt *mgmt, bool do_close);
 
+bool mgmt_set_pipeline(struct mgmt *mgmt, unsigned int depth);
+
+struct mgmt_stats {
+	uint16_t opcode;
+	unsigned int count;
+	uint64_t total_usec;
+	uint64_t max_usec;
+};
+
+typedef void (*mgmt_stats_func_t)(const struct mgmt_stats *stats,
+							void *user_data);
+
+void mgmt_foreach_stats(struct mgmt *mgmt, mgmt_stats_func_t func,
+							void *user_data);
+
 typedef void (*mgmt_request_func_t)(uint8_t status, uint16_t length,
 					const void *param, void *user_data);
 
@@ -0,0 +1,348 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "src/shared/util.h"
+#include "src/shared/notify-ring.h"
+
+#define REC_HDR_LEN	sizeof(struct notify_ring_rec)
+#define REC_ALIGN(len)	(((len) + 7) & ~7UL)
+
+#define RING_MIN_SIZE	1024
+#define RING_MAX_SIZE	(16 * 1024 * 1024)
+
+struct notify_ring {
+	int mem_fd;
+	int event_fd;
+	struct notify_ring_hdr *hdr;
+	uint8_t *data;
+	size_t map_len;
+	uint32_t size;
+	bool producer;
+	unsigned int pending;
+};
+
+/* Find last (most siginificant) set bit */
+static inline unsigned int fls(unsigned int x)
+{
+	return x ? sizeof(x) * 8 - __builtin_clz(x) : 0;
+}
+
+/* Round up to nearest power of two */
+static inline unsigned int align_power2(unsigned int u)
+{
+	return 1 << fls(u - 1);
+}
+
+static uint64_t ring_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct notify_ring *ring_map(int mem_fd, int event_fd, size_t len,
+								bool producer)
+{
+	struct notify_ring *ring;
+	void *map;
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	ring = new0(struct notify_ring, 1);
+	ring->mem_fd = mem_fd;
+	ring->event_fd = event_fd;
+	ring->hdr = map;
+	ring->map_len = len;
+	ring->producer = producer;
+
+	return ring;
+}
+
+struct notify_ring *notify_ring_new(size_t size)
+{
+	struct notify_ring *ring;
+	int mem_fd, event_fd;
+	size_t len;
+
+	if (size < RING_MIN_SIZE)
+		size = RING_MIN_SIZE;
+	else if (size > RING_MAX_SIZE)
+		size = RING_MAX_SIZE;
+
+	size = align_power2(size);
+	len = sizeof(struct notify_ring_hdr) + size;
+
+	mem_fd = memfd_create("bluez-notify-ring",
+					MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (mem_fd < 0)
+		return NULL;
+
+	if (ftruncate(mem_fd, len) < 0)
+		goto fail;
+
+	/* Make sure the consumer cannot resize the memory underneath */
+	if (fcntl(mem_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+							F_SEAL_SEAL) < 0)
+		goto fail;
+
+	event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (event_fd < 0)
+		goto fail;
+
+	ring = ring_map(mem_fd, event_fd, len, true);
+	if (!ring) {
+		close(event_fd);
+		goto fail;
+	}
+
+	ring->size = size;
+	ring->data = (uint8_t *) ring->hdr + sizeof(struct notify_ring_hdr);
+
+	ring->hdr->magic = NOTIFY_RING_MAGIC;
+	ring->hdr->version = NOTIFY_RING_VERSION;
+	ring->hdr->size = size;
+	ring->hdr->offset = sizeof(struct notify_ring_hdr);
+
+	return ring;
+
+fail:
+	close(mem_fd);
+	return NULL;
+}
+
+struct notify_ring *notify_ring_attach(int mem_fd, int event_fd)
+{
+	struct notify_ring *ring;
+	struct notify_ring_hdr *hdr;
+	struct stat st;
+
+	if (mem_fd < 0 || event_fd < 0)
+		return NULL;
+
+	if (fstat(mem_fd, &st) < 0 ||
+			st.st_size < (off_t) sizeof(struct notify_ring_hdr))
+		return NULL;
+
+	ring = ring_map(mem_fd, event_fd, st.st_size, false);
+	if (!ring)
+		return NULL;
+
+	hdr = ring->hdr;
+
+	if (hdr->magic != NOTIFY_RING_MAGIC ||
+			hdr->version != NOTIFY_RING_VERSION ||
+			hdr->offset < sizeof(*hdr) || hdr->size < REC_HDR_LEN ||
+			(hdr->size & (hdr->size - 1)) ||
+			(size_t) hdr->offset + hdr->size > ring->map_len) {
+		munmap(ring->hdr, ring->map_len);
+		free(ring);
+		return NULL;
+	}
+
+	ring->size = hdr->size;
+	ring->data = (uint8_t *) hdr + hdr->offset;
+
+	return ring;
+}
+
+void notify_ring_free(struct notify_ring *ring)
+{
+	if (!ring)
+		return;
+
+	munmap(ring->hdr, ring->map_len);
+	close(ring->mem_fd);
+	close(ring->event_fd);
+	free(ring);
+}
+
+int notify_ring_get_fd(struct notify_ring *ring)
+{
+	if (!ring)
+		return -1;
+
+	return ring->mem_fd;
+}
+
+int notify_ring_get_event_fd(struct notify_ring *ring)
+{
+	if (!ring)
+		return -1;
+
+	return ring->event_fd;
+}
+
+size_t notify_ring_capacity(struct notify_ring *ring)
+{
+	if (!ring)
+		return 0;
+
+	return ring->size;
+}
+
+size_t notify_ring_len(struct notify_ring *ring)
+{
+	uint64_t head, tail;
+
+	if (!ring)
+		return 0;
+
+	head = __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+	tail = __atomic_load_n(&ring->hdr->tail, __ATOMIC_ACQUIRE);
+
+	return head - tail;
+}
+
+uint64_t notify_ring_get_dropped(struct notify_ring *ring)
+{
+	if (!ring)
+		return 0;
+
+	return __atomic_load_n(&ring->hdr->dropped, __ATOMIC_RELAXED);
+}
+
+bool notify_ring_push(struct notify_ring *ring, const uint8_t *data,
+							uint16_t len)
+{
+	struct notify_ring_hdr *hdr;
+	struct notify_ring_rec *rec;
+	uint64_t head, tail;
+	size_t rec_len, off, pad = 0;
+
+	if (!ring || !ring->producer || len >= NOTIFY_RING_WRAP)
+		return false;
+
+	hdr = ring->hdr;
+	rec_len = REC_ALIGN(REC_HDR_LEN + len);
+
+	head = hdr->head;
+	tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+	off = head & (ring->size - 1);
+
+	/* Records are never split, skip what is left at the end */
+	if (off + rec_len > ring->size)
+		pad = ring->size - off;
+
+	if (pad + rec_len > ring->size - (head - tail)) {
+		hdr->seq++;
+		__atomic_store_n(&hdr->dropped, hdr->dropped + 1,
+							__ATOMIC_RELAXED);
+		return false;
+	}
+
+	if (pad) {
+		uint16_t wrap = NOTIFY_RING_WRAP;
+
+		memcpy(ring->data + off, &wrap, sizeof(wrap));
+		head += pad;
+		off = 0;
+	}
+
+	rec = (struct notify_ring_rec *) (ring->data + off);
+	rec->len = len;
+	rec->flags = 0;
+	rec->seq = hdr->seq++;
+	rec->timestamp = ring_now();
+	if (len)
+		memcpy(rec->data, data, len);
+
+	__atomic_store_n(&hdr->head, head + rec_len, __ATOMIC_RELEASE);
+
+	ring->pending++;
+
+	return true;
+}
+
+/* Wake up the consumer if anything was pushed since the last kick */
+bool notify_ring_kick(struct notify_ring *ring)
+{
+	uint64_t val = 1;
+
+	if (!ring || !ring->pending)
+		return false;
+
+	ring->pending = 0;
+
+	if (write(ring->event_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return false;
+
+	return true;
+}
+
+unsigned int notify_ring_drain(struct notify_ring *ring,
+				notify_ring_func_t func, void *user_data)
+{
+	struct notify_ring_hdr *hdr;
+	uint64_t head, tail, val;
+	unsigned int count = 0;
+
+	if (!ring || ring->producer)
+		return 0;
+
+	hdr = ring->hdr;
+
+	/* Reset the wakeup counter before looking at the ring so that any
+	 * record pushed afterwards generates a new wakeup.
+	 */
+	if (read(ring->event_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return 0;
+
+	tail = hdr->tail;
+	head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+	while (tail != head) {
+		size_t off = tail & (ring->size - 1);
+		struct notify_ring_rec *rec;
+		uint16_t len = NOTIFY_RING_WRAP;
+
+		if (ring->size - off >= REC_HDR_LEN)
+			memcpy(&len, ring->data + off, sizeof(len));
+
+		if (len == NOTIFY_RING_WRAP) {
+			tail += ring->size - off;
+			continue;
+		}
+
+		rec = (struct notify_ring_rec *) (ring->data + off);
+
+		/* Don't trust the producer with the record length */
+		if (off + REC_HDR_LEN + len > ring->size)
+			break;
+
+		if (func)
+			func(rec->seq, rec->timestamp, rec->data, len,
+								user_data);
+
+		tail += REC_ALIGN(REC_HDR_LEN + len);
+		count++;
+	}
+
+	__atomic_store_n(&hdr->tail, tail, __ATOMIC_RELEASE);
+
+	return count;
+}
@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Shared memory notification ring
+ *
+ * The producer allocates a memfd containing a header followed by a power
+ * of two sized data area, and an eventfd used for wakeups. Both are passed
+ * to the consumer which maps the memfd and drains records after each
+ * wakeup. The producer only writes head, seq and dropped, the consumer
+ * only writes tail.
+ */
+#define NOTIFY_RING_MAGIC	0x474e5242	/* "BRNG" */
+#define NOTIFY_RING_VERSION	1
+
+struct notify_ring_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;		/* Size of the data area */
+	uint32_t offset;	/* Offset of the data area */
+	uint64_t head;		/* Producer position */
+	uint64_t seq;		/* Sequence number of the next record */
+	uint64_t dropped;	/* Records dropped since the ring was full */
+	uint8_t pad0[24];
+	uint64_t tail;		/* Consumer position */
+	uint8_t pad1[56];
+};
+
+/* Records are 8 octet aligned, a record with NOTIFY_RING_WRAP as length
+ * means the rest of the data area is unused and the next record is at the
+ * start of it.
+ */
+#define NOTIFY_RING_WRAP	0xffff
+
+struct notify_ring_rec {
+	uint16_t len;
+	uint16_t flags;
+	uint32_t seq;
+	uint64_t timestamp;	/* CLOCK_MONOTONIC in nanoseconds */
+	uint8_t data[];
+};
+
+typedef void (*notify_ring_func_t)(uint32_t seq, uint64_t timestamp,
+					const uint8_t *data, uint16_t len,
+					void *user_data);
+
+struct notify_ring;
+
+struct notify_ring *notify_ring_new(size_t size);
+struct notify_ring *notify_ring_attach(int mem_fd, int event_fd);
+void notify_ring_free(struct notify_ring *ring);
+
+int notify_ring_get_fd(struct notify_ring *ring);
+int notify_ring_get_event_fd(struct notify_ring *ring);
+size_t notify_ring_capacity(struct notify_ring *ring);
+size_t notify_ring_len(struct notify_ring *ring);
+uint64_t notify_ring_get_dropped(struct notify_ring *ring);
+
+bool notify_ring_push(struct notify_ring *ring, const uint8_t *data,
+							uint16_t len);
+bool notify_ring_kick(struct notify_ring *ring);
+
+unsigned int notify_ring_drain(struct notify_ring *ring,
+				notify_ring_func_t func, void *user_data);
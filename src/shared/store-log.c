@@ -0,0 +1,665 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "src/shared/util.h"
+#include "src/shared/store-log.h"
+
+/*
+ * File format, all values are little endian:
+ *
+ *   header: magic (4), version (4)
+ *   record: crc (4), data length (4), key length (2), type (1), reserved (1),
+ *           key, data
+ *
+ * The CRC-32 of a record covers everything following the crc field.
+ */
+#define LOG_MAGIC		0x4c53425a	/* "ZBSL" */
+#define LOG_VERSION		1
+#define LOG_HDR_LEN		8
+
+#define REC_HDR_LEN		12
+#define REC_PUT			0x01
+#define REC_DEL			0x02
+
+#define LOG_COMPACT_MIN		(64 * 1024)
+#define LOG_BUCKETS_MIN		64
+
+struct log_entry {
+	struct log_entry *next;
+	uint32_t hash;
+	char *key;
+	uint8_t *data;
+	size_t len;
+};
+
+struct store_log {
+	char *path;
+	int fd;
+	struct log_entry **buckets;
+	unsigned int num_buckets;
+	unsigned int num_entries;
+	size_t size;		/* Size of the file */
+	size_t live;		/* Size of the records still in use */
+	size_t corrupted;	/* Size of the corrupted data skipped */
+};
+
+static uint32_t crc_table[256];
+
+static uint32_t log_crc32(const uint8_t *data, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	size_t i;
+
+	if (!crc_table[1]) {
+		uint32_t c;
+		int n, k;
+
+		for (n = 0; n < 256; n++) {
+			c = n;
+			for (k = 0; k < 8; k++)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			crc_table[n] = c;
+		}
+	}
+
+	for (i = 0; i < len; i++)
+		crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+	return crc ^ 0xffffffff;
+}
+
+static uint32_t key_hash(const char *key)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*key) {
+		hash ^= (uint8_t) *key++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static size_t record_len(const char *key, size_t len)
+{
+	return REC_HDR_LEN + strlen(key) + len;
+}
+
+static size_t record_encode(uint8_t *buf, uint8_t type, const char *key,
+						const void *data, size_t len)
+{
+	size_t key_len = strlen(key);
+
+	put_le32(len, buf + 4);
+	put_le16(key_len, buf + 8);
+	buf[10] = type;
+	buf[11] = 0;
+	memcpy(buf + REC_HDR_LEN, key, key_len);
+	if (len)
+		memcpy(buf + REC_HDR_LEN + key_len, data, len);
+
+	put_le32(log_crc32(buf + 4, REC_HDR_LEN - 4 + key_len + len), buf);
+
+	return REC_HDR_LEN + key_len + len;
+}
+
+static bool write_all(int fd, const uint8_t *buf, size_t len, off_t offset)
+{
+	while (len) {
+		ssize_t written;
+
+		written = pwrite(fd, buf, len, offset);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		buf += written;
+		len -= written;
+		offset += written;
+	}
+
+	return true;
+}
+
+static struct log_entry **entry_lookup(struct store_log *log, const char *key,
+								uint32_t hash)
+{
+	struct log_entry **entry;
+
+	entry = &log->buckets[hash & (log->num_buckets - 1)];
+
+	while (*entry) {
+		if ((*entry)->hash == hash && !strcmp((*entry)->key, key))
+			break;
+
+		entry = &(*entry)->next;
+	}
+
+	return entry;
+}
+
+static void entry_free(struct log_entry *entry)
+{
+	free(entry->key);
+	free(entry->data);
+	free(entry);
+}
+
+static void index_resize(struct store_log *log)
+{
+	struct log_entry **buckets;
+	unsigned int num_buckets = log->num_buckets * 2;
+	unsigned int i;
+
+	buckets = new0(struct log_entry *, num_buckets);
+
+	for (i = 0; i < log->num_buckets; i++) {
+		struct log_entry *entry = log->buckets[i];
+
+		while (entry) {
+			struct log_entry *next = entry->next;
+			unsigned int n = entry->hash & (num_buckets - 1);
+
+			entry->next = buckets[n];
+			buckets[n] = entry;
+			entry = next;
+		}
+	}
+
+	free(log->buckets);
+	log->buckets = buckets;
+	log->num_buckets = num_buckets;
+}
+
+static void index_put(struct store_log *log, const char *key,
+						const void *data, size_t len)
+{
+	uint32_t hash = key_hash(key);
+	struct log_entry **ptr = entry_lookup(log, key, hash);
+	struct log_entry *entry = *ptr;
+
+	if (entry) {
+		log->live -= record_len(entry->key, entry->len);
+		free(entry->data);
+	} else {
+		entry = new0(struct log_entry, 1);
+		entry->hash = hash;
+		entry->key = strdup(key);
+		*ptr = entry;
+		log->num_entries++;
+	}
+
+	entry->data = malloc(len ? len : 1);
+	memcpy(entry->data, data, len);
+	entry->len = len;
+
+	log->live += record_len(key, len);
+
+	if (log->num_entries > log->num_buckets)
+		index_resize(log);
+}
+
+static void index_del(struct store_log *log, const char *key)
+{
+	struct log_entry **ptr = entry_lookup(log, key, key_hash(key));
+	struct log_entry *entry = *ptr;
+
+	if (!entry)
+		return;
+
+	*ptr = entry->next;
+	log->live -= record_len(entry->key, entry->len);
+	log->num_entries--;
+	entry_free(entry);
+}
+
+/* Check the record at off, returns its length or 0 if it isn't valid */
+static size_t record_check(const uint8_t *buf, size_t size, size_t off)
+{
+	const uint8_t *rec = buf + off;
+	uint32_t len;
+	uint16_t key_len;
+
+	if (off + REC_HDR_LEN > size)
+		return 0;
+
+	len = get_le32(rec + 4);
+	key_len = get_le16(rec + 8);
+
+	if (!key_len || size - off - REC_HDR_LEN < key_len + (size_t) len)
+		return 0;
+
+	if (log_crc32(rec + 4, REC_HDR_LEN - 4 + key_len + len) !=
+							get_le32(rec))
+		return 0;
+
+	if (memchr(rec + REC_HDR_LEN, '\0', key_len))
+		return 0;
+
+	return REC_HDR_LEN + key_len + len;
+}
+
+/*
+ * Replay the records, returns the offset following the last valid one.
+ *
+ * An invalid record followed by valid ones is corruption within the file,
+ * it is skipped so that the records after it are not lost. Otherwise it is
+ * an incomplete write at the end of the file which is to be discarded.
+ */
+static size_t log_replay(struct store_log *log, const uint8_t *buf,
+								size_t size)
+{
+	size_t off = LOG_HDR_LEN;
+
+	while (off + REC_HDR_LEN <= size) {
+		const uint8_t *rec = buf + off;
+		size_t rec_len, next;
+		uint16_t key_len;
+		char *key;
+
+		rec_len = record_check(buf, size, off);
+		if (!rec_len) {
+			for (next = off + 1; next + REC_HDR_LEN <= size; next++)
+				if (record_check(buf, size, next))
+					break;
+
+			if (next + REC_HDR_LEN > size)
+				break;
+
+			log->corrupted += next - off;
+			off = next;
+			continue;
+		}
+
+		key_len = get_le16(rec + 8);
+		key = strndup((const char *) rec + REC_HDR_LEN, key_len);
+
+		switch (rec[10]) {
+		case REC_PUT:
+			index_put(log, key, rec + REC_HDR_LEN + key_len,
+						rec_len - REC_HDR_LEN - key_len);
+			break;
+		case REC_DEL:
+			index_del(log, key);
+			break;
+		}
+
+		free(key);
+
+		off += rec_len;
+	}
+
+	return off;
+}
+
+static uint8_t *read_file(int fd, size_t *size)
+{
+	struct stat st;
+	uint8_t *buf;
+	size_t off = 0;
+
+	if (fstat(fd, &st) < 0)
+		return NULL;
+
+	buf = malloc(st.st_size ? st.st_size : 1);
+	if (!buf)
+		return NULL;
+
+	while (off < (size_t) st.st_size) {
+		ssize_t len;
+
+		len = read(fd, buf + off, st.st_size - off);
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		if (len <= 0) {
+			free(buf);
+			return NULL;
+		}
+
+		off += len;
+	}
+
+	*size = off;
+
+	return buf;
+}
+
+static bool write_header(int fd)
+{
+	uint8_t hdr[LOG_HDR_LEN];
+
+	put_le32(LOG_MAGIC, hdr);
+	put_le32(LOG_VERSION, hdr + 4);
+
+	return write_all(fd, hdr, sizeof(hdr), 0);
+}
+
+struct store_log *store_log_open(const char *path)
+{
+	struct store_log *log;
+	uint8_t *buf;
+	size_t size, off;
+	int fd;
+
+	if (!path)
+		return NULL;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return NULL;
+
+	buf = read_file(fd, &size);
+	if (!buf) {
+		close(fd);
+		return NULL;
+	}
+
+	if (size >= LOG_HDR_LEN && (get_le32(buf) != LOG_MAGIC ||
+					get_le32(buf + 4) != LOG_VERSION)) {
+		free(buf);
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	log = new0(struct store_log, 1);
+	log->path = strdup(path);
+	log->fd = fd;
+	log->num_buckets = LOG_BUCKETS_MIN;
+	log->buckets = new0(struct log_entry *, log->num_buckets);
+
+	if (size < LOG_HDR_LEN) {
+		/* New file or the header itself never made it to disk */
+		if (ftruncate(fd, 0) < 0 || !write_header(fd))
+			goto fail;
+
+		off = size = LOG_HDR_LEN;
+	} else
+		off = log_replay(log, buf, size);
+
+	/* Discard the incomplete record following the last valid one */
+	if (off < size && ftruncate(fd, off) < 0)
+		goto fail;
+
+	log->size = off;
+
+	free(buf);
+
+	return log;
+
+fail:
+	free(buf);
+	store_log_close(log);
+	return NULL;
+}
+
+void store_log_close(struct store_log *log)
+{
+	unsigned int i;
+
+	if (!log)
+		return;
+
+	for (i = 0; i < log->num_buckets; i++) {
+		struct log_entry *entry = log->buckets[i];
+
+		while (entry) {
+			struct log_entry *next = entry->next;
+
+			entry_free(entry);
+			entry = next;
+		}
+	}
+
+	close(log->fd);
+	free(log->buckets);
+	free(log->path);
+	free(log);
+}
+
+const void *store_log_get(struct store_log *log, const char *key,
+								size_t *len)
+{
+	struct log_entry *entry;
+
+	if (!log || !key)
+		return NULL;
+
+	entry = *entry_lookup(log, key, key_hash(key));
+	if (!entry)
+		return NULL;
+
+	if (len)
+		*len = entry->len;
+
+	return entry->data;
+}
+
+static bool log_append(struct store_log *log, uint8_t type, const char *key,
+						const void *data, size_t len)
+{
+	uint8_t *buf;
+	size_t rec_len;
+	bool ret;
+
+	buf = malloc(record_len(key, len));
+	if (!buf)
+		return false;
+
+	rec_len = record_encode(buf, type, key, data, len);
+
+	/* On failure the size isn't updated, so a partially written record
+	 * is overwritten by the next one or dropped when the file is opened.
+	 */
+	ret = write_all(log->fd, buf, rec_len, log->size);
+	if (ret)
+		log->size += rec_len;
+
+	free(buf);
+
+	return ret;
+}
+
+static void log_maybe_compact(struct store_log *log)
+{
+	if (log->size < LOG_COMPACT_MIN)
+		return;
+
+	if (log->size - LOG_HDR_LEN > 2 * log->live)
+		store_log_compact(log);
+}
+
+bool store_log_put(struct store_log *log, const char *key,
+						const void *data, size_t len)
+{
+	const void *old;
+	size_t old_len;
+
+	if (!log || !key || !*key || strlen(key) > UINT16_MAX ||
+						len > UINT32_MAX)
+		return false;
+
+	old = store_log_get(log, key, &old_len);
+	if (old && old_len == len && !memcmp(old, data, len))
+		return true;
+
+	if (!log_append(log, REC_PUT, key, data, len))
+		return false;
+
+	index_put(log, key, data, len);
+	log_maybe_compact(log);
+
+	return true;
+}
+
+bool store_log_del(struct store_log *log, const char *key)
+{
+	if (!log || !key)
+		return false;
+
+	if (!store_log_get(log, key, NULL))
+		return true;
+
+	if (!log_append(log, REC_DEL, key, NULL, 0))
+		return false;
+
+	index_del(log, key);
+	log_maybe_compact(log);
+
+	return true;
+}
+
+void store_log_foreach(struct store_log *log, store_log_func_t func,
+							void *user_data)
+{
+	unsigned int i;
+
+	if (!log || !func)
+		return;
+
+	for (i = 0; i < log->num_buckets; i++) {
+		struct log_entry *entry;
+
+		for (entry = log->buckets[i]; entry; entry = entry->next)
+			func(entry->key, entry->data, entry->len, user_data);
+	}
+}
+
+unsigned int store_log_count(struct store_log *log)
+{
+	if (!log)
+		return 0;
+
+	return log->num_entries;
+}
+
+size_t store_log_get_size(struct store_log *log)
+{
+	if (!log)
+		return 0;
+
+	return log->size;
+}
+
+size_t store_log_get_corrupted(struct store_log *log)
+{
+	if (!log)
+		return 0;
+
+	return log->corrupted;
+}
+
+bool store_log_sync(struct store_log *log)
+{
+	if (!log)
+		return false;
+
+	return fdatasync(log->fd) == 0;
+}
+
+static void sync_dir(const char *path)
+{
+	char *dir, *sep;
+	int fd;
+
+	dir = strdup(path);
+	sep = strrchr(dir, '/');
+	if (sep == dir)
+		sep[1] = '\0';
+	else if (sep)
+		*sep = '\0';
+	else
+		strcpy(dir, ".");
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+
+	free(dir);
+}
+
+/*
+ * Write the live records to a new file which then atomically replaces the
+ * current one, a crash at any point leaves either of them intact.
+ */
+bool store_log_compact(struct store_log *log)
+{
+	uint8_t *buf;
+	size_t size = LOG_HDR_LEN;
+	unsigned int i;
+	char *tmp;
+	int fd;
+
+	if (!log)
+		return false;
+
+	buf = malloc(LOG_HDR_LEN + log->live);
+	if (!buf)
+		return false;
+
+	put_le32(LOG_MAGIC, buf);
+	put_le32(LOG_VERSION, buf + 4);
+
+	for (i = 0; i < log->num_buckets; i++) {
+		struct log_entry *entry;
+
+		for (entry = log->buckets[i]; entry; entry = entry->next)
+			size += record_encode(buf + size, REC_PUT, entry->key,
+						entry->data, entry->len);
+	}
+
+	if (asprintf(&tmp, "%s.tmp", log->path) < 0) {
+		free(buf);
+		return false;
+	}
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		goto fail;
+
+	if (!write_all(fd, buf, size, 0) || fsync(fd) < 0 ||
+						rename(tmp, log->path) < 0) {
+		close(fd);
+		unlink(tmp);
+		goto fail;
+	}
+
+	sync_dir(log->path);
+
+	close(log->fd);
+	log->fd = fd;
+	log->size = size;
+
+	free(tmp);
+	free(buf);
+
+	return true;
+
+fail:
+	free(tmp);
+	free(buf);
+	return false;
+}
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Log structured key/value store
+ *
+ * All records are kept in a single file, changes are appended to it and the
+ * complete content is indexed in memory. Every record carries a checksum,
+ * an incomplete or corrupted record at the end of the file, e.g. after a
+ * crash, is discarded when the file is opened. Corrupted data followed by
+ * valid records is skipped instead and reported by store_log_get_corrupted().
+ * Once the file contains more stale records than live ones it is rewritten
+ * to a temporary file which then replaces it.
+ */
+struct store_log;
+
+typedef void (*store_log_func_t)(const char *key, const void *data,
+						size_t len, void *user_data);
+
+struct store_log *store_log_open(const char *path);
+void store_log_close(struct store_log *log);
+
+const void *store_log_get(struct store_log *log, const char *key,
+								size_t *len);
+bool store_log_put(struct store_log *log, const char *key,
+						const void *data, size_t len);
+bool store_log_del(struct store_log *log, const char *key);
+void store_log_foreach(struct store_log *log, store_log_func_t func,
+							void *user_data);
+
+unsigned int store_log_count(struct store_log *log);
+size_t store_log_get_size(struct store_log *log);
+size_t store_log_get_corrupted(struct store_log *log);
+
+bool store_log_sync(struct store_log *log);
+bool store_log_compact(struct store_log *log);
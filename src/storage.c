@@ -20,7 +20,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 #include <time.h>
+#include <dirent.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 
@@ -31,6 +34,11 @@
 #include "lib/sdp_lib.h"
 #include "lib/uuid.h"
 
+#include "src/shared/util.h"
+#include "src/shared/store-log.h"
+
+#include "btd.h"
+#include "log.h"
 #include "textfile.h"
 #include "uuid-helper.h"
 #include "storage.h"
@@ -38,6 +46,33 @@
 /* When all services should trust a remote device */
 #define GLOBAL_TRUST "[all]"
 
+/* Delay in seconds before changes are written back to disk */
+#define STORAGE_FLUSH_DELAY 2
+
+/* Per adapter device database, see DeviceStorage in main.conf */
+#define STORAGE_DB "devices.db"
+
+/*
+ * In-memory copy of a key file. The content is kept as serialized so it can
+ * be compared cheaply with new content, files which haven't been used
+ * during a whole flush period are dropped.
+ */
+struct storage_file {
+	char *filename;
+	char *data;
+	gsize length;
+	bool loaded;
+	bool exists;
+	bool dirty;
+	bool used;
+};
+
+static GHashTable *storage_files;
+static GHashTable *storage_dbs;
+static guint storage_flush_id;
+static unsigned int storage_stores;
+static unsigned int storage_writes;
+
 struct match {
 	GSList *keys;
 	char *pattern;
@@ -184,3 +219,475 @@ sdp_record_t *find_record_in_list(sdp_list_t *recs, const char *uuid)
 	}
 	return NULL;
 }
+
+static void storage_db_free(gpointer data)
+{
+	store_log_close(data);
+}
+
+/* Get the database of an adapter storage directory, opening it if needed */
+static struct store_log *storage_db_open(const char *dirname)
+{
+	struct store_log *db;
+	char filename[PATH_MAX];
+
+	if (btd_opts.device_storage != DEVICE_STORAGE_DATABASE)
+		return NULL;
+
+	if (!storage_dbs)
+		storage_dbs = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, storage_db_free);
+
+	db = g_hash_table_lookup(storage_dbs, dirname);
+	if (db)
+		return db;
+
+	snprintf(filename, PATH_MAX, "%s/" STORAGE_DB, dirname);
+	create_file(filename, 0600);
+
+	db = store_log_open(filename);
+	if (!db) {
+		error("Unable to open %s: %s", filename, strerror(errno));
+		return NULL;
+	}
+
+	if (store_log_get_corrupted(db))
+		warn("Skipped %zu bytes of corrupted data in %s",
+					store_log_get_corrupted(db), filename);
+
+	DBG("%s: %u records", filename, store_log_count(db));
+
+	g_hash_table_insert(storage_dbs, g_strdup(dirname), db);
+
+	return db;
+}
+
+/*
+ * Get the database a path below an adapter storage directory belongs to,
+ * name is set to the path relative to the adapter directory.
+ */
+static struct store_log *storage_db_get(const char *path, const char **name)
+{
+	char dirname[PATH_MAX];
+	const char *adapter;
+
+	if (btd_opts.device_storage != DEVICE_STORAGE_DATABASE)
+		return NULL;
+
+	if (strncmp(path, STORAGEDIR "/", strlen(STORAGEDIR) + 1))
+		return NULL;
+
+	adapter = path + strlen(STORAGEDIR) + 1;
+	if (strlen(adapter) < 19 || adapter[17] != '/')
+		return NULL;
+
+	snprintf(dirname, PATH_MAX, "%.*s", (int) (adapter + 17 - path),
+									path);
+	*name = adapter + 18;
+
+	return storage_db_open(dirname);
+}
+
+static bool storage_db_key(const char *name)
+{
+	char addr[18];
+
+	/* Device info files: <address>/info */
+	if (strlen(name) == 22 && !strcmp(name + 17, "/info")) {
+		memcpy(addr, name, 17);
+		addr[17] = '\0';
+		return bachk(addr) == 0;
+	}
+
+	/* Device cache files: cache/<address> */
+	if (!strncmp(name, "cache/", 6))
+		return bachk(name + 6) == 0;
+
+	return false;
+}
+
+/* Only the files accessed through btd_storage_* are kept in the database */
+static struct store_log *storage_db_lookup(const char *filename,
+							const char **key)
+{
+	const char *name;
+
+	if (btd_opts.device_storage != DEVICE_STORAGE_DATABASE)
+		return NULL;
+
+	if (strncmp(filename, STORAGEDIR "/", strlen(STORAGEDIR) + 1))
+		return NULL;
+
+	name = strchr(filename + strlen(STORAGEDIR) + 1, '/');
+	if (!name || !storage_db_key(name + 1))
+		return NULL;
+
+	return storage_db_get(filename, key);
+}
+
+static void storage_file_free(gpointer data)
+{
+	struct storage_file *file = data;
+
+	g_free(file->filename);
+	g_free(file->data);
+	g_free(file);
+}
+
+static struct storage_file *storage_file_get(const char *filename)
+{
+	struct storage_file *file;
+
+	if (!storage_files)
+		storage_files = g_hash_table_new_full(g_str_hash, g_str_equal,
+						NULL, storage_file_free);
+
+	file = g_hash_table_lookup(storage_files, filename);
+	if (file)
+		return file;
+
+	file = g_new0(struct storage_file, 1);
+	file->filename = g_strdup(filename);
+	g_hash_table_insert(storage_files, file->filename, file);
+
+	return file;
+}
+
+static void storage_file_write(struct storage_file *file, bool sync)
+{
+	struct store_log *db;
+	const char *key;
+	GError *gerr = NULL;
+
+	file->dirty = false;
+	storage_writes++;
+
+	db = storage_db_lookup(file->filename, &key);
+	if (db) {
+		if (!store_log_put(db, key, file->data, file->length) ||
+					(sync && !store_log_sync(db)))
+			error("Unable to write %s to database: %s",
+					file->filename, strerror(errno));
+		return;
+	}
+
+	create_file(file->filename, 0600);
+
+	/* The content is written to a temporary file which is then renamed */
+	if (!g_file_set_contents(file->filename, file->data, file->length,
+								&gerr)) {
+		error("Unable to write %s: %s", file->filename, gerr->message);
+		g_error_free(gerr);
+	}
+}
+
+static void storage_db_sync(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	store_log_sync(value);
+}
+
+static gboolean storage_flush_cb(gpointer user_data)
+{
+	GHashTableIter iter;
+	gpointer value;
+	bool written = false;
+
+	g_hash_table_iter_init(&iter, storage_files);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct storage_file *file = value;
+
+		if (file->dirty) {
+			storage_file_write(file, false);
+			written = true;
+		} else if (!file->used) {
+			g_hash_table_iter_remove(&iter);
+			continue;
+		}
+
+		file->used = false;
+	}
+
+	/* Database records are synced once per flush */
+	if (written && storage_dbs)
+		g_hash_table_foreach(storage_dbs, storage_db_sync, NULL);
+
+	DBG("%u stores, %u writes", storage_stores, storage_writes);
+
+	if (g_hash_table_size(storage_files))
+		return TRUE;
+
+	storage_flush_id = 0;
+
+	return FALSE;
+}
+
+static void storage_schedule_flush(void)
+{
+	if (storage_flush_id)
+		return;
+
+	storage_flush_id = g_timeout_add_seconds(STORAGE_FLUSH_DELAY,
+						storage_flush_cb, NULL);
+}
+
+/*
+ * Load a key file through the storage cache, pending changes stored with
+ * btd_storage_store() are visible even if not yet written to disk.
+ */
+gboolean btd_storage_load(GKeyFile *key_file, const char *filename)
+{
+	struct storage_file *file;
+
+	file = storage_file_get(filename);
+	file->used = true;
+
+	if (!file->loaded) {
+		struct store_log *db;
+		const void *data = NULL;
+		const char *key;
+		size_t len;
+
+		db = storage_db_lookup(filename, &key);
+		if (db)
+			data = store_log_get(db, key, &len);
+
+		/* Files are still used if not found in the database so
+		 * existing storage keeps working when switching over.
+		 */
+		if (data) {
+			file->data = g_malloc(len + 1);
+			memcpy(file->data, data, len);
+			file->data[len] = '\0';
+			file->length = len;
+			file->exists = true;
+		} else
+			file->exists = g_file_get_contents(filename,
+							&file->data,
+							&file->length, NULL);
+
+		file->loaded = true;
+		storage_schedule_flush();
+	}
+
+	if (!file->exists)
+		return FALSE;
+
+	return g_key_file_load_from_data(key_file, file->data, file->length,
+								0, NULL);
+}
+
+/*
+ * Store a key file, the write is deferred so that several changes to the
+ * same file are written at once and is skipped if the content is unchanged.
+ */
+void btd_storage_store(GKeyFile *key_file, const char *filename)
+{
+	struct storage_file *file;
+	char *data;
+	gsize length = 0;
+
+	data = g_key_file_to_data(key_file, &length, NULL);
+
+	storage_stores++;
+
+	file = storage_file_get(filename);
+	file->used = true;
+
+	if (file->exists && file->length == length &&
+					!memcmp(file->data, data, length)) {
+		g_free(data);
+		return;
+	}
+
+	g_free(file->data);
+	file->data = data;
+	file->length = length;
+	file->loaded = true;
+	file->exists = true;
+	file->dirty = true;
+
+	storage_schedule_flush();
+}
+
+/* Store a key file and write it right away, used for keys */
+void btd_storage_sync(GKeyFile *key_file, const char *filename)
+{
+	struct storage_file *file;
+
+	btd_storage_store(key_file, filename);
+
+	file = g_hash_table_lookup(storage_files, filename);
+	if (file && file->dirty)
+		storage_file_write(file, true);
+}
+
+static gboolean storage_file_match(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	const char *filename = key;
+	const char *path = user_data;
+	size_t len = strlen(path);
+
+	return !strncmp(filename, path, len) &&
+			(filename[len] == '\0' || filename[len] == '/');
+}
+
+struct db_match {
+	const char *name;
+	GSList *keys;
+};
+
+static void storage_db_match(const char *key, const void *data, size_t len,
+							void *user_data)
+{
+	struct db_match *match = user_data;
+	size_t name_len = strlen(match->name);
+
+	if (!strncmp(key, match->name, name_len) &&
+			(key[name_len] == '\0' || key[name_len] == '/'))
+		match->keys = g_slist_prepend(match->keys, g_strdup(key));
+}
+
+/*
+ * Drop pending changes of a file or directory that is being removed, along
+ * with its records in the device database.
+ */
+void btd_storage_forget(const char *path)
+{
+	struct db_match match = { NULL, NULL };
+	struct store_log *db;
+	GSList *l;
+
+	if (storage_files)
+		g_hash_table_foreach_remove(storage_files, storage_file_match,
+							(gpointer) path);
+
+	db = storage_db_get(path, &match.name);
+	if (!db)
+		return;
+
+	store_log_foreach(db, storage_db_match, &match);
+
+	for (l = match.keys; l; l = l->next)
+		store_log_del(db, l->data);
+
+	if (match.keys)
+		store_log_sync(db);
+
+	g_slist_free_full(match.keys, g_free);
+}
+
+static void storage_db_device(const char *key, const void *data, size_t len,
+							void *user_data)
+{
+	GPtrArray *devices = user_data;
+
+	if (strlen(key) != 22 || strcmp(key + 17, "/info"))
+		return;
+
+	g_ptr_array_add(devices, g_strndup(key, 17));
+}
+
+static gint device_cmp(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+/*
+ * Get the addresses of the devices stored for an adapter, either as device
+ * directory or as record in the device database. The NULL terminated array
+ * must be freed with g_strfreev().
+ */
+char **btd_storage_get_devices(const char *dirname)
+{
+	GPtrArray *devices;
+	struct store_log *db;
+	struct dirent *entry;
+	DIR *dir;
+	guint i;
+
+	db = storage_db_open(dirname);
+
+	dir = opendir(dirname);
+	if (!dir && !db)
+		return NULL;
+
+	devices = g_ptr_array_new();
+
+	while (dir && (entry = readdir(dir)) != NULL) {
+		if (entry->d_type == DT_UNKNOWN)
+			entry->d_type = util_get_dt(dirname, entry->d_name);
+
+		if (entry->d_type != DT_DIR || bachk(entry->d_name) < 0)
+			continue;
+
+		g_ptr_array_add(devices, g_strdup(entry->d_name));
+	}
+
+	if (dir)
+		closedir(dir);
+
+	store_log_foreach(db, storage_db_device, devices);
+
+	/* Devices found both as directory and in the database */
+	g_ptr_array_sort(devices, device_cmp);
+
+	for (i = 1; i < devices->len; i++) {
+		if (strcmp(devices->pdata[i - 1], devices->pdata[i]))
+			continue;
+
+		g_free(g_ptr_array_remove_index(devices, i--));
+	}
+
+	g_ptr_array_add(devices, NULL);
+
+	return (char **) g_ptr_array_free(devices, FALSE);
+}
+
+void btd_storage_flush(void)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (!storage_files)
+		return;
+
+	g_hash_table_iter_init(&iter, storage_files);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct storage_file *file = value;
+
+		if (file->dirty)
+			storage_file_write(file, false);
+	}
+
+	if (storage_dbs)
+		g_hash_table_foreach(storage_dbs, storage_db_sync, NULL);
+}
+
+void btd_storage_cleanup(void)
+{
+	btd_storage_flush();
+
+	if (storage_flush_id) {
+		g_source_remove(storage_flush_id);
+		storage_flush_id = 0;
+	}
+
+	if (storage_files) {
+		g_hash_table_destroy(storage_files);
+		storage_files = NULL;
+	}
+
+	if (storage_dbs) {
+		g_hash_table_destroy(storage_dbs);
+		storage_dbs = NULL;
+	}
+
+	if (storage_stores)
+		info("Storage: %u stores, %u writes (%u saved)",
+				storage_stores, storage_writes,
+				storage_stores - storage_writes);
+}
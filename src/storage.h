@@ -14,3 +14,11 @@ int read_on_mode(const char *src, char *mode, int length);
 int read_local_name(const bdaddr_t *bdaddr, char *name);
 sdp_record_t *record_from_string(const char *str);
 sdp_record_t *find_record_in_list(sdp_list_t *recs, const char *uuid);
+
+gboolean btd_storage_load(GKeyFile *key_file, const char *filename);
+void btd_storage_store(GKeyFile *key_file, const char *filename);
+void btd_storage_sync(GKeyFile *key_file, const char *filename);
+void btd_storage_forget(const char *path);
+char **btd_storage_get_devices(const char *dirname);
+void btd_storage_flush(void);
+void btd_storage_cleanup(void);
@@ -44,63 +44,109 @@ struct monitor_hdr {
 	uint16_t len;
 } __attribute__ ((packed));
 
-static struct btsnoop *btsnoop_file = NULL;
+#define ARCHIVE_BLOCK_SIZE	(256 * 1024)
+#define ARCHIVE_FLUSH_TIMEOUT	5
 
-static void data_callback(int fd, uint32_t events, void *user_data)
-{
+#define BATCH_SIZE		32
+
+struct batch_slot {
+	struct monitor_hdr hdr;
 	uint8_t buf[BTSNOOP_MAX_PACKET_SIZE];
 	unsigned char control[64];
-	struct monitor_hdr hdr;
-	struct msghdr msg;
 	struct iovec iov[2];
+};
 
-	if (events & (EPOLLERR | EPOLLHUP)) {
-		mainloop_exit_failure();
+static struct btsnoop *btsnoop_file = NULL;
+
+static struct mmsghdr batch_msgs[BATCH_SIZE];
+static struct batch_slot batch_slots[BATCH_SIZE];
+static unsigned long batch_reads;
+static unsigned long batch_frames;
+static unsigned int batch_max;
+
+static void process_frame(struct msghdr *msg, ssize_t len)
+{
+	struct monitor_hdr *hdr = msg->msg_iov[0].iov_base;
+	struct cmsghdr *cmsg;
+	struct timeval *tv = NULL;
+	struct timeval ctv;
+	uint16_t opcode, index, pktlen;
+
+	if (len < (ssize_t) sizeof(*hdr))
 		return;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+				cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+
+		if (cmsg->cmsg_type == SCM_TIMESTAMP) {
+			memcpy(&ctv, CMSG_DATA(cmsg), sizeof(ctv));
+			tv = &ctv;
+		}
 	}
 
-	iov[0].iov_base = &hdr;
-	iov[0].iov_len = sizeof(hdr);
-	iov[1].iov_base = buf;
-	iov[1].iov_len = sizeof(buf);
+	opcode = le16_to_cpu(hdr->opcode);
+	index  = le16_to_cpu(hdr->index);
+	pktlen = le16_to_cpu(hdr->len);
 
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_iov = iov;
-	msg.msg_iovlen = 2;
-	msg.msg_control = control;
-	msg.msg_controllen = sizeof(control);
+	btsnoop_write_hci(btsnoop_file, tv, index, opcode, 0,
+					msg->msg_iov[1].iov_base, pktlen);
+}
+
+static void data_callback(int fd, uint32_t events, void *user_data)
+{
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		mainloop_exit_failure();
+		return;
+	}
 
 	while (1) {
-		struct cmsghdr *cmsg;
-		struct timeval *tv = NULL;
-		struct timeval ctv;
-		uint16_t opcode, index, pktlen;
-		ssize_t len;
-
-		len = recvmsg(fd, &msg, MSG_DONTWAIT);
-		if (len < 0)
-			break;
+		int i, count;
 
-		if (len < (ssize_t) sizeof(hdr))
+		count = recvmmsg(fd, batch_msgs, BATCH_SIZE, MSG_DONTWAIT,
+									NULL);
+		if (count <= 0)
 			break;
 
-		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
-					cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-			if (cmsg->cmsg_level != SOL_SOCKET)
-				continue;
+		batch_reads++;
+		batch_frames += count;
 
-			if (cmsg->cmsg_type == SCM_TIMESTAMP) {
-				memcpy(&ctv, CMSG_DATA(cmsg), sizeof(ctv));
-				tv = &ctv;
-			}
+		if ((unsigned int) count > batch_max)
+			batch_max = count;
+
+		for (i = 0; i < count; i++) {
+			struct msghdr *msg = &batch_msgs[i].msg_hdr;
+
+			process_frame(msg, batch_msgs[i].msg_len);
+
+			/* Reset the control area for the next batch */
+			msg->msg_controllen = sizeof(batch_slots[i].control);
 		}
 
-		opcode = le16_to_cpu(hdr.opcode);
-		index  = le16_to_cpu(hdr.index);
-		pktlen = le16_to_cpu(hdr.len);
+		/* A short batch means the socket queue has been drained */
+		if (count < BATCH_SIZE)
+			break;
+	}
+}
 
-		btsnoop_write_hci(btsnoop_file, tv, index, opcode, 0, buf,
-									pktlen);
+static void init_batch(void)
+{
+	int i;
+
+	for (i = 0; i < BATCH_SIZE; i++) {
+		struct batch_slot *slot = &batch_slots[i];
+		struct msghdr *msg = &batch_msgs[i].msg_hdr;
+
+		slot->iov[0].iov_base = &slot->hdr;
+		slot->iov[0].iov_len = sizeof(slot->hdr);
+		slot->iov[1].iov_base = slot->buf;
+		slot->iov[1].iov_len = sizeof(slot->buf);
+
+		msg->msg_iov = slot->iov;
+		msg->msg_iovlen = 2;
+		msg->msg_control = slot->control;
+		msg->msg_controllen = sizeof(slot->control);
 	}
 }
 
@@ -138,11 +184,21 @@ static bool open_monitor_channel(void)
 		return false;
 	}
 
+	init_batch();
+
 	mainloop_add_fd(fd, EPOLLIN, data_callback, NULL, NULL);
 
 	return true;
 }
 
+static void flush_callback(int id, void *user_data)
+{
+	/* Bound the amount of trace data lost on a crash */
+	btsnoop_flush(btsnoop_file);
+
+	mainloop_modify_timeout(id, ARCHIVE_FLUSH_TIMEOUT * 1000);
+}
+
 static void signal_callback(int signum, void *user_data)
 {
 	switch (signum) {
@@ -196,6 +252,7 @@ static void usage(void)
 		"\t-p, --parents          Create basename parent directories\n"
 		"\t-l, --limit <limit>    Limit traces file size (rotate)\n"
 		"\t-c, --count <count>    Limit number of rotated files\n"
+		"\t-A, --archive[=<size>] Write compressed indexed archive\n"
 		"\t-v, --version          Show version\n"
 		"\t-h, --help             Show help options\n");
 }
@@ -205,6 +262,7 @@ static const struct option main_options[] = {
 	{ "parents",	no_argument,		NULL, 'p' },
 	{ "limit",	required_argument,	NULL, 'l' },
 	{ "count",	required_argument,	NULL, 'c' },
+	{ "archive",	optional_argument,	NULL, 'A' },
 	{ "version",	no_argument,		NULL, 'v' },
 	{ "help",	no_argument,		NULL, 'h' },
 	{ }
@@ -262,6 +320,7 @@ int main(int argc, char *argv[])
 	const char *path = "hci.log";
 	unsigned long max_count = 0;
 	size_t size_limit = 0;
+	size_t block_size = 0;
 	bool parents = false;
 	int exit_status;
 	char *endptr;
@@ -273,7 +332,7 @@ int main(int argc, char *argv[])
 	while (true) {
 		int opt;
 
-		opt = getopt_long(argc, argv, "b:l:c:vhp", main_options,
+		opt = getopt_long(argc, argv, "b:l:c:A::vhp", main_options,
 									NULL);
 		if (opt < 0)
 			break;
@@ -314,6 +373,25 @@ int main(int argc, char *argv[])
 		case 'c':
 			max_count = strtoul(optarg, &endptr, 10);
 			break;
+		case 'A':
+			block_size = ARCHIVE_BLOCK_SIZE;
+
+			if (!optarg)
+				break;
+
+			block_size = strtoul(optarg, &endptr, 10);
+
+			if (*endptr == 'K' || *endptr == 'k') {
+				block_size *= 1024;
+				endptr++;
+			}
+
+			if (*endptr != '\0' || block_size < 4096 ||
+						block_size > 16 * 1024 * 1024) {
+				fprintf(stderr, "Invalid archive block size\n");
+				return EXIT_FAILURE;
+			}
+			break;
 		case 'p':
 			if (getppid() != 1) {
 				fprintf(stderr, "Parents option allowed only "
@@ -345,11 +423,15 @@ int main(int argc, char *argv[])
 	if (parents && create_dir(path) < 0)
 		return EXIT_FAILURE;
 
-	btsnoop_file = btsnoop_create(path, size_limit, max_count,
-							BTSNOOP_FORMAT_MONITOR);
+	btsnoop_file = btsnoop_create_archive(path, size_limit, max_count,
+					BTSNOOP_FORMAT_MONITOR, block_size);
 	if (!btsnoop_file)
 		return EXIT_FAILURE;
 
+	if (block_size)
+		mainloop_add_timeout(ARCHIVE_FLUSH_TIMEOUT * 1000,
+						flush_callback, NULL, NULL);
+
 	drop_capabilities();
 
 	printf("Bluetooth monitor logger ver %s\n", VERSION);
@@ -361,6 +443,12 @@ int main(int argc, char *argv[])
 
 	mainloop_sd_notify("STATUS=Quitting");
 
+	if (batch_reads)
+		printf("Logged %lu frames in %lu reads (%.1f per read, "
+					"max %u)\n", batch_frames, batch_reads,
+					(double) batch_frames / batch_reads,
+					batch_max);
+
 	btsnoop_unref(btsnoop_file);
 
 	return exit_status;
@@ -114,149 +114,538 @@ static int open_btsnoop(const char *path, uint32_t *type)
 	return fd;
 }
 
-#define MAX_MERGE 8
+/* Timestamps are microseconds since 2000-01-01 plus this offset */
+#define BTSNOOP_EPOCH_DELTA	0x00E03AB44A676000ll
+#define BTSNOOP_EPOCH_UNIX	946684800ll
 
-static void command_merge(const char *output, int argc, char *argv[])
+#define MERGE_BUF_SIZE		(64 * 1024)
+
+struct merge_input {
+	const char *path;
+	int fd;
+	uint32_t type;
+	unsigned int order;
+	unsigned char buf[MERGE_BUF_SIZE];
+	size_t offset;
+	size_t len;
+	uint64_t ts;
+	uint32_t flags;
+	uint32_t drops;
+	const unsigned char *data;
+	uint32_t size;
+};
+
+struct merge_output {
+	uint16_t index;
+	int fd;
+	unsigned char buf[MERGE_BUF_SIZE];
+	size_t len;
+};
+
+struct merge_filter {
+	uint64_t start;
+	uint64_t end;
+	uint16_t *index;
+	unsigned int num_index;
+	uint16_t *handle;
+	unsigned int num_handle;
+	uint16_t *opcode;
+	unsigned int num_opcode;
+	bool split;
+};
+
+static struct merge_filter merge_filter;
+
+static bool input_fill(struct merge_input *input, size_t size)
 {
-	struct btsnoop_pkt input_pkt[MAX_MERGE];
-	unsigned char buf[2048];
-	int output_fd, input_fd[MAX_MERGE], num_input = 0;
-	int i, select_input;
-	ssize_t len, written;
-	uint32_t toread, flags;
-	uint16_t index, opcode;
-
-	if (argc > MAX_MERGE) {
-		fprintf(stderr, "only up to %d files allowed\n", MAX_MERGE);
-		return;
+	ssize_t len;
+
+	if (input->len - input->offset >= size)
+		return true;
+
+	memmove(input->buf, input->buf + input->offset,
+					input->len - input->offset);
+	input->len -= input->offset;
+	input->offset = 0;
+
+	while (input->len < size) {
+		len = read(input->fd, input->buf + input->len,
+					sizeof(input->buf) - input->len);
+		if (len <= 0)
+			return false;
+
+		input->len += len;
 	}
 
-	for (i = 0; i < argc; i++) {
-		uint32_t type;
-		int fd;
+	return true;
+}
 
-		fd = open_btsnoop(argv[i], &type);
-		if (fd < 0)
-			break;
+static bool input_next(struct merge_input *input)
+{
+	const struct btsnoop_pkt *pkt;
+	uint32_t size;
 
-		if (type != 1002) {
-			fprintf(stderr, "unsupported link data type %u\n",
-									type);
-			close(fd);
+	if (!input_fill(input, BTSNOOP_PKT_SIZE))
+		return false;
+
+	pkt = (const void *) (input->buf + input->offset);
+	size = be32toh(pkt->len);
+
+	if (size > sizeof(input->buf) - BTSNOOP_PKT_SIZE) {
+		fprintf(stderr, "packet too large in %s\n", input->path);
+		return false;
+	}
+
+	if (!input_fill(input, BTSNOOP_PKT_SIZE + size))
+		return false;
+
+	pkt = (const void *) (input->buf + input->offset);
+
+	input->ts = be64toh(pkt->ts);
+	input->flags = be32toh(pkt->flags);
+	input->drops = be32toh(pkt->drops);
+	input->data = pkt->data;
+	input->size = size;
+
+	input->offset += BTSNOOP_PKT_SIZE + size;
+
+	return true;
+}
+
+static bool input_less(const struct merge_input *a,
+					const struct merge_input *b)
+{
+	if (a->ts != b->ts)
+		return a->ts < b->ts;
+
+	return a->order < b->order;
+}
+
+static void heap_sift_down(struct merge_input **heap, unsigned int num,
+							unsigned int pos)
+{
+	while (1) {
+		unsigned int left = pos * 2 + 1;
+		unsigned int right = left + 1;
+		unsigned int min = pos;
+		struct merge_input *tmp;
+
+		if (left < num && input_less(heap[left], heap[min]))
+			min = left;
+
+		if (right < num && input_less(heap[right], heap[min]))
+			min = right;
+
+		if (min == pos)
 			break;
+
+		tmp = heap[pos];
+		heap[pos] = heap[min];
+		heap[min] = tmp;
+		pos = min;
+	}
+}
+
+static bool input_convert(struct merge_input *input, uint16_t *index,
+				uint16_t *opcode, const unsigned char **data,
+				uint32_t *size)
+{
+	*data = input->data;
+	*size = input->size;
+
+	switch (input->type) {
+	case BTSNOOP_FORMAT_MONITOR:
+		*index = input->flags >> 16;
+		*opcode = input->flags & 0xffff;
+		return true;
+
+	case BTSNOOP_FORMAT_HCI:
+		*index = input->order;
+
+		if (input->flags & 0x02) {
+			if (input->flags & 0x01)
+				*opcode = BTSNOOP_OPCODE_EVENT_PKT;
+			else
+				*opcode = BTSNOOP_OPCODE_COMMAND_PKT;
+		} else {
+			if (input->flags & 0x01)
+				*opcode = BTSNOOP_OPCODE_ACL_RX_PKT;
+			else
+				*opcode = BTSNOOP_OPCODE_ACL_TX_PKT;
 		}
+		return true;
+
+	case BTSNOOP_FORMAT_UART:
+		if (input->size < 1)
+			return false;
+
+		*index = input->order;
+		*data = input->data + 1;
+		*size = input->size - 1;
+
+		switch (input->data[0]) {
+		case 0x01:
+			*opcode = BTSNOOP_OPCODE_COMMAND_PKT;
+			return true;
+		case 0x02:
+			if (input->flags & 0x01)
+				*opcode = BTSNOOP_OPCODE_ACL_RX_PKT;
+			else
+				*opcode = BTSNOOP_OPCODE_ACL_TX_PKT;
+			return true;
+		case 0x03:
+			if (input->flags & 0x01)
+				*opcode = BTSNOOP_OPCODE_SCO_RX_PKT;
+			else
+				*opcode = BTSNOOP_OPCODE_SCO_TX_PKT;
+			return true;
+		case 0x04:
+			*opcode = BTSNOOP_OPCODE_EVENT_PKT;
+			return true;
+		case 0x05:
+			if (input->flags & 0x01)
+				*opcode = BTSNOOP_OPCODE_ISO_RX_PKT;
+			else
+				*opcode = BTSNOOP_OPCODE_ISO_TX_PKT;
+			return true;
+		}
+		break;
+	}
+
+	return false;
+}
+
+static bool filter_has(const uint16_t *list, unsigned int num, uint16_t val)
+{
+	unsigned int i;
+
+	if (!num)
+		return true;
 
-		input_fd[num_input++] = fd;
+	for (i = 0; i < num; i++) {
+		if (list[i] == val)
+			return true;
 	}
 
-	if (num_input != argc) {
-		fprintf(stderr, "failed to open all input files\n");
-		goto close_input;
+	return false;
+}
+
+static bool filter_match(uint64_t ts, uint16_t index, uint16_t opcode,
+				const unsigned char *data, uint32_t size)
+{
+	if (merge_filter.start && ts < merge_filter.start)
+		return false;
+
+	if (!filter_has(merge_filter.index, merge_filter.num_index, index))
+		return false;
+
+	if (!filter_has(merge_filter.opcode, merge_filter.num_opcode, opcode))
+		return false;
+
+	/* Commands and events are kept to preserve the context of the
+	 * selected connections.
+	 */
+	switch (opcode) {
+	case BTSNOOP_OPCODE_ACL_TX_PKT:
+	case BTSNOOP_OPCODE_ACL_RX_PKT:
+	case BTSNOOP_OPCODE_SCO_TX_PKT:
+	case BTSNOOP_OPCODE_SCO_RX_PKT:
+	case BTSNOOP_OPCODE_ISO_TX_PKT:
+	case BTSNOOP_OPCODE_ISO_RX_PKT:
+		if (size < 2)
+			return false;
+
+		if (!filter_has(merge_filter.handle, merge_filter.num_handle,
+				(data[0] | (data[1] << 8)) & 0x0fff))
+			return false;
+		break;
 	}
 
-	output_fd = create_btsnoop(output);
-	if (output_fd < 0)
-		goto close_input;
+	return true;
+}
+
+static bool output_flush(struct merge_output *output)
+{
+	size_t offset = 0;
+	ssize_t written;
 
-	for (i = 0; i < num_input; i++) {
-		len = read(input_fd[i], &input_pkt[i], BTSNOOP_PKT_SIZE);
-		if (len < 0 || len != BTSNOOP_PKT_SIZE) {
-			close(input_fd[i]);
-			input_fd[i] = -1;
+	while (offset < output->len) {
+		written = write(output->fd, output->buf + offset,
+						output->len - offset);
+		if (written < 0) {
+			perror("failed to write output");
+			return false;
 		}
+
+		offset += written;
 	}
 
-next_packet:
-	select_input = -1;
+	output->len = 0;
 
-	for (i = 0; i < num_input; i++) {
-		uint64_t ts;
+	return true;
+}
 
-		if (input_fd[i] < 0)
-			continue;
+static struct merge_output *output_open(const char *path, uint16_t index)
+{
+	struct merge_output *output;
 
-		if (select_input < 0) {
-			select_input = i;
-			continue;
-		}
+	output = calloc(1, sizeof(*output));
+	if (!output) {
+		fprintf(stderr, "failed to allocate output\n");
+		return NULL;
+	}
 
-		ts = be64toh(input_pkt[i].ts);
+	output->index = index;
 
-		if (ts < be64toh(input_pkt[select_input].ts))
-			select_input = i;
+	output->fd = create_btsnoop(path);
+	if (output->fd < 0) {
+		free(output);
+		return NULL;
 	}
 
-	if (select_input < 0)
-		goto close_output;
+	return output;
+}
 
-	toread = be32toh(input_pkt[select_input].size);
-	flags = be32toh(input_pkt[select_input].flags);
+static void output_close(struct merge_output *output)
+{
+	output_flush(output);
+	close(output->fd);
+	free(output);
+}
 
-	len = read(input_fd[select_input], buf, toread);
-	if (len < 0 || len != (ssize_t) toread) {
-		close(input_fd[select_input]);
-		input_fd[select_input] = -1;
-		goto next_packet;
+static struct merge_output *output_lookup(const char *path,
+					struct merge_output ***outputs,
+					unsigned int *num_output,
+					uint16_t index)
+{
+	struct merge_output *output, **tmp;
+	char *split_path;
+	unsigned int i;
+
+	for (i = 0; i < *num_output; i++) {
+		if ((*outputs)[i]->index == index)
+			return (*outputs)[i];
 	}
 
-	written = htobe32(toread - 1);
-	input_pkt[select_input].size = written;
-	input_pkt[select_input].len = written;
+	if (asprintf(&split_path, "%s.hci%u", path, index) < 0) {
+		fprintf(stderr, "failed to allocate output path\n");
+		return NULL;
+	}
 
-	switch (buf[0]) {
-	case 0x01:
-		opcode = BTSNOOP_OPCODE_COMMAND_PKT;
-		break;
-	case 0x02:
-		if (flags & 0x01)
-			opcode = BTSNOOP_OPCODE_ACL_RX_PKT;
-		else
-			opcode = BTSNOOP_OPCODE_ACL_TX_PKT;
-		break;
-	case 0x03:
-		if (flags & 0x01)
-			opcode = BTSNOOP_OPCODE_SCO_RX_PKT;
-		else
-			opcode = BTSNOOP_OPCODE_SCO_TX_PKT;
-		break;
-	case 0x04:
-		opcode = BTSNOOP_OPCODE_EVENT_PKT;
-		break;
-	default:
-		goto skip_write;
+	output = output_open(split_path, index);
+	free(split_path);
+
+	if (!output)
+		return NULL;
+
+	tmp = realloc(*outputs, (*num_output + 1) * sizeof(*tmp));
+	if (!tmp) {
+		output_close(output);
+		return NULL;
 	}
 
-	index = select_input;
-	input_pkt[select_input].flags = htobe32((index << 16) | opcode);
+	tmp[(*num_output)++] = output;
+	*outputs = tmp;
+
+	return output;
+}
+
+static bool output_write(struct merge_output *output, uint64_t ts,
+				uint16_t index, uint16_t opcode, uint32_t drops,
+				const unsigned char *data, uint32_t size)
+{
+	struct btsnoop_pkt pkt;
+
+	if (output->len + BTSNOOP_PKT_SIZE + size > sizeof(output->buf) &&
+							!output_flush(output))
+		return false;
+
+	pkt.size = htobe32(size);
+	pkt.len = htobe32(size);
+	pkt.flags = htobe32((index << 16) | opcode);
+	pkt.drops = htobe32(drops);
+	pkt.ts = htobe64(ts);
 
-	written = write(output_fd, &input_pkt[select_input], BTSNOOP_PKT_SIZE);
-	if (written != BTSNOOP_PKT_SIZE) {
-		fprintf(stderr, "write of packet header failed\n");
-		goto close_output;
+	memcpy(output->buf + output->len, &pkt, BTSNOOP_PKT_SIZE);
+	output->len += BTSNOOP_PKT_SIZE;
+
+	memcpy(output->buf + output->len, data, size);
+	output->len += size;
+
+	return true;
+}
+
+static void command_merge(const char *output, int argc, char *argv[])
+{
+	struct merge_input *inputs, **heap;
+	struct merge_output *single = NULL, **outputs = NULL;
+	unsigned int num_heap = 0, num_output = 0;
+	unsigned long num_packets = 0;
+	int i;
+
+	inputs = calloc(argc, sizeof(*inputs));
+	heap = calloc(argc, sizeof(*heap));
+	if (!inputs || !heap) {
+		fprintf(stderr, "failed to allocate inputs\n");
+		goto done;
 	}
 
-	written = write(output_fd, buf + 1, toread - 1);
-	if (written != (ssize_t) toread - 1) {
-		fprintf(stderr, "write of packet data failed\n");
-		goto close_output;
+	for (i = 0; i < argc; i++)
+		inputs[i].fd = -1;
+
+	for (i = 0; i < argc; i++) {
+		struct merge_input *input = &inputs[i];
+
+		input->path = argv[i];
+		input->order = i;
+
+		input->fd = open_btsnoop(argv[i], &input->type);
+		if (input->fd < 0)
+			break;
+
+		switch (input->type) {
+		case BTSNOOP_FORMAT_HCI:
+		case BTSNOOP_FORMAT_UART:
+		case BTSNOOP_FORMAT_MONITOR:
+			break;
+		default:
+			fprintf(stderr, "unsupported link data type %u\n",
+								input->type);
+			goto close_input;
+		}
+
+		posix_fadvise(input->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		if (!input_next(input))
+			continue;
+
+		heap[num_heap] = input;
+		num_heap++;
 	}
 
-skip_write:
-	len = read(input_fd[select_input],
-				&input_pkt[select_input], BTSNOOP_PKT_SIZE);
-	if (len < 0 || len != BTSNOOP_PKT_SIZE) {
-		close(input_fd[select_input]);
-		input_fd[select_input] = -1;
+	if (i != argc) {
+		fprintf(stderr, "failed to open all input files\n");
+		goto close_input;
 	}
 
-	goto next_packet;
+	for (i = num_heap / 2; i >= 0; i--)
+		heap_sift_down(heap, num_heap, i);
+
+	if (!merge_filter.split) {
+		single = output_open(output, 0);
+		if (!single)
+			goto close_input;
+	}
+
+	while (num_heap > 0) {
+		struct merge_input *input = heap[0];
+		struct merge_output *out = single;
+		const unsigned char *data;
+		uint16_t index, opcode;
+		uint32_t size;
+
+		/* All remaining packets are past the end of the window */
+		if (merge_filter.end && input->ts > merge_filter.end)
+			break;
+
+		if (input_convert(input, &index, &opcode, &data, &size) &&
+				filter_match(input->ts, index, opcode,
+								data, size)) {
+			if (!out)
+				out = output_lookup(output, &outputs,
+							&num_output, index);
+
+			if (!out || !output_write(out, input->ts, index,
+							opcode, input->drops,
+							data, size))
+				goto close_output;
+
+			num_packets++;
+		}
+
+		if (!input_next(input)) {
+			close(input->fd);
+			input->fd = -1;
+			heap[0] = heap[--num_heap];
+		}
+
+		heap_sift_down(heap, num_heap, 0);
+	}
+
+	printf("Merged %lu packets from %d files\n", num_packets, argc);
 
 close_output:
-	close(output_fd);
+	if (single)
+		output_close(single);
+
+	for (i = 0; i < (int) num_output; i++)
+		output_close(outputs[i]);
+
+	free(outputs);
 
 close_input:
-	for (i = 0; i < num_input; i++)
-		close(input_fd[i]);
+	for (i = 0; i < argc; i++) {
+		if (inputs[i].fd >= 0)
+			close(inputs[i].fd);
+	}
+
+done:
+	free(heap);
+	free(inputs);
+}
+
+static bool parse_time(const char *str, uint64_t *ts)
+{
+	unsigned long long sec, usec = 0;
+	char *end;
+	int digits;
+
+	errno = 0;
+	sec = strtoull(str, &end, 10);
+	if (errno || end == str)
+		return false;
+
+	if (*end == '.') {
+		for (digits = 0, end++; digits < 6; digits++) {
+			usec *= 10;
+			if (*end >= '0' && *end <= '9')
+				usec += *end++ - '0';
+		}
+
+		while (*end >= '0' && *end <= '9')
+			end++;
+	}
+
+	if (*end != '\0' || sec < BTSNOOP_EPOCH_UNIX)
+		return false;
+
+	*ts = (sec - BTSNOOP_EPOCH_UNIX) * 1000000 + usec + BTSNOOP_EPOCH_DELTA;
+
+	return true;
+}
+
+static bool parse_filter(const char *str, uint16_t **list, unsigned int *num)
+{
+	unsigned long val;
+	uint16_t *tmp;
+	char *end;
+
+	if (!strncasecmp(str, "hci", 3))
+		str += 3;
+
+	errno = 0;
+	val = strtoul(str, &end, 0);
+	if (errno || end == str || *end != '\0' || val > 0xffff)
+		return false;
+
+	tmp = realloc(*list, (*num + 1) * sizeof(*tmp));
+	if (!tmp)
+		return false;
+
+	tmp[(*num)++] = val;
+	*list = tmp;
+
+	return true;
 }
 
 static void command_extract_eir(const char *input)
@@ -506,12 +895,25 @@ static void usage(void)
 		"\t-m, --merge <output>   Merge multiple btsnoop files\n"
 		"\t-e, --extract <input>  Extract data from btsnoop file\n"
 		"\t-h, --help             Show help options\n");
+	printf("merge options:\n"
+		"\t-S, --start <time>     Skip packets before time\n"
+		"\t-E, --end <time>       Skip packets after time\n"
+		"\t-i, --index <num>      Keep only packets of index\n"
+		"\t-H, --handle <num>     Keep only data packets of handle\n"
+		"\t-o, --opcode <num>     Keep only packets with opcode\n"
+		"\t-s, --split            Write one output file per index\n");
 }
 
 static const struct option main_options[] = {
 	{ "merge",   required_argument, NULL, 'm' },
 	{ "extract", required_argument, NULL, 'e' },
 	{ "type",    required_argument, NULL, 't' },
+	{ "start",   required_argument, NULL, 'S' },
+	{ "end",     required_argument, NULL, 'E' },
+	{ "index",   required_argument, NULL, 'i' },
+	{ "handle",  required_argument, NULL, 'H' },
+	{ "opcode",  required_argument, NULL, 'o' },
+	{ "split",   no_argument,       NULL, 's' },
 	{ "version", no_argument,       NULL, 'v' },
 	{ "help",    no_argument,       NULL, 'h' },
 	{ }
@@ -529,7 +931,7 @@ int main(int argc, char *argv[])
 	for (;;) {
 		int opt;
 
-		opt = getopt_long(argc, argv, "m:e:t:vh", main_options, NULL);
+		opt = getopt_long(argc, argv, "m:e:t:S:E:i:H:o:svh", main_options, NULL);
 		if (opt < 0)
 			break;
 
@@ -545,6 +947,42 @@ int main(int argc, char *argv[])
 		case 't':
 			type = optarg;
 			break;
+		case 'S':
+			if (!parse_time(optarg, &merge_filter.start)) {
+				fprintf(stderr, "invalid start time\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'E':
+			if (!parse_time(optarg, &merge_filter.end)) {
+				fprintf(stderr, "invalid end time\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'i':
+			if (!parse_filter(optarg, &merge_filter.index,
+						&merge_filter.num_index)) {
+				fprintf(stderr, "invalid index\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'H':
+			if (!parse_filter(optarg, &merge_filter.handle,
+						&merge_filter.num_handle)) {
+				fprintf(stderr, "invalid handle\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			if (!parse_filter(optarg, &merge_filter.opcode,
+						&merge_filter.num_opcode)) {
+				fprintf(stderr, "invalid opcode\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			merge_filter.split = true;
+			break;
 		case 'v':
 			printf("%s\n", VERSION);
 			return EXIT_SUCCESS;
@@ -592,5 +1030,9 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	free(merge_filter.index);
+	free(merge_filter.handle);
+	free(merge_filter.opcode);
+
 	return EXIT_SUCCESS;
 }
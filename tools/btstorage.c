@@ -0,0 +1,442 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "bluetooth/bluetooth.h"
+
+#include "src/shared/store-log.h"
+
+/* Must match the name used by bluetoothd */
+#define DEVICE_DB "devices.db"
+
+static char *read_file(const char *path, size_t *len)
+{
+	char *data;
+	FILE *fp;
+	long size;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return NULL;
+
+	if (fseek(fp, 0, SEEK_END) < 0 || (size = ftell(fp)) < 0) {
+		fclose(fp);
+		return NULL;
+	}
+
+	rewind(fp);
+
+	data = malloc(size ? size : 1);
+	if (data && fread(data, 1, size, fp) != (size_t) size) {
+		free(data);
+		data = NULL;
+	}
+
+	fclose(fp);
+
+	*len = size;
+
+	return data;
+}
+
+static bool import_file(struct store_log *log, const char *dirname,
+							const char *key)
+{
+	char path[PATH_MAX];
+	size_t len;
+	char *data;
+	bool ret;
+	int n;
+
+	n = snprintf(path, sizeof(path), "%s/%s", dirname, key);
+	if (n < 0 || n >= (int) sizeof(path))
+		return false;
+
+	data = read_file(path, &len);
+	if (!data)
+		return false;
+
+	ret = store_log_put(log, key, data, len);
+	if (!ret)
+		fprintf(stderr, "Failed to import %s\n", path);
+
+	free(data);
+
+	return ret;
+}
+
+static bool is_address(const char *dirname, struct dirent *entry,
+							unsigned char type)
+{
+	struct stat st;
+	char path[PATH_MAX];
+	int len;
+
+	if (bachk(entry->d_name) < 0)
+		return false;
+
+	if (entry->d_type != DT_UNKNOWN)
+		return entry->d_type == type;
+
+	len = snprintf(path, sizeof(path), "%s/%s", dirname, entry->d_name);
+	if (len < 0 || len >= (int) sizeof(path))
+		return false;
+
+	if (stat(path, &st) < 0)
+		return false;
+
+	return type == DT_DIR ? S_ISDIR(st.st_mode) : S_ISREG(st.st_mode);
+}
+
+static unsigned int import_devices(struct store_log *log, const char *dirname)
+{
+	struct dirent *entry;
+	unsigned int count = 0;
+	char key[PATH_MAX];
+	DIR *dir;
+
+	dir = opendir(dirname);
+	if (!dir)
+		return 0;
+
+	while ((entry = readdir(dir))) {
+		if (!is_address(dirname, entry, DT_DIR))
+			continue;
+
+		snprintf(key, sizeof(key), "%s/info", entry->d_name);
+
+		if (import_file(log, dirname, key))
+			count++;
+	}
+
+	closedir(dir);
+
+	return count;
+}
+
+static unsigned int import_cache(struct store_log *log, const char *dirname)
+{
+	struct dirent *entry;
+	unsigned int count = 0;
+	char path[PATH_MAX];
+	char key[PATH_MAX];
+	DIR *dir;
+	int len;
+
+	len = snprintf(path, sizeof(path), "%s/cache", dirname);
+	if (len < 0 || len >= (int) sizeof(path))
+		return 0;
+
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+
+	/* GATT cache files have a .gatt suffix and are kept as files */
+	while ((entry = readdir(dir))) {
+		if (!is_address(path, entry, DT_REG))
+			continue;
+
+		snprintf(key, sizeof(key), "cache/%s", entry->d_name);
+
+		if (import_file(log, dirname, key))
+			count++;
+	}
+
+	closedir(dir);
+
+	return count;
+}
+
+static int make_dirs(const char *path)
+{
+	char *dir, *sep;
+	int err = 0;
+
+	dir = strdup(path);
+
+	for (sep = strchr(dir + 1, '/'); sep; sep = strchr(sep + 1, '/')) {
+		*sep = '\0';
+
+		if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+			err = -errno;
+			break;
+		}
+
+		*sep = '/';
+	}
+
+	free(dir);
+
+	return err;
+}
+
+struct export_data {
+	const char *dirname;
+	unsigned int count;
+	bool failed;
+};
+
+static void export_record(const char *key, const void *data, size_t len,
+							void *user_data)
+{
+	struct export_data *export = user_data;
+	char path[PATH_MAX], tmp[PATH_MAX + sizeof(".tmp")];
+	FILE *fp;
+	int ret;
+
+	/* Never write outside of the adapter directory */
+	if (key[0] == '/' || strstr(key, "..")) {
+		fprintf(stderr, "Skipping invalid key %s\n", key);
+		return;
+	}
+
+	ret = snprintf(path, sizeof(path), "%s/%s", export->dirname, key);
+	if (ret < 0 || ret >= (int) sizeof(path)) {
+		fprintf(stderr, "Skipping too long key %s\n", key);
+		return;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	if (make_dirs(path) < 0)
+		goto failed;
+
+	fp = fopen(tmp, "w");
+	if (!fp)
+		goto failed;
+
+	if (fwrite(data, 1, len, fp) != len) {
+		fclose(fp);
+		unlink(tmp);
+		goto failed;
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		goto failed;
+	}
+
+	export->count++;
+	return;
+
+failed:
+	fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+	export->failed = true;
+}
+
+static void print_record(const char *key, const void *data, size_t len,
+							void *user_data)
+{
+	printf("%-40s %zu\n", key, len);
+}
+
+static struct store_log *open_db(const char *dirname)
+{
+	char path[PATH_MAX];
+	struct store_log *log;
+
+	snprintf(path, sizeof(path), "%s/" DEVICE_DB, dirname);
+
+	log = store_log_open(path);
+	if (!log)
+		fprintf(stderr, "Failed to open %s: %s\n", path,
+							strerror(errno));
+	else if (store_log_get_corrupted(log))
+		fprintf(stderr, "Skipped %zu bytes of corrupted data in %s\n",
+					store_log_get_corrupted(log), path);
+
+	return log;
+}
+
+static int command_import(const char *dirname)
+{
+	struct store_log *log;
+	unsigned int devices, cache;
+	bool ret;
+
+	log = open_db(dirname);
+	if (!log)
+		return EXIT_FAILURE;
+
+	devices = import_devices(log, dirname);
+	cache = import_cache(log, dirname);
+
+	ret = store_log_compact(log);
+
+	printf("Imported %u device and %u cache files, %u records\n",
+				devices, cache, store_log_count(log));
+
+	store_log_close(log);
+
+	return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int command_export(const char *dirname)
+{
+	struct export_data export = { .dirname = dirname };
+	struct store_log *log;
+
+	log = open_db(dirname);
+	if (!log)
+		return EXIT_FAILURE;
+
+	store_log_foreach(log, export_record, &export);
+
+	printf("Exported %u of %u records\n", export.count,
+						store_log_count(log));
+
+	store_log_close(log);
+
+	return export.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int command_list(const char *dirname)
+{
+	struct store_log *log;
+
+	log = open_db(dirname);
+	if (!log)
+		return EXIT_FAILURE;
+
+	store_log_foreach(log, print_record, NULL);
+
+	printf("%u records, %zu bytes\n", store_log_count(log),
+						store_log_get_size(log));
+
+	store_log_close(log);
+
+	return EXIT_SUCCESS;
+}
+
+static int command_compact(const char *dirname)
+{
+	struct store_log *log;
+	size_t size;
+	bool ret;
+
+	log = open_db(dirname);
+	if (!log)
+		return EXIT_FAILURE;
+
+	size = store_log_get_size(log);
+	ret = store_log_compact(log);
+
+	printf("Compacted from %zu to %zu bytes\n", size,
+						store_log_get_size(log));
+
+	store_log_close(log);
+
+	return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void usage(void)
+{
+	printf("btstorage - device database handling tool\n"
+		"Usage:\n");
+	printf("\tbtstorage <command> <adapter>\n");
+	printf("commands:\n"
+		"\t-i, --import    Import device info and cache files\n"
+		"\t-e, --export    Write database records back to files\n"
+		"\t-l, --list      List database records\n"
+		"\t-c, --compact   Remove stale records from database\n"
+		"\t-h, --help      Show help options\n");
+	printf("The adapter is either an address or a storage directory,\n"
+		"bluetoothd must not be running while the database is "
+		"modified.\n");
+}
+
+static const struct option main_options[] = {
+	{ "import",  no_argument, NULL, 'i' },
+	{ "export",  no_argument, NULL, 'e' },
+	{ "list",    no_argument, NULL, 'l' },
+	{ "compact", no_argument, NULL, 'c' },
+	{ "version", no_argument, NULL, 'v' },
+	{ "help",    no_argument, NULL, 'h' },
+	{ }
+};
+
+enum { INVALID, IMPORT, EXPORT, LIST, COMPACT };
+
+int main(int argc, char *argv[])
+{
+	unsigned short command = INVALID;
+	char dirname[PATH_MAX];
+	const char *adapter;
+
+	for (;;) {
+		int opt;
+
+		opt = getopt_long(argc, argv, "ielcvh", main_options, NULL);
+		if (opt < 0)
+			break;
+
+		switch (opt) {
+		case 'i':
+			command = IMPORT;
+			break;
+		case 'e':
+			command = EXPORT;
+			break;
+		case 'l':
+			command = LIST;
+			break;
+		case 'c':
+			command = COMPACT;
+			break;
+		case 'v':
+			printf("%s\n", VERSION);
+			return EXIT_SUCCESS;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (command == INVALID || argc - optind != 1) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	adapter = argv[optind];
+
+	if (!bachk(adapter))
+		snprintf(dirname, sizeof(dirname), STORAGEDIR "/%s", adapter);
+	else
+		snprintf(dirname, sizeof(dirname), "%s", adapter);
+
+	switch (command) {
+	case IMPORT:
+		return command_import(dirname);
+	case EXPORT:
+		return command_export(dirname);
+	case LIST:
+		return command_list(dirname);
+	case COMPACT:
+		return command_compact(dirname);
+	}
+
+	return EXIT_FAILURE;
+}
@@ -2720,6 +2720,39 @@ static const struct generic_data load_link_keys_invalid_params_test_3 = {
 	.expect_status = MGMT_STATUS_INVALID_PARAMS,
 };
 
+/* Enough entries to go well past HCI_MAX_ACL_SIZE for every key type */
+#define LOAD_KEYS_MANY 1500
+
+static const void *load_link_keys_many_func(uint16_t *len)
+{
+	static uint8_t param[sizeof(struct mgmt_cp_load_link_keys) +
+			LOAD_KEYS_MANY * sizeof(struct mgmt_link_key_info)];
+	struct mgmt_cp_load_link_keys *cp = (void *) param;
+	uint16_t i;
+
+	memset(param, 0, sizeof(param));
+	cp->key_count = cpu_to_le16(LOAD_KEYS_MANY);
+
+	for (i = 0; i < LOAD_KEYS_MANY; i++) {
+		struct mgmt_link_key_info *key = &cp->keys[i];
+
+		put_le16(i, key->addr.bdaddr.b);
+		key->addr.type = BDADDR_BREDR;
+		key->type = 0x04;
+		put_le16(i, key->val);
+	}
+
+	*len = sizeof(param);
+
+	return param;
+}
+
+static const struct generic_data load_link_keys_success_test_3 = {
+	.send_opcode = MGMT_OP_LOAD_LINK_KEYS,
+	.send_func = load_link_keys_many_func,
+	.expect_status = MGMT_STATUS_SUCCESS,
+};
+
 static const char load_ltks_valid_param_1[] = { 0x00, 0x00 };
 /* Invalid key count */
 static const char load_ltks_invalid_param_1[] = { 0x01, 0x00 };
@@ -2778,6 +2811,37 @@ static const struct generic_data load_ltks_invalid_params_test_3 = {
 	.expect_status = MGMT_STATUS_INVALID_PARAMS,
 };
 
+static const void *load_ltks_many_func(uint16_t *len)
+{
+	static uint8_t param[sizeof(struct mgmt_cp_load_long_term_keys) +
+			LOAD_KEYS_MANY * sizeof(struct mgmt_ltk_info)];
+	struct mgmt_cp_load_long_term_keys *cp = (void *) param;
+	uint16_t i;
+
+	memset(param, 0, sizeof(param));
+	cp->key_count = cpu_to_le16(LOAD_KEYS_MANY);
+
+	for (i = 0; i < LOAD_KEYS_MANY; i++) {
+		struct mgmt_ltk_info *key = &cp->keys[i];
+
+		put_le16(i, key->addr.bdaddr.b);
+		key->addr.type = BDADDR_LE_PUBLIC;
+		key->central = i & 0x01;
+		key->enc_size = 16;
+		put_le16(i, key->val);
+	}
+
+	*len = sizeof(param);
+
+	return param;
+}
+
+static const struct generic_data load_ltks_success_test_2 = {
+	.send_opcode = MGMT_OP_LOAD_LONG_TERM_KEYS,
+	.send_func = load_ltks_many_func,
+	.expect_status = MGMT_STATUS_SUCCESS,
+};
+
 static const char load_ltks_invalid_param_4[22] = { 0x1d, 0x07 };
 static const struct generic_data load_ltks_invalid_params_test_4 = {
 	.send_opcode = MGMT_OP_LOAD_LONG_TERM_KEYS,
@@ -3876,6 +3940,35 @@ static const struct generic_data load_irks_success2_test = {
 	.expect_status = MGMT_STATUS_SUCCESS,
 };
 
+static const void *load_irks_many_func(uint16_t *len)
+{
+	static uint8_t param[sizeof(struct mgmt_cp_load_irks) +
+			LOAD_KEYS_MANY * sizeof(struct mgmt_irk_info)];
+	struct mgmt_cp_load_irks *cp = (void *) param;
+	uint16_t i;
+
+	memset(param, 0, sizeof(param));
+	cp->irk_count = cpu_to_le16(LOAD_KEYS_MANY);
+
+	for (i = 0; i < LOAD_KEYS_MANY; i++) {
+		struct mgmt_irk_info *irk = &cp->irks[i];
+
+		put_le16(i, irk->addr.bdaddr.b);
+		irk->addr.type = BDADDR_LE_PUBLIC;
+		put_le16(i, irk->val);
+	}
+
+	*len = sizeof(param);
+
+	return param;
+}
+
+static const struct generic_data load_irks_success3_test = {
+	.send_opcode = MGMT_OP_LOAD_IRKS,
+	.send_func = load_irks_many_func,
+	.expect_status = MGMT_STATUS_SUCCESS,
+};
+
 static const char load_irks_nval_addr_type[] = { 0x01, 0x00,
 			0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x00,
 			0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
@@ -10858,6 +10951,9 @@ int main(int argc, char *argv[])
 	test_bredrle("Load Link Keys - Empty List Success 2",
 				&load_link_keys_success_test_2,
 				NULL, test_command_generic);
+	test_bredrle("Load Link Keys - Many Keys Success",
+				&load_link_keys_success_test_3,
+				NULL, test_command_generic);
 	test_bredrle("Load Link Keys - Invalid Parameters 1",
 				&load_link_keys_invalid_params_test_1,
 				NULL, test_command_generic);
@@ -10871,6 +10967,9 @@ int main(int argc, char *argv[])
 	test_bredrle("Load Long Term Keys - Success 1",
 				&load_ltks_success_test_1,
 				NULL, test_command_generic);
+	test_bredrle("Load Long Term Keys - Success 2",
+				&load_ltks_success_test_2,
+				NULL, test_command_generic);
 	test_bredrle("Load Long Term Keys - Invalid Parameters 1",
 				&load_ltks_invalid_params_test_1,
 				NULL, test_command_generic);
@@ -11082,6 +11181,9 @@ int main(int argc, char *argv[])
 	test_bredrle("Load IRKs - Success 2",
 				&load_irks_success2_test,
 				NULL, test_command_generic);
+	test_bredrle("Load IRKs - Success 3",
+				&load_irks_success3_test,
+				NULL, test_command_generic);
 	test_bredrle("Load IRKs - Invalid Parameters 1",
 				&load_irks_nval_param1_test,
 				NULL, test_command_generic);
@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "src/shared/tester.h"
+
+#include "src/shared/btsnoop.c"
+
+#define NUM_PROBES	10000
+
+static void make_bdaddr(uint8_t *bdaddr, unsigned int seed)
+{
+	bdaddr[0] = seed;
+	bdaddr[1] = seed >> 8;
+	bdaddr[2] = seed >> 16;
+	bdaddr[3] = 0x1b;
+	bdaddr[4] = 0xdc;
+	bdaddr[5] = 0x00;
+}
+
+static unsigned int count_bits(const struct arc_blk *blk)
+{
+	unsigned int i, bits = 0;
+
+	for (i = 0; i < ARC_BLOOM_SIZE; i++)
+		bits += __builtin_popcount(blk->bloom[i]);
+
+	return bits;
+}
+
+static void test_bloom_single(const void *test_data)
+{
+	static const uint8_t bdaddr[6] = { 0x01, 0x02, 0x03,
+						0x04, 0x05, 0x06 };
+	struct arc_blk blk;
+	uint8_t other[6];
+	unsigned int i;
+
+	memset(&blk, 0, sizeof(blk));
+
+	arc_bloom_add(&blk, bdaddr);
+
+	g_assert_cmpuint(count_bits(&blk), ==, ARC_BLOOM_HASHES);
+	g_assert(arc_bloom_has(&blk, bdaddr));
+
+	/* Neighbouring addresses differ in a single byte only */
+	for (i = 0; i < 6; i++) {
+		memcpy(other, bdaddr, sizeof(other));
+		other[i] ^= 0x01;
+		g_assert(!arc_bloom_has(&blk, other));
+	}
+
+	for (i = 0; i < NUM_PROBES; i++) {
+		make_bdaddr(other, i);
+		g_assert(!arc_bloom_has(&blk, other));
+	}
+
+	tester_test_passed();
+}
+
+static void test_bloom_spread(const void *test_data)
+{
+	struct arc_blk blk;
+	uint8_t bdaddr[6];
+	unsigned int i, hits = 0;
+
+	memset(&blk, 0, sizeof(blk));
+
+	for (i = 0; i < 100; i++) {
+		make_bdaddr(bdaddr, i * 7919);
+		arc_bloom_add(&blk, bdaddr);
+	}
+
+	for (i = 0; i < 100; i++) {
+		make_bdaddr(bdaddr, i * 7919);
+		g_assert(arc_bloom_has(&blk, bdaddr));
+	}
+
+	/* 100 addresses in 2048 bits with three hashes gives a false
+	 * positive rate of about 0.25%, allow up to 1%.
+	 */
+	for (i = 0; i < NUM_PROBES; i++) {
+		make_bdaddr(bdaddr, 0x800000 + i);
+		if (arc_bloom_has(&blk, bdaddr))
+			hits++;
+	}
+
+	g_assert_cmpuint(hits, <, NUM_PROBES / 100);
+
+	tester_test_passed();
+}
+
+int main(int argc, char *argv[])
+{
+	tester_init(&argc, &argv);
+
+	tester_add("/btsnoop/bloom/single", NULL, NULL,
+						test_bloom_single, NULL);
+	tester_add("/btsnoop/bloom/spread", NULL, NULL,
+						test_bloom_spread, NULL);
+
+	return tester_run();
+}
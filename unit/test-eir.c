@@ -539,6 +539,23 @@ static void print_debug(const char *str, void *user_data)
 	tester_debug("%s%s", prefix, str);
 }
 
+static bool check_uuid(const bt_uuid_t *uuid, void *user_data)
+{
+	GSList **list = user_data;
+	char uuid_str[MAX_LEN_UUID_STR];
+	bt_uuid_t u128;
+
+	bt_uuid_to_uuid128(uuid, &u128);
+	bt_uuid_to_string(&u128, uuid_str, sizeof(uuid_str));
+
+	g_assert(*list != NULL);
+	g_assert_cmpstr((*list)->data, ==, uuid_str);
+
+	*list = g_slist_next(*list);
+
+	return false;
+}
+
 static void test_parsing(gconstpointer data)
 {
 	const struct test_data *test = data;
@@ -583,6 +600,12 @@ static void test_parsing(gconstpointer data)
 		g_assert(eir.services == NULL);
 	}
 
+	/* Iterating the raw data must find the same UUIDs */
+	list = eir.services;
+	g_assert(!eir_find_uuid(test->eir_data, test->eir_size, check_uuid,
+								&list));
+	g_assert(list == NULL);
+
 	for (list = eir.msd_list; list; list = list->next) {
 		struct eir_msd *msd = list->data;
 
@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <glib.h>
+
+#include "src/shared/util.h"
+#include "src/shared/tester.h"
+#include "src/gatt-ccc.h"
+
+struct client {
+	const char *name;
+	unsigned int notified;
+};
+
+static void notify_client(void *sub, void *user_data)
+{
+	struct client *client = sub;
+
+	client->notified++;
+}
+
+static void test_subscribe(const void *data)
+{
+	struct gatt_ccc_index *index;
+	struct client a = { .name = "a" }, b = { .name = "b" };
+
+	index = gatt_ccc_index_new();
+	g_assert(index != NULL);
+
+	g_assert(gatt_ccc_index_count(index, 0x0003) == 0);
+
+	g_assert(gatt_ccc_index_set(index, 0x0003, &a, true));
+	g_assert(gatt_ccc_index_set(index, 0x0003, &b, true));
+	g_assert(gatt_ccc_index_count(index, 0x0003) == 2);
+
+	/* Subscribing again must not add a second entry */
+	g_assert(!gatt_ccc_index_set(index, 0x0003, &a, true));
+	g_assert(gatt_ccc_index_count(index, 0x0003) == 2);
+
+	/* Other handles are not affected */
+	g_assert(gatt_ccc_index_count(index, 0x0006) == 0);
+
+	gatt_ccc_index_free(index);
+
+	tester_test_passed();
+}
+
+static void test_unsubscribe(const void *data)
+{
+	struct gatt_ccc_index *index;
+	struct client a = { .name = "a" }, b = { .name = "b" };
+
+	index = gatt_ccc_index_new();
+
+	g_assert(!gatt_ccc_index_set(index, 0x0003, &a, false));
+
+	g_assert(gatt_ccc_index_set(index, 0x0003, &a, true));
+	g_assert(gatt_ccc_index_set(index, 0x0003, &b, true));
+
+	g_assert(gatt_ccc_index_set(index, 0x0003, &a, false));
+	g_assert(gatt_ccc_index_count(index, 0x0003) == 1);
+
+	g_assert(!gatt_ccc_index_set(index, 0x0003, &a, false));
+
+	g_assert(gatt_ccc_index_set(index, 0x0003, &b, false));
+	g_assert(gatt_ccc_index_count(index, 0x0003) == 0);
+
+	/* The handle can be subscribed again once it became empty */
+	g_assert(gatt_ccc_index_set(index, 0x0003, &b, true));
+	g_assert(gatt_ccc_index_count(index, 0x0003) == 1);
+
+	gatt_ccc_index_free(index);
+
+	tester_test_passed();
+}
+
+static void test_notify(const void *data)
+{
+	struct gatt_ccc_index *index;
+	struct client a = { .name = "a" }, b = { .name = "b" };
+	struct client c = { .name = "c" };
+
+	index = gatt_ccc_index_new();
+
+	gatt_ccc_index_set(index, 0x0003, &a, true);
+	gatt_ccc_index_set(index, 0x0003, &b, true);
+	gatt_ccc_index_set(index, 0x0006, &c, true);
+
+	gatt_ccc_index_foreach(index, 0x0003, notify_client, NULL);
+	g_assert(a.notified == 1);
+	g_assert(b.notified == 1);
+	g_assert(c.notified == 0);
+
+	gatt_ccc_index_set(index, 0x0003, &a, false);
+
+	gatt_ccc_index_foreach(index, 0x0003, notify_client, NULL);
+	g_assert(a.notified == 1);
+	g_assert(b.notified == 2);
+	g_assert(c.notified == 0);
+
+	gatt_ccc_index_foreach(index, 0x0006, notify_client, NULL);
+	g_assert(a.notified == 1);
+	g_assert(b.notified == 2);
+	g_assert(c.notified == 1);
+
+	/* Handles without subscribers reach nobody */
+	gatt_ccc_index_foreach(index, 0x0009, notify_client, NULL);
+	g_assert(a.notified + b.notified + c.notified == 4);
+
+	gatt_ccc_index_free(index);
+
+	tester_test_passed();
+}
+
+int main(int argc, char *argv[])
+{
+	tester_init(&argc, &argv);
+
+	tester_add("/gatt-ccc/subscribe", NULL, NULL, test_subscribe, NULL);
+	tester_add("/gatt-ccc/unsubscribe", NULL, NULL, test_unsubscribe, NULL);
+	tester_add("/gatt-ccc/notify", NULL, NULL, test_notify, NULL);
+
+	return tester_run();
+}
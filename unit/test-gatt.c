@@ -19,6 +19,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 
 #include <glib.h>
 
@@ -2281,6 +2282,641 @@ static const struct test_step test_notification_server_1 = {
 	.length = 0x03,
 };
 
+static const uint8_t reuse_data[] = { 0x01, 0x02, 0x03, 0x04, 0x05,
+					0x06, 0x07, 0x08, 0x09 };
+
+static void test_server_notification_reuse(struct context *context)
+{
+	static const uint8_t offsets[] = { 0, 5, 6, 9 };
+	static unsigned int i;
+
+	/* Each call reuses the PDU buffer of the previous notification with
+	 * a different length, the PDU list checks nothing stale is sent.
+	 */
+	g_assert(i + 1 < sizeof(offsets));
+
+	g_assert(bt_gatt_server_send_notification(context->server, 0x0003,
+					reuse_data + offsets[i],
+					offsets[i + 1] - offsets[i], false));
+	i++;
+}
+
+static const struct test_step test_notification_server_reuse = {
+	.handle = 0x0003,
+	.func = test_server_notification_reuse,
+};
+
+#define PARALLEL_BEARERS	4
+#define PARALLEL_MTU		512
+
+static int security_fd = -1;
+static int security_level;
+static unsigned int security_reads;
+
+/*
+ * Additional bearers are attached as EATT channels, which query their MTU
+ * from the L2CAP socket. Answer that query for the socketpairs used here.
+ * The socket in security_fd is also made to look like L2CAP, reporting
+ * security_level as its security.
+ */
+int getsockopt(int fd, int level, int optname, void *optval,
+							socklen_t *optlen)
+{
+	if (fd == security_fd && level == SOL_SOCKET &&
+					(optname == SO_DOMAIN ||
+					optname == SO_PROTOCOL)) {
+		*(int *) optval = optname == SO_DOMAIN ? AF_BLUETOOTH :
+							BTPROTO_L2CAP;
+		*optlen = sizeof(int);
+		return 0;
+	}
+
+	if (fd == security_fd && level == SOL_BLUETOOTH &&
+						optname == BT_SECURITY) {
+		struct bt_security *sec = optval;
+
+		memset(sec, 0, sizeof(*sec));
+		sec->level = security_level;
+		*optlen = sizeof(*sec);
+		security_reads++;
+		return 0;
+	}
+
+	if (level == SOL_BLUETOOTH && optname == BT_SNDMTU &&
+					*optlen >= sizeof(uint16_t)) {
+		*(uint16_t *) optval = PARALLEL_MTU;
+		*optlen = sizeof(uint16_t);
+		return 0;
+	}
+
+	return syscall(SYS_getsockopt, fd, level, optname, optval, optlen);
+}
+
+struct parallel_test {
+	struct gatt_db *db;
+	unsigned int bearers;
+	uint8_t features;
+	bool reorder;
+};
+
+struct parallel_context;
+
+/* Relays the PDUs of one bearer between client and server */
+struct relay {
+	struct parallel_context *context;
+	int client_fd;
+	int server_fd;
+	unsigned int client_watch;
+	unsigned int server_watch;
+	unsigned int pending;
+	uint8_t held[512];
+	ssize_t held_len;
+};
+
+struct parallel_context {
+	const struct parallel_test *test;
+	struct gatt_db *client_db;
+	struct bt_gatt_server *server;
+	struct bt_gatt_client *client;
+	struct relay relays[PARALLEL_BEARERS];
+	unsigned int reordered;
+};
+
+static void check_attr(struct gatt_db_attribute *attr, void *user_data)
+{
+	struct gatt_db *db = user_data;
+	struct gatt_db_attribute *peer;
+
+	uint16_t ext_prop, peer_ext_prop;
+
+	peer = gatt_db_get_attribute(db, gatt_db_attribute_get_handle(attr));
+	g_assert(peer);
+	g_assert(!bt_uuid_cmp(gatt_db_attribute_get_type(attr),
+					gatt_db_attribute_get_type(peer)));
+
+	/* Extended properties are read in bulk during discovery */
+	if (!gatt_db_attribute_get_char_data(attr, NULL, NULL, NULL,
+							&ext_prop, NULL))
+		return;
+
+	g_assert(gatt_db_attribute_get_char_data(peer, NULL, NULL, NULL,
+						&peer_ext_prop, NULL));
+	g_assert_cmpuint(ext_prop, ==, peer_ext_prop);
+}
+
+static void check_service(struct gatt_db_attribute *attr, void *user_data)
+{
+	gatt_db_service_foreach(attr, NULL, check_attr, user_data);
+}
+
+static void relay_flush(struct parallel_context *context)
+{
+	unsigned int i;
+
+	for (i = 0; i < context->test->bearers; i++) {
+		struct relay *relay = &context->relays[i];
+
+		if (!relay->held_len)
+			continue;
+
+		g_assert(write(relay->client_fd, relay->held,
+				relay->held_len) == relay->held_len);
+		relay->held_len = 0;
+		context->reordered++;
+	}
+}
+
+static bool relay_should_hold(struct relay *relay)
+{
+	struct parallel_context *context = relay->context;
+	unsigned int i;
+
+	if (!context->test->reorder)
+		return false;
+
+	/* Only hold back a response while another descriptor request is in
+	 * flight whose response can be delivered first.
+	 */
+	for (i = 0; i < context->test->bearers; i++) {
+		struct relay *other = &context->relays[i];
+
+		if (other->held_len)
+			return false;
+
+		if (other != relay && other->pending)
+			return true;
+	}
+
+	return false;
+}
+
+static gboolean relay_client_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct relay *relay = user_data;
+	uint8_t buf[512];
+	ssize_t len;
+
+	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP))
+		return FALSE;
+
+	len = read(relay->client_fd, buf, sizeof(buf));
+	if (len <= 0)
+		return FALSE;
+
+	if (buf[0] == BT_ATT_OP_FIND_INFO_REQ)
+		relay->pending++;
+
+	g_assert(write(relay->server_fd, buf, len) == len);
+
+	return TRUE;
+}
+
+static gboolean relay_server_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct relay *relay = user_data;
+	uint8_t buf[512];
+	ssize_t len;
+
+	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP))
+		return FALSE;
+
+	len = read(relay->server_fd, buf, sizeof(buf));
+	if (len <= 0)
+		return FALSE;
+
+	if (buf[0] == BT_ATT_OP_FIND_INFO_RSP ||
+			(buf[0] == BT_ATT_OP_ERROR_RSP && len > 1 &&
+			buf[1] == BT_ATT_OP_FIND_INFO_REQ)) {
+		relay->pending--;
+
+		if (buf[0] == BT_ATT_OP_FIND_INFO_RSP &&
+					relay_should_hold(relay)) {
+			memcpy(relay->held, buf, len);
+			relay->held_len = len;
+			return TRUE;
+		}
+	}
+
+	g_assert(write(relay->client_fd, buf, len) == len);
+
+	/* Held responses are delivered after a later one */
+	if (buf[0] == BT_ATT_OP_FIND_INFO_RSP)
+		relay_flush(relay->context);
+
+	return TRUE;
+}
+
+static unsigned int relay_watch(int fd, GIOFunc func, void *user_data)
+{
+	GIOChannel *io;
+	unsigned int id;
+
+	io = g_io_channel_unix_new(fd);
+	id = g_io_add_watch(io, G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+							func, user_data);
+	g_io_channel_unref(io);
+
+	return id;
+}
+
+static void relay_free(struct relay *relay)
+{
+	g_source_remove(relay->client_watch);
+	g_source_remove(relay->server_watch);
+	close(relay->client_fd);
+	close(relay->server_fd);
+}
+
+static void relay_init(struct parallel_context *context, struct relay *relay,
+					int *client_fd, int *server_fd)
+{
+	int err, client[2], server[2];
+
+	err = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, client);
+	g_assert(err == 0);
+
+	err = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, server);
+	g_assert(err == 0);
+
+	relay->context = context;
+	relay->client_fd = client[1];
+	relay->server_fd = server[1];
+
+	relay->client_watch = relay_watch(relay->client_fd, relay_client_cb,
+									relay);
+	relay->server_watch = relay_watch(relay->server_fd, relay_server_cb,
+									relay);
+
+	*client_fd = client[0];
+	*server_fd = server[0];
+}
+
+static gboolean parallel_quit(gpointer user_data)
+{
+	struct parallel_context *context = user_data;
+	unsigned int i;
+
+	bt_gatt_client_unref(context->client);
+	bt_gatt_server_unref(context->server);
+	gatt_db_unref(context->client_db);
+
+	for (i = 0; i < context->test->bearers; i++)
+		relay_free(&context->relays[i]);
+
+	g_free(context);
+
+	tester_test_passed();
+
+	return FALSE;
+}
+
+static void parallel_ready(bool success, uint8_t att_ecode, void *user_data)
+{
+	struct parallel_context *context = user_data;
+	struct bt_att_tx_stats stats[PARALLEL_BEARERS];
+	int i, n;
+
+	g_assert(success);
+
+	/* Descriptors inserted in handle order must give the same database
+	 * no matter in which order the responses arrived.
+	 */
+	gatt_db_foreach_service(context->test->db, NULL, check_service,
+							context->client_db);
+	gatt_db_foreach_service(context->client_db, NULL, check_service,
+							context->test->db);
+
+	if (context->test->reorder)
+		g_assert_cmpuint(context->reordered, >, 0);
+
+	/* Every bearer must have carried part of the discovery */
+	n = bt_att_get_tx_stats(bt_gatt_client_get_att(context->client),
+							stats, PARALLEL_BEARERS);
+	g_assert_cmpint(n, ==, context->test->bearers);
+
+	for (i = 0; i < n; i++)
+		g_assert_cmpuint(stats[i].reqs, >, 0);
+
+	g_idle_add(parallel_quit, context);
+}
+
+static void test_parallel_discovery(gconstpointer data)
+{
+	const struct parallel_test *test = data;
+	struct parallel_context *context;
+	struct bt_att *server_att = NULL, *client_att = NULL;
+	unsigned int i;
+
+	context = g_new0(struct parallel_context, 1);
+	context->test = test;
+	context->client_db = gatt_db_new();
+
+	for (i = 0; i < test->bearers; i++) {
+		int client_fd, server_fd;
+
+		relay_init(context, &context->relays[i], &client_fd,
+								&server_fd);
+
+		if (!server_att) {
+			server_att = bt_att_new(server_fd, false);
+			client_att = bt_att_new(client_fd, false);
+			g_assert(server_att && client_att);
+
+			bt_att_set_close_on_unref(server_att, true);
+			bt_att_set_close_on_unref(client_att, true);
+			continue;
+		}
+
+		g_assert(!bt_att_attach_fd(server_att, server_fd));
+		g_assert(!bt_att_attach_fd(client_att, client_fd));
+	}
+
+	context->server = bt_gatt_server_new(test->db, server_att, 512, 0);
+	g_assert(context->server);
+
+	context->client = bt_gatt_client_new(context->client_db, client_att,
+							512, test->features);
+	g_assert(context->client);
+
+	bt_gatt_client_ready_register(context->client, parallel_ready,
+								context, NULL);
+
+	bt_att_unref(server_att);
+	bt_att_unref(client_att);
+}
+
+static struct parallel_test parallel_1 = {
+	.bearers = 1,
+};
+
+static struct parallel_test parallel_4 = {
+	.bearers = PARALLEL_BEARERS,
+};
+
+static struct parallel_test parallel_4_reorder = {
+	.bearers = PARALLEL_BEARERS,
+	.reorder = true,
+};
+
+static struct parallel_test parallel_4_eatt = {
+	.bearers = PARALLEL_BEARERS,
+	.features = BT_GATT_CHRC_CLI_FEAT_EATT,
+};
+
+struct bearer_context {
+	struct bt_att *att;
+	int fds[PARALLEL_BEARERS];
+	unsigned int watches[PARALLEL_BEARERS];
+	unsigned int reqs[PARALLEL_BEARERS];
+	unsigned int rsps;
+};
+
+static gboolean bearer_req_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct bearer_context *context = user_data;
+	int fd = g_io_channel_unix_get_fd(io);
+	unsigned int i, total = 0;
+	uint8_t buf[512];
+	ssize_t len;
+
+	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP))
+		return FALSE;
+
+	len = read(fd, buf, sizeof(buf));
+	g_assert_cmpint(len, ==, 3);
+	g_assert_cmpint(buf[0], ==, BT_ATT_OP_READ_REQ);
+
+	for (i = 0; i < PARALLEL_BEARERS; i++) {
+		if (context->fds[i] == fd)
+			context->reqs[i]++;
+
+		/* Each bearer gets exactly one of the requests */
+		g_assert_cmpuint(context->reqs[i], <=, 1);
+		total += context->reqs[i];
+	}
+
+	/* Only answer once all requests are out, so none of the bearers
+	 * could have been picked twice.
+	 */
+	if (total < PARALLEL_BEARERS)
+		return TRUE;
+
+	for (i = 0; i < PARALLEL_BEARERS; i++) {
+		uint8_t rsp[] = { BT_ATT_OP_READ_RSP, i };
+
+		g_assert(write(context->fds[i], rsp, sizeof(rsp)) ==
+								sizeof(rsp));
+	}
+
+	return TRUE;
+}
+
+static gboolean bearer_quit(gpointer user_data)
+{
+	struct bearer_context *context = user_data;
+	unsigned int i;
+
+	bt_att_unref(context->att);
+
+	for (i = 0; i < PARALLEL_BEARERS; i++) {
+		g_source_remove(context->watches[i]);
+		close(context->fds[i]);
+	}
+
+	g_free(context);
+
+	tester_test_passed();
+
+	return FALSE;
+}
+
+static void bearer_rsp_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct bearer_context *context = user_data;
+	struct bt_att_tx_stats stats[PARALLEL_BEARERS];
+	int i, n;
+
+	g_assert_cmpint(opcode, ==, BT_ATT_OP_READ_RSP);
+	g_assert_cmpint(length, ==, 1);
+
+	if (++context->rsps < PARALLEL_BEARERS)
+		return;
+
+	n = bt_att_get_tx_stats(context->att, stats, PARALLEL_BEARERS);
+	g_assert_cmpint(n, ==, PARALLEL_BEARERS);
+
+	for (i = 0; i < n; i++)
+		g_assert_cmpuint(stats[i].reqs, ==, 1);
+
+	g_idle_add(bearer_quit, context);
+}
+
+static void test_bearer_distribution(gconstpointer data)
+{
+	struct bearer_context *context;
+	unsigned int i;
+
+	context = g_new0(struct bearer_context, 1);
+
+	for (i = 0; i < PARALLEL_BEARERS; i++) {
+		int err, sv[2];
+
+		err = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv);
+		g_assert(err == 0);
+
+		context->fds[i] = sv[1];
+		context->watches[i] = relay_watch(sv[1], bearer_req_cb,
+								context);
+
+		if (!context->att) {
+			context->att = bt_att_new(sv[0], false);
+			g_assert(context->att);
+			bt_att_set_close_on_unref(context->att, true);
+			continue;
+		}
+
+		g_assert(!bt_att_attach_fd(context->att, sv[0]));
+	}
+
+	/* Requests queued back to back go out on the idle bearers */
+	for (i = 0; i < PARALLEL_BEARERS; i++) {
+		uint8_t pdu[2];
+
+		put_le16(i + 1, pdu);
+		g_assert(bt_att_send(context->att, BT_ATT_OP_READ_REQ, pdu,
+						sizeof(pdu), bearer_rsp_cb,
+						context, NULL));
+	}
+}
+
+struct security_context {
+	struct gatt_db *db;
+	struct bt_att *att;
+	struct bt_gatt_client *client;
+	int fd;
+};
+
+static gboolean security_quit(gpointer user_data)
+{
+	struct security_context *context = user_data;
+
+	close(context->fd);
+
+	/* Discovery never completes, drop it while the client is alive */
+	bt_att_cancel_all(context->att);
+	bt_gatt_client_unref(context->client);
+	bt_att_unref(context->att);
+	gatt_db_unref(context->db);
+	g_free(context);
+
+	security_fd = -1;
+
+	tester_test_passed();
+
+	return FALSE;
+}
+
+static gboolean security_read_cb(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct security_context *context = user_data;
+	uint8_t buf[512];
+	ssize_t len;
+
+	len = read(context->fd, buf, sizeof(buf));
+	g_assert(len > 0);
+
+	/* Skip the requests of the client discovery */
+	if (buf[0] != BT_ATT_OP_WRITE_CMD &&
+				buf[0] != BT_ATT_OP_SIGNED_WRITE_CMD)
+		return TRUE;
+
+	/* The link was encrypted so the write must not be signed */
+	g_assert_cmpint(buf[0], ==, BT_ATT_OP_WRITE_CMD);
+
+	g_idle_add(security_quit, context);
+
+	return FALSE;
+}
+
+static void test_security_cache(gconstpointer data)
+{
+	struct security_context *context;
+	uint8_t key[16] = {0xD8, 0x51, 0x59, 0x48, 0x45, 0x1F, 0xEA, 0x32, 0x0D,
+				0xC0, 0x5A, 0x2E, 0x88, 0x30, 0x81, 0x88 };
+	GIOChannel *io;
+	unsigned int reads;
+	int err, sv[2];
+
+	context = g_new0(struct security_context, 1);
+
+	err = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv);
+	g_assert(err == 0);
+
+	/* Make sv[0] look like an unencrypted L2CAP socket */
+	security_fd = sv[0];
+	security_level = BT_SECURITY_LOW;
+	security_reads = 0;
+
+	context->fd = sv[1];
+	context->att = bt_att_new(sv[0], false);
+	g_assert(context->att);
+
+	bt_att_set_close_on_unref(context->att, true);
+
+	g_assert_cmpint(bt_att_get_security(context->att, NULL), ==,
+							BT_SECURITY_LOW);
+	reads = security_reads;
+	g_assert_cmpuint(reads, >, 0);
+
+	/* The level is cached until something signals a change */
+	security_level = BT_SECURITY_MEDIUM;
+	g_assert_cmpint(bt_att_get_security(context->att, NULL), ==,
+							BT_SECURITY_LOW);
+	g_assert_cmpuint(security_reads, ==, reads);
+
+	/* A new encryption key invalidates it */
+	bt_att_set_enc_key_size(context->att, 16);
+	g_assert_cmpint(bt_att_get_security(context->att, NULL), ==,
+							BT_SECURITY_MEDIUM);
+
+	security_level = BT_SECURITY_HIGH;
+	bt_att_reset_security(context->att);
+	g_assert_cmpint(bt_att_get_security(context->att, NULL), ==,
+							BT_SECURITY_HIGH);
+
+	/*
+	 * Cache a low level, then have the link encrypted without bt_att
+	 * being told. A signed write must still notice the encryption.
+	 */
+	security_level = BT_SECURITY_LOW;
+	bt_att_reset_security(context->att);
+	g_assert_cmpint(bt_att_get_security(context->att, NULL), ==,
+							BT_SECURITY_LOW);
+	security_level = BT_SECURITY_MEDIUM;
+
+	g_assert(bt_att_set_local_key(context->att, key, local_counter,
+								context));
+
+	context->db = gatt_db_new();
+	context->client = bt_gatt_client_new(context->db, context->att,
+						BT_ATT_DEFAULT_LE_MTU, 0);
+	g_assert(context->client);
+
+	io = g_io_channel_unix_new(sv[1]);
+	g_io_add_watch(io, G_IO_IN, security_read_cb, context);
+	g_io_channel_unref(io);
+
+	g_assert(bt_gatt_client_write_without_response(context->client,
+							0x0003, true,
+							write_data_1,
+							sizeof(write_data_1)));
+}
+
 static uint8_t indication_received;
 
 static void test_indication_cb(void *user_data)
@@ -3269,6 +3905,20 @@ int main(int argc, char *argv[])
 			raw_pdu(),
 			raw_pdu(0x1B, 0x03, 0x00, 0x01, 0x02, 0x03));
 
+	define_test_server("/robustness/notification-buffer-reuse",
+			test_server, ts_small_db,
+			&test_notification_server_reuse,
+			raw_pdu(0x03, 0x00, 0x02),
+			raw_pdu(0x12, 0x04, 0x00, 0x01, 0x00),
+			raw_pdu(0x13),
+			raw_pdu(),
+			raw_pdu(0x1B, 0x03, 0x00, 0x01, 0x02, 0x03, 0x04,
+								0x05),
+			raw_pdu(),
+			raw_pdu(0x1B, 0x03, 0x00, 0x06),
+			raw_pdu(),
+			raw_pdu(0x1B, 0x03, 0x00, 0x07, 0x08, 0x09));
+
 	define_test_server("/TP/GAI/SR/BV-01-C", test_server, ts_small_db,
 			&test_indication_server_1,
 			raw_pdu(0x03, 0x00, 0x02),
@@ -4487,5 +5137,31 @@ int main(int argc, char *argv[])
 			raw_pdu(0xff, 0x00),
 			raw_pdu());
 
+	/*
+	 * Parallel discovery
+	 *
+	 * Requests are spread over the idle bearers, and full discovery of
+	 * the large test database over several bearers gives the same
+	 * database even when descriptor responses arrive out of order.
+	 * Extended properties are read with Read Multiple, or Read Multiple
+	 * Variable Length when the client supports EATT.
+	 */
+	parallel_1.db = parallel_4.db = ts_large_db_1;
+	parallel_4_reorder.db = parallel_4_eatt.db = ts_large_db_1;
+
+	tester_add("/gatt/bearers/distribution", NULL, NULL,
+					test_bearer_distribution, NULL);
+	tester_add("/gatt/bearers/discovery/1", &parallel_1, NULL,
+					test_parallel_discovery, NULL);
+	tester_add("/gatt/bearers/discovery/4", &parallel_4, NULL,
+					test_parallel_discovery, NULL);
+	tester_add("/gatt/bearers/discovery/4-reorder", &parallel_4_reorder,
+					NULL, test_parallel_discovery, NULL);
+	tester_add("/gatt/bearers/discovery/4-eatt", &parallel_4_eatt,
+					NULL, test_parallel_discovery, NULL);
+
+	tester_add("/gatt/security/cache", NULL, NULL,
+					test_security_cache, NULL);
+
 	return tester_run();
 }
@@ -29,12 +29,20 @@ struct context {
 	struct mgmt *mgmt_client;
 	guint server_source;
 	GList *handler_list;
+	GList *batch;
+	unsigned int batch_size;
+	struct handler *deferred;
+	GList *requests;
+	unsigned int count;
 };
 
 enum action {
 	ACTION_PASSED,
 	ACTION_IGNORE,
 	ACTION_RESPOND,
+	ACTION_RESPOND_BATCH,
+	ACTION_RESPOND_LATER,
+	ACTION_RESPOND_ALONE,
 };
 
 struct handler {
@@ -59,6 +67,19 @@ static void context_quit(struct context *context)
 	g_main_loop_quit(context->main_loop);
 }
 
+static gboolean respond_later(gpointer user_data)
+{
+	struct context *context = user_data;
+	struct handler *handler = context->deferred;
+
+	context->deferred = NULL;
+
+	g_assert_cmpint(write(context->fd, handler->rsp_data,
+				handler->rsp_size), ==, handler->rsp_size);
+
+	return FALSE;
+}
+
 static void check_actions(struct context *context, int fd,
 					const void *data, uint16_t size)
 {
@@ -88,6 +109,39 @@ static void check_actions(struct context *context, int fd,
 			ret = write(fd, handler->rsp_data, handler->rsp_size);
 			g_assert(ret >= 0);
 			return;
+		case ACTION_RESPOND_BATCH:
+			/*
+			 * Respond only once all commands are on the wire, in
+			 * the reverse order they were received.
+			 */
+			context->batch = g_list_prepend(context->batch,
+								handler);
+			if (g_list_length(context->batch) < context->batch_size)
+				return;
+
+			for (list = context->batch; list;
+						list = g_list_next(list)) {
+				handler = list->data;
+				ret = write(fd, handler->rsp_data,
+							handler->rsp_size);
+				g_assert(ret >= 0);
+			}
+
+			g_list_free(context->batch);
+			context->batch = NULL;
+			return;
+		case ACTION_RESPOND_LATER:
+			/* Leave room for anything else that is sent meanwhile */
+			g_assert(!context->deferred);
+			context->deferred = handler;
+			g_idle_add(respond_later, context);
+			return;
+		case ACTION_RESPOND_ALONE:
+			/* No other command may be pending when it is sent */
+			g_assert(!context->deferred);
+			ret = write(fd, handler->rsp_data, handler->rsp_size);
+			g_assert(ret >= 0);
+			return;
 		case ACTION_IGNORE:
 			return;
 		}
@@ -400,6 +454,248 @@ static void test_unregister_index(gconstpointer data)
 	execute_context(context);
 }
 
+static const unsigned char add_device_command[] =
+				{ 0x33, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00 };
+static const unsigned char add_device_response[] =
+				{ 0x01, 0x00, 0x00, 0x00, 0x0a, 0x00,
+				0x33, 0x00, 0x00, 0x00, 0x00, 0x00,
+				0x00, 0x00, 0x00, 0x01 };
+static const unsigned char add_device_index_1_command[] =
+				{ 0x33, 0x00, 0x01, 0x00, 0x08, 0x00, 0x01 };
+static const unsigned char add_device_index_1_response[] =
+				{ 0x01, 0x00, 0x01, 0x00, 0x0a, 0x00,
+				0x33, 0x00, 0x00, 0x01, 0x00, 0x00,
+				0x00, 0x00, 0x00, 0x01 };
+static const unsigned char block_device_command[] =
+				{ 0x26, 0x00, 0x00, 0x00, 0x07, 0x00, 0x02 };
+static const unsigned char block_device_response[] =
+				{ 0x01, 0x00, 0x00, 0x00, 0x0a, 0x00,
+				0x26, 0x00, 0x00, 0x02, 0x00, 0x00,
+				0x00, 0x00, 0x00, 0x01 };
+static const unsigned char get_conn_info_command[] =
+				{ 0x31, 0x00, 0x00, 0x00, 0x07, 0x00 };
+static const unsigned char get_conn_info_response[] =
+				{ 0x01, 0x00, 0x00, 0x00, 0x0d, 0x00,
+				0x31, 0x00, 0x00, 0x00, 0x00, 0x00,
+				0x00, 0x00, 0x00, 0x01, 0x00, 0x00,
+				0x00 };
+
+struct pipeline_request {
+	struct context *context;
+	uint16_t opcode;
+	uint16_t index;
+	uint8_t addr;
+	uint16_t length;
+};
+
+static const struct pipeline_request pipeline_1[] = {
+	{ .opcode = MGMT_OP_ADD_DEVICE, .index = 0, .addr = 0,
+		.length = sizeof(struct mgmt_cp_add_device) },
+	{ .opcode = MGMT_OP_ADD_DEVICE, .index = 1, .addr = 1,
+		.length = sizeof(struct mgmt_cp_add_device) },
+	{ .opcode = MGMT_OP_BLOCK_DEVICE, .index = 0, .addr = 2,
+		.length = sizeof(struct mgmt_cp_block_device) },
+};
+
+static const struct pipeline_request pipeline_2[] = {
+	{ .opcode = MGMT_OP_ADD_DEVICE, .index = 0, .addr = 0,
+		.length = sizeof(struct mgmt_cp_add_device) },
+	{ .opcode = MGMT_OP_GET_CONN_INFO, .index = 0, .addr = 0,
+		.length = sizeof(struct mgmt_cp_get_conn_info) },
+};
+
+static void pipeline_stats(const struct mgmt_stats *stats, void *user_data)
+{
+	struct context *context = user_data;
+
+	g_assert(stats->max_usec <= stats->total_usec);
+
+	context->count += stats->count;
+}
+
+static void pipeline_cb(uint8_t status, uint16_t length, const void *param,
+							void *user_data)
+{
+	struct pipeline_request *req = user_data;
+	struct context *context = req->context;
+	const struct mgmt_addr_info *addr = param;
+
+	g_assert_cmpint(status, ==, MGMT_STATUS_SUCCESS);
+
+	/* Each reply must reach the request it belongs to */
+	g_assert_cmpint(length, >=, sizeof(*addr));
+	g_assert_cmpint(addr->bdaddr.b[0], ==, req->addr);
+
+	if (req->opcode == MGMT_OP_GET_CONN_INFO)
+		g_assert_cmpint(length, ==,
+					sizeof(struct mgmt_rp_get_conn_info));
+	else
+		g_assert_cmpint(length, ==, sizeof(*addr));
+
+	/* Requests are completed in order unless they were pipelined */
+	if (!context->batch_size)
+		g_assert(req == g_list_nth_data(context->requests,
+							context->count));
+
+	if (++context->count < g_list_length(context->requests))
+		return;
+
+	context->count = 0;
+	mgmt_foreach_stats(context->mgmt_client, pipeline_stats, context);
+	g_assert_cmpint(context->count, ==, g_list_length(context->requests));
+
+	g_list_free_full(context->requests, g_free);
+	context->requests = NULL;
+
+	context_quit(context);
+}
+
+static void pipeline_send(struct context *context,
+				const struct pipeline_request *requests,
+				unsigned int count)
+{
+	struct mgmt_cp_add_device cp;
+	unsigned int i;
+
+	g_assert(mgmt_set_pipeline(context->mgmt_client, 4));
+
+	/* The leading address is common to all the commands used */
+	memset(&cp, 0, sizeof(cp));
+	cp.addr.type = BDADDR_LE_PUBLIC;
+	cp.action = 0x01;
+
+	for (i = 0; i < count; i++) {
+		struct pipeline_request *req;
+
+		req = g_memdup(&requests[i], sizeof(*req));
+		req->context = context;
+		context->requests = g_list_append(context->requests, req);
+
+		cp.addr.bdaddr.b[0] = req->addr;
+		g_assert(mgmt_send(context->mgmt_client, req->opcode,
+						req->index, req->length, &cp,
+						pipeline_cb, req, NULL) > 0);
+	}
+}
+
+static void test_pipeline(gconstpointer data)
+{
+	struct context *context = create_context();
+
+	add_action(context, add_device_command, sizeof(add_device_command),
+			add_device_response, sizeof(add_device_response),
+			MGMT_STATUS_SUCCESS, true, ACTION_RESPOND_BATCH);
+	add_action(context, add_device_index_1_command,
+			sizeof(add_device_index_1_command),
+			add_device_index_1_response,
+			sizeof(add_device_index_1_response),
+			MGMT_STATUS_SUCCESS, true, ACTION_RESPOND_BATCH);
+	add_action(context, block_device_command,
+			sizeof(block_device_command),
+			block_device_response, sizeof(block_device_response),
+			MGMT_STATUS_SUCCESS, true, ACTION_RESPOND_BATCH);
+
+	/*
+	 * The server only replies once every command has arrived, so this
+	 * only completes if all of them got pipelined.
+	 */
+	context->batch_size = G_N_ELEMENTS(pipeline_1);
+
+	pipeline_send(context, pipeline_1, G_N_ELEMENTS(pipeline_1));
+
+	execute_context(context);
+}
+
+static void test_pipeline_serial(gconstpointer data)
+{
+	struct context *context = create_context();
+
+	/* Get Connection Information must wait for Add Device to complete */
+	add_action(context, add_device_command, sizeof(add_device_command),
+			add_device_response, sizeof(add_device_response),
+			MGMT_STATUS_SUCCESS, true, ACTION_RESPOND_LATER);
+	add_action(context, get_conn_info_command,
+			sizeof(get_conn_info_command),
+			get_conn_info_response, sizeof(get_conn_info_response),
+			MGMT_STATUS_SUCCESS, true, ACTION_RESPOND_ALONE);
+
+	pipeline_send(context, pipeline_2, G_N_ELEMENTS(pipeline_2));
+
+	execute_context(context);
+}
+
+static const unsigned char device_found_event[] =
+				{ 0x12, 0x00, 0x00, 0x00, 0x0e, 0x00,
+				0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+				0xc4, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+#define LOOKUP_ADAPTERS 4
+
+static void lookup_other_cb(uint16_t index, uint16_t length,
+					const void *param, void *user_data)
+{
+	g_assert_not_reached();
+}
+
+static void lookup_first_cb(uint16_t index, uint16_t length,
+					const void *param, void *user_data)
+{
+	struct context *context = user_data;
+
+	g_assert_cmpint(index, ==, 0);
+	g_assert_cmpint(length, ==, sizeof(device_found_event) - 6);
+	g_assert_cmpint(context->count++, ==, 0);
+}
+
+static void lookup_second_cb(uint16_t index, uint16_t length,
+					const void *param, void *user_data)
+{
+	struct context *context = user_data;
+
+	g_assert_cmpint(index, ==, 0);
+	g_assert_cmpint(context->count++, ==, 1);
+
+	context_quit(context);
+}
+
+static void test_event_lookup(gconstpointer data)
+{
+	struct context *context = create_context();
+	uint16_t event, index;
+
+	/* Roughly what bluetoothd registers for each adapter */
+	for (index = 0; index < LOOKUP_ADAPTERS; index++) {
+		for (event = MGMT_EV_CONTROLLER_ERROR;
+				event <= MGMT_EV_CONTROLLER_RESUME; event++) {
+			if (event == MGMT_EV_DEVICE_FOUND && !index)
+				continue;
+
+			mgmt_register(context->mgmt_client, event, index,
+					lookup_other_cb, context, NULL);
+		}
+	}
+
+	/* Event codes sharing a list with Device Found must not match */
+	mgmt_register(context->mgmt_client, MGMT_EV_DEVICE_FOUND + 64, 0,
+					lookup_other_cb, context, NULL);
+	mgmt_register(context->mgmt_client, MGMT_EV_DEVICE_FOUND + 64,
+					MGMT_INDEX_NONE, lookup_other_cb,
+					context, NULL);
+
+	/* Handlers for any index match too, in registration order */
+	mgmt_register(context->mgmt_client, MGMT_EV_DEVICE_FOUND,
+					MGMT_INDEX_NONE, lookup_first_cb,
+					context, NULL);
+	mgmt_register(context->mgmt_client, MGMT_EV_DEVICE_FOUND, 0,
+					lookup_second_cb, context, NULL);
+
+	g_assert_cmpint(write(context->fd, device_found_event,
+					sizeof(device_found_event)), ==,
+					sizeof(device_found_event));
+
+	execute_context(context);
+}
+
 static void test_destroy(gconstpointer data)
 {
 	const struct command_test_data *test = data;
@@ -430,6 +726,7 @@ int main(int argc, char *argv[])
 
 	g_test_add_data_func("/mgmt/event/1", &event_test_1, test_event);
 	g_test_add_data_func("/mgmt/event/2", &event_test_1, test_event2);
+	g_test_add_data_func("/mgmt/event/3", NULL, test_event_lookup);
 
 	g_test_add_data_func("/mgmt/unregister/1", &event_test_1,
 							test_unregister_all);
@@ -438,5 +735,8 @@ int main(int argc, char *argv[])
 
 	g_test_add_data_func("/mgmt/destroy/1", &event_test_1, test_destroy);
 
+	g_test_add_data_func("/mgmt/pipeline/1", NULL, test_pipeline);
+	g_test_add_data_func("/mgmt/pipeline/2", NULL, test_pipeline_serial);
+
 	return g_test_run();
 }
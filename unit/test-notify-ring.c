@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <glib.h>
+
+#include "src/shared/notify-ring.h"
+#include "src/shared/tester.h"
+
+struct drain_data {
+	uint32_t seq;
+	unsigned int count;
+};
+
+static struct notify_ring *attach_consumer(struct notify_ring *producer)
+{
+	struct notify_ring *consumer;
+
+	consumer = notify_ring_attach(
+				fcntl(notify_ring_get_fd(producer),
+						F_DUPFD_CLOEXEC, 0),
+				fcntl(notify_ring_get_event_fd(producer),
+						F_DUPFD_CLOEXEC, 0));
+	g_assert(consumer != NULL);
+
+	return consumer;
+}
+
+static void check_record(uint32_t seq, uint64_t timestamp,
+				const uint8_t *data, uint16_t len,
+				void *user_data)
+{
+	struct drain_data *drain = user_data;
+	uint16_t i;
+
+	g_assert_cmpuint(seq, ==, drain->seq);
+	g_assert_cmpuint(len, ==, seq % 64);
+	g_assert(timestamp != 0);
+
+	for (i = 0; i < len; i++)
+		g_assert_cmpuint(data[i], ==, (uint8_t) (seq + i));
+
+	drain->seq++;
+	drain->count++;
+}
+
+static void push_record(struct notify_ring *ring, uint32_t seq)
+{
+	uint8_t buf[64];
+	uint16_t i, len = seq % 64;
+
+	for (i = 0; i < len; i++)
+		buf[i] = seq + i;
+
+	g_assert(notify_ring_push(ring, buf, len));
+}
+
+static void test_alloc(const void *data)
+{
+	struct notify_ring *ring;
+	size_t i;
+
+	for (i = 1; i < 100000; i += 997) {
+		ring = notify_ring_new(i);
+		g_assert(ring != NULL);
+
+		g_assert(notify_ring_capacity(ring) >= i ||
+				notify_ring_capacity(ring) >= 1024);
+		g_assert_cmpuint(notify_ring_len(ring), ==, 0);
+
+		notify_ring_free(ring);
+	}
+
+	tester_test_passed();
+}
+
+static void test_wrap(const void *data)
+{
+	struct notify_ring *producer, *consumer;
+	struct drain_data drain = { 0, 0 };
+	uint32_t seq = 0;
+	int i;
+
+	producer = notify_ring_new(1024);
+	consumer = attach_consumer(producer);
+
+	/* Push and drain in uneven batches so records wrap around the end
+	 * of the data area at different offsets.
+	 */
+	for (i = 0; i < 1000; i++) {
+		int j, batch = i % 13 + 1;
+
+		for (j = 0; j < batch; j++)
+			push_record(producer, seq++);
+
+		g_assert(notify_ring_kick(producer));
+		g_assert(!notify_ring_kick(producer));
+
+		drain.count = 0;
+		g_assert_cmpuint(notify_ring_drain(consumer, check_record,
+						&drain), ==, batch);
+		g_assert_cmpuint(drain.count, ==, batch);
+		g_assert_cmpuint(notify_ring_len(producer), ==, 0);
+	}
+
+	g_assert_cmpuint(notify_ring_get_dropped(consumer), ==, 0);
+
+	notify_ring_free(consumer);
+	notify_ring_free(producer);
+
+	tester_test_passed();
+}
+
+static void count_record(uint32_t seq, uint64_t timestamp,
+				const uint8_t *data, uint16_t len,
+				void *user_data)
+{
+	struct drain_data *drain = user_data;
+
+	drain->seq = seq;
+	drain->count++;
+}
+
+static void test_overflow(const void *data)
+{
+	struct notify_ring *producer, *consumer;
+	struct drain_data drain = { 0, 0 };
+	uint8_t buf[40];
+	unsigned int pushed = 0, i;
+
+	producer = notify_ring_new(1024);
+	consumer = attach_consumer(producer);
+
+	memset(buf, 0xaa, sizeof(buf));
+
+	/* Nothing is drained so the ring eventually fills up */
+	for (i = 0; i < 100; i++) {
+		if (notify_ring_push(producer, buf, sizeof(buf)))
+			pushed++;
+	}
+
+	g_assert_cmpuint(pushed, <, 100);
+	g_assert_cmpuint(notify_ring_get_dropped(consumer), ==, 100 - pushed);
+
+	notify_ring_kick(producer);
+
+	g_assert_cmpuint(notify_ring_drain(consumer, count_record, &drain),
+								==, pushed);
+	g_assert_cmpuint(drain.seq, ==, pushed - 1);
+
+	/* Sequence numbers keep counting dropped records */
+	g_assert(notify_ring_push(producer, buf, sizeof(buf)));
+	notify_ring_kick(producer);
+
+	g_assert_cmpuint(notify_ring_drain(consumer, count_record, &drain),
+								==, 1);
+	g_assert_cmpuint(drain.seq, ==, 100);
+
+	notify_ring_free(consumer);
+	notify_ring_free(producer);
+
+	tester_test_passed();
+}
+
+static void test_wakeup(const void *data)
+{
+	struct notify_ring *producer, *consumer;
+	uint8_t buf[20] = { };
+	uint64_t val;
+	int i;
+
+	producer = notify_ring_new(4096);
+	consumer = attach_consumer(producer);
+
+	/* A batch of records results in a single wakeup */
+	for (i = 0; i < 10; i++)
+		g_assert(notify_ring_push(producer, buf, sizeof(buf)));
+
+	g_assert(notify_ring_kick(producer));
+
+	g_assert(read(notify_ring_get_event_fd(consumer), &val,
+						sizeof(val)) == sizeof(val));
+	g_assert_cmpuint(val, ==, 1);
+
+	g_assert_cmpuint(notify_ring_drain(consumer, NULL, NULL), ==, 10);
+
+	notify_ring_free(consumer);
+	notify_ring_free(producer);
+
+	tester_test_passed();
+}
+
+int main(int argc, char *argv[])
+{
+	tester_init(&argc, &argv);
+
+	tester_add("/notify-ring/alloc", NULL, NULL, test_alloc, NULL);
+	tester_add("/notify-ring/wrap", NULL, NULL, test_wrap, NULL);
+	tester_add("/notify-ring/overflow", NULL, NULL, test_overflow, NULL);
+	tester_add("/notify-ring/wakeup", NULL, NULL, test_wakeup, NULL);
+
+	return tester_run();
+}
@@ -113,6 +113,7 @@ static void destroy_context(struct context *context)
 {
 	sdp_svcdb_collect_all(context->fd);
 	sdp_svcdb_reset();
+	sdp_cstate_reset();
 
 	g_source_remove(context->server_source);
 	g_source_remove(context->client_source);
@@ -693,6 +694,108 @@ static void test_sdp(gconstpointer data)
 	g_idle_add(send_pdu, context);
 }
 
+static void check_record_pdu(const sdp_record_t *rec)
+{
+	sdp_record_t *parsed;
+	sdp_buf_t pdu, check;
+	sdp_list_t *a, *b;
+	int scanned = 0;
+
+	g_assert(sdp_gen_record_pdu(rec, &pdu) == 0);
+	g_assert_cmpuint(pdu.data_size, ==, pdu.buf_size);
+
+	parsed = sdp_extract_pdu(pdu.data, pdu.data_size, &scanned);
+	g_assert(parsed != NULL);
+	g_assert_cmpint(scanned, ==, pdu.data_size);
+
+	/* Every attribute must make it into the PDU, in the same order */
+	for (a = rec->attrlist, b = parsed->attrlist; a && b;
+						a = a->next, b = b->next) {
+		sdp_data_t *d1 = a->data, *d2 = b->data;
+
+		g_assert_cmpuint(d1->attrId, ==, d2->attrId);
+	}
+
+	g_assert(a == NULL && b == NULL);
+
+	g_assert(sdp_gen_record_pdu(parsed, &check) == 0);
+	g_assert_cmpuint(check.data_size, ==, pdu.data_size);
+	g_assert(!memcmp(check.data, pdu.data, pdu.data_size));
+
+	sdp_record_free(parsed);
+	free(check.data);
+	free(pdu.data);
+}
+
+static void test_record_pdu(gconstpointer data)
+{
+	static const uint8_t small_pdu[] = { 0x35, 0x0d, 0x09, 0x00, 0x00,
+					0x0a, 0x00, 0x01, 0x00, 0x00, 0x09,
+					0x00, 0x08, 0x08, 0xff };
+	uint8_t dtd = SDP_UINT32;
+	void *dtds[60], *values[60];
+	uint32_t handle = 0x10000, nums[60];
+	uint8_t avail = 0xff;
+	sdp_record_t *rec;
+	sdp_data_t *seq;
+	sdp_list_t *l;
+	sdp_buf_t pdu;
+	int i;
+
+	set_fixed_db_timestamp(0x496f0654);
+
+	register_public_browse_group();
+	register_server_service();
+	register_serial_port();
+	register_object_push();
+	register_hid_keyboard();
+	register_file_transfer();
+
+	for (l = sdp_get_record_list(); l; l = l->next)
+		check_record_pdu(l->data);
+
+	sdp_svcdb_reset();
+
+	/* A short record must keep its last attribute */
+	rec = sdp_record_alloc();
+	rec->handle = handle;
+	sdp_attr_add_new(rec, SDP_ATTR_RECORD_HANDLE, SDP_UINT32, &handle);
+	sdp_attr_add_new(rec, SDP_ATTR_SERVICE_AVAILABILITY, SDP_UINT8,
+									&avail);
+
+	check_record_pdu(rec);
+
+	g_assert(sdp_gen_record_pdu(rec, &pdu) == 0);
+	g_assert_cmpuint(pdu.data_size, ==, sizeof(small_pdu));
+	g_assert(!memcmp(pdu.data, small_pdu, sizeof(small_pdu)));
+	free(pdu.data);
+
+	/* A SEQ8 holding more than 255 bytes must be written as a SEQ16 */
+	for (i = 0; i < 60; i++) {
+		nums[i] = i;
+		dtds[i] = &dtd;
+		values[i] = &nums[i];
+	}
+
+	seq = sdp_seq_alloc(dtds, values, 60);
+	g_assert(seq != NULL);
+	g_assert_cmpuint(seq->dtd, ==, SDP_SEQ8);
+	sdp_attr_add(rec, 0x0200, seq);
+
+	check_record_pdu(rec);
+
+	g_assert(sdp_gen_record_pdu(rec, &pdu) == 0);
+	g_assert_cmpuint(pdu.data[0], ==, SDP_SEQ16);
+	g_assert_cmpuint(pdu.data[sizeof(small_pdu) + 1 + 3], ==, SDP_SEQ16);
+	g_assert_cmpuint(get_be16(pdu.data + sizeof(small_pdu) + 1 + 4), ==,
+									60 * 5);
+	free(pdu.data);
+
+	sdp_record_free(rec);
+
+	tester_test_passed();
+}
+
 static void test_sdp_de_attr(gconstpointer data)
 {
 	const struct test_data_de *test = data;
@@ -2811,5 +2914,13 @@ int main(int argc, char *argv[])
 				0x00, 0x09, 0x00, 0x01, 0x08),
 		raw_pdu(0x01, 0x00, 0x02, 0x00, 0x02, 0x00, 0x05));
 
+	/*
+	 * Record serialization
+	 *
+	 * Generate the PDUs of the records used by the tests above and of
+	 * records with edge case sizes, and parse them back.
+	 */
+	tester_add("/sdp/record/pdu", NULL, NULL, test_record_pdu, NULL);
+
 	return tester_run();
 }
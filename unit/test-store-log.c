@@ -0,0 +1,278 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "src/shared/store-log.h"
+#include "src/shared/tester.h"
+
+static char *create_path(void)
+{
+	char *path = g_strdup("/tmp/test-store-log-XXXXXX");
+	int fd;
+
+	fd = mkstemp(path);
+	g_assert(fd >= 0);
+	close(fd);
+	unlink(path);
+
+	return path;
+}
+
+static void check_value(struct store_log *log, const char *key,
+							const char *value)
+{
+	const char *data;
+	size_t len;
+
+	data = store_log_get(log, key, &len);
+	if (!value) {
+		g_assert(data == NULL);
+		return;
+	}
+
+	g_assert(data != NULL);
+	g_assert_cmpuint(len, ==, strlen(value));
+	g_assert(!memcmp(data, value, len));
+}
+
+static void put_value(struct store_log *log, const char *key,
+							const char *value)
+{
+	g_assert(store_log_put(log, key, value, strlen(value)));
+}
+
+static off_t file_size(const char *path)
+{
+	struct stat st;
+
+	g_assert(stat(path, &st) == 0);
+
+	return st.st_size;
+}
+
+static void test_basic(const void *data)
+{
+	struct store_log *log;
+	char *path = create_path();
+
+	log = store_log_open(path);
+	g_assert(log != NULL);
+	g_assert_cmpuint(store_log_count(log), ==, 0);
+
+	put_value(log, "00:11:22:33:44:55/info", "[General]\nName=foo\n");
+	put_value(log, "cache/00:11:22:33:44:55", "[General]\n");
+	put_value(log, "00:11:22:33:44:55/info", "[General]\nName=bar\n");
+	put_value(log, "66:77:88:99:AA:BB/info", "[General]\n");
+	g_assert(store_log_del(log, "66:77:88:99:AA:BB/info"));
+	g_assert(store_log_del(log, "unknown"));
+
+	g_assert_cmpuint(store_log_count(log), ==, 2);
+	check_value(log, "00:11:22:33:44:55/info", "[General]\nName=bar\n");
+	check_value(log, "66:77:88:99:AA:BB/info", NULL);
+
+	store_log_close(log);
+
+	log = store_log_open(path);
+	g_assert(log != NULL);
+	g_assert_cmpuint(store_log_count(log), ==, 2);
+	check_value(log, "00:11:22:33:44:55/info", "[General]\nName=bar\n");
+	check_value(log, "cache/00:11:22:33:44:55", "[General]\n");
+	check_value(log, "66:77:88:99:AA:BB/info", NULL);
+
+	store_log_close(log);
+
+	unlink(path);
+	g_free(path);
+
+	tester_test_passed();
+}
+
+static void test_truncated(const void *data)
+{
+	struct store_log *log;
+	char *path = create_path();
+	off_t size;
+
+	log = store_log_open(path);
+	put_value(log, "a", "first");
+	size = store_log_get_size(log);
+	put_value(log, "b", "second");
+	store_log_close(log);
+
+	/* Cut the last record in half as if the write never completed */
+	g_assert(truncate(path, size + 8) == 0);
+
+	log = store_log_open(path);
+	g_assert(log != NULL);
+	g_assert_cmpuint(store_log_count(log), ==, 1);
+	g_assert_cmpuint(file_size(path), ==, size);
+	check_value(log, "a", "first");
+	check_value(log, "b", NULL);
+
+	put_value(log, "c", "third");
+	store_log_close(log);
+
+	log = store_log_open(path);
+	g_assert_cmpuint(store_log_count(log), ==, 2);
+	check_value(log, "c", "third");
+	store_log_close(log);
+
+	unlink(path);
+	g_free(path);
+
+	tester_test_passed();
+}
+
+static void test_corrupted(const void *data)
+{
+	struct store_log *log;
+	char *path = create_path();
+	off_t size;
+	FILE *fp;
+
+	log = store_log_open(path);
+	put_value(log, "a", "first");
+	size = store_log_get_size(log);
+	put_value(log, "b", "second");
+	store_log_close(log);
+
+	/* Flip a bit in the value of the last record */
+	fp = fopen(path, "r+");
+	g_assert(fp != NULL);
+	g_assert(fseek(fp, -1, SEEK_END) == 0);
+	fputc('D', fp);
+	fclose(fp);
+
+	log = store_log_open(path);
+	g_assert(log != NULL);
+	g_assert_cmpuint(store_log_count(log), ==, 1);
+	g_assert_cmpuint(store_log_get_size(log), ==, size);
+	check_value(log, "b", NULL);
+	g_assert_cmpuint(store_log_get_corrupted(log), ==, 0);
+	put_value(log, "b", "second");
+	put_value(log, "c", "third");
+	store_log_close(log);
+
+	/* Corrupt the record in the middle, the one after it must survive */
+	fp = fopen(path, "r+");
+	g_assert(fp != NULL);
+	g_assert(fseek(fp, size + 15, SEEK_SET) == 0);
+	fputc('D', fp);
+	fclose(fp);
+
+	size = file_size(path);
+
+	log = store_log_open(path);
+	g_assert(log != NULL);
+	g_assert_cmpuint(store_log_count(log), ==, 2);
+	g_assert_cmpuint(store_log_get_corrupted(log), >, 0);
+	g_assert_cmpuint(store_log_get_size(log), ==, size);
+	g_assert_cmpuint(file_size(path), ==, size);
+	check_value(log, "a", "first");
+	check_value(log, "b", NULL);
+	check_value(log, "c", "third");
+
+	/* Records appended after the corrupted data are found again */
+	put_value(log, "d", "fourth");
+	store_log_close(log);
+
+	log = store_log_open(path);
+	g_assert_cmpuint(store_log_count(log), ==, 3);
+	check_value(log, "c", "third");
+	check_value(log, "d", "fourth");
+
+	/* Compacting drops the corrupted data */
+	g_assert(store_log_compact(log));
+	store_log_close(log);
+
+	log = store_log_open(path);
+	g_assert_cmpuint(store_log_count(log), ==, 3);
+	g_assert_cmpuint(store_log_get_corrupted(log), ==, 0);
+	store_log_close(log);
+
+	/* A file which isn't a log is left alone */
+	fp = fopen(path, "w");
+	fputs("[General]\nName=foo\n", fp);
+	fclose(fp);
+
+	g_assert(store_log_open(path) == NULL);
+	g_assert_cmpuint(file_size(path), ==, 19);
+
+	unlink(path);
+	g_free(path);
+
+	tester_test_passed();
+}
+
+static void test_compact(const void *data)
+{
+	struct store_log *log;
+	char *path = create_path();
+	char key[32], value[64];
+	size_t max = 0;
+	int i;
+
+	log = store_log_open(path);
+
+	/* Keep overwriting the same records, the file must not keep growing */
+	for (i = 0; i < 20000; i++) {
+		snprintf(key, sizeof(key), "%02X:00:00:00:00:00/info", i % 100);
+		snprintf(value, sizeof(value), "[General]\nCount=%d\n", i);
+		put_value(log, key, value);
+
+		if (store_log_get_size(log) > max)
+			max = store_log_get_size(log);
+	}
+
+	g_assert_cmpuint(store_log_count(log), ==, 100);
+	g_assert_cmpuint(max, <, 256 * 1024);
+
+	g_assert(store_log_compact(log));
+	g_assert_cmpuint(file_size(path), ==, store_log_get_size(log));
+	store_log_close(log);
+
+	log = store_log_open(path);
+	g_assert_cmpuint(store_log_count(log), ==, 100);
+
+	for (i = 19900; i < 20000; i++) {
+		snprintf(key, sizeof(key), "%02X:00:00:00:00:00/info", i % 100);
+		snprintf(value, sizeof(value), "[General]\nCount=%d\n", i);
+		check_value(log, key, value);
+	}
+
+	store_log_close(log);
+
+	unlink(path);
+	g_free(path);
+
+	tester_test_passed();
+}
+
+int main(int argc, char *argv[])
+{
+	tester_init(&argc, &argv);
+
+	tester_add("/store-log/basic", NULL, NULL, test_basic, NULL);
+	tester_add("/store-log/truncated", NULL, NULL, test_truncated, NULL);
+	tester_add("/store-log/corrupted", NULL, NULL, test_corrupted, NULL);
+	tester_add("/store-log/compact", NULL, NULL, test_compact, NULL);
+
+	return tester_run();
+}